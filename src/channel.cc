@@ -0,0 +1,149 @@
+/*
+ * @Author: lvxr
+ * @brief 协程间通信的通道
+ */
+
+#include "channel.h"
+
+#include <algorithm>
+
+#include "iomanager.h"
+#include "marco.h"
+#include "scheduler.h"
+#include "util.h"
+
+namespace sylar {
+
+SelectState::SelectState() {
+    if (Scheduler::InTaskFiber()) {
+        Fiber* cur = Fiber::GetCurrent();
+        m_fiber.reset(cur);
+        m_scheduler = Scheduler::GetThis();
+        m_thread = cur->isSharedStack() ? GetThreadId() : -1;
+    }
+}
+
+void SelectState::wake() {
+    if (m_fiber) {
+        // 不能把m_fiber移走，等待者可能还没有执行到wait，要靠它判断是否在协程中
+        m_scheduler->schedule(m_fiber, m_thread);
+    } else {
+        m_sem.notify();
+    }
+}
+
+int SelectState::wait(uint64_t timeout_ms) {
+    if (!m_fiber) {
+        if (timeout_ms == ~0ull) {
+            m_sem.wait();
+        } else if (!m_sem.waitFor(timeout_ms)) {
+            if (claim(-2)) {
+                return -2;
+            }
+            // 超时的同时被选中了，等唤醒者的通知
+            m_sem.wait();
+        }
+        return m_selected;
+    }
+
+    Timer::ptr timer;
+    if (timeout_ms != ~0ull) {
+        IOManager* iom = IOManager::GetThis();
+        SYLAR_ASSERT2(iom, "select with timeout in fiber needs IOManager");
+        SelectState::ptr self = shared_from_this();
+        timer = iom->addTimer(timeout_ms, [self]() {
+            if (self->claim(-2)) {
+                self->wake();
+            }
+        });
+    }
+    // 这里可能已经被唤醒并schedule了，调度器会等我们切换出去再执行
+    Fiber::YieldToHold();
+    m_fiber.reset();
+    if (timer) {
+        timer->cancel();
+    }
+    return m_selected;
+}
+
+static void LockAll(std::vector<ChannelBase::MutexType*>& mutexes) {
+    for (auto i : mutexes) {
+        i->lock();
+    }
+}
+
+static void UnlockAll(std::vector<ChannelBase::MutexType*>& mutexes) {
+    for (auto it = mutexes.rbegin(); it != mutexes.rend(); ++it) {
+        (*it)->unlock();
+    }
+}
+
+int Select(const std::vector<SelectCase::ptr>& cases, uint64_t timeout_ms) {
+    // 按地址顺序加锁，多个select之间不会死锁
+    std::vector<ChannelBase*> channels;
+    channels.reserve(cases.size());
+    for (auto& c : cases) {
+        channels.push_back(c->m_channel);
+    }
+    std::sort(channels.begin(), channels.end());
+    channels.erase(std::unique(channels.begin(), channels.end()),
+                   channels.end());
+    std::vector<ChannelBase::MutexType*> mutexes;
+    mutexes.reserve(channels.size());
+    for (auto i : channels) {
+        mutexes.push_back(&i->m_mutex);
+    }
+
+    std::vector<SelectState::ptr> wakes;
+    LockAll(mutexes);
+    // 先声明要等待再检查，和spsc通道无锁路径上先操作缓冲区再检查等待者配合
+    for (auto& c : cases) {
+        c->announce(true);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (size_t i = 0; i < cases.size(); ++i) {
+        if (cases[i]->complete(wakes)) {
+            for (auto& c : cases) {
+                c->announce(false);
+            }
+            UnlockAll(mutexes);
+            ChannelBase::Wake(wakes);
+            cases[i]->finish();
+            return i;
+        }
+    }
+    if (timeout_ms == 0) {
+        for (auto& c : cases) {
+            c->announce(false);
+        }
+        UnlockAll(mutexes);
+        return -1;
+    }
+
+    SelectState::ptr state = std::make_shared<SelectState>();
+    for (size_t i = 0; i < cases.size(); ++i) {
+        cases[i]->m_state = state;
+        cases[i]->m_index = i;
+        cases[i]->enqueue();
+    }
+    UnlockAll(mutexes);
+
+    int selected = state->wait(timeout_ms);
+
+    LockAll(mutexes);
+    for (auto& c : cases) {
+        c->dequeue();
+        c->announce(false);
+    }
+    UnlockAll(mutexes);
+    for (auto& c : cases) {
+        c->m_state.reset();
+    }
+    if (selected < 0) {
+        return -1;
+    }
+    cases[selected]->finish();
+    return selected;
+}
+
+}  // namespace sylar
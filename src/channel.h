@@ -0,0 +1,631 @@
+/*
+ * @Author: lvxr
+ * @brief 协程间通信的通道
+ */
+
+#ifndef __SYLAR_CHANNEL_H__
+#define __SYLAR_CHANNEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "fiber.h"
+#include "mutex.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+class Scheduler;
+class ChannelBase;
+template <class T>
+class Channel;
+
+/**
+ * @brief: 一次阻塞的send/recv/select的等待状态
+ * @details: 一次select可能同时挂在多个通道的等待队列上，
+ *           唤醒者先claim，成功的那一个完成数据传递并唤醒等待者，
+ *           其他通道上的同一个等待状态就失效了。
+ *           保存在堆上，共享栈协程挂起后栈上的对象不能被其他线程访问
+ */
+class SelectState : public std::enable_shared_from_this<SelectState>,
+                    Noncopyable {
+public:
+    typedef std::shared_ptr<SelectState> ptr;
+
+    /**
+     * @brief: 记录当前协程，不在调度器的任务协程中时阻塞线程
+     */
+    SelectState();
+
+    /**
+     * @brief: 选中分支index
+     * @return {bool} 已经被其他分支选中或者已经超时返回false
+     */
+    bool claim(int index) {
+        int expected = -1;
+        return m_selected.compare_exchange_strong(expected, index);
+    }
+
+    /**
+     * @brief: 返回被选中的分支，-1表示还没有，-2表示超时
+     */
+    int getSelected() const { return m_selected; }
+
+    /**
+     * @brief: 唤醒等待者，只能由claim成功的一方调用一次
+     */
+    void wake();
+
+    /**
+     * @brief: 挂起直到被唤醒或超时
+     * @param[in] {uint64_t} timeout_ms 超时时间(毫秒)，~0ull表示不超时
+     * @return {int} 被选中的分支，超时返回-2
+     */
+    int wait(uint64_t timeout_ms);
+
+private:
+    std::atomic<int> m_selected{-1};
+    // 挂起的协程
+    Fiber::ptr m_fiber;
+    Scheduler* m_scheduler = nullptr;
+    int m_thread = -1;
+    // 不在任务协程中时阻塞线程
+    Semaphore m_sem;
+};
+
+/**
+ * @brief: select的一个分支，由Channel::recvCase/sendCase创建
+ */
+class SelectCase : Noncopyable {
+public:
+    typedef std::shared_ptr<SelectCase> ptr;
+
+    virtual ~SelectCase() {}
+
+    /**
+     * @brief: 分支完成后是否成功，通道关闭时为false
+     */
+    bool ok() const { return m_ok; }
+
+protected:
+    friend int Select(const std::vector<SelectCase::ptr>& cases,
+                      uint64_t timeout_ms);
+    template <class T>
+    friend class Channel;
+
+    SelectCase(ChannelBase* channel) : m_channel(channel) {}
+
+    /**
+     * @brief: 尝试立即完成，需要唤醒的对端放到wakes里
+     * @pre: 持有通道的锁
+     */
+    virtual bool complete(std::vector<SelectState::ptr>& wakes) = 0;
+
+    /**
+     * @brief: 加入通道的等待队列
+     * @pre: 持有通道的锁
+     */
+    virtual void enqueue() = 0;
+
+    /**
+     * @brief: 从通道的等待队列中移除
+     * @pre: 持有通道的锁
+     */
+    virtual void dequeue() = 0;
+
+    /**
+     * @brief: 声明/取消即将在通道上等待，SPSC通道的无锁路径据此决定是否加锁唤醒
+     * @pre: 持有通道的锁
+     */
+    virtual void announce(bool v) = 0;
+
+    /**
+     * @brief: 选中后由select的调用者执行，把接收到的值移动给用户
+     */
+    virtual void finish() {}
+
+protected:
+    ChannelBase* m_channel;
+    // 等待时的状态
+    SelectState::ptr m_state;
+    // 在select中的下标
+    int m_index = 0;
+    // 是否在等待队列中
+    bool m_queued = false;
+    bool m_ok = false;
+};
+
+/**
+ * @brief: 通道的公共部分
+ */
+class ChannelBase : Noncopyable {
+public:
+    typedef Spinlock MutexType;
+
+    virtual ~ChannelBase() {}
+
+protected:
+    friend int Select(const std::vector<SelectCase::ptr>& cases,
+                      uint64_t timeout_ms);
+
+    /**
+     * @brief: 唤醒claim成功的等待者，在释放锁之后调用
+     */
+    static void Wake(std::vector<SelectState::ptr>& wakes) {
+        for (auto& i : wakes) {
+            i->wake();
+        }
+        wakes.clear();
+    }
+
+protected:
+    MutexType m_mutex;
+};
+
+/**
+ * @brief: 在多个分支上等待，执行第一个可以完成的分支
+ * @details: 多个分支同时就绪时选择下标最小的；
+ *           同一个select里的分支可以属于不同类型的通道。
+ *           在协程中使用超时需要运行在IOManager上
+ * @param[in] cases 分支
+ * @param[in] {uint64_t} timeout_ms 超时时间(毫秒)，0表示不等待，~0ull表示不超时
+ * @return {int} 完成的分支下标，超时返回-1
+ */
+int Select(const std::vector<SelectCase::ptr>& cases,
+           uint64_t timeout_ms = ~0ull);
+
+/**
+ * @brief: Go风格的通道
+ * @details: capacity为0时是无缓冲通道，send要等到有接收者取走才返回；
+ *           否则是容量为capacity的有缓冲通道。
+ *           send/recv阻塞时挂起当前协程(不在协程中时阻塞线程)，等待者先来先得。
+ *           值总是被移动而不是拷贝，T需要可以默认构造和移动赋值。
+ *           close之后send返回false，recv取完缓冲区剩余的值后返回false。
+ *           spsc为true时只能有一个发送者和一个接收者，缓冲区是无锁环形队列，
+ *           没有等待者时send/recv不加锁；这种模式下应当由发送者close
+ */
+template <class T>
+class Channel : public ChannelBase {
+public:
+    typedef std::shared_ptr<Channel> ptr;
+
+    /**
+     * @brief: 构造函数
+     * @param[in] {size_t} capacity 缓冲区大小，0为无缓冲通道
+     * @param[in] {bool} spsc 是否单生产者单消费者，只对有缓冲通道生效
+     */
+    Channel(size_t capacity = 0, bool spsc = false)
+        : m_capacity(capacity), m_spsc(spsc && capacity > 0), m_ring(capacity) {}
+
+    /**
+     * @brief: 发送，缓冲区满(无缓冲通道没有接收者)时挂起
+     * @return {bool} 通道已经关闭返回false
+     */
+    bool send(T&& v) {
+        if (m_spsc && trySendFast(v)) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_recvWaiting.load(std::memory_order_relaxed)) {
+                drain();
+            }
+            return true;
+        }
+        bool ok = false;
+        if (trySendOnce(v, ok)) {
+            return ok;
+        }
+        std::shared_ptr<SendCase> c(new SendCase(this, std::move(v)));
+        Select({c});
+        return c->ok();
+    }
+
+    bool send(const T& v) {
+        T tmp(v);
+        return send(std::move(tmp));
+    }
+
+    /**
+     * @brief: 接收，缓冲区空(无缓冲通道没有发送者)时挂起
+     * @return {bool} 通道已经关闭并且没有剩余的值返回false
+     */
+    bool recv(T& v) {
+        bool ok = false;
+        if (tryRecv(v, ok)) {
+            return ok;
+        }
+        std::shared_ptr<RecvCase> c(new RecvCase(this, &v));
+        Select({c});
+        return c->ok();
+    }
+
+    /**
+     * @brief: 不等待的发送
+     * @return {bool} 发送成功返回true，通道满或者关闭返回false
+     */
+    bool trySend(T&& v) {
+        bool ok = false;
+        return trySendOnce(v, ok) && ok;
+    }
+
+    /**
+     * @brief: 不等待的接收
+     * @return {bool} 收到值返回true
+     */
+    bool tryRecv(T& v) {
+        bool ok = false;
+        return tryRecv(v, ok) && ok;
+    }
+
+    /**
+     * @brief: 关闭通道，唤醒所有等待者
+     */
+    void close() {
+        std::vector<SelectState::ptr> wakes;
+        MutexType::Lock lock(m_mutex);
+        if (m_closed) {
+            return;
+        }
+        m_closed.store(true, std::memory_order_seq_cst);
+        // 等无锁send放完正在放的值，之后的接收者一定能看到它
+        while (m_sendBusy.load(std::memory_order_seq_cst)) {
+        }
+        drainLocked(wakes);
+        while (!m_recvq.empty()) {
+            RecvCase* r = popFront(m_recvq);
+            if (r->m_state->claim(r->m_index)) {
+                r->m_ok = false;
+                wakes.push_back(r->m_state);
+            }
+        }
+        while (!m_sendq.empty()) {
+            SendCase* s = popFront(m_sendq);
+            if (s->m_state->claim(s->m_index)) {
+                s->m_ok = false;
+                wakes.push_back(s->m_state);
+            }
+        }
+        lock.unlock();
+        Wake(wakes);
+    }
+
+    bool isClosed() const { return m_closed; }
+
+    /**
+     * @brief: 缓冲区中值的数量
+     */
+    size_t size() const {
+        return m_tail.load(std::memory_order_acquire) -
+               m_head.load(std::memory_order_acquire);
+    }
+
+    size_t getCapacity() const { return m_capacity; }
+
+    bool isSpsc() const { return m_spsc; }
+
+    /**
+     * @brief: 创建接收分支，选中后收到的值移动到out
+     * @details: out在select返回前都必须有效
+     */
+    SelectCase::ptr recvCase(T& out) {
+        return std::make_shared<RecvCase>(this, &out);
+    }
+
+    /**
+     * @brief: 创建发送分支，没有被选中时v被丢弃
+     */
+    SelectCase::ptr sendCase(T v) {
+        return std::make_shared<SendCase>(this, std::move(v));
+    }
+
+private:
+    class RecvCase : public SelectCase {
+    public:
+        RecvCase(Channel* channel, T* out) : SelectCase(channel), m_out(out) {}
+
+    protected:
+        bool complete(std::vector<SelectState::ptr>& wakes) override {
+            return channel()->recvLocked(m_value, m_ok, wakes);
+        }
+
+        void enqueue() override {
+            m_it = channel()->m_recvq.insert(channel()->m_recvq.end(), this);
+            m_queued = true;
+        }
+
+        void dequeue() override {
+            if (m_queued) {
+                channel()->m_recvq.erase(m_it);
+                m_queued = false;
+            }
+        }
+
+        void announce(bool v) override {
+            if (v) {
+                channel()->m_recvWaiting.fetch_add(1);
+            } else {
+                channel()->m_recvWaiting.fetch_sub(1);
+            }
+        }
+
+        void finish() override {
+            if (m_ok) {
+                *m_out = std::move(m_value);
+            }
+        }
+
+    private:
+        friend class Channel;
+
+        Channel* channel() const { return static_cast<Channel*>(m_channel); }
+
+    private:
+        T* m_out;
+        // 发送者交给我们的值，挂起期间不能直接写用户的栈
+        T m_value;
+        typename std::list<RecvCase*>::iterator m_it;
+    };
+
+    class SendCase : public SelectCase {
+    public:
+        SendCase(Channel* channel, T&& v)
+            : SelectCase(channel), m_value(std::move(v)) {}
+
+    protected:
+        bool complete(std::vector<SelectState::ptr>& wakes) override {
+            return channel()->sendLocked(m_value, m_ok, wakes);
+        }
+
+        void enqueue() override {
+            m_it = channel()->m_sendq.insert(channel()->m_sendq.end(), this);
+            m_queued = true;
+        }
+
+        void dequeue() override {
+            if (m_queued) {
+                channel()->m_sendq.erase(m_it);
+                m_queued = false;
+            }
+        }
+
+        void announce(bool v) override {
+            if (v) {
+                channel()->m_sendWaiting.fetch_add(1);
+            } else {
+                channel()->m_sendWaiting.fetch_sub(1);
+            }
+        }
+
+    private:
+        friend class Channel;
+
+        Channel* channel() const { return static_cast<Channel*>(m_channel); }
+
+    private:
+        T m_value;
+        typename std::list<SendCase*>::iterator m_it;
+    };
+
+    template <class C>
+    static C* popFront(std::list<C*>& q) {
+        C* c = q.front();
+        q.pop_front();
+        c->m_queued = false;
+        return c;
+    }
+
+    /**
+     * @brief: 放入环形缓冲区
+     * @details: 同一时刻只能有一个线程push，一个线程pop。
+     *           spsc时push由发送者无锁执行或者在锁内执行(发送者挂起时)，
+     *           否则都在锁内执行
+     */
+    bool ringPush(T& v) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) >= m_capacity) {
+            return false;
+        }
+        m_ring[tail % m_capacity] = std::move(v);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool ringPop(T& v) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        v = std::move(m_ring[head % m_capacity]);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief: spsc发送者的无锁路径
+     * @details: 先声明正在发送再检查关闭，与close的先关闭再等待配对，
+     *           两边至少有一方看到对方：要么这里看到已经关闭走加锁路径，
+     *           要么close等到值放进缓冲区之后才交给接收者并让它们看到关闭，
+     *           不会出现send返回true而接收者已经因为关闭返回false
+     * @return {bool} 放入缓冲区返回true
+     */
+    bool trySendFast(T& v) {
+        m_sendBusy.store(true, std::memory_order_seq_cst);
+        bool ok = !m_closed.load(std::memory_order_seq_cst) && ringPush(v);
+        m_sendBusy.store(false, std::memory_order_release);
+        return ok;
+    }
+
+    /**
+     * @brief: 缓冲区中的值交给等待的接收者
+     * @pre: 持有锁
+     */
+    void drainLocked(std::vector<SelectState::ptr>& wakes) {
+        while (!m_recvq.empty() && size() > 0) {
+            RecvCase* r = popFront(m_recvq);
+            if (r->m_state->claim(r->m_index)) {
+                ringPop(r->m_value);
+                r->m_ok = true;
+                wakes.push_back(r->m_state);
+            }
+        }
+    }
+
+    /**
+     * @brief: 等待的发送者的值放入缓冲区
+     * @pre: 持有锁
+     */
+    void refillLocked(std::vector<SelectState::ptr>& wakes) {
+        while (!m_sendq.empty() && size() < m_capacity) {
+            SendCase* s = popFront(m_sendq);
+            if (s->m_state->claim(s->m_index)) {
+                ringPush(s->m_value);
+                s->m_ok = true;
+                wakes.push_back(s->m_state);
+            }
+        }
+    }
+
+    /**
+     * @brief: spsc无锁send之后发现有接收者在等待
+     */
+    void drain() {
+        std::vector<SelectState::ptr> wakes;
+        MutexType::Lock lock(m_mutex);
+        drainLocked(wakes);
+        lock.unlock();
+        Wake(wakes);
+    }
+
+    /**
+     * @brief: spsc无锁recv之后发现有发送者在等待
+     */
+    void refill() {
+        std::vector<SelectState::ptr> wakes;
+        MutexType::Lock lock(m_mutex);
+        refillLocked(wakes);
+        lock.unlock();
+        Wake(wakes);
+    }
+
+    /**
+     * @brief: 尝试接收，成功时值移动到v
+     * @pre: 持有锁
+     * @param[out] {bool} ok 是否收到值，通道关闭时为false
+     * @return {bool} 不需要等待返回true
+     */
+    bool recvLocked(T& v, bool& ok, std::vector<SelectState::ptr>& wakes) {
+        if (ringPop(v)) {
+            ok = true;
+            // 空出了位置，让等待的发送者放进来
+            refillLocked(wakes);
+            return true;
+        }
+        while (!m_sendq.empty()) {
+            SendCase* s = popFront(m_sendq);
+            if (s->m_state->claim(s->m_index)) {
+                v = std::move(s->m_value);
+                ok = s->m_ok = true;
+                wakes.push_back(s->m_state);
+                return true;
+            }
+        }
+        if (m_closed) {
+            ok = false;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief: 尝试发送，成功时v被移走
+     * @pre: 持有锁
+     * @param[out] {bool} ok 是否发送成功，通道关闭时为false
+     * @return {bool} 不需要等待返回true
+     */
+    bool sendLocked(T& v, bool& ok, std::vector<SelectState::ptr>& wakes) {
+        if (m_closed) {
+            ok = false;
+            return true;
+        }
+        while (!m_recvq.empty()) {
+            RecvCase* r = popFront(m_recvq);
+            if (r->m_state->claim(r->m_index)) {
+                r->m_value = std::move(v);
+                r->m_ok = ok = true;
+                wakes.push_back(r->m_state);
+                return true;
+            }
+        }
+        if (m_capacity > 0 && ringPush(v)) {
+            ok = true;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief: 不挂起地尝试接收，spsc时先走无锁路径
+     * @return {bool} 不需要等待返回true
+     */
+    bool tryRecv(T& v, bool& ok) {
+        if (m_spsc && ringPop(v)) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_sendWaiting.load(std::memory_order_relaxed)) {
+                refill();
+            }
+            ok = true;
+            return true;
+        }
+        return tryRecvOnce(v, ok);
+    }
+
+    /**
+     * @brief: 加锁尝试一次，不需要等待时不用创建select分支
+     */
+    bool trySendOnce(T& v, bool& ok) {
+        std::vector<SelectState::ptr> wakes;
+        MutexType::Lock lock(m_mutex);
+        if (!sendLocked(v, ok, wakes)) {
+            return false;
+        }
+        lock.unlock();
+        Wake(wakes);
+        return true;
+    }
+
+    bool tryRecvOnce(T& v, bool& ok) {
+        std::vector<SelectState::ptr> wakes;
+        MutexType::Lock lock(m_mutex);
+        if (!recvLocked(v, ok, wakes)) {
+            return false;
+        }
+        lock.unlock();
+        Wake(wakes);
+        return true;
+    }
+
+private:
+    size_t m_capacity;
+    bool m_spsc;
+    std::atomic<bool> m_closed{false};
+    // 环形缓冲区，m_head/m_tail单调递增
+    std::vector<T> m_ring;
+    std::atomic<size_t> m_head{0};
+    std::atomic<size_t> m_tail{0};
+    // 等待的接收者和发送者，先来先得
+    std::list<RecvCase*> m_recvq;
+    std::list<SendCase*> m_sendq;
+    // 准备等待的接收者和发送者数量，spsc的无锁路径用来判断是否需要加锁唤醒
+    std::atomic<uint32_t> m_recvWaiting{0};
+    std::atomic<uint32_t> m_sendWaiting{0};
+    // spsc的无锁send正在检查关闭和放入缓冲区
+    std::atomic<bool> m_sendBusy{false};
+};
+
+}  // namespace sylar
+
+#endif
@@ -6,14 +6,209 @@
 
 #include "src/config.h"
 
+#include "src/config_snapshot.h"
+#include "src/env.h"
+#include "src/util.h"
+
 namespace sylar {
 
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+ConfigDispatcher::ConfigDispatcher() {}
+
+ConfigDispatcher::~ConfigDispatcher() {
+    Thread::ptr thread;
+    {
+        MutexType::Lock lock(m_mutex);
+        thread.swap(m_thread);
+        if (thread) {
+            // 空任务通知分发线程退出
+            m_tasks.push_back(nullptr);
+            m_sem.notify();
+        }
+    }
+    if (thread) {
+        thread->join();
+    }
+}
+
+void ConfigDispatcher::post(std::function<void()> cb) {
+    MutexType::Lock lock(m_mutex);
+    m_tasks.push_back(cb);
+    if (!m_thread) {
+        m_thread.reset(new Thread(std::bind(&ConfigDispatcher::run, this),
+                                  "config_dispatch"));
+    }
+    m_sem.notify();
+}
+
+void ConfigDispatcher::flush() {
+    {
+        MutexType::Lock lock(m_mutex);
+        if (!m_thread || Thread::GetThis() == m_thread.get()) {
+            return;
+        }
+    }
+    // 队列先进先出，屏障任务执行时之前投递的通知都已执行完毕
+    Semaphore sem;
+    post([&sem]() { sem.notify(); });
+    sem.wait();
+}
+
+void ConfigDispatcher::run() {
+    while (true) {
+        m_sem.wait();
+        std::function<void()> cb;
+        {
+            MutexType::Lock lock(m_mutex);
+            cb.swap(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        if (!cb) {
+            break;
+        }
+        try {
+            cb();
+        } catch (std::exception& e) {
+            SYLAR_LOG_ERROR(g_logger)
+                << "ConfigDispatcher listener exception " << e.what();
+        } catch (...) {
+            SYLAR_LOG_ERROR(g_logger) << "ConfigDispatcher listener exception";
+        }
+    }
+}
+
+const uint32_t ConfigVarBase::INVALID_ID;
+
+ConfigIndex::ConfigIndex(const std::vector<ConfigVarBase::ptr>& vars)
+    : m_vars(vars) {
+    if (m_vars.empty()) {
+        return;
+    }
+    // 负载因子0.8，失败时扩大槽位重试
+    size_t slot_count = m_vars.size() + m_vars.size() / 4 + 1;
+    while (!build(slot_count)) {
+        slot_count *= 2;
+    }
+}
+
+uint64_t ConfigIndex::Hash(const std::string& name, uint32_t seed) {
+    // FNV-1a，再用murmur3的finalizer打散
+    uint64_t h = 14695981039346656037ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+    for (auto c : name) {
+        h ^= (unsigned char)c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+bool ConfigIndex::build(size_t slot_count) {
+    size_t bucket_count = m_vars.size() / 4 + 1;
+    std::vector<std::vector<uint32_t> > buckets(bucket_count);
+    for (uint32_t id = 0; id < m_vars.size(); ++id) {
+        buckets[Hash(m_vars[id]->getName(), 0) % bucket_count].push_back(id);
+    }
+
+    // 先放元素多的桶，越往后空槽越少
+    std::vector<uint32_t> order(bucket_count);
+    for (uint32_t i = 0; i < bucket_count; ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    m_seeds.assign(bucket_count, 0);
+    m_slots.assign(slot_count, ConfigVarBase::INVALID_ID);
+    std::vector<size_t> pos;
+    for (auto b : order) {
+        auto& bucket = buckets[b];
+        if (bucket.empty()) {
+            break;
+        }
+        bool ok = false;
+        for (uint32_t seed = 1; seed < (1 << 16) && !ok; ++seed) {
+            pos.clear();
+            ok = true;
+            for (auto id : bucket) {
+                size_t p = Hash(m_vars[id]->getName(), seed) % slot_count;
+                if (m_slots[p] != ConfigVarBase::INVALID_ID ||
+                    std::find(pos.begin(), pos.end(), p) != pos.end()) {
+                    ok = false;
+                    break;
+                }
+                pos.push_back(p);
+            }
+            if (ok) {
+                m_seeds[b] = seed;
+                for (size_t i = 0; i < bucket.size(); ++i) {
+                    m_slots[pos[i]] = bucket[i];
+                }
+            }
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+ConfigVarBase::ptr ConfigIndex::find(const std::string& name) const {
+    if (m_vars.empty()) {
+        return nullptr;
+    }
+    uint32_t seed = m_seeds[Hash(name, 0) % m_seeds.size()];
+    uint32_t id = m_slots[Hash(name, seed) % m_slots.size()];
+    if (id == ConfigVarBase::INVALID_ID || m_vars[id]->getName() != name) {
+        return nullptr;
+    }
+    return m_vars[id];
+}
+
 ConfigVarBase::ptr Config::LookupBase(const std::string& name) {
+    ConfigIndex* index = GetIndex().load(std::memory_order_acquire);
+    if (index) {
+        ConfigVarBase::ptr v = index->find(name);
+        // 索引包含全部配置项时，未命中即不存在
+        if (v || index->size() == GetCount().load(std::memory_order_acquire)) {
+            return v;
+        }
+    }
     RWMutexType::ReadLock lock(GetMutex());
     auto it = GetDatas().find(name);
     return it == GetDatas().end() ? nullptr : it->second;
 }
 
+ConfigVarBase::ptr Config::LookupById(uint32_t id) {
+    ConfigIndex* index = GetIndex().load(std::memory_order_acquire);
+    if (index && id < index->size()) {
+        return index->get(id);
+    }
+    RWMutexType::ReadLock lock(GetMutex());
+    return id < GetVars().size() ? GetVars()[id] : nullptr;
+}
+
+void Config::Intern(ConfigVarBase::ptr var) {
+    var->m_id = GetVars().size();
+    GetVars().push_back(var);
+    GetDatas()[var->getName()] = var;
+    GetCount().store(GetVars().size(), std::memory_order_release);
+}
+
+void Config::RebuildIndex() {
+    RWMutexType::WriteLock lock(GetMutex());
+    ConfigIndex* index = GetIndex().load(std::memory_order_acquire);
+    if (index && index->size() == GetVars().size()) {
+        return;
+    }
+    ConfigIndex::ptr new_index(new ConfigIndex(GetVars()));
+    GetIndexes().push_back(new_index);
+    GetIndex().store(new_index.get(), std::memory_order_release);
+}
+
 /**
  * @brief: 拍平YAML文件中配置项，便于查找
  */
@@ -21,7 +216,7 @@ static void ListAllMember(
     const std::string& prefix, const YAML::Node& node,
     std::list<std::pair<std::string, const YAML::Node>>& output) {
     // 配置名错误
-    if (prefix.find_first_not_of("abcdefghikjlmnopqrstuvwxyz._012345678") !=
+    if (prefix.find_first_not_of("abcdefghikjlmnopqrstuvwxyz._0123456789") !=
         std::string::npos) {
         SYLAR_LOG_ERROR(SYLAR_LOG_ROOT())
             << "Config invalid name: " << prefix << " : " << node;
@@ -39,6 +234,13 @@ static void ListAllMember(
 }
 
 void Config::LoadFromYaml(const YAML::Node& root) {
+    ConfigTree tree;
+    Flatten(root, tree);
+    LoadFromTree(tree);
+}
+
+void Config::Flatten(const YAML::Node& root, ConfigTree& tree,
+                     const std::string& origin) {
     std::list<std::pair<std::string, const YAML::Node>> all_nodes;
     ListAllMember("", root, all_nodes);
 
@@ -47,16 +249,179 @@ void Config::LoadFromYaml(const YAML::Node& root) {
         if (key.empty()) continue;
 
         std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-        ConfigVarBase::ptr v = LookupBase(key);
-        if (v) {
-            if (it.second.IsScalar()) {
-                v->fromString(it.second.Scalar());
-            } else {
-                std::stringstream ss;
-                ss << it.second;
-                v->fromString(ss.str());
+        ConfigEntry& entry = tree[key];
+        if (it.second.IsScalar()) {
+            entry.value = it.second.Scalar();
+        } else {
+            std::stringstream ss;
+            ss << it.second;
+            entry.value = ss.str();
+        }
+        entry.origin = origin;
+        entry.is_map = it.second.IsMap();
+    }
+}
+
+bool Config::ParseYamlFiles(const std::vector<std::string>& files,
+                            ConfigTree& tree,
+                            std::vector<ConfigConflict>* conflicts) {
+    std::vector<ConfigTree> trees(files.size());
+    std::atomic<size_t> next{0};
+    std::atomic<bool> ok{true};
+    auto parse = [&files, &trees, &next, &ok]() {
+        for (size_t i = next++; i < files.size(); i = next++) {
+            try {
+                Flatten(YAML::LoadFile(files[i]), trees[i], files[i]);
+            } catch (std::exception& e) {
+                ok = false;
+                SYLAR_LOG_ERROR(g_logger) << "ParseYamlFiles file=" << files[i]
+                                          << " failed: " << e.what();
             }
         }
+    };
+
+    // 小线程池，线程数不超过文件数、CPU核数和8
+    size_t thread_count = std::min<size_t>(files.size(), 8);
+    thread_count = std::min<size_t>(
+        thread_count, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<Thread::ptr> threads;
+    for (size_t i = 1; i < thread_count; ++i) {
+        threads.push_back(Thread::ptr(
+            new Thread(parse, "config_load_" + std::to_string(i))));
+    }
+    // 当前线程也参与解析
+    parse();
+    for (auto& thr : threads) {
+        thr->join();
     }
+
+    // 按文件顺序合并，结果与解析的先后无关
+    for (auto& t : trees) {
+        for (auto& it : t) {
+            auto old = tree.find(it.first);
+            if (old != tree.end() && old->second.value != it.second.value &&
+                (!it.second.is_map || LookupBase(it.first))) {
+                SYLAR_LOG_WARN(g_logger)
+                    << "Config conflict key=" << it.first
+                    << " origin=" << old->second.origin
+                    << " overridden by " << it.second.origin;
+                if (conflicts) {
+                    ConfigConflict c;
+                    c.key = it.first;
+                    c.origin = old->second.origin;
+                    c.override_origin = it.second.origin;
+                    conflicts->push_back(c);
+                }
+            }
+            tree[it.first] = it.second;
+        }
+    }
+    return ok;
 }
+
+void Config::LoadFromYamlFiles(const std::vector<std::string>& files,
+                               std::vector<ConfigConflict>* conflicts) {
+    ConfigTree tree;
+    ParseYamlFiles(files, tree, conflicts);
+    LoadFromTree(tree);
+}
+
+void Config::LoadFromTree(const ConfigTree& tree) {
+    RebuildIndex();
+    for (auto& it : tree) {
+        ConfigVarBase::ptr v = LookupBase(it.first);
+        if (v) {
+            v->fromString(it.second.value);
+        }
+    }
+}
+
+void Config::LoadFromSnapshot(const ConfigSnapshot& snapshot,
+                              const ConfigTree& overrides) {
+    RebuildIndex();
+    std::vector<ConfigVarBase::ptr> vars;
+    Visit([&vars](ConfigVarBase::ptr v) { vars.push_back(v); });
+
+    std::string value;
+    for (auto& v : vars) {
+        auto it = overrides.find(v->getName());
+        if (it != overrides.end()) {
+            v->fromString(it->second.value);
+        } else if (snapshot.find(v->getName(), value)) {
+            v->fromString(value);
+        }
+    }
+}
+
+void Config::CollectOverrides(ConfigTree& tree, const std::string& env_prefix) {
+    std::vector<ConfigVarBase::ptr> vars;
+    Visit([&vars](ConfigVarBase::ptr v) { vars.push_back(v); });
+
+    auto env = EnvMgr::GetInstance();
+    for (auto& v : vars) {
+        std::string name = env_prefix + v->getName();
+        for (auto& c : name) {
+            c = c == '.' ? '_' : ::toupper(c);
+        }
+        const char* value = getenv(name.c_str());
+        if (value) {
+            ConfigEntry& entry = tree[v->getName()];
+            entry.value = value;
+            entry.origin = "env:" + name;
+            entry.is_map = false;
+        }
+    }
+
+    for (auto& it : env->getConfigOverrides()) {
+        std::string key = it.first;
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        ConfigEntry& entry = tree[key];
+        entry.value = it.second;
+        entry.origin = "cmdline:-set " + it.first;
+        entry.is_map = false;
+    }
+}
+
+void Config::LoadFromConfDir(const std::string& conf_path,
+                             const std::string& env_prefix) {
+    std::string path = conf_path.empty()
+                           ? EnvMgr::GetInstance()->getConfigPath()
+                           : conf_path;
+    std::vector<std::string> files;
+    FSUtil::ListAllFile(files, path, ".yaml");
+    std::sort(files.begin(), files.end());
+
+    ConfigTree overrides;
+    CollectOverrides(overrides, env_prefix);
+
+    ConfigSnapshot snapshot;
+    if (snapshot.open(path + "/" + ConfigSnapshot::FileName())) {
+        if (snapshot.isFresh(files)) {
+            SYLAR_LOG_INFO(g_logger)
+                << "LoadFromConfDir use snapshot path=" << path
+                << " entries=" << snapshot.size()
+                << " overrides=" << overrides.size();
+            LoadFromSnapshot(snapshot, overrides);
+            return;
+        }
+        SYLAR_LOG_INFO(g_logger)
+            << "LoadFromConfDir snapshot is stale, fallback to yaml path="
+            << path;
+    }
+
+    ConfigTree tree;
+    ParseYamlFiles(files, tree);
+    for (auto& it : overrides) {
+        tree[it.first] = it.second;
+    }
+    LoadFromTree(tree);
+}
+
+void Config::Visit(std::function<void(ConfigVarBase::ptr)> cb) {
+    RWMutexType::ReadLock lock(GetMutex());
+    for (auto& v : GetVars()) {
+        cb(v);
+    }
+}
+
 }  // namespace sylar
\ No newline at end of file
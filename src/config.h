@@ -9,6 +9,7 @@
 #include <yaml-cpp/yaml.h>
 
 #include <algorithm>
+#include <atomic>
 #include <boost/lexical_cast.hpp>
 #include <functional>
 #include <list>
@@ -22,9 +23,63 @@
 #include <vector>
 
 #include "log.h"
+#include "mutex.h"
+#include "singleton.h"
+#include "thread.h"
 
 namespace sylar {
 
+/**
+ * @brief 配置变更通知分发器
+ * @details 使用一个专用线程按投递顺序执行异步监听回调,
+ *          避免耗时的回调阻塞配置项的读写
+ */
+class ConfigDispatcher : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 构造函数,分发线程在第一次投递时启动
+     */
+    ConfigDispatcher();
+
+    /**
+     * @brief 析构函数,执行完已投递的通知后退出分发线程
+     */
+    ~ConfigDispatcher();
+
+    /**
+     * @brief 投递一个通知,按投递顺序在分发线程上执行
+     * @param[in] cb 通知任务,不能为空
+     */
+    void post(std::function<void()> cb);
+
+    /**
+     * @brief 等待当前已投递的通知全部执行完毕
+     * @details 在分发线程内调用时直接返回,避免自己等待自己
+     */
+    void flush();
+
+private:
+    /**
+     * @brief 分发线程执行函数
+     */
+    void run();
+
+private:
+    // 互斥锁,保护任务队列和线程
+    MutexType m_mutex;
+    // 待执行任务数量
+    Semaphore m_sem;
+    // 任务队列,空任务表示退出
+    std::list<std::function<void()> > m_tasks;
+    // 分发线程
+    Thread::ptr m_thread;
+};
+
+// 单例类
+typedef sylar::Singleton<ConfigDispatcher> ConfigDispatcherMgr;
+
 /**
  * @brief: 配置变量的基类,纯虚类
  */
@@ -52,6 +107,11 @@ public:
      */
     const std::string& getName() const { return m_name; }
 
+    /**
+     * @brief 返回配置参数的句柄,注册到Config时分配,之后不再改变
+     */
+    uint32_t getId() const { return m_id; }
+
     /**
      * @brief 返回配置参数的描述
      */
@@ -72,11 +132,70 @@ public:
      */
     virtual std::string getTypeName() const = 0;
 
+    // 无效的句柄
+    static const uint32_t INVALID_ID = (uint32_t)-1;
+
 protected:
+    friend class Config;
     // 配置参数的名称
     std::string m_name;
     // 配置参数的描述
     std::string m_description;
+    // 配置参数的句柄
+    uint32_t m_id = INVALID_ID;
+};
+
+/**
+ * @brief 配置参数名称的只读索引
+ * @details 用注册时的全部配置参数构建完美哈希表(hash and displace),
+ *          构建后不再修改,查找时不需要加锁,最多计算两次哈希和比较一次字符串
+ */
+class ConfigIndex {
+public:
+    typedef std::shared_ptr<ConfigIndex> ptr;
+
+    /**
+     * @brief 构造函数
+     * @param[in] vars 以句柄为下标的全部配置参数
+     */
+    ConfigIndex(const std::vector<ConfigVarBase::ptr>& vars);
+
+    /**
+     * @brief 按名称查找配置参数,不存在返回nullptr
+     */
+    ConfigVarBase::ptr find(const std::string& name) const;
+
+    /**
+     * @brief 按句柄查找配置参数,不存在返回nullptr
+     */
+    ConfigVarBase::ptr get(uint32_t id) const {
+        return id < m_vars.size() ? m_vars[id] : nullptr;
+    }
+
+    /**
+     * @brief 返回索引中配置参数的数量
+     */
+    size_t size() const { return m_vars.size(); }
+
+private:
+    /**
+     * @brief 以slot_count个槽位尝试构建完美哈希表
+     * @return 所有桶都找到无冲突的种子返回true
+     */
+    bool build(size_t slot_count);
+
+    /**
+     * @brief 带种子的字符串哈希
+     */
+    static uint64_t Hash(const std::string& name, uint32_t seed);
+
+private:
+    // 以句柄为下标的配置参数
+    std::vector<ConfigVarBase::ptr> m_vars;
+    // 每个桶的位移种子
+    std::vector<uint32_t> m_seeds;
+    // 槽位到句柄的映射
+    std::vector<uint32_t> m_slots;
 };
 
 /**
@@ -351,23 +470,43 @@ public:
     /**
      * @brief: 设置当前参数的值
      * @details 如果参数的值有发生变化,则通知所有注册回调函数
+     *          同步回调在释放锁之后执行,异步回调投递到ConfigDispatcher执行
      */
     void setValue(const T& v) {
+        std::vector<on_change_cb> cbs;
+        std::shared_ptr<const T> old_value;
+        std::shared_ptr<const T> new_value;
         {
-            // 上读锁
-            RWMutexType::ReadLock lock(m_mutex);
+            // 上写锁
+            RWMutexType::WriteLock lock(m_mutex);
             if (v == m_val) {
                 // 如果新值和旧值相同，则不做任何操作
                 return;
             }
-            // 不同执行回调函数
+            old_value.reset(new T(m_val));
+            m_val = v;
+            new_value.reset(new T(v));
             for (auto& it : m_cbs) {
-                it.second(m_val, v);
+                cbs.push_back(it.second);
+            }
+            // 在锁内投递，保证异步回调收到的快照顺序与发布顺序一致
+            if (!m_asyncCbs.empty()) {
+                std::vector<on_change_cb> async_cbs;
+                for (auto& it : m_asyncCbs) {
+                    async_cbs.push_back(it.second);
+                }
+                ConfigDispatcherMgr::GetInstance()->post(
+                    [async_cbs, old_value, new_value]() {
+                        for (auto& cb : async_cbs) {
+                            cb(*old_value, *new_value);
+                        }
+                    });
             }
         }
-        // 不相同写值，先上写锁
-        RWMutexType::WriteLock lock(m_mutex);
-        m_val = v;
+        // 锁外执行同步回调，回调中可以再读取该配置项
+        for (auto& cb : cbs) {
+            cb(*old_value, *new_value);
+        }
     }
 
     /**
@@ -380,12 +519,23 @@ public:
      * @return: 返回该回调函数对应的唯一id,用于删除回调
      */
     uint64_t addListener(on_change_cb cb) {
-        // 用于生成唯一id
-        static uint64_t s_fun_id = 0;
         RWMutexType::WriteLock lock(m_mutex);
-        ++s_fun_id;
-        m_cbs[s_fun_id] = cb;
-        return s_fun_id;
+        uint64_t id = ++GetListenerId();
+        m_cbs[id] = cb;
+        return id;
+    }
+
+    /**
+     * @brief: 添加异步变换回调函数
+     * @details 回调在ConfigDispatcher的分发线程上按发布顺序执行,
+     *          可以通过ConfigDispatcher::flush等待执行完毕
+     * @return: 返回该回调函数对应的唯一id,用于删除回调
+     */
+    uint64_t addAsyncListener(on_change_cb cb) {
+        RWMutexType::WriteLock lock(m_mutex);
+        uint64_t id = ++GetListenerId();
+        m_asyncCbs[id] = cb;
+        return id;
     }
 
     /**
@@ -395,6 +545,7 @@ public:
     void delListener(uint64_t id) {
         RWMutexType::WriteLock lock(m_mutex);
         m_cbs.erase(id);
+        m_asyncCbs.erase(id);
     }
 
     /**
@@ -405,7 +556,11 @@ public:
     on_change_cb getListener(uint64_t id) {
         RWMutexType::ReadLock lock(m_mutex);
         auto it = m_cbs.find(id);
-        return it == m_cbs.end() ? nullptr : it->second;
+        if (it != m_cbs.end()) {
+            return it->second;
+        }
+        it = m_asyncCbs.find(id);
+        return it == m_asyncCbs.end() ? nullptr : it->second;
     }
 
     /**
@@ -414,6 +569,16 @@ public:
     void clearListener() {
         RWMutexType::WriteLock lock(m_mutex);
         m_cbs.clear();
+        m_asyncCbs.clear();
+    }
+
+private:
+    /**
+     * @brief 用于生成回调函数的唯一id
+     */
+    static std::atomic<uint64_t>& GetListenerId() {
+        static std::atomic<uint64_t> s_fun_id{0};
+        return s_fun_id;
     }
 
 private:
@@ -423,8 +588,39 @@ private:
     T m_val;
     // 回调函数集合
     std::map<uint64_t, on_change_cb> m_cbs;
+    // 异步回调函数集合
+    std::map<uint64_t, on_change_cb> m_asyncCbs;
 };
 
+class ConfigSnapshot;
+
+/**
+ * @brief 拍平后的配置项的值
+ */
+struct ConfigEntry {
+    // YAML格式的值
+    std::string value;
+    // 来源,一般为配置文件路径
+    std::string origin;
+    // 是否为YAML Map节点
+    bool is_map = false;
+};
+
+/**
+ * @brief 合并配置树时的冲突
+ */
+struct ConfigConflict {
+    // 配置项名称
+    std::string key;
+    // 被覆盖的值的来源
+    std::string origin;
+    // 生效的值的来源
+    std::string override_origin;
+};
+
+// 拍平后的配置树,配置项名称 -> 值
+typedef std::map<std::string, ConfigEntry> ConfigTree;
+
 class Config {
 public:
     typedef std::unordered_map<std::string, ConfigVarBase::ptr> ConfigVarMap;
@@ -444,43 +640,46 @@ public:
     static typename ConfigVar<T>::ptr Lookup(
         const std::string& name, const T& default_value,
         const std::string& decription = "") {
-        // 上写锁
-        RWMutexType::WriteLock lock(GetMutex());
-        // 查找参数名称为name的参数
-        auto it = GetDatas().find(name);
-        // 如果存在该变量
-        if (it != GetDatas().end()) {
-            // 为了解决智能指针的类型转换问题，增加了std::dynamic_pointer_cast方法，该方法只适用于std::shared_ptr
-            auto tmp = std::dynamic_pointer_cast<ConfigVar<T>>(it->second);
-            if (tmp) {
-                // 可以转换，格式正确
-                SYLAR_LOG_INFO(SYLAR_LOG_ROOT())
-                    << "Lookup name=" << name << " exists";
-                return tmp;
-            } else {
-                // 格式不正确
+        // 已存在的配置参数只走读路径，不上写锁
+        ConfigVarBase::ptr base = LookupBase(name);
+        if (!base) {
+            // 不存在该变量
+            // 判断变量名字是否合法
+            if (name.find_first_not_of(
+                    "abcdefghikjlmnopqrstuvwxyz._0123456789") !=
+                std::string::npos) {
                 SYLAR_LOG_ERROR(SYLAR_LOG_ROOT())
-                    << "Lookup name=" << name << " exist but type not "
-                    << TypeToName<T>()
-                    << " real_type=" << it->second->getTypeName()
-                    << " and value is " << it->second->toString();
-                return nullptr;
+                    << "Lookup name invalid " << name;
+                throw std::invalid_argument(name);
             }
-        }
 
-        // 不存在该变量
-        // 判断变量名字是否合法
-        if (name.find_first_not_of("abcdefghikjlmnopqrstuvwxyz._012345678") !=
-            std::string::npos) {
-            SYLAR_LOG_ERROR(SYLAR_LOG_ROOT()) << "Lookup name invalid " << name;
-            throw std::invalid_argument(name);
+            // 上写锁，再次查找，防止其他线程已经创建
+            RWMutexType::WriteLock lock(GetMutex());
+            auto it = GetDatas().find(name);
+            if (it == GetDatas().end()) {
+                // 创建变量
+                typename ConfigVar<T>::ptr v(
+                    new ConfigVar<T>(name, default_value, decription));
+                Intern(v);
+                return v;
+            }
+            base = it->second;
         }
 
-        // 创建变量
-        typename ConfigVar<T>::ptr v(
-            new ConfigVar<T>(name, default_value, decription));
-        GetDatas()[name] = v;
-        return v;
+        // 为了解决智能指针的类型转换问题，增加了std::dynamic_pointer_cast方法，该方法只适用于std::shared_ptr
+        auto tmp = std::dynamic_pointer_cast<ConfigVar<T>>(base);
+        if (tmp) {
+            // 可以转换，格式正确
+            SYLAR_LOG_INFO(SYLAR_LOG_ROOT())
+                << "Lookup name=" << name << " exists";
+            return tmp;
+        }
+        // 格式不正确
+        SYLAR_LOG_ERROR(SYLAR_LOG_ROOT())
+            << "Lookup name=" << name << " exist but type not "
+            << TypeToName<T>() << " real_type=" << base->getTypeName()
+            << " and value is " << base->toString();
+        return nullptr;
     }
 
     /**
@@ -490,10 +689,7 @@ public:
      */
     template <class T>
     static typename ConfigVar<T>::ptr Lookup(const std::string& name) {
-        RWMutexType::ReadLock lock(GetMutex());
-        auto it = GetDatas().find(name);
-        if (it == GetDatas().end()) return nullptr;
-        return std::dynamic_pointer_cast<ConfigVar<T>>(it->second);
+        return std::dynamic_pointer_cast<ConfigVar<T>>(LookupBase(name));
     }
 
     /**
@@ -501,13 +697,105 @@ public:
      */
     static void LoadFromYaml(const YAML::Node& root);
 
+    /**
+     * @brief 将YAML::Node拍平成配置树,同名配置项覆盖树中已有的值
+     * @param[in] root YAML根节点
+     * @param[out] tree 配置树
+     * @param[in] origin 配置来源,一般为配置文件路径
+     */
+    static void Flatten(const YAML::Node& root, ConfigTree& tree,
+                        const std::string& origin = "");
+
+    /**
+     * @brief 并行解析多个YAML文件并合并成一个配置树
+     * @details 在一组sylar::Thread上并行解析,然后按files的顺序合并,
+     *          后面的文件覆盖前面的文件,与线程调度无关
+     * @param[in] files 配置文件,顺序即优先级从低到高
+     * @param[out] tree 合并后的配置树
+     * @param[out] conflicts 不为空时输出被覆盖的配置项
+     * @return 所有文件都解析成功返回true
+     */
+    static bool ParseYamlFiles(const std::vector<std::string>& files,
+                               ConfigTree& tree,
+                               std::vector<ConfigConflict>* conflicts = nullptr);
+
+    /**
+     * @brief 并行解析多个YAML文件,合并后一次性应用
+     * @param[in] files 配置文件,顺序即优先级从低到高
+     * @param[out] conflicts 不为空时输出被覆盖的配置项
+     */
+    static void LoadFromYamlFiles(
+        const std::vector<std::string>& files,
+        std::vector<ConfigConflict>* conflicts = nullptr);
+
+    /**
+     * @brief 使用拍平后的配置树初始化配置模块
+     */
+    static void LoadFromTree(const ConfigTree& tree);
+
+    /**
+     * @brief 使用预编译的二进制配置快照初始化配置模块
+     * @details 只按已注册的配置参数在快照索引中查找,不解析YAML文件
+     */
+    static void LoadFromSnapshot(const ConfigSnapshot& snapshot,
+                                 const ConfigTree& overrides = ConfigTree());
+
+    /**
+     * @brief 收集环境变量和命令行中的配置覆盖
+     * @details 环境变量: env_prefix + 配置名转大写且'.'替换为'_',
+     *          如fiber.stack_size对应SYLAR_FIBER_STACK_SIZE,只查找已注册的配置参数;
+     *          命令行: Env::init解析的-set key=value,可以出现多次;
+     *          命令行优先于环境变量
+     * @param[out] tree 覆盖项写入该配置树,覆盖已有的值
+     * @param[in] env_prefix 环境变量前缀
+     */
+    static void CollectOverrides(ConfigTree& tree,
+                                 const std::string& env_prefix = "SYLAR_");
+
+    /**
+     * @brief 加载配置目录
+     * @details 优先级从低到高: 默认值, 配置文件, 环境变量, 命令行-set,
+     *          启动时合并成一个结果后只应用一次.
+     *          目录下存在比所有*.yaml都新的快照(sylar_confc生成)时直接使用快照,
+     *          否则并行解析目录下所有*.yaml文件,按路径字典序合并,后者优先
+     * @param[in] path 配置目录,为空时使用Env::getConfigPath()
+     * @param[in] env_prefix 环境变量前缀,见CollectOverrides
+     */
+    static void LoadFromConfDir(const std::string& path = "",
+                                const std::string& env_prefix = "SYLAR_");
+
+    /**
+     * @brief 遍历所有已注册的配置参数
+     */
+    static void Visit(std::function<void(ConfigVarBase::ptr)> cb);
+
     /**
      * @brief 查找配置参数,返回配置参数的基类
      * @param[in] name 配置参数名称
      */
     static ConfigVarBase::ptr LookupBase(const std::string& name);
 
+    /**
+     * @brief 按句柄查找配置参数,返回配置参数的基类
+     * @param[in] id 配置参数句柄,见ConfigVarBase::getId
+     */
+    static ConfigVarBase::ptr LookupById(uint32_t id);
+
+    /**
+     * @brief 用当前所有配置参数重建只读索引
+     * @details 启动时配置参数注册完成后调用(LoadFromYaml会自动调用),
+     *          之后按名称查找不再加锁;重建后新注册的配置参数在下次重建前
+     *          退化为读锁查找
+     */
+    static void RebuildIndex();
+
 private:
+    /**
+     * @brief 登记新的配置参数并分配句柄
+     * @pre 已持有GetMutex()的写锁
+     */
+    static void Intern(ConfigVarBase::ptr var);
+
     /**
      * @brief 返回所有的配置项
      */
@@ -516,6 +804,38 @@ private:
         return s_datas;
     }
 
+    /**
+     * @brief 返回以句柄为下标的所有配置项
+     */
+    static std::vector<ConfigVarBase::ptr>& GetVars() {
+        static std::vector<ConfigVarBase::ptr> s_vars;
+        return s_vars;
+    }
+
+    /**
+     * @brief 已注册配置项的数量,用于判断只读索引是否完整
+     */
+    static std::atomic<uint32_t>& GetCount() {
+        static std::atomic<uint32_t> s_count{0};
+        return s_count;
+    }
+
+    /**
+     * @brief 当前发布的只读索引
+     */
+    static std::atomic<ConfigIndex*>& GetIndex() {
+        static std::atomic<ConfigIndex*> s_index{nullptr};
+        return s_index;
+    }
+
+    /**
+     * @brief 发布过的所有只读索引,读者可能仍在使用旧索引,因此不释放
+     */
+    static std::list<ConfigIndex::ptr>& GetIndexes() {
+        static std::list<ConfigIndex::ptr> s_indexes;
+        return s_indexes;
+    }
+
     /**
      * @brief 配置项的RWMutex
      */
@@ -0,0 +1,333 @@
+/*
+ * @Author: lvxr
+ * @brief 预编译的二进制配置快照
+ */
+#include "config_snapshot.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+
+#include "log.h"
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// 快照文件魔数
+static const char s_magic[8] = {'S', 'Y', 'L', 'A', 'R', 'C', 'F', 'G'};
+// 快照文件格式版本
+static const uint32_t s_version = 2;
+// 空索引槽位
+static const uint32_t s_empty_slot = (uint32_t)-1;
+
+/**
+ * @brief 快照文件头
+ */
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    // 配置项数量
+    uint32_t count;
+    // 索引槽位数量,2的幂
+    uint32_t index_size;
+    // 编译时配置文件数量
+    uint32_t source_count;
+    // 编译时配置文件的路径,大小和修改时间的哈希
+    uint64_t source_hash;
+    // 文件总长度
+    uint64_t file_size;
+    // 头部校验和,计算时该字段为0
+    uint32_t header_crc;
+    // 头部之后所有数据的校验和
+    uint32_t body_crc;
+};
+
+/**
+ * @brief 配置项,偏移量相对文件起始位置
+ */
+struct SnapshotEntry {
+    uint32_t key_offset;
+    uint32_t key_len;
+    uint32_t value_offset;
+    uint32_t value_len;
+};
+
+static uint32_t Crc32(const void* data, size_t len, uint32_t crc = 0) {
+    static uint32_t s_table[256] = {0};
+    static bool s_inited = [] {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            s_table[i] = c;
+        }
+        return true;
+    }();
+    (void)s_inited;
+
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = s_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t HashKey(const char* key, size_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static const SnapshotHeader* GetHeader(const char* data) {
+    return (const SnapshotHeader*)data;
+}
+
+static const SnapshotEntry* GetEntries(const char* data) {
+    return (const SnapshotEntry*)(data + sizeof(SnapshotHeader));
+}
+
+static const uint32_t* GetIndex(const char* data) {
+    return (const uint32_t*)(data + sizeof(SnapshotHeader) +
+                             GetHeader(data)->count * sizeof(SnapshotEntry));
+}
+
+ConfigSnapshot::ConfigSnapshot() {}
+
+ConfigSnapshot::~ConfigSnapshot() { close(); }
+
+bool ConfigSnapshot::open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot invalid file " << path;
+        ::close(fd);
+        return false;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot mmap " << path
+                                  << " errno=" << errno << " "
+                                  << strerror(errno);
+        return false;
+    }
+    m_data = (const char*)addr;
+    m_size = st.st_size;
+
+    // 校验头部
+    SnapshotHeader header = *GetHeader(m_data);
+    uint32_t header_crc = header.header_crc;
+    header.header_crc = 0;
+    uint64_t min_size = sizeof(SnapshotHeader) +
+                        (uint64_t)header.count * sizeof(SnapshotEntry) +
+                        (uint64_t)header.index_size * sizeof(uint32_t);
+    if (memcmp(header.magic, s_magic, sizeof(s_magic)) ||
+        header.version != s_version ||
+        Crc32(&header, sizeof(header)) != header_crc ||
+        header.file_size != m_size || min_size > m_size ||
+        (header.index_size & (header.index_size - 1)) ||
+        header.index_size <= header.count) {
+        SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot bad header " << path;
+        close();
+        return false;
+    }
+
+    // 校验数据区
+    if (Crc32(m_data + sizeof(SnapshotHeader),
+              m_size - sizeof(SnapshotHeader)) != header.body_crc) {
+        SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot bad checksum " << path;
+        close();
+        return false;
+    }
+
+    // 校验偏移量，之后的查找不再检查边界
+    const SnapshotEntry* entries = GetEntries(m_data);
+    for (uint32_t i = 0; i < header.count; ++i) {
+        const SnapshotEntry& e = entries[i];
+        if ((uint64_t)e.key_offset + e.key_len > m_size ||
+            (uint64_t)e.value_offset + e.value_len > m_size) {
+            SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot bad entry " << path;
+            close();
+            return false;
+        }
+    }
+    const uint32_t* index = GetIndex(m_data);
+    for (uint32_t i = 0; i < header.index_size; ++i) {
+        if (index[i] != s_empty_slot && index[i] >= header.count) {
+            SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot bad index " << path;
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void ConfigSnapshot::close() {
+    if (m_data) {
+        munmap((void*)m_data, m_size);
+        m_data = nullptr;
+        m_size = 0;
+    }
+}
+
+size_t ConfigSnapshot::size() const {
+    return m_data ? GetHeader(m_data)->count : 0;
+}
+
+bool ConfigSnapshot::find(const std::string& key, std::string& value) const {
+    if (!m_data) {
+        return false;
+    }
+    const SnapshotHeader* header = GetHeader(m_data);
+    const SnapshotEntry* entries = GetEntries(m_data);
+    const uint32_t* index = GetIndex(m_data);
+    uint32_t mask = header->index_size - 1;
+    // 线性探测，装载因子不超过0.5
+    for (uint32_t slot = HashKey(key.c_str(), key.size()) & mask;;
+         slot = (slot + 1) & mask) {
+        uint32_t idx = index[slot];
+        if (idx == s_empty_slot) {
+            return false;
+        }
+        const SnapshotEntry& e = entries[idx];
+        if (e.key_len == key.size() &&
+            !memcmp(m_data + e.key_offset, key.c_str(), key.size())) {
+            value.assign(m_data + e.value_offset, e.value_len);
+            return true;
+        }
+    }
+}
+
+bool ConfigSnapshot::isFresh(const std::vector<std::string>& files) const {
+    if (!m_data) {
+        return false;
+    }
+    const SnapshotHeader* header = GetHeader(m_data);
+    uint64_t hash = 0;
+    return header->source_count == files.size() &&
+           GetSourcesHash(files, hash) && hash == header->source_hash;
+}
+
+/**
+ * @brief FNV-1a 64位
+ */
+static uint64_t Hash64(const void* data, size_t len, uint64_t h) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool ConfigSnapshot::GetSourcesHash(const std::vector<std::string>& files,
+                                    uint64_t& hash) {
+    hash = 14695981039346656037ULL;
+    struct stat st;
+    for (auto& file : files) {
+        if (stat(file.c_str(), &st)) {
+            return false;
+        }
+        // 路径包含结尾的'\0',避免相邻路径拼接后相同
+        uint64_t size = st.st_size;
+        uint64_t mtime =
+            st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+        hash = Hash64(file.c_str(), file.size() + 1, hash);
+        hash = Hash64(&size, sizeof(size), hash);
+        hash = Hash64(&mtime, sizeof(mtime), hash);
+    }
+    return true;
+}
+
+bool ConfigSnapshot::Write(const std::string& path, const ConfigTree& tree,
+                           const std::vector<std::string>& files) {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = s_version;
+    header.count = tree.size();
+    header.index_size = 2;
+    while (header.index_size < header.count * 2) {
+        header.index_size <<= 1;
+    }
+    header.source_count = files.size();
+    if (!GetSourcesHash(files, header.source_hash)) {
+        SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot stat sources failed "
+                                  << path << " errno=" << errno << " "
+                                  << strerror(errno);
+        return false;
+    }
+
+    std::vector<SnapshotEntry> entries;
+    std::vector<uint32_t> index(header.index_size, s_empty_slot);
+    std::string strings;
+    uint64_t strings_offset = sizeof(SnapshotHeader) +
+                              header.count * sizeof(SnapshotEntry) +
+                              header.index_size * sizeof(uint32_t);
+    uint32_t mask = header.index_size - 1;
+    for (auto& it : tree) {
+        SnapshotEntry e;
+        e.key_offset = strings_offset + strings.size();
+        e.key_len = it.first.size();
+        strings.append(it.first);
+        e.value_offset = strings_offset + strings.size();
+        e.value_len = it.second.value.size();
+        strings.append(it.second.value);
+
+        uint32_t slot = HashKey(it.first.c_str(), it.first.size()) & mask;
+        while (index[slot] != s_empty_slot) {
+            slot = (slot + 1) & mask;
+        }
+        index[slot] = entries.size();
+        entries.push_back(e);
+    }
+    if (strings_offset + strings.size() > (uint32_t)-1) {
+        SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot too large " << path;
+        return false;
+    }
+
+    std::string body;
+    body.append((const char*)entries.data(),
+                entries.size() * sizeof(SnapshotEntry));
+    body.append((const char*)index.data(), index.size() * sizeof(uint32_t));
+    body.append(strings);
+    header.file_size = sizeof(header) + body.size();
+    header.body_crc = Crc32(body.data(), body.size());
+    header.header_crc = Crc32(&header, sizeof(header));
+
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+        ofs.write((const char*)&header, sizeof(header));
+        ofs.write(body.data(), body.size());
+        if (!ofs) {
+            SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot write " << tmp
+                                      << " failed";
+            return false;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str())) {
+        SYLAR_LOG_ERROR(g_logger) << "ConfigSnapshot rename " << tmp << " to "
+                                  << path << " errno=" << errno << " "
+                                  << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace sylar
@@ -0,0 +1,110 @@
+/*
+ * @Author: lvxr
+ * @brief 预编译的二进制配置快照
+ */
+#ifndef SYLAR_CONFIG_SNAPSHOT_H
+#define SYLAR_CONFIG_SNAPSHOT_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief 二进制配置快照
+ * @details 由sylar_confc将配置目录拍平后的配置树编译而成,运行时mmap只读加载
+ *          文件布局:
+ *          Header | Entry[count] | uint32_t index[index_size] | 字符串区
+ *          index为按配置项名称哈希的开放寻址表,保存Entry下标;
+ *          Header中保存头部和数据区的crc32校验和,以及编译时配置文件的数量和
+ *          每个文件的路径,大小,修改时间的哈希,用于判断快照是否过期
+ */
+class ConfigSnapshot : Noncopyable {
+public:
+    typedef std::shared_ptr<ConfigSnapshot> ptr;
+
+    /**
+     * @brief 构造函数
+     */
+    ConfigSnapshot();
+
+    /**
+     * @brief 析构函数,解除映射
+     */
+    ~ConfigSnapshot();
+
+    /**
+     * @brief 映射并校验快照文件
+     * @return 文件存在且格式,校验和都正确返回true
+     */
+    bool open(const std::string& path);
+
+    /**
+     * @brief 解除映射
+     */
+    void close();
+
+    /**
+     * @brief 是否已打开
+     */
+    bool isOpen() const { return m_data != nullptr; }
+
+    /**
+     * @brief 返回配置项数量
+     */
+    size_t size() const;
+
+    /**
+     * @brief 查找配置项
+     * @param[in] key 配置项名称
+     * @param[out] value 配置项的值(YAML格式)
+     * @return 存在返回true
+     */
+    bool find(const std::string& key, std::string& value) const;
+
+    /**
+     * @brief 快照是否比配置文件新
+     * @param[in] files 当前配置目录下的所有配置文件
+     * @details 配置文件数量,路径(决定合并顺序),大小或修改时间和编译时不同都视为过期;
+     *          修改时间只比较是否相等,cp -p等恢复出更旧的文件也能发现
+     */
+    bool isFresh(const std::vector<std::string>& files) const;
+
+    /**
+     * @brief 将配置树编译成快照文件
+     * @param[in] path 快照文件路径,先写临时文件再rename
+     * @param[in] tree 拍平后的配置树
+     * @param[in] files 配置树来源的配置文件
+     */
+    static bool Write(const std::string& path, const ConfigTree& tree,
+                      const std::vector<std::string>& files);
+
+    /**
+     * @brief 返回配置目录下快照文件的文件名
+     */
+    static const char* FileName() { return "config.snapshot"; }
+
+    /**
+     * @brief 按顺序计算配置文件的路径,大小和修改时间(纳秒)的哈希
+     * @param[out] hash 哈希值
+     * @return 有文件无法访问返回false
+     */
+    static bool GetSourcesHash(const std::vector<std::string>& files,
+                               uint64_t& hash);
+
+private:
+    // 映射的起始地址
+    const char* m_data = nullptr;
+    // 映射的长度
+    size_t m_size = 0;
+};
+
+}  // namespace sylar
+
+#endif
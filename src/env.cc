@@ -53,7 +53,20 @@ bool Env::init(int argc, char** argv) {
                 return false;
             }
         } else {
-            if (now_key) {
+            if (now_key && !strcmp(now_key, "set")) {
+                // -set key=value 可以出现多次，不放入m_args
+                const char* eq = strchr(argv[i], '=');
+                if (eq == nullptr || eq == argv[i]) {
+                    SYLAR_LOG_ERROR(g_logger)
+                        << "invalid arg idx=" << i << " val=" << argv[i]
+                        << ", -set requires key=value";
+                    return false;
+                }
+                RWMutexType::WriteLock lock(m_mutex);
+                m_overrides.push_back(std::make_pair(
+                    std::string(argv[i], eq - argv[i]), std::string(eq + 1)));
+                now_key = nullptr;
+            } else if (now_key) {
                 add(now_key, argv[i]);
                 now_key = nullptr;
             } else {
@@ -117,6 +130,11 @@ void Env::printHelp() {
     }
 }
 
+std::vector<std::pair<std::string, std::string> > Env::getConfigOverrides() {
+    RWMutexType::ReadLock lock(m_mutex);
+    return m_overrides;
+}
+
 bool Env::setEnv(const std::string& key, const std::string& val) {
     return !setenv(key.c_str(), val.c_str(), 1);
 }
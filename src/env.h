@@ -8,6 +8,7 @@
 #define SYLAR_ENV_H
 
 #include <map>
+#include <string>
 #include <vector>
 
 #include "mutex.h"
@@ -85,6 +86,11 @@ public:
     std::string getEnv(const std::string& key,
                        const std::string& default_value = "");
 
+    /**
+     * @brief: 返回命令行中-set key=value指定的配置覆盖,按出现顺序
+     */
+    std::vector<std::pair<std::string, std::string> > getConfigOverrides();
+
     std::string getAbsolutePath(const std::string& path) const;
     std::string getAbsoluteWorkPath(const std::string& path) const;
     std::string getConfigPath();
@@ -96,6 +102,8 @@ private:
     std::map<std::string, std::string> m_args;
     // 帮助信息
     std::vector<std::pair<std::string, std::string> > m_helps;
+    // 命令行配置覆盖 -set key=value
+    std::vector<std::pair<std::string, std::string> > m_overrides;
 
     // 程序名字，即文件名
     std::string m_program;
@@ -0,0 +1,147 @@
+/*
+ * @Author: lvxr
+ * @brief 文件句柄管理
+ */
+
+#ifndef __SYLAR_FD_MANAGER_H__
+#define __SYLAR_FD_MANAGER_H__
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "mutex.h"
+#include "singleton.h"
+
+namespace sylar {
+
+/**
+ * @brief: 文件句柄上下文
+ * @details: 记录fd是否是socket、用户是否设置了非阻塞以及读写超时。
+ *           hook住的socket在系统层面总是非阻塞的，用户没有设置非阻塞时由hook负责挂起协程
+ */
+class FdCtx : public std::enable_shared_from_this<FdCtx> {
+public:
+    typedef std::shared_ptr<FdCtx> ptr;
+
+    /**
+     * @brief: 构造函数
+     * @param[in] {int} fd 文件句柄
+     */
+    FdCtx(int fd);
+
+    /**
+     * @brief: 析构函数
+     */
+    ~FdCtx();
+
+    /**
+     * @brief: 是否初始化完成
+     */
+    bool isInit() const { return m_isInit; }
+
+    /**
+     * @brief: 是否是socket
+     */
+    bool isSocket() const { return m_isSocket; }
+
+    /**
+     * @brief: 是否已关闭
+     */
+    bool isClose() const { return m_isClosed; }
+
+    /**
+     * @brief: 设置用户层面的非阻塞
+     */
+    void setUserNonblock(bool v) { m_userNonblock = v; }
+
+    /**
+     * @brief: 用户是否设置了非阻塞
+     */
+    bool getUserNonblock() const { return m_userNonblock; }
+
+    /**
+     * @brief: 设置系统层面的非阻塞
+     */
+    void setSysNonblock(bool v) { m_sysNonblock = v; }
+
+    /**
+     * @brief: 系统层面是否非阻塞
+     */
+    bool getSysNonblock() const { return m_sysNonblock; }
+
+    /**
+     * @brief: 设置超时时间
+     * @param[in] {int} type SO_RCVTIMEO或者SO_SNDTIMEO
+     * @param[in] {uint64_t} v 超时时间(毫秒)
+     */
+    void setTimeout(int type, uint64_t v);
+
+    /**
+     * @brief: 返回超时时间(毫秒)，没有设置时为~0ull
+     */
+    uint64_t getTimeout(int type);
+
+private:
+    /**
+     * @brief: 初始化，socket设置为系统层面非阻塞
+     */
+    bool init();
+
+private:
+    // 是否初始化
+    bool m_isInit : 1;
+    // 是否是socket
+    bool m_isSocket : 1;
+    // 是否hook非阻塞
+    bool m_sysNonblock : 1;
+    // 是否用户主动设置非阻塞
+    bool m_userNonblock : 1;
+    // 是否关闭
+    bool m_isClosed : 1;
+    // 文件句柄
+    int m_fd;
+    // 读超时时间(毫秒)
+    uint64_t m_recvTimeout;
+    // 写超时时间(毫秒)
+    uint64_t m_sendTimeout;
+};
+
+/**
+ * @brief: 文件句柄管理类
+ */
+class FdManager {
+public:
+    typedef RWMutex RWMutexType;
+
+    /**
+     * @brief: 构造函数
+     */
+    FdManager();
+
+    /**
+     * @brief: 获取/创建文件句柄上下文
+     * @param[in] {int} fd 文件句柄
+     * @param[in] {bool} auto_create 不存在时是否自动创建
+     * @return: 不存在并且不自动创建时返回nullptr
+     */
+    FdCtx::ptr get(int fd, bool auto_create = false);
+
+    /**
+     * @brief: 删除文件句柄上下文
+     */
+    void del(int fd);
+
+private:
+    RWMutexType m_mutex;
+    // 文件句柄上下文，下标为fd
+    std::vector<FdCtx::ptr> m_datas;
+};
+
+// 文件句柄管理单例
+typedef Singleton<FdManager> FdMgr;
+
+}  // namespace sylar
+
+#endif
@@ -5,11 +5,24 @@
 
 #include "fiber.h"
 
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <atomic>
+#include <map>
+#include <sstream>
+#include <vector>
 
 #include "config.h"
+#include "fiber_profiler.h"
+#include "fiber_trace.h"
 #include "log.h"
 #include "marco.h"
+#include "scheduler.h"
 
 namespace sylar {
 
@@ -21,7 +34,9 @@ static std::atomic<uint64_t> s_fiber_id{0};
 static std::atomic<uint64_t> s_fiber_count{0};
 
 // 现在正在运行的协程,使用原生指针,避免频繁切换造成的性能损失
-static thread_local Fiber* t_fiber = nullptr;
+thread_local Fiber* Fiber::t_fiber = nullptr;
+thread_local bool Fiber::t_preempt = false;
+thread_local uint32_t Fiber::t_switches = 0;
 // 当前线程主协程
 static thread_local Fiber::ptr t_threadFiber = nullptr;
 
@@ -29,13 +44,465 @@ static thread_local Fiber::ptr t_threadFiber = nullptr;
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size = Config::Lookup<uint32_t>(
     "fiber.stack_size", 128 * 1024, "fiber stack size");
 
+// 每个线程缓存的空闲协程栈数量上限
+static ConfigVar<uint32_t>::ptr g_fiber_stack_pool_size =
+    Config::Lookup<uint32_t>("fiber.stack_pool_size", 64,
+                             "max idle fiber stacks cached per thread");
+
+// g_fiber_stack_pool_size的缓存，释放栈时不用加锁读取配置
+static std::atomic<uint32_t> s_stack_pool_size{64};
+
+// 每个线程缓存的已结束协程数量上限
+static ConfigVar<uint32_t>::ptr g_fiber_pool_size = Config::Lookup<uint32_t>(
+    "fiber.pool_size", 64, "max finished fibers cached per thread for reuse");
+
+// g_fiber_pool_size的缓存
+static std::atomic<uint32_t> s_fiber_pool_size{64};
+// g_fiber_stack_size的缓存，只复用默认栈大小的协程
+static std::atomic<uint32_t> s_fiber_stack_size{128 * 1024};
+// 复用协程池的次数
+static std::atomic<uint64_t> s_pool_hits{0};
+// 协程池为空新建协程的次数
+static std::atomic<uint64_t> s_pool_misses{0};
+
+// 已注册的协程局部变量个数
+static std::atomic<size_t> s_local_count{0};
+// 协程局部变量的释放函数，下标与变量下标相同
+static std::atomic<void (*)(void*)> s_local_destroy[SYLAR_FIBER_LOCAL_MAX];
+
+struct FiberIniter {
+    FiberIniter() {
+        s_stack_pool_size = g_fiber_stack_pool_size->getValue();
+        g_fiber_stack_pool_size->addListener(
+            [](const uint32_t& old_value, const uint32_t& new_value) {
+                s_stack_pool_size = new_value;
+            });
+        s_fiber_stack_size = g_fiber_stack_size->getValue();
+        g_fiber_stack_size->addListener(
+            [](const uint32_t& old_value, const uint32_t& new_value) {
+                s_fiber_stack_size = new_value;
+            });
+        s_fiber_pool_size = g_fiber_pool_size->getValue();
+        g_fiber_pool_size->addListener(
+            [](const uint32_t& old_value, const uint32_t& new_value) {
+                s_fiber_pool_size = new_value;
+            });
+    }
+};
+
+static FiberIniter __fiber_init;
+
 class MallocStackAllocator {
 public:
     static void* Alloc(size_t size) { return malloc(size); }
     static void Dealloc(void* vp, size_t size) { return free(vp); }
 };
 
-using StackAllocator = MallocStackAllocator;
+/**
+ * @brief: mmap分配的协程栈
+ * @details: 栈的低地址处有一页PROT_NONE的保护页，栈溢出时触发SIGSEGV而不是悄悄破坏堆；
+ *           释放的栈放入线程本地的空闲链表复用，超过fiber.stack_pool_size时munmap；
+ *           放入空闲链表时madvise(MADV_DONTNEED)归还栈顶页以外的物理内存，
+ *           大量协程退出后RSS不会一直停留在峰值
+ */
+class MmapStackAllocator {
+public:
+    /**
+     * @brief: 构造当前线程的空闲栈缓存
+     * @details: 线程本地对象按构造的逆序析构，
+     *           析构时还要归还栈的线程本地对象需要在它之后构造
+     */
+    static void InitThread() { GetPool(); }
+
+    static void* Alloc(size_t size) {
+        size = RoundUp(size);
+        auto& pool = GetPool();
+        auto it = pool.stacks.find(size);
+        if (it != pool.stacks.end() && !it->second.empty()) {
+            void* vp = it->second.back();
+            it->second.pop_back();
+            --pool.count;
+            return vp;
+        }
+
+        size_t page = PageSize();
+        void* base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        SYLAR_ASSERT2(base != MAP_FAILED,
+                      "mmap fiber stack size=" << size << " errno=" << errno);
+        if (mprotect(base, page, PROT_NONE)) {
+            SYLAR_LOG_ERROR(g_logger)
+                << "mprotect fiber stack guard page errno=" << errno;
+        }
+        return (char*)base + page;
+    }
+
+    static void Dealloc(void* vp, size_t size) {
+        size = RoundUp(size);
+        auto& pool = GetPool();
+        if (pool.count < s_stack_pool_size) {
+            // 保留栈顶一页，协程入口总会用到
+            madvise(vp, size - PageSize(), MADV_DONTNEED);
+            pool.stacks[size].push_back(vp);
+            ++pool.count;
+            return;
+        }
+        Unmap(vp, size);
+    }
+
+private:
+    /**
+     * @brief: 线程本地的空闲栈，按栈大小分组
+     */
+    struct Pool {
+        ~Pool() {
+            for (auto& it : stacks) {
+                for (auto vp : it.second) {
+                    Unmap(vp, it.first);
+                }
+            }
+        }
+        std::map<size_t, std::vector<void*> > stacks;
+        uint32_t count = 0;
+    };
+
+    static Pool& GetPool() {
+        static thread_local Pool t_pool;
+        return t_pool;
+    }
+
+    static size_t PageSize() {
+        static size_t s_page = sysconf(_SC_PAGESIZE);
+        return s_page;
+    }
+
+    static size_t RoundUp(size_t size) {
+        size_t page = PageSize();
+        return (size + page - 1) / page * page;
+    }
+
+    static void Unmap(void* vp, size_t size) {
+        size_t page = PageSize();
+        munmap((char*)vp - page, size + page);
+    }
+};
+
+using StackAllocator = MmapStackAllocator;
+
+/**
+ * @brief: 线程本地的已结束协程池
+ * @details: 协程和它的栈一起缓存，Create时reset成新的回调
+ */
+class FiberPool {
+public:
+    FiberPool() { StackAllocator::InitThread(); }
+
+    ~FiberPool() {
+        t_destroyed = true;
+        for (auto f : m_fibers) {
+            delete f;
+        }
+    }
+
+    /**
+     * @brief: 线程退出时协程池已经析构，之后释放的协程不能再放进来
+     */
+    static bool IsDestroyed() { return t_destroyed; }
+
+    /**
+     * @brief: 取出一个协程，没有时返回nullptr
+     */
+    Fiber* pop() {
+        if (m_fibers.empty()) {
+            return nullptr;
+        }
+        Fiber* f = m_fibers.back();
+        m_fibers.pop_back();
+        return f;
+    }
+
+    /**
+     * @brief: 放入一个协程
+     * @return: 已满时返回false
+     */
+    bool push(Fiber* f) {
+        if (m_fibers.size() >= s_fiber_pool_size) {
+            return false;
+        }
+        m_fibers.push_back(f);
+        return true;
+    }
+
+    static FiberPool& GetThis() {
+        static thread_local FiberPool t_pool;
+        return t_pool;
+    }
+
+private:
+    std::vector<Fiber*> m_fibers;
+    static thread_local bool t_destroyed;
+};
+
+thread_local bool FiberPool::t_destroyed = false;
+
+// 每个线程的共享栈大小
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+    Config::Lookup<uint32_t>("fiber.shared_stack_size", 1024 * 1024,
+                             "shared fiber stack size");
+
+// 每个线程的共享栈数量，共享栈协程轮流分配到这些栈上
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_count =
+    Config::Lookup<uint32_t>("fiber.shared_stack_count", 4,
+                             "shared fiber stacks per thread");
+
+/**
+ * @brief: 共享栈
+ */
+struct FiberSharedStack {
+    // 栈内存
+    char* stack = nullptr;
+    // 栈大小
+    size_t size = 0;
+    // 当前栈上内容所属的协程
+    Fiber* owner = nullptr;
+};
+
+/**
+ * @brief: 线程本地的共享栈
+ */
+class SharedStackPool {
+public:
+    // 共享栈在第一次使用时才分配，空闲栈缓存要先构造，析构时才能归还
+    SharedStackPool() { StackAllocator::InitThread(); }
+
+    ~SharedStackPool() {
+        for (auto& s : m_stacks) {
+            StackAllocator::Dealloc(s.stack, s.size);
+        }
+    }
+
+    /**
+     * @brief: 轮流分配共享栈
+     */
+    FiberSharedStack* next() {
+        if (m_stacks.empty()) {
+            size_t count = std::max(1u, g_fiber_shared_stack_count->getValue());
+            m_stacks.resize(count);
+            for (auto& s : m_stacks) {
+                s.size = g_fiber_shared_stack_size->getValue();
+                s.stack = (char*)StackAllocator::Alloc(s.size);
+            }
+        }
+        return &m_stacks[m_next++ % m_stacks.size()];
+    }
+
+    /**
+     * @brief: 共享栈是否属于本线程
+     */
+    bool contains(FiberSharedStack* s) const {
+        return !m_stacks.empty() && s >= &m_stacks.front() &&
+               s <= &m_stacks.back();
+    }
+
+    static SharedStackPool& GetThis() {
+        static thread_local SharedStackPool t_pool;
+        return t_pool;
+    }
+
+private:
+    std::vector<FiberSharedStack> m_stacks;
+    size_t m_next = 0;
+};
+
+#ifdef SYLAR_FIBER_ASM
+
+extern "C" {
+/**
+ * @brief: 保存当前上下文并切换到目标上下文
+ * @param[out] from 保存当前上下文的栈指针
+ * @param[in] to 目标上下文的栈指针
+ * @details: callee-saved寄存器压入当前栈，再从目标栈弹出；
+ *           caller-saved寄存器由编译器在调用点保存
+ */
+void sylar_swap_context(void** from, void* to);
+}
+
+#    if defined(__x86_64__)
+// 栈布局(低地址在前): mxcsr/x87控制字(8字节) r15 r14 r13 r12 rbx rbp 返回地址
+asm(R"(
+    .pushsection .text
+    .globl sylar_swap_context
+    .hidden sylar_swap_context
+    .type sylar_swap_context, %function
+    .align 16
+sylar_swap_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size sylar_swap_context, .-sylar_swap_context
+    .popsection
+)");
+
+/**
+ * @brief: 在协程栈顶构造初始上下文，第一次切换进来时ret到fn
+ */
+static void MakeContext(FiberContext* ctx, void* stack, size_t size,
+                        void (*fn)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    void** sp = (void**)top;
+    // fn的返回地址，fn不会返回；ret之后rsp = top - 8，满足函数入口的对齐要求
+    *--sp = nullptr;
+    *--sp = (void*)fn;
+    // rbp rbx r12 r13 r14 r15
+    for (int i = 0; i < 6; ++i) {
+        *--sp = nullptr;
+    }
+    --sp;
+    // 默认的mxcsr和x87控制字
+    ((uint32_t*)sp)[0] = 0x1F80;
+    ((uint32_t*)sp)[1] = 0x037F;
+    ctx->sp = sp;
+}
+#    elif defined(__aarch64__)
+// 栈布局(低地址在前): x19-x28 x29 x30(返回地址) d8-d15，共160字节
+asm(R"(
+    .pushsection .text
+    .globl sylar_swap_context
+    .hidden sylar_swap_context
+    .type sylar_swap_context, %function
+    .align 4
+sylar_swap_context:
+    sub sp, sp, #160
+    stp x19, x20, [sp, #0]
+    stp x21, x22, [sp, #16]
+    stp x23, x24, [sp, #32]
+    stp x25, x26, [sp, #48]
+    stp x27, x28, [sp, #64]
+    stp x29, x30, [sp, #80]
+    stp d8, d9, [sp, #96]
+    stp d10, d11, [sp, #112]
+    stp d12, d13, [sp, #128]
+    stp d14, d15, [sp, #144]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp x19, x20, [sp, #0]
+    ldp x21, x22, [sp, #16]
+    ldp x23, x24, [sp, #32]
+    ldp x25, x26, [sp, #48]
+    ldp x27, x28, [sp, #64]
+    ldp x29, x30, [sp, #80]
+    ldp d8, d9, [sp, #96]
+    ldp d10, d11, [sp, #112]
+    ldp d12, d13, [sp, #128]
+    ldp d14, d15, [sp, #144]
+    add sp, sp, #160
+    ret
+    .size sylar_swap_context, .-sylar_swap_context
+    .popsection
+)");
+
+/**
+ * @brief: 在协程栈顶构造初始上下文，第一次切换进来时ret到fn(x30)
+ */
+static void MakeContext(FiberContext* ctx, void* stack, size_t size,
+                        void (*fn)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    void** sp = (void**)(top - 160);
+    for (int i = 0; i < 20; ++i) {
+        sp[i] = nullptr;
+    }
+    // x30
+    sp[11] = (void*)fn;
+    ctx->sp = sp;
+}
+#    endif
+
+/**
+ * @brief: 初始化线程主协程的上下文，第一次切换出去时才保存
+ */
+static void InitContext(FiberContext* ctx) { ctx->sp = nullptr; }
+
+/**
+ * @brief: 保存当前上下文到from，切换到to
+ */
+static void SwapContext(FiberContext* from, FiberContext* to) {
+    sylar_swap_context(&from->sp, to->sp);
+}
+
+#else
+
+static void MakeContext(FiberContext* ctx, void* stack, size_t size,
+                        void (*fn)()) {
+    if (getcontext(ctx)) {
+        SYLAR_ASSERT2(false, "getcontext");
+    }
+    ctx->uc_link = nullptr;
+    ctx->uc_stack.ss_sp = stack;
+    ctx->uc_stack.ss_size = size;
+    makecontext(ctx, fn, 0);
+}
+
+static void InitContext(FiberContext* ctx) {
+    if (getcontext(ctx)) {
+        SYLAR_ASSERT2(false, "getcontext");
+    }
+}
+
+static void SwapContext(FiberContext* from, FiberContext* to) {
+    if (swapcontext(from, to)) {
+        SYLAR_ASSERT2(false, "swapcontext");
+    }
+}
+
+#endif
+
+FiberEntry FiberEntry::FromCallback(const std::function<void()>& cb) {
+    FiberEntry entry;
+    entry.type = &cb.target_type();
+    void (*const* fn)() = cb.target<void (*)()>();
+    if (fn) {
+        entry.fn = *fn;
+    }
+    return entry;
+}
+
+std::string FiberEntry::getName() const {
+    if (!type) {
+        return "";
+    }
+    const char* mangled = type->name();
+    Dl_info info;
+    if (fn && dladdr((void*)fn, &info) && info.dli_sname) {
+        mangled = info.dli_sname;
+    } else if (fn) {
+        std::stringstream ss;
+        ss << (void*)fn;
+        return ss.str();
+    }
+    char* demangled = abi::__cxa_demangle(mangled, nullptr, nullptr, nullptr);
+    std::string name = demangled ? demangled : mangled;
+    free(demangled);
+    return name;
+}
 
 void Fiber::SetThis(Fiber* f) { t_fiber = f; }
 
@@ -47,38 +514,57 @@ uint64_t Fiber::GetFiberId() {
 }
 
 Fiber::Fiber() {
+    // 线程主协程只在本线程内引用
+    m_localRef = true;
     m_state = EXEC;
     SetThis(this);
-    if (getcontext(&m_ctx)) SYLAR_ASSERT2(false, "getcontext");
+    InitContext(&m_ctx);
 
     ++s_fiber_count;
     SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber main fiber create success!";
 }
 
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
+Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller,
+             bool shared_stack)
     : m_id(++s_fiber_id), m_cb(cb) {
     ++s_fiber_count;
-    m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
+#ifdef SYLAR_FIBER_ASM
+    if (shared_stack) {
+        // 共享栈和栈上的初始上下文在第一次切换进来时才分配和构造，
+        // 在其他线程创建的协程可以交给调度器在工作线程上运行
+        m_shared = true;
+        m_ctx.sp = nullptr;
+        SYLAR_FIBER_TRACE(CREATE, m_id, INIT, NONE);
+        SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id << " shared";
+        return;
+    }
+#endif
+    m_stacksize = stacksize ? stacksize : ChooseStackSize(cb);
 
     m_stack = StackAllocator::Alloc(m_stacksize);
-    if (getcontext(&m_ctx)) {
-        SYLAR_ASSERT2(false, "getcontext");
+    if (SYLAR_UNLIKELY(FiberProfiler::IsStackEnabled())) {
+        FiberProfiler::FillStack(this, m_cb);
     }
-
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    MakeContext(&m_ctx, m_stack, m_stacksize,
+                use_caller ? &Fiber::CallerMainFunc : &Fiber::MainFunc);
+    SYLAR_FIBER_TRACE(CREATE, m_id, INIT, NONE);
 
     SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id;
 }
 
 Fiber::~Fiber() {
     --s_fiber_count;
+    destroyLocals();
+    delete[] m_moreLocals;
     if (m_stack) {
         SYLAR_ASSERT(m_state == TERM || m_state == EXCEPT || m_state == INIT);
         StackAllocator::Dealloc(m_stack, m_stacksize);
+    } else if (m_shared) {
+        SYLAR_ASSERT(m_state == TERM || m_state == EXCEPT || m_state == INIT);
+        if (m_sharedStack && m_sharedStack->owner == this) {
+            m_sharedStack->owner = nullptr;
+        }
+        free(m_saved);
     } else {
         SYLAR_ASSERT(!m_cb);
         SYLAR_ASSERT(m_state == EXEC);
@@ -94,84 +580,328 @@ Fiber::~Fiber() {
 }
 
 void Fiber::reset(std::function<void()> cb) {
-    SYLAR_ASSERT(m_stack);
+    SYLAR_ASSERT(m_stack || m_shared);
     SYLAR_ASSERT(m_state == TERM || m_state == EXCEPT || m_state == INIT);
+    if (SYLAR_UNLIKELY(m_stackFilled)) {
+        FiberProfiler::MeasureStack(this);
+    }
     m_cb = cb;
-    if (getcontext(&m_ctx)) {
-        SYLAR_ASSERT2(false, "getcontext");
+    m_exception = nullptr;
+    m_entry = FiberEntry();
+    m_cpuTime = 0;
+    m_runStart = 0;
+    if (m_shared) {
+        // 保留已经分配的共享栈，协程仍然固定在原来的线程上
+        m_ctx = FiberContext();
+        m_savedSize = 0;
+    } else {
+        if (SYLAR_UNLIKELY(FiberProfiler::IsStackEnabled())) {
+            FiberProfiler::FillStack(this, m_cb);
+        }
+        MakeContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc);
     }
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
     m_state = INIT;
+    if (m_cb) {
+        SYLAR_FIBER_TRACE(CREATE, m_id, INIT, NONE);
+    }
+}
+
+void Fiber::acquireSharedStack() {
+#ifdef SYLAR_FIBER_ASM
+    if (!m_sharedStack) {
+        m_sharedStack = SharedStackPool::GetThis().next();
+        m_stackThread = GetThreadId();
+    }
+    FiberSharedStack* ss = m_sharedStack;
+    SYLAR_ASSERT2(SharedStackPool::GetThis().contains(ss),
+                  "shared stack fiber resumed on another thread id=" << m_id);
+    if (ss->owner != this) {
+        if (ss->owner) {
+            ss->owner->saveSharedStack();
+        }
+        ss->owner = this;
+        if (m_ctx.sp) {
+            memcpy(ss->stack + ss->size - m_savedSize, m_saved, m_savedSize);
+        }
+    }
+    if (!m_ctx.sp) {
+        MakeContext(&m_ctx, ss->stack, ss->size, &Fiber::MainFunc);
+    }
+#endif
+}
+
+void Fiber::saveSharedStack() {
+#ifdef SYLAR_FIBER_ASM
+    if (m_state == TERM || m_state == EXCEPT || !m_ctx.sp) {
+        // 栈上没有需要保留的内容
+        m_savedSize = 0;
+        return;
+    }
+    char* top = m_sharedStack->stack + m_sharedStack->size;
+    m_savedSize = top - (char*)m_ctx.sp;
+    if (m_savedCap < m_savedSize) {
+        free(m_saved);
+        m_savedCap = (m_savedSize + 255) & ~(size_t)255;
+        m_saved = (char*)malloc(m_savedCap);
+    }
+    memcpy(m_saved, m_ctx.sp, m_savedSize);
+#endif
+}
+
+/**
+ * @brief: 返回swapIn/swapOut切换的对象，有调度器时是调度协程，否则是线程主协程
+ */
+static Fiber* GetSchedulerFiber() {
+    Fiber* fiber = Scheduler::GetMainFiber();
+    return fiber ? fiber : t_threadFiber.get();
 }
 
 void Fiber::swapIn() {
+    Fiber* main_fiber = GetSchedulerFiber();
     SetThis(this);
     SYLAR_ASSERT(m_state != EXEC);
+    SYLAR_FIBER_TRACE(BEGIN, m_id, m_state, RESUME);
     m_state = EXEC;
-    if (swapcontext(&(*t_threadFiber).m_ctx, &m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
+    ++t_switches;
+    t_preempt = false;
+    if (m_shared) {
+        acquireSharedStack();
     }
+    SYLAR_FIBER_SWITCH_IN(this);
+    SwapContext(&main_fiber->m_ctx, &m_ctx);
 }
 
-void Fiber::swapOut() {
-    SetThis(t_threadFiber.get());
-    if (swapcontext(&m_ctx, &(*t_threadFiber).m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
+void Fiber::swapOut() { swapOut(m_state); }
+
+void Fiber::swapOut(State state) {
+    SYLAR_FIBER_SWITCH_OUT(this, state);
+    if (SYLAR_UNLIKELY(FiberTrace::IsEnabled())) {
+        FiberTrace::Record(FiberTrace::END, m_id, state,
+                           state == READY  ? FiberTrace::YIELD
+                           : state == HOLD ? FiberTrace::HOLD
+                                           : FiberTrace::FINISH);
     }
+    // 调度器有下一个任务时直接切换过去，调度协程只在没有任务时运行
+    if (Scheduler::SwitchToNext(this, state)) {
+        return;
+    }
+    Fiber* main_fiber = GetSchedulerFiber();
+    SetThis(main_fiber);
+    SwapContext(&m_ctx, &main_fiber->m_ctx);
+    Scheduler::FinishSwitch();
+}
+
+bool Fiber::canSwitchTo(const Fiber& to) const {
+    if (!to.m_shared) {
+        return true;
+    }
+    // 目标分配到的共享栈可能正是自己所在的栈
+    if (!to.m_sharedStack) {
+        return !m_shared;
+    }
+    return to.m_sharedStack != m_sharedStack;
+}
+
+void Fiber::switchTo(Fiber& to) {
+    SYLAR_ASSERT(t_fiber == this);
+    SYLAR_ASSERT(canSwitchTo(to));
+    SYLAR_ASSERT(to.m_state != EXEC);
+    SYLAR_FIBER_TRACE(BEGIN, to.m_id, to.m_state, SWITCH);
+    SetThis(&to);
+    to.m_state = EXEC;
+    ++t_switches;
+    t_preempt = false;
+    if (to.m_shared) {
+        to.acquireSharedStack();
+    }
+    SYLAR_FIBER_SWITCH_IN(&to);
+    SwapContext(&m_ctx, &to.m_ctx);
+}
+
+void Fiber::call() {
+    SYLAR_FIBER_TRACE(BEGIN, m_id, m_state, CALL);
+    SetThis(this);
+    m_state = EXEC;
+    SYLAR_FIBER_SWITCH_IN(this);
+    SwapContext(&t_threadFiber->m_ctx, &m_ctx);
+}
+
+void Fiber::back() {
+    SYLAR_FIBER_TRACE(END, m_id, m_state, BACK);
+    SYLAR_FIBER_SWITCH_OUT(this, m_state);
+    SetThis(t_threadFiber.get());
+    SwapContext(&m_ctx, &t_threadFiber->m_ctx);
 }
 
 Fiber::ptr Fiber::GetThis() {
     if (t_fiber) {
-        return t_fiber->shared_from_this();
+        return Fiber::ptr(t_fiber);
     }
     Fiber::ptr main_fiber(new Fiber);
     SYLAR_ASSERT(t_fiber == main_fiber.get());
     t_threadFiber = main_fiber;
-    return t_fiber->shared_from_this();
+    return main_fiber;
 }
 
 void Fiber::YieldToReady() {
-    Fiber::ptr cur = GetThis();
+    // 时间片已经用完时排到全局队列末尾，而不是放回自己的队列马上又被取出来
+    if (SYLAR_UNLIKELY(t_preempt) && Scheduler::YieldPreempted()) {
+        return;
+    }
+    Fiber* cur = GetCurrent();
     SYLAR_ASSERT(cur->m_state == EXEC);
-    cur->m_state = READY;
-    cur->swapOut();
+    cur->swapOut(READY);
 }
 
 void Fiber::YieldToHold() {
-    Fiber::ptr cur = GetThis();
+    Fiber* cur = GetCurrent();
     SYLAR_ASSERT(cur->m_state == EXEC);
-    cur->m_state = HOLD;
-    cur->swapOut();
+    cur->swapOut(HOLD);
 }
 
+void Fiber::Preempt() { Scheduler::YieldPreempted(); }
+
 uint64_t Fiber::TotalFibers() { return s_fiber_count; }
 
+Fiber::ptr Fiber::Create(std::function<void()> cb) {
+    // 协程池里只有默认大小的栈
+    size_t size = ChooseStackSize(cb);
+    Fiber* f =
+        size == s_fiber_stack_size ? FiberPool::GetThis().pop() : nullptr;
+    if (!f) {
+        ++s_pool_misses;
+        return Fiber::ptr(new Fiber(cb, size));
+    }
+    ++s_pool_hits;
+    f->m_id = ++s_fiber_id;
+    f->reset(cb);
+    return Fiber::ptr(f);
+}
+
+size_t Fiber::ChooseStackSize(const std::function<void()>& cb) {
+    if (SYLAR_UNLIKELY(FiberProfiler::IsStackAutoSize()) && cb) {
+        size_t size = FiberProfiler::GetStackSize(FiberEntry::FromCallback(cb));
+        if (size) {
+            return size;
+        }
+    }
+    return s_fiber_stack_size;
+}
+
+uint64_t Fiber::GetPoolHits() { return s_pool_hits; }
+
+uint64_t Fiber::GetPoolMisses() { return s_pool_misses; }
+
+size_t Fiber::RegisterLocal(void (*destroy)(void*)) {
+    size_t index = s_local_count++;
+    SYLAR_ASSERT2(index < SYLAR_FIBER_LOCAL_MAX,
+                  "too many fiber locals max=" << SYLAR_FIBER_LOCAL_MAX);
+    s_local_destroy[index] = destroy;
+    return index;
+}
+
+void Fiber::setLocal(size_t index, void* value) {
+    SYLAR_ASSERT(index < s_local_count);
+    if (index < SYLAR_FIBER_LOCAL_INLINE) {
+        m_locals[index] = value;
+        return;
+    }
+    if (!m_moreLocals) {
+        m_moreLocals =
+            new void*[SYLAR_FIBER_LOCAL_MAX - SYLAR_FIBER_LOCAL_INLINE]();
+    }
+    m_moreLocals[index - SYLAR_FIBER_LOCAL_INLINE] = value;
+}
+
+void Fiber::destroyLocals() {
+    // 释放函数可能又设置了其他变量，最多重复几轮
+    for (int round = 0; round < 4; ++round) {
+        bool found = false;
+        size_t count =
+            std::min(s_local_count.load(), (size_t)SYLAR_FIBER_LOCAL_MAX);
+        for (size_t i = 0; i < count; ++i) {
+            void* value = getLocal(i);
+            if (!value) {
+                continue;
+            }
+            found = true;
+            setLocal(i, nullptr);
+            s_local_destroy[i].load()(value);
+        }
+        if (!found) {
+            break;
+        }
+    }
+}
+
+void Fiber::Release(Fiber* fiber) {
+    if (SYLAR_UNLIKELY(fiber->m_stackFilled)) {
+        FiberProfiler::MeasureStack(fiber);
+    }
+    // 只复用默认大小独立栈的普通协程，线程主协程和共享栈协程直接释放
+    if (fiber->m_stack && !fiber->m_localRef && !FiberPool::IsDestroyed() &&
+        fiber->m_stacksize == s_fiber_stack_size &&
+        (fiber->m_state == TERM || fiber->m_state == EXCEPT ||
+         fiber->m_state == INIT)) {
+        fiber->m_cb = nullptr;
+        fiber->m_exception = nullptr;
+        if (FiberPool::GetThis().push(fiber)) {
+            return;
+        }
+    }
+    delete fiber;
+}
+
 void Fiber::MainFunc() {
-    Fiber::ptr cur = GetThis();
-    SYLAR_ASSERT(cur);
+    // 可能是其他协程直接切换过来的，先处理切换出去的协程
+    Scheduler::FinishSwitch();
+    Fiber* cur = GetCurrent();
+    try {
+        cur->m_cb();
+        cur->m_cb = nullptr;
+        cur->m_state = TERM;
+    } catch (std::exception& e) {
+        cur->m_state = EXCEPT;
+        cur->m_exception = std::current_exception();
+        SYLAR_LOG_ERROR(g_logger) << "Fiber Except: " << e.what()
+                                  << " fiber_id=" << cur->getId() << std::endl
+                                  << sylar::BacktraceToString();
+    } catch (...) {
+        cur->m_state = EXCEPT;
+        cur->m_exception = std::current_exception();
+        SYLAR_LOG_ERROR(g_logger)
+            << "Fiber Except" << " fiber_id=" << cur->getId() << std::endl
+            << sylar::BacktraceToString();
+    }
+    SYLAR_FIBER_TRACE(TERM, cur->getId(), cur->m_state, NONE);
+    cur->destroyLocals();
+    cur->swapOut();
+    SYLAR_ASSERT2(false, "never reach fiber_id=" + std::to_string(cur->getId()));
+}
+
+void Fiber::CallerMainFunc() {
+    Fiber* cur = GetCurrent();
     try {
         cur->m_cb();
         cur->m_cb = nullptr;
         cur->m_state = TERM;
     } catch (std::exception& e) {
         cur->m_state = EXCEPT;
+        cur->m_exception = std::current_exception();
         SYLAR_LOG_ERROR(g_logger) << "Fiber Except: " << e.what()
                                   << " fiber_id=" << cur->getId() << std::endl
                                   << sylar::BacktraceToString();
     } catch (...) {
         cur->m_state = EXCEPT;
+        cur->m_exception = std::current_exception();
         SYLAR_LOG_ERROR(g_logger)
             << "Fiber Except" << " fiber_id=" << cur->getId() << std::endl
             << sylar::BacktraceToString();
     }
-    auto raw_ptr = cur.get();
-    cur.reset();
-    raw_ptr->swapOut();
-    SYLAR_ASSERT2(false,
-                  "never reach fiber_id=" + std::to_string(raw_ptr->getId()));
+    SYLAR_FIBER_TRACE(TERM, cur->getId(), cur->m_state, NONE);
+    cur->destroyLocals();
+    cur->back();
+    SYLAR_ASSERT2(false, "never reach fiber_id=" + std::to_string(cur->getId()));
 }
 
 }  // namespace sylar
\ No newline at end of file
@@ -42,16 +42,91 @@ int swapcontext(ucontext_t *oucp, const ucontext_t *ucp);
 #ifndef __SYLAR_FIBER_H__
 #define __SYLAR_FIBER_H__
 
-#include <ucontext.h>
+/*
+上下文切换后端
+x86-64和aarch64默认使用汇编实现的切换，只保存callee-saved寄存器和栈指针，
+不像swapcontext那样每次切换都通过rt_sigprocmask系统调用保存和恢复信号掩码；
+其他平台或者定义了SYLAR_FIBER_UCONTEXT(cmake -DFIBER_UCONTEXT=ON)时使用ucontext
+*/
+#if !defined(SYLAR_FIBER_UCONTEXT) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#    define SYLAR_FIBER_ASM 1
+#endif
+
+#ifndef SYLAR_FIBER_ASM
+#    include <ucontext.h>
+#endif
+
+// 协程内联保存的协程局部变量个数，超过的放在按需分配的数组里
+#define SYLAR_FIBER_LOCAL_INLINE 8
+// 协程局部变量的最大个数
+#define SYLAR_FIBER_LOCAL_MAX 128
 
+#include <stdint.h>
+
+#include <atomic>
+#include <exception>
 #include <functional>
-#include <memory>
+#include <string>
+#include <typeinfo>
+
+#include "intrusive_ptr.h"
 
 namespace sylar {
 
-class Fiber : public std::enable_shared_from_this<Fiber> {
+#ifdef SYLAR_FIBER_ASM
+/**
+ * @brief: 协程上下文
+ * @details: 寄存器在切换时压入协程自己的栈，上下文只需要记录栈指针
+ */
+struct FiberContext {
+    void* sp = nullptr;
+};
+#else
+typedef ucontext_t FiberContext;
+#endif
+
+struct FiberSharedStack;
+
+/**
+ * @brief: 协程入口，用来按任务类型统计
+ * @details: 入口是函数指针时用函数地址区分，否则用可调用对象的类型区分，
+ *           同一个lambda或者bind表达式创建的协程属于同一类
+ */
+struct FiberEntry {
+    // 可调用对象的类型
+    const std::type_info* type = nullptr;
+    // 入口是函数指针时的地址
+    void (*fn)() = nullptr;
+
+    /**
+     * @brief: 取得回调的入口
+     */
+    static FiberEntry FromCallback(const std::function<void()>& cb);
+
+    /**
+     * @brief: 返回可读的入口名称，函数指针通过符号表解析
+     */
+    std::string getName() const;
+
+    bool empty() const { return !type; }
+
+    bool operator<(const FiberEntry& rhs) const {
+        return type != rhs.type ? type < rhs.type : fn < rhs.fn;
+    }
+};
+
+/**
+ * @brief: 协程
+ * @details: 使用侵入式引用计数，GetThis不需要shared_from_this，
+ *           让出协程时不会创建智能指针
+ */
+class Fiber {
+    friend class Scheduler;
+    friend class FiberProfiler;
+
 public:
-    typedef std::shared_ptr<Fiber> ptr;
+    typedef IntrusivePtr<Fiber> ptr;
 
     /**
      * @brief: 协程状态
@@ -82,11 +157,20 @@ public:
     /**
      * @brief: 带参构造函数，用于构造子协程
      * @param[in] {std::function<void()>} cb  协程运行函数，协程入口
-     * @param[in] {size_t} stacksize 协程栈大小
-     * @param[in] {bool} use_caller 是否在MainFiber主协程上调度
+     * @param[in] {size_t} stacksize 协程栈大小，0表示由ChooseStackSize选择
+     * @param[in] {bool} use_caller 是否是use_caller调度器的调度协程，
+     *                              为true时用call/back与线程主协程切换
+     * @param[in] {bool} shared_stack 是否使用共享栈
+     * @details: 共享栈模式下协程运行在线程本地的几个大栈上(fiber.shared_stack_size)，
+     *           其他协程要使用同一个栈时才把已用部分拷贝到按需分配的私有缓冲区，
+     *           空闲协程的内存只与实际栈深度有关；stacksize被忽略。
+     *           共享栈在第一次运行时从当前线程分配，之后只能在这个线程上运行，
+     *           调度器会把它固定到该线程(getStackThread)；协程暂停时栈上对象的地址无效，
+     *           不要把栈上对象的指针交给其他协程；只有汇编上下文后端支持，
+     *           使用ucontext时退化为独立栈
      */
     Fiber(std::function<void()> cb, size_t stacksize = 0,
-          bool use_caller = false);
+          bool use_caller = false, bool shared_stack = false);
 
     /**
      * @brief: 析构函数
@@ -109,6 +193,32 @@ public:
      */
     void swapOut();
 
+    /**
+     * @brief: 从当前协程直接切换到目标协程，不经过调度协程
+     * @pre: this是当前运行的协程，canSwitchTo(to)为true
+     * @details: 只做一次上下文切换，this的状态由调用者在切换前设置
+     */
+    void switchTo(Fiber& to);
+
+    /**
+     * @brief: 能否从当前协程直接切换到目标协程
+     * @details: 两者在同一个共享栈上时，自己的栈内容换出之前不能恢复目标，
+     *           需要先回到调度协程；目标还没有分配共享栈时，只能从独立栈协程切换过去
+     */
+    bool canSwitchTo(const Fiber& to) const;
+
+    /**
+     * @brief: 从线程主协程切换到当前协程
+     * @pre: 执行的是use_caller调度器的调度协程
+     */
+    void call();
+
+    /**
+     * @brief: 将当前协程切换回线程主协程
+     * @pre: 执行的是use_caller调度器的调度协程
+     */
+    void back();
+
     /**
      * @brief: 返回协程id
      */
@@ -119,7 +229,117 @@ public:
      */
     State getState() const { return m_state; }
 
+    /**
+     * @brief: 返回协程入口函数抛出的异常，状态为EXCEPT时有效
+     * @details: reset或者回收到协程池时清空
+     */
+    std::exception_ptr getException() const { return m_exception; }
+
+    /**
+     * @brief: 返回协程累计的运行时间，纳秒
+     * @details: 从切入到切出的单调时钟时间，只在fiber.profile.cpu打开时统计
+     */
+    uint64_t getCpuTime() const { return m_cpuTime; }
+
+    /**
+     * @brief: 返回协程入口，统计打开后第一次切入时取得
+     */
+    const FiberEntry& getEntry() const { return m_entry; }
+
+    /**
+     * @brief: 返回独立栈的大小，共享栈和线程主协程返回0
+     */
+    size_t getStackSize() const { return m_stack ? m_stacksize : 0; }
+
+    /**
+     * @brief: 是否使用共享栈
+     */
+    bool isSharedStack() const { return m_shared; }
+
+    /**
+     * @brief: 返回共享栈所属的线程id，还没有运行过或者不是共享栈协程返回-1
+     */
+    int getStackThread() const { return m_stackThread; }
+
+    /**
+     * @brief: 返回共享栈模式下保存栈内容占用的内存
+     */
+    size_t getSavedStackSize() const { return m_savedCap; }
+
+    /**
+     * @brief: 增加引用计数
+     */
+    void ref() {
+        if (m_localRef) {
+            m_refs.store(m_refs.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+        } else {
+            m_refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief: 减少引用计数，减到0时放回协程池或者释放
+     */
+    void unref() {
+        uint32_t n = 0;
+        if (m_localRef) {
+            n = m_refs.load(std::memory_order_relaxed) - 1;
+            m_refs.store(n, std::memory_order_relaxed);
+        } else {
+            n = m_refs.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        }
+        if (n == 0) {
+            Release(this);
+        }
+    }
+
+    /**
+     * @brief: 设置引用计数是否只在一个线程里修改
+     * @details: 为true时引用计数不使用原子指令，线程主协程默认为true
+     * @attention: 只有所有引用都在同一个线程里复制和释放时才能设置为true；
+     *             被调度器调度的协程可能在其他线程被唤醒，不能设置
+     */
+    void setLocalRefCount(bool v) { m_localRef = v; }
+
+    /**
+     * @brief: 引用计数是否只在一个线程里修改
+     */
+    bool isLocalRefCount() const { return m_localRef; }
+
+    /**
+     * @brief: 返回协程局部变量的值，没有设置时返回nullptr
+     * @param[in] {size_t} index RegisterLocal返回的下标
+     */
+    void* getLocal(size_t index) const {
+        if (index < SYLAR_FIBER_LOCAL_INLINE) {
+            return m_locals[index];
+        }
+        return m_moreLocals ? m_moreLocals[index - SYLAR_FIBER_LOCAL_INLINE]
+                            : nullptr;
+    }
+
+    /**
+     * @brief: 设置协程局部变量的值
+     * @details: 协程结束或者析构时用注册的destroy释放不为空的值
+     */
+    void setLocal(size_t index, void* value);
+
 public:
+    /**
+     * @brief: 返回当前所在协程的裸指针，不修改引用计数
+     * @details: 线程还没有协程时创建线程主协程；
+     *           正在运行的协程总是被切换它进来的一方引用着
+     */
+    static Fiber* GetCurrent() { return t_fiber ? t_fiber : GetThis().get(); }
+
+    /**
+     * @brief: 注册一个协程局部变量
+     * @param[in] destroy 释放变量值的函数
+     * @return: 变量的下标，从0开始连续分配，最多SYLAR_FIBER_LOCAL_MAX个
+     */
+    static size_t RegisterLocal(void (*destroy)(void*));
+
     /**
      * @brief: 设置当前线程的运行协程
      * @param[in] {Fiber*} f 运行协程
@@ -146,30 +366,142 @@ public:
      */
     static uint64_t TotalFibers();
 
+    /**
+     * @brief: 创建执行cb的协程，优先复用当前线程协程池里已经结束的协程
+     * @details: 复用的协程保留了已经映射的默认大小的栈，不需要重新分配；
+     *           结束的协程在最后一个引用释放时放回释放线程的协程池，
+     *           每个线程最多缓存fiber.pool_size个
+     */
+    static Fiber::ptr Create(std::function<void()> cb);
+
+    /**
+     * @brief: 选择执行cb的协程栈大小
+     * @details: 默认为fiber.stack_size；打开fiber.stack_auto_size后，
+     *           按入口记录过足够多次栈深度的使用推荐大小，见FiberProfiler::GetStackSize
+     */
+    static size_t ChooseStackSize(const std::function<void()>& cb);
+
+    /**
+     * @brief: 返回Create复用协程池的次数
+     */
+    static uint64_t GetPoolHits();
+
+    /**
+     * @brief: 返回Create新建协程的次数
+     */
+    static uint64_t GetPoolMisses();
+
+    /**
+     * @brief: 抢占检查点
+     * @details: scheduler.preempt_slice_ms大于0时，工作线程的定时器标记运行超过时间片的
+     *           任务协程，在检查点让出并排到全局队列末尾；持有线程锁时推迟到下一个检查点。
+     *           FiberMutex等加锁、输出日志和YieldToReady时会自动检查，长时间计算的代码可以主动调用
+     */
+    static void CheckPreempt() {
+        if (__builtin_expect(__atomic_load_n(&t_preempt, __ATOMIC_RELAXED), 0)) {
+            Preempt();
+        }
+    }
+
     /**
      * @brief: 协程执行函数
      * @post: 执行完毕返回到线程主协程
      */
     static void MainFunc();
 
+    /**
+     * @brief: 调度协程的执行函数
+     * @post: 执行完毕返回到线程主协程
+     */
+    static void CallerMainFunc();
+
     /**
      * @brief: 获取当前协程的id
      */
     static uint64_t GetFiberId();
 
 private:
+    /**
+     * @brief: 引用计数减到0时调用，可以复用的协程放回协程池，否则释放
+     */
+    static void Release(Fiber* fiber);
+
+    /**
+     * @brief: 抢占标记被设置时由CheckPreempt调用
+     */
+    static void Preempt();
+
+    /**
+     * @brief: 将当前协程切换到后台，切换出来以后状态为state
+     */
+    void swapOut(State state);
+
+    /**
+     * @brief: 切换进共享栈协程之前，换出占用共享栈的协程并恢复自己的栈内容
+     */
+    void acquireSharedStack();
+
+    /**
+     * @brief: 把自己在共享栈上已用的部分拷贝到私有缓冲区
+     */
+    void saveSharedStack();
+
+    /**
+     * @brief: 释放所有协程局部变量
+     */
+    void destroyLocals();
+
+private:
+    // 当前线程正在运行的协程，initial-exec模型读取时不需要调用__tls_get_addr
+    static thread_local Fiber* t_fiber __attribute__((tls_model("initial-exec")));
+    // 当前协程的时间片已经用完，由调度器的定时器信号设置，切入协程时清除
+    static thread_local bool t_preempt __attribute__((tls_model("initial-exec")));
+    // 本线程切入协程的次数，定时器信号据此判断当前协程运行了多久
+    static thread_local uint32_t t_switches
+        __attribute__((tls_model("initial-exec")));
+
+    // 引用计数
+    std::atomic<uint32_t> m_refs{0};
+    // 引用计数是否只在一个线程里修改
+    bool m_localRef = false;
     // 协程id
     uint64_t m_id = 0;
     // 协程运行栈大小
-    u_int32_t m_stacksize = 0;
+    uint32_t m_stacksize = 0;
     // 线程状态
     State m_state = INIT;
     // 协程上下文
-    ucontext_t m_ctx;
+    FiberContext m_ctx;
     // 协程运行栈指针
     void* m_stack = nullptr;
     // 协程运行函数，协程入口
     std::function<void()> m_cb;
+    // 协程入口函数抛出的异常
+    std::exception_ptr m_exception;
+    // 协程入口
+    FiberEntry m_entry;
+    // 累计运行时间，纳秒
+    uint64_t m_cpuTime = 0;
+    // 本次切入的时间，没有在统计时为0
+    uint64_t m_runStart = 0;
+    // 独立栈是否填充了探测栈深度的图案
+    bool m_stackFilled = false;
+    // 是否使用共享栈
+    bool m_shared = false;
+    // 共享栈所属的线程id，第一次运行时确定
+    int m_stackThread = -1;
+    // 共享栈，第一次运行时从当前线程分配
+    FiberSharedStack* m_sharedStack = nullptr;
+    // 共享栈模式下被换出时保存的栈内容
+    char* m_saved = nullptr;
+    // 保存的栈内容大小
+    size_t m_savedSize = 0;
+    // 保存栈内容的缓冲区大小
+    size_t m_savedCap = 0;
+    // 内联的协程局部变量
+    void* m_locals[SYLAR_FIBER_LOCAL_INLINE] = {};
+    // 下标超过SYLAR_FIBER_LOCAL_INLINE的协程局部变量
+    void** m_moreLocals = nullptr;
 };
 }  // namespace sylar
 
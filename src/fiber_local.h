@@ -0,0 +1,81 @@
+/*
+ * @Author: lvxr
+ * @brief 协程局部变量
+ */
+
+#ifndef __SYLAR_FIBER_LOCAL_H__
+#define __SYLAR_FIBER_LOCAL_H__
+
+#include "fiber.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief: 协程局部变量
+ * @details: 类似thread_local，但是每个协程有自己的值，协程在线程间迁移或者
+ *           在同一个线程里交替执行时互不影响；不在协程里时使用线程主协程的值。
+ *           构造时分配一个下标，值保存在Fiber内部的数组里，
+ *           第一次访问时默认构造，协程结束时析构。
+ *           一般定义为全局或者静态变量，下标不回收
+ * @tparam T 变量类型，需要可以默认构造
+ */
+template <class T>
+class FiberLocal : Noncopyable {
+public:
+    FiberLocal() : m_index(Fiber::RegisterLocal(&FiberLocal::Destroy)) {}
+
+    /**
+     * @brief: 返回当前协程的值，没有时默认构造
+     */
+    T* get() const {
+        Fiber* fiber = Fiber::GetCurrent();
+        void* value = fiber->getLocal(m_index);
+        if (!value) {
+            value = new T();
+            fiber->setLocal(m_index, value);
+        }
+        return (T*)value;
+    }
+
+    /**
+     * @brief: 当前协程是否已经有值
+     */
+    bool has() const { return Fiber::GetCurrent()->getLocal(m_index); }
+
+    /**
+     * @brief: 设置当前协程的值
+     */
+    void set(const T& v) const { *get() = v; }
+
+    /**
+     * @brief: 提前释放当前协程的值
+     */
+    void reset() const {
+        Fiber* fiber = Fiber::GetCurrent();
+        void* value = fiber->getLocal(m_index);
+        if (value) {
+            fiber->setLocal(m_index, nullptr);
+            Destroy(value);
+        }
+    }
+
+    T* operator->() const { return get(); }
+
+    T& operator*() const { return *get(); }
+
+    /**
+     * @brief: 返回注册的下标
+     */
+    size_t getIndex() const { return m_index; }
+
+private:
+    static void Destroy(void* value) { delete (T*)value; }
+
+private:
+    size_t m_index;
+};
+
+}  // namespace sylar
+
+#endif
@@ -0,0 +1,634 @@
+/*
+ * @Author: lvxr
+ * @brief 协程运行时间统计和长时间占用线程的协程检测
+ */
+
+#include "fiber_profiler.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "config.h"
+#include "log.h"
+#include "mutex.h"
+#include "scheduler.h"
+#include "thread.h"
+#include "util.h"
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// 是否统计协程运行时间
+static ConfigVar<bool>::ptr g_fiber_profile_cpu = Config::Lookup<bool>(
+    "fiber.profile.cpu", false, "account fiber on-cpu time per entry point");
+
+// 任务协程一次运行超过这个时间时报告，0为关闭看门狗
+static ConfigVar<uint32_t>::ptr g_fiber_hog_threshold =
+    Config::Lookup<uint32_t>("fiber.profile.hog_threshold_ms", 0,
+                             "report fibers running longer than this, 0 off");
+
+// 是否统计协程栈深度
+static ConfigVar<bool>::ptr g_fiber_profile_stack = Config::Lookup<bool>(
+    "fiber.profile.stack", false,
+    "pattern-fill fiber stacks and record stack depth per entry point");
+
+// 是否按入口自动选择协程栈大小
+static ConfigVar<bool>::ptr g_fiber_stack_auto_size = Config::Lookup<bool>(
+    "fiber.stack_auto_size", false,
+    "choose fiber stack size per entry point from recorded stack depth");
+
+// 填充协程栈的图案
+static const uint64_t STACK_PATTERN = 0x5a5a5a5a5a5a5a5aull;
+// 推荐栈大小需要的最少记录次数
+static const uint64_t STACK_MIN_SAMPLES = 16;
+// 推荐的最小栈大小，给信号处理函数和日志留出空间
+static const size_t STACK_MIN_SIZE = 16 * 1024;
+
+// 看门狗向运行超时的线程发送这个信号，在信号处理函数中取得调用栈
+static const int HOG_SIGNAL = SIGURG;
+// 调用栈最大层数
+static const int HOG_BACKTRACE_SIZE = 64;
+
+bool FiberProfiler::s_cpuEnabled = false;
+bool FiberProfiler::s_stackEnabled = false;
+bool FiberProfiler::s_stackAutoSize = false;
+// g_fiber_hog_threshold的缓存
+static std::atomic<uint32_t> s_hog_threshold{0};
+// 超时运行次数
+static std::atomic<uint64_t> s_hog_count{0};
+
+static uint64_t MonotonicNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void FiberProfiler::Histogram::add(uint64_t ns) {
+    ++count;
+    total += ns;
+    max = std::max(max, ns);
+    int i = ns ? 63 - __builtin_clzll(ns) : 0;
+    ++buckets[i];
+}
+
+void FiberProfiler::Histogram::merge(const Histogram& rhs) {
+    count += rhs.count;
+    total += rhs.total;
+    max = std::max(max, rhs.max);
+    for (int i = 0; i < BUCKETS; ++i) {
+        buckets[i] += rhs.buckets[i];
+    }
+}
+
+uint64_t FiberProfiler::Histogram::percentile(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t target = std::max<uint64_t>(1, (uint64_t)(p * count + 0.5));
+    uint64_t sum = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        sum += buckets[i];
+        if (sum >= target) {
+            return i >= 63 ? max : std::min<uint64_t>(max, 2ull << i);
+        }
+    }
+    return max;
+}
+
+/**
+ * @brief: 线程的统计数据
+ * @details: 运行中的任务协程(fiberId/start)由本线程写入，看门狗读取；
+ *           直方图由本线程在mutex下更新，汇总时读取
+ */
+struct FiberProfileThread {
+    typedef std::shared_ptr<FiberProfileThread> ptr;
+    typedef Spinlock MutexType;
+
+    FiberProfileThread() : tid(GetThreadId()), name(Thread::GetName()) {}
+
+    pid_t tid;
+    std::string name;
+
+    // 正在运行的任务协程，切入时间为0表示没有
+    std::atomic<uint64_t> fiberId{0};
+    std::atomic<uint64_t> start{0};
+    std::atomic<const std::type_info*> entryType{nullptr};
+    std::atomic<void (*)()> entryFn{nullptr};
+    // 看门狗已经报告过的切入时间，只由看门狗读写
+    uint64_t reported = 0;
+
+    // 0空闲，1看门狗请求调用栈，2信号处理函数已经写入
+    std::atomic<int> btState{0};
+    void* bt[HOG_BACKTRACE_SIZE];
+    int btSize = 0;
+
+    MutexType mutex;
+    std::map<FiberEntry, FiberProfiler::Histogram> stats;
+};
+
+/**
+ * @brief: 所有线程的统计数据，线程退出时直方图合并到m_retired
+ * @details: 有意不析构，退出阶段还在运行的线程和看门狗可以继续访问
+ */
+class FiberProfileRegistry {
+public:
+    typedef Mutex MutexType;
+
+    void add(FiberProfileThread::ptr t) {
+        MutexType::Lock lock(m_mutex);
+        m_threads.push_back(t);
+    }
+
+    void retire(FiberProfileThread::ptr t) {
+        MutexType::Lock lock(m_mutex);
+        {
+            FiberProfileThread::MutexType::Lock l(t->mutex);
+            Merge(m_retired, t->stats);
+        }
+        m_threads.erase(std::remove(m_threads.begin(), m_threads.end(), t),
+                        m_threads.end());
+    }
+
+    std::vector<FiberProfileThread::ptr> list() {
+        MutexType::Lock lock(m_mutex);
+        return m_threads;
+    }
+
+    std::map<FiberEntry, FiberProfiler::Histogram> collect() {
+        MutexType::Lock lock(m_mutex);
+        std::map<FiberEntry, FiberProfiler::Histogram> stats = m_retired;
+        for (auto& t : m_threads) {
+            FiberProfileThread::MutexType::Lock l(t->mutex);
+            Merge(stats, t->stats);
+        }
+        return stats;
+    }
+
+    void reset() {
+        MutexType::Lock lock(m_mutex);
+        m_retired.clear();
+        for (auto& t : m_threads) {
+            FiberProfileThread::MutexType::Lock l(t->mutex);
+            t->stats.clear();
+        }
+    }
+
+    static FiberProfileRegistry& GetInstance() {
+        static FiberProfileRegistry* s_registry = new FiberProfileRegistry;
+        return *s_registry;
+    }
+
+private:
+    static void Merge(std::map<FiberEntry, FiberProfiler::Histogram>& to,
+                      const std::map<FiberEntry, FiberProfiler::Histogram>& from) {
+        for (auto& i : from) {
+            to[i.first].merge(i.second);
+        }
+    }
+
+private:
+    MutexType m_mutex;
+    std::vector<FiberProfileThread::ptr> m_threads;
+    std::map<FiberEntry, FiberProfiler::Histogram> m_retired;
+};
+
+/**
+ * @brief: 按入口记录的栈深度
+ * @details: 只在协程结束后记录，次数远少于切换，所有线程共用一个读写锁；
+ *           打开自动选择栈大小时新建协程读取推荐大小
+ */
+class FiberStackRegistry {
+public:
+    typedef RWMutex MutexType;
+
+    void add(const FiberEntry& entry, uint64_t bytes) {
+        MutexType::WriteLock lock(m_mutex);
+        m_stats[entry].add(bytes);
+    }
+
+    size_t recommend(const FiberEntry& entry) {
+        MutexType::ReadLock lock(m_mutex);
+        auto it = m_stats.find(entry);
+        if (it == m_stats.end() || it->second.count < STACK_MIN_SAMPLES) {
+            return 0;
+        }
+        return Recommend(it->second.max);
+    }
+
+    std::map<FiberEntry, FiberProfiler::Histogram> collect() {
+        MutexType::ReadLock lock(m_mutex);
+        return m_stats;
+    }
+
+    void reset() {
+        MutexType::WriteLock lock(m_mutex);
+        m_stats.clear();
+    }
+
+    /**
+     * @brief: 最大深度的两倍向上取2的幂，至少STACK_MIN_SIZE
+     */
+    static size_t Recommend(uint64_t max) {
+        size_t size = STACK_MIN_SIZE;
+        while (size < max * 2) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    static FiberStackRegistry& GetInstance() {
+        static FiberStackRegistry* s_registry = new FiberStackRegistry;
+        return *s_registry;
+    }
+
+private:
+    MutexType m_mutex;
+    std::map<FiberEntry, FiberProfiler::Histogram> m_stats;
+};
+
+// 当前线程的统计数据，信号处理函数中也会读取，所以用裸指针，
+// initial-exec模型读取时不需要调用非异步信号安全的__tls_get_addr
+static thread_local FiberProfileThread* t_profile
+    __attribute__((tls_model("initial-exec"))) = nullptr;
+
+/**
+ * @brief: 线程退出时把统计数据交给注册表
+ */
+struct FiberProfileHolder {
+    ~FiberProfileHolder() {
+        if (thread) {
+            t_profile = nullptr;
+            FiberProfileRegistry::GetInstance().retire(thread);
+        }
+    }
+
+    FiberProfileThread::ptr thread;
+};
+
+static FiberProfileThread* GetProfileThread() {
+    if (SYLAR_LIKELY(t_profile)) {
+        return t_profile;
+    }
+    static thread_local FiberProfileHolder t_holder;
+    t_holder.thread.reset(new FiberProfileThread);
+    FiberProfileRegistry::GetInstance().add(t_holder.thread);
+    t_profile = t_holder.thread.get();
+    return t_profile;
+}
+
+static void HogSignalHandler(int sig) {
+    int saved = errno;
+    FiberProfileThread* t = t_profile;
+    if (t && t->btState.load(std::memory_order_acquire) == 1) {
+        t->btSize = backtrace(t->bt, HOG_BACKTRACE_SIZE);
+        t->btState.store(2, std::memory_order_release);
+    }
+    errno = saved;
+}
+
+/**
+ * @brief: 看门狗线程
+ * @details: 每隔阈值的1/4检查一次所有线程正在运行的任务协程，
+ *           同一次运行只报告一次
+ */
+class FiberWatchdog {
+public:
+    void start() {
+        MutexType::Lock lock(m_mutex);
+        if (m_thread) {
+            return;
+        }
+        static bool s_installed = InstallSignal();
+        (void)s_installed;
+        m_stop = false;
+        m_thread.reset(
+            new Thread(std::bind(&FiberWatchdog::run, this), "fiber_watchdog"));
+    }
+
+    void stop() {
+        Thread::ptr thr;
+        {
+            MutexType::Lock lock(m_mutex);
+            thr.swap(m_thread);
+            m_stop = true;
+        }
+        if (thr) {
+            m_sem.notify();
+            thr->join();
+        }
+    }
+
+    static FiberWatchdog& GetInstance() {
+        static FiberWatchdog* s_watchdog = new FiberWatchdog;
+        return *s_watchdog;
+    }
+
+private:
+    typedef Mutex MutexType;
+
+    static bool InstallSignal() {
+        // 预先调用一次，backtrace第一次调用时会加载libgcc，不能在信号处理函数中做
+        void* bt[1];
+        backtrace(bt, 1);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &HogSignalHandler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(HOG_SIGNAL, &sa, nullptr)) {
+            SYLAR_LOG_ERROR(g_logger)
+                << "FiberWatchdog sigaction errno=" << errno;
+            return false;
+        }
+        return true;
+    }
+
+    void run() {
+        while (!m_stop) {
+            uint32_t threshold = s_hog_threshold;
+            uint32_t interval =
+                std::min<uint32_t>(100, std::max<uint32_t>(1, threshold / 4));
+            m_sem.waitFor(interval);
+            if (m_stop || !threshold) {
+                continue;
+            }
+            uint64_t now = MonotonicNS();
+            for (auto& t : FiberProfileRegistry::GetInstance().list()) {
+                check(t, now, threshold * 1000000ull);
+            }
+        }
+    }
+
+    void check(FiberProfileThread::ptr t, uint64_t now, uint64_t threshold) {
+        uint64_t start = t->start.load(std::memory_order_acquire);
+        uint64_t fiber_id = t->fiberId.load(std::memory_order_relaxed);
+        FiberEntry entry;
+        entry.type = t->entryType.load(std::memory_order_relaxed);
+        entry.fn = t->entryFn.load(std::memory_order_relaxed);
+        if (!start || now < start + threshold || t->reported == start ||
+            t->start.load(std::memory_order_acquire) != start) {
+            return;
+        }
+        t->reported = start;
+        ++s_hog_count;
+
+        // 让运行超时的线程在信号处理函数里取得自己的调用栈，最多等100ms
+        std::vector<std::string> bt;
+        t->btState.store(1, std::memory_order_release);
+        if (syscall(SYS_tgkill, getpid(), t->tid, HOG_SIGNAL) == 0) {
+            for (int i = 0; i < 100; ++i) {
+                if (t->btState.load(std::memory_order_acquire) == 2) {
+                    break;
+                }
+                usleep(1000);
+            }
+        }
+        if (t->btState.exchange(0, std::memory_order_acq_rel) == 2 &&
+            t->start.load(std::memory_order_acquire) == start) {
+            char** strings = backtrace_symbols(t->bt, t->btSize);
+            if (strings) {
+                // 跳过信号处理函数和信号跳板
+                for (int i = 2; i < t->btSize; ++i) {
+                    bt.push_back(strings[i]);
+                }
+                free(strings);
+            }
+        }
+
+        std::stringstream ss;
+        for (auto& i : bt) {
+            ss << "    " << i << std::endl;
+        }
+        SYLAR_LOG_ERROR(g_logger)
+            << "fiber hog fiber_id=" << fiber_id << " thread=" << t->name
+            << " tid=" << t->tid << " running=" << (now - start) / 1000000
+            << "ms entry=" << entry.getName() << std::endl
+            << ss.str();
+    }
+
+private:
+    MutexType m_mutex;
+    Thread::ptr m_thread;
+    std::atomic<bool> m_stop{false};
+    Semaphore m_sem;
+};
+
+void FiberProfiler::UpdateEnabled() {
+    bool enable = g_fiber_profile_cpu->getValue() || s_hog_threshold > 0;
+    __atomic_store_n(&s_cpuEnabled, enable, __ATOMIC_RELAXED);
+}
+
+struct FiberProfilerIniter {
+    FiberProfilerIniter() {
+        s_hog_threshold = g_fiber_hog_threshold->getValue();
+        FiberProfiler::UpdateEnabled();
+        g_fiber_profile_cpu->addListener(
+            [](const bool& old_value, const bool& new_value) {
+                FiberProfiler::UpdateEnabled();
+            });
+        g_fiber_hog_threshold->addListener(
+            [](const uint32_t& old_value, const uint32_t& new_value) {
+                s_hog_threshold = new_value;
+                FiberProfiler::UpdateEnabled();
+                if (new_value) {
+                    FiberWatchdog::GetInstance().start();
+                } else {
+                    FiberWatchdog::GetInstance().stop();
+                }
+            });
+        if (s_hog_threshold) {
+            FiberWatchdog::GetInstance().start();
+        }
+
+        FiberProfiler::s_stackEnabled = g_fiber_profile_stack->getValue();
+        g_fiber_profile_stack->addListener(
+            [](const bool& old_value, const bool& new_value) {
+                __atomic_store_n(&FiberProfiler::s_stackEnabled, new_value,
+                                 __ATOMIC_RELAXED);
+            });
+        FiberProfiler::s_stackAutoSize = g_fiber_stack_auto_size->getValue();
+        g_fiber_stack_auto_size->addListener(
+            [](const bool& old_value, const bool& new_value) {
+                __atomic_store_n(&FiberProfiler::s_stackAutoSize, new_value,
+                                 __ATOMIC_RELAXED);
+            });
+    }
+
+    ~FiberProfilerIniter() { FiberWatchdog::GetInstance().stop(); }
+};
+
+static FiberProfilerIniter __fiber_profiler_init;
+
+void FiberProfiler::OnSwitchIn(Fiber* fiber) {
+    uint64_t now = MonotonicNS();
+    fiber->m_runStart = now;
+    if (fiber->m_entry.empty() && fiber->m_cb) {
+        fiber->m_entry = FiberEntry::FromCallback(fiber->m_cb);
+    }
+    // 只有调度器的任务协程由看门狗检查，idle协程等会长时间阻塞
+    if (Scheduler::InTaskFiber()) {
+        FiberProfileThread* t = GetProfileThread();
+        t->fiberId.store(fiber->m_id, std::memory_order_relaxed);
+        t->entryType.store(fiber->m_entry.type, std::memory_order_relaxed);
+        t->entryFn.store(fiber->m_entry.fn, std::memory_order_relaxed);
+        t->start.store(now, std::memory_order_release);
+    }
+}
+
+void FiberProfiler::OnSwitchOut(Fiber* fiber, int state) {
+    if (!fiber->m_runStart) {
+        // 切入时统计还没有打开
+        return;
+    }
+    uint64_t now = MonotonicNS();
+    fiber->m_cpuTime += now - fiber->m_runStart;
+    fiber->m_runStart = 0;
+    FiberProfileThread* t = t_profile;
+    if (t && t->start.load(std::memory_order_relaxed) &&
+        t->fiberId.load(std::memory_order_relaxed) == fiber->m_id) {
+        t->start.store(0, std::memory_order_release);
+    }
+    if ((state == Fiber::TERM || state == Fiber::EXCEPT) &&
+        !fiber->m_entry.empty()) {
+        t = GetProfileThread();
+        FiberProfileThread::MutexType::Lock lock(t->mutex);
+        t->stats[fiber->m_entry].add(fiber->m_cpuTime);
+    }
+}
+
+std::map<std::string, FiberProfiler::Histogram> FiberProfiler::GetCpuStats() {
+    std::map<std::string, Histogram> stats;
+    for (auto& i : FiberProfileRegistry::GetInstance().collect()) {
+        stats[i.first.getName()].merge(i.second);
+    }
+    return stats;
+}
+
+void FiberProfiler::ResetCpuStats() { FiberProfileRegistry::GetInstance().reset(); }
+
+void FiberProfiler::DumpCpuStats(std::ostream& os) {
+    std::map<std::string, Histogram> stats = GetCpuStats();
+    std::vector<std::pair<std::string, Histogram> > sorted(stats.begin(),
+                                                           stats.end());
+    // 总运行时间多的在前
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<std::string, Histogram>& a,
+                 const std::pair<std::string, Histogram>& b) {
+                  return a.second.total > b.second.total;
+              });
+    os << std::left << std::setw(12) << "count" << std::setw(12) << "total_ms"
+       << std::setw(12) << "avg_us" << std::setw(12) << "p50_us"
+       << std::setw(12) << "p99_us" << std::setw(12) << "max_us"
+       << "entry" << std::endl;
+    for (auto& i : sorted) {
+        const Histogram& h = i.second;
+        os << std::setw(12) << h.count << std::setw(12) << h.total / 1000000
+           << std::setw(12) << h.total / h.count / 1000 << std::setw(12)
+           << h.percentile(0.5) / 1000 << std::setw(12)
+           << h.percentile(0.99) / 1000 << std::setw(12) << h.max / 1000
+           << i.first << std::endl;
+    }
+}
+
+uint64_t FiberProfiler::GetHogCount() { return s_hog_count; }
+
+void FiberProfiler::FillStack(Fiber* fiber, const std::function<void()>& cb) {
+    if (!fiber->m_stack) {
+        return;
+    }
+    // 协程结束时m_cb已经清空，入口要在开始之前取得
+    if (fiber->m_entry.empty() && cb) {
+        fiber->m_entry = FiberEntry::FromCallback(cb);
+    }
+    if (!fiber->m_stackFilled) {
+        uint64_t* begin = (uint64_t*)fiber->m_stack;
+        std::fill(begin, begin + fiber->m_stacksize / sizeof(uint64_t),
+                  STACK_PATTERN);
+        fiber->m_stackFilled = true;
+    }
+}
+
+void FiberProfiler::MeasureStack(Fiber* fiber) {
+    if (!fiber->m_stackFilled ||
+        (fiber->m_state != Fiber::TERM && fiber->m_state != Fiber::EXCEPT)) {
+        return;
+    }
+    // 栈从高地址向低地址增长，从栈底找第一个被改写的位置
+    uint64_t* begin = (uint64_t*)fiber->m_stack;
+    uint64_t* end = begin + fiber->m_stacksize / sizeof(uint64_t);
+    uint64_t* p = begin;
+    while (p < end && *p == STACK_PATTERN) {
+        ++p;
+    }
+    if (!fiber->m_entry.empty()) {
+        FiberStackRegistry::GetInstance().add(fiber->m_entry,
+                                              (char*)end - (char*)p);
+        // 回收后又被复用时不再重复记录
+        fiber->m_entry = FiberEntry();
+    }
+    if (IsStackEnabled()) {
+        // 只有被改写的部分需要重新填充
+        std::fill(p, end, STACK_PATTERN);
+    } else {
+        fiber->m_stackFilled = false;
+    }
+}
+
+size_t FiberProfiler::GetStackSize(const FiberEntry& entry) {
+    if (entry.empty()) {
+        return 0;
+    }
+    return FiberStackRegistry::GetInstance().recommend(entry);
+}
+
+std::map<std::string, FiberProfiler::Histogram> FiberProfiler::GetStackStats() {
+    std::map<std::string, Histogram> stats;
+    for (auto& i : FiberStackRegistry::GetInstance().collect()) {
+        stats[i.first.getName()].merge(i.second);
+    }
+    return stats;
+}
+
+void FiberProfiler::ResetStackStats() {
+    FiberStackRegistry::GetInstance().reset();
+}
+
+void FiberProfiler::DumpStackStats(std::ostream& os) {
+    std::map<std::string, Histogram> stats = GetStackStats();
+    std::vector<std::pair<std::string, Histogram> > sorted(stats.begin(),
+                                                           stats.end());
+    // 栈用得深的在前
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<std::string, Histogram>& a,
+                 const std::pair<std::string, Histogram>& b) {
+                  return a.second.max > b.second.max;
+              });
+    os << std::left << std::setw(12) << "count" << std::setw(12) << "p50"
+       << std::setw(12) << "p99" << std::setw(12) << "max" << std::setw(12)
+       << "recommend" << "entry" << std::endl;
+    for (auto& i : sorted) {
+        const Histogram& h = i.second;
+        os << std::setw(12) << h.count << std::setw(12) << h.percentile(0.5)
+           << std::setw(12) << h.percentile(0.99) << std::setw(12) << h.max
+           << std::setw(12)
+           << (h.count < STACK_MIN_SAMPLES
+                   ? std::string("-")
+                   : std::to_string(FiberStackRegistry::Recommend(h.max)))
+           << i.first << std::endl;
+    }
+}
+
+}  // namespace sylar
@@ -0,0 +1,175 @@
+/*
+ * @Author: lvxr
+ * @brief 协程运行时间统计和长时间占用线程的协程检测
+ */
+
+#ifndef __SYLAR_FIBER_PROFILER_H__
+#define __SYLAR_FIBER_PROFILER_H__
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+
+#include "fiber.h"
+#include "marco.h"
+
+namespace sylar {
+
+/**
+ * @brief: 协程运行时间和栈深度统计
+ * @details: 打开fiber.profile.cpu后，协程每次切入切出读取单调时钟，
+ *           累计到Fiber::getCpuTime；协程结束时把总运行时间按入口(任务类型)记入直方图。
+ *           fiber.profile.hog_threshold_ms大于0时启动看门狗线程，
+ *           调度器的任务协程一次运行超过阈值时输出协程id和调用栈，并自动打开统计。
+ *           打开fiber.profile.stack后，独立栈在分配时填充固定图案，
+ *           结束的协程回收或者复用前扫描被改写的最深位置，按入口记入栈深度直方图；
+ *           打开fiber.stack_auto_size后新建协程按入口使用推荐的栈大小。
+ *           关闭时每个切换点只有一次分支
+ */
+class FiberProfiler {
+public:
+    /**
+     * @brief: 运行时间直方图
+     * @details: 第i个桶统计[2^i, 2^(i+1))纳秒
+     */
+    struct Histogram {
+        static const int BUCKETS = 64;
+
+        uint64_t count = 0;
+        uint64_t total = 0;
+        uint64_t max = 0;
+        uint64_t buckets[BUCKETS] = {};
+
+        void add(uint64_t ns);
+        void merge(const Histogram& rhs);
+
+        /**
+         * @brief: 返回百分位数所在桶的上界，纳秒
+         * @param[in] {double} p 0到1之间
+         */
+        uint64_t percentile(double p) const;
+    };
+
+    /**
+     * @brief: 运行时间统计是否打开
+     */
+    static bool IsCpuEnabled() {
+        return __atomic_load_n(&s_cpuEnabled, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @brief: 协程切入后调用
+     */
+    static void OnSwitchIn(Fiber* fiber);
+
+    /**
+     * @brief: 协程切出前调用
+     * @param[in] {int} state 切出后的状态，TERM/EXCEPT时记入直方图
+     */
+    static void OnSwitchOut(Fiber* fiber, int state);
+
+    /**
+     * @brief: 返回按入口名称汇总的运行时间直方图，包括已经退出的线程
+     */
+    static std::map<std::string, Histogram> GetCpuStats();
+
+    /**
+     * @brief: 清空直方图
+     */
+    static void ResetCpuStats();
+
+    /**
+     * @brief: 以表格形式输出直方图汇总
+     */
+    static void DumpCpuStats(std::ostream& os);
+
+    /**
+     * @brief: 返回看门狗发现的超时运行次数
+     */
+    static uint64_t GetHogCount();
+
+    /**
+     * @brief: 栈深度统计是否打开
+     */
+    static bool IsStackEnabled() {
+        return __atomic_load_n(&s_stackEnabled, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @brief: 是否按入口自动选择栈大小
+     */
+    static bool IsStackAutoSize() {
+        return __atomic_load_n(&s_stackAutoSize, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @brief: 协程设置入口之后、构造初始上下文之前调用，填充还没有填充的栈
+     * @param[in] {function} cb 协程的入口
+     */
+    static void FillStack(Fiber* fiber, const std::function<void()>& cb);
+
+    /**
+     * @brief: 结束的协程回收或者复用前调用，记录栈深度并重新填充被改写的部分
+     */
+    static void MeasureStack(Fiber* fiber);
+
+    /**
+     * @brief: 返回入口推荐的栈大小
+     * @details: 记录的最大深度的两倍向上取2的幂，至少16KB；
+     *           记录少于16次时返回0
+     */
+    static size_t GetStackSize(const FiberEntry& entry);
+
+    /**
+     * @brief: 返回按入口名称汇总的栈深度直方图，字节
+     */
+    static std::map<std::string, Histogram> GetStackStats();
+
+    /**
+     * @brief: 清空栈深度直方图，自动选择的栈大小也恢复为默认
+     */
+    static void ResetStackStats();
+
+    /**
+     * @brief: 以表格形式输出栈深度和推荐的栈大小
+     */
+    static void DumpStackStats(std::ostream& os);
+
+private:
+    /**
+     * @brief: 根据配置更新s_cpuEnabled
+     */
+    static void UpdateEnabled();
+
+private:
+    // 运行时间统计是否打开
+    static bool s_cpuEnabled;
+    // 栈深度统计是否打开
+    static bool s_stackEnabled;
+    // 是否按入口自动选择栈大小
+    static bool s_stackAutoSize;
+    friend struct FiberProfilerIniter;
+};
+
+}  // namespace sylar
+
+/**
+ * @brief: 协程切入后统计，关闭时只有一次分支
+ */
+#define SYLAR_FIBER_SWITCH_IN(fiber)                            \
+    if (SYLAR_UNLIKELY(sylar::FiberProfiler::IsCpuEnabled())) { \
+        sylar::FiberProfiler::OnSwitchIn(fiber);                \
+    }
+
+/**
+ * @brief: 协程切出前统计，关闭时只有一次分支
+ */
+#define SYLAR_FIBER_SWITCH_OUT(fiber, state)                    \
+    if (SYLAR_UNLIKELY(sylar::FiberProfiler::IsCpuEnabled())) { \
+        sylar::FiberProfiler::OnSwitchOut(fiber, state);        \
+    }
+
+#endif
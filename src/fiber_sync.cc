@@ -0,0 +1,304 @@
+/*
+ * @Author: lvxr
+ * @brief 协程同步原语
+ */
+
+#include "fiber_sync.h"
+
+#include <vector>
+
+#include "marco.h"
+#include "scheduler.h"
+#include "util.h"
+
+namespace sylar {
+
+// 挂起之前自旋尝试的次数，临界区很短时避免一次切换
+static const int s_spin_count = 64;
+
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+void FiberWaitQueue::Waiter::wake() {
+    if (fiber) {
+        scheduler->schedule(&fiber, thread);
+    } else {
+        sem->notify();
+    }
+}
+
+void FiberWaitQueue::wait(Spinlock::Lock& guard, int tag,
+                          ScopedLockImpl<FiberMutex>* release) {
+    m_waiters.push_back(Waiter());
+    Waiter& waiter = m_waiters.back();
+    waiter.tag = tag;
+    if (Scheduler::InTaskFiber()) {
+        Fiber* cur = Fiber::GetCurrent();
+        waiter.fiber.reset(cur);
+        waiter.scheduler = Scheduler::GetThis();
+        waiter.thread = cur->isSharedStack() ? GetThreadId() : -1;
+        guard.unlock();
+        if (release) {
+            release->unlock();
+        }
+        // 这里可能已经被唤醒并schedule了，调度器会等我们切换出去再执行
+        Fiber::YieldToHold();
+    } else {
+        Semaphore sem;
+        waiter.sem = &sem;
+        guard.unlock();
+        if (release) {
+            release->unlock();
+        }
+        sem.wait();
+    }
+}
+
+bool FiberWaitQueue::pop(Waiter& waiter) {
+    if (m_waiters.empty()) {
+        return false;
+    }
+    Waiter& front = m_waiters.front();
+    waiter.fiber.swap(front.fiber);
+    waiter.scheduler = front.scheduler;
+    waiter.thread = front.thread;
+    waiter.sem = front.sem;
+    waiter.tag = front.tag;
+    m_waiters.pop_front();
+    return true;
+}
+
+void FiberMutex::lock() {
+    Fiber::CheckPreempt();
+    // 已经有人排队时自旋也拿不到锁，直接排队
+    for (int i = 0; i < s_spin_count && m_waiting == 0; ++i) {
+        if (tryLock()) {
+            return;
+        }
+        CpuRelax();
+    }
+    Spinlock::Lock guard(m_guard);
+    ++m_waiting;
+    if (tryLock()) {
+        --m_waiting;
+        return;
+    }
+    // 被唤醒时解锁者已经把锁交给了我们，m_locked保持为true
+    m_waiters.wait(guard);
+}
+
+void FiberMutex::unlock() {
+    if (m_waiting == 0) {
+        m_locked.store(false);
+        // 释放之后再检查一次，和lock里先加m_waiting再tryLock配合，
+        // 保证刚排队的等待者不会错过唤醒
+        if (m_waiting == 0) {
+            return;
+        }
+        Spinlock::Lock guard(m_guard);
+        // 锁可能已经被别人拿走，由它解锁时唤醒等待者
+        if (m_waiters.empty() || !tryLock()) {
+            return;
+        }
+        guard.unlock();
+        unlock();
+        return;
+    }
+    FiberWaitQueue::Waiter waiter;
+    Spinlock::Lock guard(m_guard);
+    if (!m_waiters.pop(waiter)) {
+        m_locked.store(false);
+        return;
+    }
+    --m_waiting;
+    guard.unlock();
+    waiter.wake();
+}
+
+enum RWWaiterTag { RW_READER = 0, RW_WRITER = 1 };
+
+bool FiberRWMutex::tryRdlock() {
+    Spinlock::Lock guard(m_guard);
+    if (!m_writer && m_waiters.empty()) {
+        ++m_readers;
+        return true;
+    }
+    return false;
+}
+
+bool FiberRWMutex::tryWrlock() {
+    Spinlock::Lock guard(m_guard);
+    if (!m_writer && m_readers == 0 && m_waiters.empty()) {
+        m_writer = true;
+        return true;
+    }
+    return false;
+}
+
+void FiberRWMutex::rdlock() {
+    Fiber::CheckPreempt();
+    for (int i = 0; i < s_spin_count; ++i) {
+        if (tryRdlock()) {
+            return;
+        }
+        CpuRelax();
+    }
+    Spinlock::Lock guard(m_guard);
+    if (!m_writer && m_waiters.empty()) {
+        ++m_readers;
+        return;
+    }
+    m_waiters.wait(guard, RW_READER);
+}
+
+void FiberRWMutex::wrlock() {
+    Fiber::CheckPreempt();
+    for (int i = 0; i < s_spin_count; ++i) {
+        if (tryWrlock()) {
+            return;
+        }
+        CpuRelax();
+    }
+    Spinlock::Lock guard(m_guard);
+    if (!m_writer && m_readers == 0 && m_waiters.empty()) {
+        m_writer = true;
+        return;
+    }
+    m_waiters.wait(guard, RW_WRITER);
+}
+
+void FiberRWMutex::unlock() {
+    Spinlock::Lock guard(m_guard);
+    if (m_writer) {
+        m_writer = false;
+    } else {
+        --m_readers;
+    }
+    if (m_writer || m_readers > 0) {
+        return;
+    }
+    wakeWaiters(guard);
+}
+
+void FiberRWMutex::wakeWaiters(Spinlock::Lock& guard) {
+    std::vector<FiberWaitQueue::Waiter> waiters;
+    if (!m_waiters.empty() && m_waiters.frontTag() == RW_WRITER) {
+        waiters.resize(1);
+        m_waiters.pop(waiters.back());
+        m_writer = true;
+    } else {
+        while (!m_waiters.empty() && m_waiters.frontTag() == RW_READER) {
+            waiters.resize(waiters.size() + 1);
+            m_waiters.pop(waiters.back());
+            ++m_readers;
+        }
+    }
+    guard.unlock();
+    for (auto& i : waiters) {
+        i.wake();
+    }
+}
+
+bool FiberSemaphore::tryWait() {
+    Spinlock::Lock guard(m_guard);
+    if (m_count > 0) {
+        --m_count;
+        return true;
+    }
+    return false;
+}
+
+void FiberSemaphore::wait() {
+    Fiber::CheckPreempt();
+    for (int i = 0; i < s_spin_count; ++i) {
+        if (tryWait()) {
+            return;
+        }
+        CpuRelax();
+    }
+    Spinlock::Lock guard(m_guard);
+    if (m_count > 0) {
+        --m_count;
+        return;
+    }
+    m_waiters.wait(guard);
+}
+
+void FiberSemaphore::notify() {
+    FiberWaitQueue::Waiter waiter;
+    Spinlock::Lock guard(m_guard);
+    if (!m_waiters.pop(waiter)) {
+        ++m_count;
+        return;
+    }
+    guard.unlock();
+    waiter.wake();
+}
+
+uint32_t FiberSemaphore::getCount() {
+    Spinlock::Lock guard(m_guard);
+    return m_count;
+}
+
+void FiberConditionVariable::wait(FiberMutex::Lock& lock) {
+    Spinlock::Lock guard(m_guard);
+    m_waiters.wait(guard, 0, &lock);
+    lock.lock();
+}
+
+void FiberConditionVariable::notifyOne() {
+    FiberWaitQueue::Waiter waiter;
+    Spinlock::Lock guard(m_guard);
+    if (!m_waiters.pop(waiter)) {
+        return;
+    }
+    guard.unlock();
+    waiter.wake();
+}
+
+void FiberConditionVariable::notifyAll() {
+    std::vector<FiberWaitQueue::Waiter> waiters;
+    Spinlock::Lock guard(m_guard);
+    while (!m_waiters.empty()) {
+        waiters.resize(waiters.size() + 1);
+        m_waiters.pop(waiters.back());
+    }
+    guard.unlock();
+    for (auto& i : waiters) {
+        i.wake();
+    }
+}
+
+void WaitGroup::add(int64_t n) {
+    // 计数在锁内修改，wait返回之后done不会再访问WaitGroup，可以放心在栈上使用
+    Spinlock::Lock guard(m_guard);
+    int64_t v = m_count.fetch_add(n) + n;
+    SYLAR_ASSERT2(v >= 0, "WaitGroup count=" << v);
+    if (v != 0 || m_waiters.empty()) {
+        return;
+    }
+    std::vector<FiberWaitQueue::Waiter> waiters;
+    while (!m_waiters.empty()) {
+        waiters.resize(waiters.size() + 1);
+        m_waiters.pop(waiters.back());
+    }
+    guard.unlock();
+    for (auto& i : waiters) {
+        i.wake();
+    }
+}
+
+void WaitGroup::wait() {
+    Spinlock::Lock guard(m_guard);
+    if (m_count == 0) {
+        return;
+    }
+    m_waiters.wait(guard);
+}
+
+}  // namespace sylar
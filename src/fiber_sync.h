@@ -0,0 +1,299 @@
+/*
+ * @Author: lvxr
+ * @brief 协程同步原语
+ */
+
+#ifndef __SYLAR_FIBER_SYNC_H__
+#define __SYLAR_FIBER_SYNC_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+
+#include "fiber.h"
+#include "mutex.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+class Scheduler;
+class FiberMutex;
+
+/**
+ * @brief: 协程等待队列
+ * @details: 调度器的任务协程等待时把自己加入队列然后YieldToHold，
+ *           唤醒时重新schedule到原来的调度器；
+ *           不在任务协程中(普通线程、调度协程)时退化为用信号量阻塞线程。
+ *           队列本身不加锁，由使用者的Spinlock保护
+ */
+class FiberWaitQueue : Noncopyable {
+public:
+    /**
+     * @brief: 等待者
+     */
+    struct Waiter {
+        // 挂起的协程
+        Fiber::ptr fiber;
+        // 协程所属的调度器
+        Scheduler* scheduler = nullptr;
+        // 共享栈协程需要回到原来的线程
+        int thread = -1;
+        // 阻塞的线程，不在任务协程中时使用
+        Semaphore* sem = nullptr;
+        // 使用者自定义的标记，例如读写锁区分读者和写者
+        int tag = 0;
+
+        /**
+         * @brief: 唤醒等待者
+         */
+        void wake();
+    };
+
+    /**
+     * @brief: 把当前协程加入队尾，释放guard后挂起，被唤醒后返回
+     * @details: 返回时guard已经释放；
+     *           加入队列后到真正挂起之间可能已经被唤醒，
+     *           调度器会等协程切换出去之后再执行它，不会丢失唤醒
+     * @param[in] {Lock&} guard 保护队列的锁，调用时必须持有
+     * @param[in] {int} tag 等待者标记
+     * @param[in] {ScopedLockImpl<FiberMutex>*} release 加入队列后一起释放的锁，
+     *            条件变量使用
+     */
+    void wait(Spinlock::Lock& guard, int tag = 0,
+              ScopedLockImpl<FiberMutex>* release = nullptr);
+
+    /**
+     * @brief: 取出队首的等待者，在释放guard之后调用wake唤醒
+     * @return {bool} 队列为空返回false
+     */
+    bool pop(Waiter& waiter);
+
+    /**
+     * @brief: 队首等待者的标记
+     * @pre: 队列不为空
+     */
+    int frontTag() const { return m_waiters.front().tag; }
+
+    bool empty() const { return m_waiters.empty(); }
+
+    size_t size() const { return m_waiters.size(); }
+
+private:
+    std::list<Waiter> m_waiters;
+};
+
+/**
+ * @brief: 协程互斥量
+ * @details: 拿不到锁时先自旋一小段时间，仍然拿不到就挂起当前协程，
+ *           线程可以继续执行其他协程，持有锁的协程也可以挂起(例如hook的IO)。
+ *           解锁时如果有等待者，锁直接交给队首的等待者，
+ *           新来的协程不能插队，保证先来先得
+ */
+class FiberMutex : Noncopyable {
+public:
+    /// 局部锁
+    typedef ScopedLockImpl<FiberMutex> Lock;
+
+    FiberMutex() {}
+
+    /**
+     * @brief: 尝试加锁，不等待
+     */
+    bool tryLock() {
+        bool expected = false;
+        return m_locked.compare_exchange_strong(expected, true,
+                                                std::memory_order_acquire);
+    }
+
+    /**
+     * @brief: 加锁
+     */
+    void lock();
+
+    /**
+     * @brief: 解锁
+     */
+    void unlock();
+
+private:
+    // 是否被持有
+    std::atomic<bool> m_locked{false};
+    // 等待者数量，没有等待者时解锁不需要加m_guard
+    std::atomic<uint32_t> m_waiting{0};
+    // 保护等待队列
+    Spinlock m_guard;
+    FiberWaitQueue m_waiters;
+};
+
+/**
+ * @brief: 协程读写锁
+ * @details: 读者之间不互斥；有等待的写者时新来的读者排队，避免写者饿死。
+ *           解锁时按队列顺序唤醒：队首是写者就只唤醒它，
+ *           队首是读者就唤醒队首连续的所有读者
+ */
+class FiberRWMutex : Noncopyable {
+public:
+    /// 局部读锁
+    typedef ReadScopedLockImpl<FiberRWMutex> ReadLock;
+
+    /// 局部写锁
+    typedef WriteScopedLockImpl<FiberRWMutex> WriteLock;
+
+    FiberRWMutex() {}
+
+    /**
+     * @brief: 尝试加读锁
+     */
+    bool tryRdlock();
+
+    /**
+     * @brief: 尝试加写锁
+     */
+    bool tryWrlock();
+
+    /**
+     * @brief: 加读锁
+     */
+    void rdlock();
+
+    /**
+     * @brief: 加写锁
+     */
+    void wrlock();
+
+    /**
+     * @brief: 解锁
+     */
+    void unlock();
+
+private:
+    /**
+     * @brief: 唤醒队首可以拿到锁的等待者
+     * @pre: 持有m_guard，返回时已经释放
+     */
+    void wakeWaiters(Spinlock::Lock& guard);
+
+private:
+    Spinlock m_guard;
+    // 持有读锁的数量
+    uint32_t m_readers = 0;
+    // 是否有写者持有
+    bool m_writer = false;
+    FiberWaitQueue m_waiters;
+};
+
+/**
+ * @brief: 协程信号量
+ */
+class FiberSemaphore : Noncopyable {
+public:
+    /**
+     * @brief: 构造函数
+     * @param[in] {uint32_t} count 初始值
+     */
+    FiberSemaphore(uint32_t count = 0) : m_count(count) {}
+
+    /**
+     * @brief: 尝试获取，不等待
+     */
+    bool tryWait();
+
+    /**
+     * @brief: 获取信号量，为0时挂起当前协程
+     */
+    void wait();
+
+    /**
+     * @brief: 释放信号量，有等待者时直接交给队首的等待者
+     */
+    void notify();
+
+    /**
+     * @brief: 返回当前值
+     */
+    uint32_t getCount();
+
+private:
+    Spinlock m_guard;
+    uint32_t m_count;
+    FiberWaitQueue m_waiters;
+};
+
+/**
+ * @brief: 协程条件变量，配合FiberMutex使用
+ */
+class FiberConditionVariable : Noncopyable {
+public:
+    FiberConditionVariable() {}
+
+    /**
+     * @brief: 释放lock并等待通知，返回前重新加锁
+     * @details: 和std::condition_variable一样可能被虚假唤醒，需要在循环里检查条件
+     * @param[in] {Lock&} lock 已经加锁的FiberMutex局部锁
+     */
+    void wait(FiberMutex::Lock& lock);
+
+    /**
+     * @brief: 等待直到pred返回true
+     */
+    template <class Predicate>
+    void wait(FiberMutex::Lock& lock, Predicate pred) {
+        while (!pred()) {
+            wait(lock);
+        }
+    }
+
+    /**
+     * @brief: 唤醒一个等待者
+     */
+    void notifyOne();
+
+    /**
+     * @brief: 唤醒所有等待者
+     */
+    void notifyAll();
+
+private:
+    Spinlock m_guard;
+    FiberWaitQueue m_waiters;
+};
+
+/**
+ * @brief: 等待一组任务完成
+ * @details: 启动任务前add，任务结束时done，计数减到0时唤醒所有wait的等待者
+ */
+class WaitGroup : Noncopyable {
+public:
+    WaitGroup() {}
+
+    /**
+     * @brief: 增加计数
+     * @param[in] {int64_t} n 增加的数量，可以为负数，计数不能小于0
+     */
+    void add(int64_t n = 1);
+
+    /**
+     * @brief: 一个任务完成，计数减一
+     */
+    void done() { add(-1); }
+
+    /**
+     * @brief: 等待计数变为0
+     */
+    void wait();
+
+    /**
+     * @brief: 返回当前计数
+     */
+    int64_t getCount() const { return m_count; }
+
+private:
+    std::atomic<int64_t> m_count{0};
+    Spinlock m_guard;
+    FiberWaitQueue m_waiters;
+};
+
+}  // namespace sylar
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ * @Author: lvxr
+ * @brief 协程切换跟踪，导出为Chrome trace格式
+ */
+
+#include "fiber_trace.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "config.h"
+#include "fiber.h"
+#include "log.h"
+#include "mutex.h"
+#include "thread.h"
+#include "util.h"
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// 是否记录协程切换
+static ConfigVar<bool>::ptr g_fiber_trace_enable = Config::Lookup<bool>(
+    "fiber.trace.enable", false, "record fiber switch events");
+
+// 每个线程缓冲区的事件数量
+static ConfigVar<uint32_t>::ptr g_fiber_trace_buffer_size =
+    Config::Lookup<uint32_t>("fiber.trace.buffer_size", 64 * 1024,
+                             "fiber trace events kept per thread");
+
+// g_fiber_trace_buffer_size的缓存，新建缓冲区时使用
+static std::atomic<uint32_t> s_buffer_size{64 * 1024};
+
+bool FiberTrace::s_enabled = false;
+
+struct FiberTraceIniter {
+    FiberTraceIniter() {
+        s_buffer_size = g_fiber_trace_buffer_size->getValue();
+        g_fiber_trace_buffer_size->addListener(
+            [](const uint32_t& old_value, const uint32_t& new_value) {
+                s_buffer_size = new_value;
+            });
+        FiberTrace::SetEnabled(g_fiber_trace_enable->getValue());
+        g_fiber_trace_enable->addListener(
+            [](const bool& old_value, const bool& new_value) {
+                FiberTrace::SetEnabled(new_value);
+            });
+    }
+};
+
+/**
+ * @brief: 跟踪事件
+ */
+struct FiberTraceEvent {
+    // CLOCK_MONOTONIC时间，纳秒
+    uint64_t ts;
+    uint64_t fiber_id;
+    uint8_t type;
+    uint8_t state;
+    uint8_t reason;
+};
+
+/**
+ * @brief: 线程的事件缓冲区
+ * @details: 只有所属线程写入，m_end用release发布；读取方复制之后重新读m_end，
+ *           复制期间可能被覆盖的部分丢弃。线程退出后缓冲区保留到Clear
+ */
+class FiberTraceBuffer {
+public:
+    typedef std::shared_ptr<FiberTraceBuffer> ptr;
+
+    FiberTraceBuffer(size_t capacity)
+        : m_tid(GetThreadId()),
+          m_name(Thread::GetName()),
+          m_events(capacity ? capacity : 1) {}
+
+    void push(const FiberTraceEvent& ev) {
+        uint64_t end = m_end.load(std::memory_order_relaxed);
+        m_events[end % m_events.size()] = ev;
+        m_end.store(end + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief: 复制现存的事件，按时间顺序
+     */
+    void copy(std::vector<FiberTraceEvent>& events) const {
+        uint64_t cap = m_events.size();
+        uint64_t end = m_end.load(std::memory_order_acquire);
+        uint64_t begin = std::max(m_begin.load(std::memory_order_relaxed),
+                                  end > cap ? end - cap : 0);
+        size_t offset = events.size();
+        for (uint64_t i = begin; i < end; ++i) {
+            events.push_back(m_events[i % cap]);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // 复制期间写入方追上来覆盖了开头的一部分
+        uint64_t now = m_end.load(std::memory_order_relaxed);
+        if (now > begin + cap) {
+            size_t overwritten = std::min(now - cap - begin, end - begin);
+            events.erase(events.begin() + offset,
+                         events.begin() + offset + overwritten);
+        }
+    }
+
+    size_t size() const {
+        uint64_t end = m_end.load(std::memory_order_acquire);
+        uint64_t begin = m_begin.load(std::memory_order_relaxed);
+        return std::min<uint64_t>(end - begin, m_events.size());
+    }
+
+    /**
+     * @brief: 丢弃现存的事件，不影响写入方
+     */
+    void clear() {
+        m_begin.store(m_end.load(std::memory_order_acquire),
+                      std::memory_order_relaxed);
+    }
+
+    pid_t getTid() const { return m_tid; }
+    const std::string& getName() const { return m_name; }
+
+    bool isExited() const { return m_exited; }
+    void setExited() { m_exited = true; }
+
+private:
+    pid_t m_tid;
+    std::string m_name;
+    std::vector<FiberTraceEvent> m_events;
+    // 写入的事件总数
+    std::atomic<uint64_t> m_end{0};
+    // Clear时的m_end，之前的事件不再输出
+    std::atomic<uint64_t> m_begin{0};
+    std::atomic<bool> m_exited{false};
+};
+
+/**
+ * @brief: 所有线程的缓冲区
+ */
+class FiberTraceRegistry {
+public:
+    typedef Mutex MutexType;
+
+    FiberTraceBuffer::ptr create() {
+        FiberTraceBuffer::ptr buf(new FiberTraceBuffer(s_buffer_size));
+        MutexType::Lock lock(m_mutex);
+        m_buffers.push_back(buf);
+        return buf;
+    }
+
+    std::vector<FiberTraceBuffer::ptr> list() {
+        MutexType::Lock lock(m_mutex);
+        return m_buffers;
+    }
+
+    void clear() {
+        MutexType::Lock lock(m_mutex);
+        std::vector<FiberTraceBuffer::ptr> alive;
+        for (auto& i : m_buffers) {
+            if (!i->isExited()) {
+                i->clear();
+                alive.push_back(i);
+            }
+        }
+        m_buffers.swap(alive);
+    }
+
+    static FiberTraceRegistry& GetInstance() {
+        static FiberTraceRegistry s_registry;
+        return s_registry;
+    }
+
+private:
+    MutexType m_mutex;
+    std::vector<FiberTraceBuffer::ptr> m_buffers;
+};
+
+/**
+ * @brief: 线程本地的缓冲区引用，线程退出时标记缓冲区
+ */
+struct FiberTraceHolder {
+    ~FiberTraceHolder() {
+        if (buffer) {
+            buffer->setExited();
+        }
+    }
+
+    FiberTraceBuffer::ptr buffer;
+};
+
+static FiberTraceIniter __fiber_trace_init;
+
+static uint64_t MonotonicNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void FiberTrace::SetEnabled(bool v) {
+    __atomic_store_n(&s_enabled, v, __ATOMIC_RELAXED);
+    if (g_fiber_trace_enable->getValue() != v) {
+        g_fiber_trace_enable->setValue(v);
+    }
+}
+
+void FiberTrace::Record(Type type, uint64_t fiber_id, int state,
+                        Reason reason) {
+    static thread_local FiberTraceHolder t_holder;
+    if (!t_holder.buffer) {
+        t_holder.buffer = FiberTraceRegistry::GetInstance().create();
+    }
+    FiberTraceEvent ev;
+    ev.ts = MonotonicNS();
+    ev.fiber_id = fiber_id;
+    ev.type = type;
+    ev.state = state;
+    ev.reason = reason;
+    t_holder.buffer->push(ev);
+}
+
+void FiberTrace::Clear() { FiberTraceRegistry::GetInstance().clear(); }
+
+size_t FiberTrace::GetEventCount() {
+    size_t count = 0;
+    for (auto& i : FiberTraceRegistry::GetInstance().list()) {
+        count += i->size();
+    }
+    return count;
+}
+
+static const char* StateToString(int state) {
+    switch (state) {
+#define XX(name)           \
+    case Fiber::name:      \
+        return #name;
+        XX(INIT);
+        XX(HOLD);
+        XX(EXEC);
+        XX(TERM);
+        XX(READY);
+        XX(EXCEPT);
+#undef XX
+        default:
+            return "UNKNOW";
+    }
+}
+
+static const char* ReasonToString(int reason) {
+    switch (reason) {
+#define XX(name, str)           \
+    case FiberTrace::name:      \
+        return str;
+        XX(NONE, "");
+        XX(RESUME, "resume");
+        XX(SWITCH, "switch");
+        XX(CALL, "call");
+        XX(YIELD, "yield");
+        XX(HOLD, "hold");
+        XX(FINISH, "finish");
+        XX(BACK, "back");
+#undef XX
+        default:
+            return "unknow";
+    }
+}
+
+/**
+ * @brief: 输出JSON字符串，转义引号、反斜杠和控制字符
+ */
+static void WriteJsonString(std::ostream& os, const std::string& str) {
+    os << '"';
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            os << '\\' << c;
+        } else if (c < 0x20) {
+            static const char* s_hex = "0123456789abcdef";
+            os << "\\u00" << s_hex[c >> 4] << s_hex[c & 0xf];
+        } else {
+            os << c;
+        }
+    }
+    os << '"';
+}
+
+/**
+ * @brief: 输出微秒时间戳，保留纳秒精度
+ */
+static void WriteTimestamp(std::ostream& os, uint64_t ns) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llu.%03u", (unsigned long long)(ns / 1000),
+             (unsigned)(ns % 1000));
+    os << buf;
+}
+
+void FiberTrace::Dump(std::ostream& os) {
+    pid_t pid = getpid();
+    std::vector<FiberTraceBuffer::ptr> buffers =
+        FiberTraceRegistry::GetInstance().list();
+    os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    auto sep = [&os, &first]() {
+        if (!first) {
+            os << ",\n";
+        }
+        first = false;
+    };
+    std::vector<FiberTraceEvent> events;
+    for (auto& buf : buffers) {
+        events.clear();
+        buf->copy(events);
+        if (events.empty()) {
+            continue;
+        }
+        sep();
+        os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+           << ",\"tid\":" << buf->getTid() << ",\"args\":{\"name\":";
+        WriteJsonString(os, buf->getName() + " " +
+                                std::to_string(buf->getTid()));
+        os << "}}";
+
+        // 缓冲区覆盖掉了开头的BEGIN时，跳过找不到配对的END
+        int depth = 0;
+        for (auto& ev : events) {
+            if (ev.type == END && depth == 0) {
+                continue;
+            }
+            sep();
+            os << "{\"pid\":" << pid << ",\"tid\":" << buf->getTid()
+               << ",\"ts\":";
+            WriteTimestamp(os, ev.ts);
+            switch (ev.type) {
+                case BEGIN:
+                    ++depth;
+                    os << ",\"ph\":\"B\",\"name\":\"fiber " << ev.fiber_id
+                       << "\",\"cat\":\"fiber\",\"args\":{\"fiber_id\":"
+                       << ev.fiber_id << ",\"from\":\""
+                       << StateToString(ev.state) << "\",\"in\":\""
+                       << ReasonToString(ev.reason) << "\"}}";
+                    break;
+                case END:
+                    --depth;
+                    os << ",\"ph\":\"E\",\"args\":{\"to\":\""
+                       << StateToString(ev.state) << "\",\"out\":\""
+                       << ReasonToString(ev.reason) << "\"}}";
+                    break;
+                default:
+                    os << ",\"ph\":\"i\",\"s\":\"t\",\"name\":\""
+                       << (ev.type == CREATE ? "create" : "term")
+                       << "\",\"cat\":\"fiber\",\"args\":{\"fiber_id\":"
+                       << ev.fiber_id << ",\"state\":\""
+                       << StateToString(ev.state) << "\"}}";
+                    break;
+            }
+        }
+    }
+    os << "]}\n";
+}
+
+std::string FiberTrace::Dump() {
+    std::stringstream ss;
+    Dump(ss);
+    return ss.str();
+}
+
+bool FiberTrace::DumpToFile(const std::string& path) {
+    std::ofstream ofs(path);
+    if (!ofs) {
+        SYLAR_LOG_ERROR(g_logger)
+            << "FiberTrace::DumpToFile open " << path << " failed";
+        return false;
+    }
+    Dump(ofs);
+    return (bool)ofs;
+}
+
+}  // namespace sylar
@@ -0,0 +1,129 @@
+/*
+ * @Author: lvxr
+ * @brief 协程切换跟踪，导出为Chrome trace格式
+ */
+
+#ifndef __SYLAR_FIBER_TRACE_H__
+#define __SYLAR_FIBER_TRACE_H__
+
+#include <stdint.h>
+
+#include <ostream>
+#include <string>
+
+#include "marco.h"
+
+namespace sylar {
+
+/**
+ * @brief: 协程切换跟踪
+ * @details: 协程创建、结束、切入、切出时记录带时间戳的事件，
+ *           每个线程写自己的环形缓冲区，写入不加锁，缓冲区满了覆盖最旧的事件。
+ *           通过配置fiber.trace.enable在运行时开关，关闭时每个记录点只有一次分支。
+ *           Dump输出Chrome/Perfetto可以打开的JSON(chrome://tracing或ui.perfetto.dev)，
+ *           每个线程一条轨道，协程每次运行是一个切片
+ */
+class FiberTrace {
+public:
+    /**
+     * @brief: 事件类型
+     */
+    enum Type {
+        // 协程创建或者复用
+        CREATE,
+        // 协程入口函数结束
+        TERM,
+        // 切入协程
+        BEGIN,
+        // 切出协程
+        END
+    };
+
+    /**
+     * @brief: 切换原因
+     */
+    enum Reason {
+        // 创建和结束事件不区分原因
+        NONE,
+        // 调度协程或线程主协程切入
+        RESUME,
+        // 从其他任务协程直接切换过来
+        SWITCH,
+        // use_caller调度器从线程主协程进入调度协程
+        CALL,
+        // 让出，之后进入就绪队列
+        YIELD,
+        // 挂起，等待被唤醒
+        HOLD,
+        // 入口函数执行结束
+        FINISH,
+        // 调度协程回到线程主协程
+        BACK
+    };
+
+    /**
+     * @brief: 跟踪是否打开
+     * @details: 记录点的唯一开销，编译成一次内存读取和一次分支
+     */
+    static bool IsEnabled() {
+        return __atomic_load_n(&s_enabled, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @brief: 打开或者关闭跟踪，等同于修改fiber.trace.enable
+     */
+    static void SetEnabled(bool v);
+
+    /**
+     * @brief: 记录一个事件到当前线程的缓冲区
+     * @param[in] {Type} type 事件类型
+     * @param[in] {uint64_t} fiber_id 协程id
+     * @param[in] {int} state 协程状态，BEGIN为切入前的状态，END/TERM为切出后的状态
+     * @param[in] {Reason} reason 切换原因
+     */
+    static void Record(Type type, uint64_t fiber_id, int state, Reason reason);
+
+    /**
+     * @brief: 丢弃已经记录的事件，已经退出的线程的缓冲区一起释放
+     */
+    static void Clear();
+
+    /**
+     * @brief: 返回所有线程缓冲区里现存的事件数量
+     */
+    static size_t GetEventCount();
+
+    /**
+     * @brief: 以Chrome trace JSON格式输出所有线程的事件
+     * @details: 可以在记录的同时调用，正在被覆盖的事件会被跳过
+     */
+    static void Dump(std::ostream& os);
+
+    /**
+     * @brief: 以字符串形式返回Dump的结果
+     */
+    static std::string Dump();
+
+    /**
+     * @brief: Dump到文件
+     * @return: 文件打开失败返回false
+     */
+    static bool DumpToFile(const std::string& path);
+
+private:
+    // 是否打开，由fiber.trace.enable的监听器修改
+    static bool s_enabled;
+};
+
+}  // namespace sylar
+
+/**
+ * @brief: 记录协程跟踪事件，关闭时只有一次分支
+ */
+#define SYLAR_FIBER_TRACE(type, fiber_id, state, reason)                     \
+    if (SYLAR_UNLIKELY(sylar::FiberTrace::IsEnabled())) {                    \
+        sylar::FiberTrace::Record(sylar::FiberTrace::type, fiber_id, state, \
+                                  sylar::FiberTrace::reason);                \
+    }
+
+#endif
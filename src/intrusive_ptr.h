@@ -0,0 +1,129 @@
+/*
+ * @Author: lvxr
+ * @brief 侵入式引用计数智能指针
+ */
+
+#ifndef __SYLAR_INTRUSIVE_PTR_H__
+#define __SYLAR_INTRUSIVE_PTR_H__
+
+#include <stddef.h>
+
+#include <functional>
+#include <utility>
+
+namespace sylar {
+
+/**
+ * @brief: 侵入式智能指针
+ * @details: 引用计数保存在对象内部，没有shared_ptr单独的控制块，
+ *           可以随时从裸指针重新构造出智能指针而不需要enable_shared_from_this。
+ *           接口与shared_ptr常用的部分保持一致
+ * @tparam T 需要提供ref()增加引用，unref()减少引用并在减到0时释放自己
+ */
+template <class T>
+class IntrusivePtr {
+public:
+    IntrusivePtr() : m_ptr(nullptr) {}
+
+    IntrusivePtr(std::nullptr_t) : m_ptr(nullptr) {}
+
+    /**
+     * @brief: 接管裸指针，引用计数加一
+     */
+    explicit IntrusivePtr(T* p) : m_ptr(p) {
+        if (m_ptr) {
+            m_ptr->ref();
+        }
+    }
+
+    IntrusivePtr(const IntrusivePtr& rhs) : m_ptr(rhs.m_ptr) {
+        if (m_ptr) {
+            m_ptr->ref();
+        }
+    }
+
+    IntrusivePtr(IntrusivePtr&& rhs) : m_ptr(rhs.m_ptr) { rhs.m_ptr = nullptr; }
+
+    ~IntrusivePtr() { release(); }
+
+    IntrusivePtr& operator=(const IntrusivePtr& rhs) {
+        IntrusivePtr(rhs).swap(*this);
+        return *this;
+    }
+
+    IntrusivePtr& operator=(IntrusivePtr&& rhs) {
+        IntrusivePtr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    IntrusivePtr& operator=(std::nullptr_t) {
+        reset();
+        return *this;
+    }
+
+    /**
+     * @brief: 释放持有的对象
+     */
+    void reset() {
+        release();
+        m_ptr = nullptr;
+    }
+
+    /**
+     * @brief: 释放持有的对象并接管p
+     */
+    void reset(T* p) { IntrusivePtr(p).swap(*this); }
+
+    void swap(IntrusivePtr& rhs) { std::swap(m_ptr, rhs.m_ptr); }
+
+    T* get() const { return m_ptr; }
+
+    T& operator*() const { return *m_ptr; }
+
+    T* operator->() const { return m_ptr; }
+
+    explicit operator bool() const { return m_ptr != nullptr; }
+
+private:
+    void release() {
+        if (m_ptr) {
+            m_ptr->unref();
+        }
+    }
+
+private:
+    T* m_ptr;
+};
+
+template <class T, class U>
+bool operator==(const IntrusivePtr<T>& a, const IntrusivePtr<U>& b) {
+    return a.get() == b.get();
+}
+
+template <class T, class U>
+bool operator!=(const IntrusivePtr<T>& a, const IntrusivePtr<U>& b) {
+    return a.get() != b.get();
+}
+
+template <class T>
+bool operator==(const IntrusivePtr<T>& a, std::nullptr_t) {
+    return !a;
+}
+
+template <class T>
+bool operator!=(const IntrusivePtr<T>& a, std::nullptr_t) {
+    return (bool)a;
+}
+
+}  // namespace sylar
+
+namespace std {
+template <class T>
+struct hash<sylar::IntrusivePtr<T> > {
+    size_t operator()(const sylar::IntrusivePtr<T>& p) const {
+        return std::hash<T*>()(p.get());
+    }
+};
+}  // namespace std
+
+#endif
@@ -0,0 +1,820 @@
+/*
+ * @Author: lvxr
+ * @brief 基于epoll的IO协程调度器
+ */
+
+#include "iomanager.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "config.h"
+#include "hook.h"
+#include "log.h"
+#include "marco.h"
+#include "uring.h"
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// IO后端
+static ConfigVar<std::string>::ptr g_iomanager_backend =
+    Config::Lookup<std::string>("iomanager.backend", "epoll",
+                                "iomanager io backend, epoll or io_uring");
+
+// 每个工作线程io_uring的SQ大小
+static ConfigVar<uint32_t>::ptr g_iomanager_uring_entries =
+    Config::Lookup<uint32_t>("iomanager.uring_entries", 256,
+                             "iomanager io_uring sq entries per thread");
+
+// io_uring上监听eventfd和epoll实例的poll请求的user_data，IO请求的user_data是UringOp指针
+static const uint64_t TICKLE_TAG = 1;
+static const uint64_t EPOLL_TAG = 2;
+// 链接在IO请求后面的超时请求
+static const uint64_t LINK_TIMEOUT_TAG = 3;
+
+/**
+ * @brief: 一次io_uring请求
+ * @details: 放在发起请求的协程栈上，协程挂起期间栈一直有效
+ */
+struct UringOp {
+    // 等待的协程
+    Fiber::ptr fiber;
+    // 协程所在的线程
+    int thread = -1;
+    // 完成事件的res
+    int res = 0;
+};
+
+/**
+ * @brief: io_uring的结果转换成系统调用的返回值
+ */
+static int UringResult(int res) {
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+static void PrepRw(io_uring_sqe* sqe, int op, int fd, const void* addr,
+                   unsigned len, uint64_t off) {
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+}
+
+IOManager::FdContext::EventContext& IOManager::FdContext::getContext(
+    Event event) {
+    switch (event) {
+        case IOManager::READ:
+            return read;
+        case IOManager::WRITE:
+            return write;
+        default:
+            SYLAR_ASSERT2(false, "getContext");
+    }
+    throw std::invalid_argument("getContext invalid event");
+}
+
+void IOManager::FdContext::resetContext(EventContext& ctx) {
+    ctx.scheduler = nullptr;
+    ctx.fiber.reset();
+    ctx.cb = nullptr;
+    ctx.thread = -1;
+}
+
+void IOManager::FdContext::triggerEvent(Event event) {
+    SYLAR_ASSERT(events & event);
+    events = (Event)(events & ~event);
+    EventContext& ctx = getContext(event);
+    if (ctx.cb) {
+        ctx.scheduler->schedule(&ctx.cb);
+    } else {
+        // 协程回到注册事件的线程上执行
+        ctx.scheduler->schedule(&ctx.fiber, ctx.thread);
+    }
+    ctx.scheduler = nullptr;
+    ctx.thread = -1;
+}
+
+IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
+    : Scheduler(threads, use_caller, name), TimerManager(getWorkerCount()) {
+    size_t n = getWorkerCount();
+    if (g_iomanager_backend->getValue() == "io_uring") {
+        m_backend = IO_URING;
+        for (size_t i = 0; i < n; ++i) {
+            IOUring* ring = new IOUring;
+            m_rings.push_back(ring);
+            if (!ring->init(g_iomanager_uring_entries->getValue())) {
+                SYLAR_LOG_WARN(g_logger)
+                    << "name=" << getName()
+                    << " io_uring unavailable, fall back to epoll";
+                m_backend = EPOLL;
+                break;
+            }
+        }
+        if (m_backend == EPOLL) {
+            for (auto ring : m_rings) {
+                delete ring;
+            }
+            m_rings.clear();
+        }
+        m_uringPolls.resize(m_rings.size());
+    } else if (g_iomanager_backend->getValue() != "epoll") {
+        SYLAR_LOG_WARN(g_logger) << "unknown iomanager.backend="
+                                 << g_iomanager_backend->getValue();
+    }
+
+    m_epfds.resize(n);
+    m_tickleFds.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        m_epfds[i] = epoll_create1(EPOLL_CLOEXEC);
+        SYLAR_ASSERT(m_epfds[i] >= 0);
+
+        m_tickleFds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        SYLAR_ASSERT(m_tickleFds[i] >= 0);
+        if (m_backend == IO_URING) {
+            // io_uring直接poll eventfd
+            continue;
+        }
+
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        event.events = EPOLLIN | EPOLLET;
+        // data.ptr为空表示tickle事件
+        event.data.ptr = nullptr;
+        int rt = epoll_ctl(m_epfds[i], EPOLL_CTL_ADD, m_tickleFds[i], &event);
+        SYLAR_ASSERT(!rt);
+    }
+
+    contextResize(32);
+
+    start();
+}
+
+IOManager::~IOManager() {
+    stop();
+    for (size_t i = 0; i < m_epfds.size(); ++i) {
+        close(m_epfds[i]);
+        close(m_tickleFds[i]);
+    }
+    for (auto ring : m_rings) {
+        delete ring;
+    }
+    for (size_t i = 0; i < m_fdContexts.size(); ++i) {
+        delete m_fdContexts[i];
+    }
+}
+
+void IOManager::contextResize(size_t size) {
+    size_t old_size = m_fdContexts.size();
+    if (size <= old_size) {
+        return;
+    }
+    m_fdContexts.resize(size);
+    for (size_t i = old_size; i < size; ++i) {
+        m_fdContexts[i] = new FdContext;
+        m_fdContexts[i]->fd = i;
+    }
+}
+
+IOManager::FdContext* IOManager::getFdContext(int fd, bool auto_create) {
+    if (fd < 0) {
+        return nullptr;
+    }
+    {
+        RWMutexType::ReadLock lock(m_mutex);
+        if ((int)m_fdContexts.size() > fd) {
+            return m_fdContexts[fd];
+        }
+        if (!auto_create) {
+            return nullptr;
+        }
+    }
+    RWMutexType::WriteLock lock(m_mutex);
+    contextResize(std::max((size_t)fd * 3 / 2 + 1, m_fdContexts.size()));
+    return m_fdContexts[fd];
+}
+
+int IOManager::selectEpoll() {
+    int idx = getWorkerIndex();
+    if (idx < 0) {
+        idx = m_nextEpoll++ % m_epfds.size();
+    }
+    return m_epfds[idx];
+}
+
+int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
+    FdContext* fd_ctx = getFdContext(fd, true);
+    if (!fd_ctx) {
+        return -1;
+    }
+
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    if (SYLAR_UNLIKELY(fd_ctx->events & event)) {
+        SYLAR_LOG_ERROR(g_logger)
+            << "addEvent assert fd=" << fd << " event=" << (EPOLL_EVENTS)event
+            << " fd_ctx.event=" << (EPOLL_EVENTS)fd_ctx->events;
+        SYLAR_ASSERT(!(fd_ctx->events & event));
+    }
+
+    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    int epfd = fd_ctx->events ? fd_ctx->epfd : selectEpoll();
+    epoll_event epevent;
+    epevent.events = EPOLLET | fd_ctx->events | event;
+    epevent.data.ptr = fd_ctx;
+
+    int rt = epoll_ctl(epfd, op, fd, &epevent);
+    if (rt) {
+        SYLAR_LOG_ERROR(g_logger)
+            << "epoll_ctl(" << epfd << ", " << op << ", " << fd << ", "
+            << (EPOLL_EVENTS)epevent.events << "):" << rt << " (" << errno
+            << ") (" << strerror(errno) << ")";
+        return -1;
+    }
+
+    ++m_pendingEventCount;
+    fd_ctx->epfd = epfd;
+    fd_ctx->events = (Event)(fd_ctx->events | event);
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    SYLAR_ASSERT(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
+
+    event_ctx.scheduler = Scheduler::GetThis() ? Scheduler::GetThis() : this;
+    if (cb) {
+        event_ctx.cb.swap(cb);
+    } else {
+        event_ctx.fiber = Fiber::GetThis();
+        SYLAR_ASSERT2(event_ctx.fiber->getState() == Fiber::EXEC,
+                      "state=" << event_ctx.fiber->getState());
+        if (getWorkerIndex() >= 0) {
+            event_ctx.thread = GetThreadId();
+        }
+    }
+    return 0;
+}
+
+bool IOManager::delEvent(int fd, Event event) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
+        return false;
+    }
+
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    if (SYLAR_UNLIKELY(!(fd_ctx->events & event))) {
+        return false;
+    }
+
+    Event new_events = (Event)(fd_ctx->events & ~event);
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_event epevent;
+    epevent.events = EPOLLET | new_events;
+    epevent.data.ptr = fd_ctx;
+
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
+    if (rt) {
+        SYLAR_LOG_ERROR(g_logger)
+            << "epoll_ctl(" << fd_ctx->epfd << ", " << op << ", " << fd << ", "
+            << (EPOLL_EVENTS)epevent.events << "):" << rt << " (" << errno
+            << ") (" << strerror(errno) << ")";
+        return false;
+    }
+
+    --m_pendingEventCount;
+    fd_ctx->events = new_events;
+    if (!new_events) {
+        fd_ctx->epfd = -1;
+    }
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    fd_ctx->resetContext(event_ctx);
+    return true;
+}
+
+bool IOManager::cancelEvent(int fd, Event event) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
+        return false;
+    }
+
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    if (SYLAR_UNLIKELY(!(fd_ctx->events & event))) {
+        return false;
+    }
+
+    Event new_events = (Event)(fd_ctx->events & ~event);
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_event epevent;
+    epevent.events = EPOLLET | new_events;
+    epevent.data.ptr = fd_ctx;
+
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
+    if (rt) {
+        SYLAR_LOG_ERROR(g_logger)
+            << "epoll_ctl(" << fd_ctx->epfd << ", " << op << ", " << fd << ", "
+            << (EPOLL_EVENTS)epevent.events << "):" << rt << " (" << errno
+            << ") (" << strerror(errno) << ")";
+        return false;
+    }
+
+    if (!new_events) {
+        fd_ctx->epfd = -1;
+    }
+    fd_ctx->triggerEvent(event);
+    --m_pendingEventCount;
+    return true;
+}
+
+bool IOManager::cancelAll(int fd) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
+        return false;
+    }
+
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    if (!fd_ctx->events) {
+        return false;
+    }
+
+    int op = EPOLL_CTL_DEL;
+    epoll_event epevent;
+    epevent.events = 0;
+    epevent.data.ptr = fd_ctx;
+
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
+    if (rt) {
+        SYLAR_LOG_ERROR(g_logger)
+            << "epoll_ctl(" << fd_ctx->epfd << ", " << op << ", " << fd << ", "
+            << (EPOLL_EVENTS)epevent.events << "):" << rt << " (" << errno
+            << ") (" << strerror(errno) << ")";
+        return false;
+    }
+
+    fd_ctx->epfd = -1;
+    if (fd_ctx->events & READ) {
+        fd_ctx->triggerEvent(READ);
+        --m_pendingEventCount;
+    }
+    if (fd_ctx->events & WRITE) {
+        fd_ctx->triggerEvent(WRITE);
+        --m_pendingEventCount;
+    }
+
+    SYLAR_ASSERT(fd_ctx->events == 0);
+    return true;
+}
+
+IOManager* IOManager::GetThis() {
+    return dynamic_cast<IOManager*>(Scheduler::GetThis());
+}
+
+void IOManager::tickle(int thread) {
+    // 与空闲线程登记后重新检查队列配对，保证两边至少有一方看到对方
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!hasIdleThreads()) {
+        return;
+    }
+    int idx = getIdleWorker(thread);
+    if (idx < 0) {
+        // 指定的线程不空闲，它执行完当前任务后会检查队列
+        return;
+    }
+    uint64_t one = 1;
+    int rt = write_f(m_tickleFds[idx], &one, sizeof(one));
+    SYLAR_ASSERT(rt == sizeof(one));
+}
+
+bool IOManager::stopping() {
+    uint64_t timeout = 0;
+    return stopping(timeout);
+}
+
+bool IOManager::stopping(uint64_t& timeout) {
+    timeout = getNextTimer();
+    // 其他线程的时间轮上还有定时器时也不能停止
+    return timeout == ~0ull && !hasTimer() && m_pendingEventCount == 0 &&
+           Scheduler::stopping();
+}
+
+void IOManager::onTimerInsertedAtFront(int wheel) {
+    if (wheel == getWorkerIndex()) {
+        // 本线程进入epoll_wait前会重新计算超时
+        return;
+    }
+    if (wheel >= (int)m_tickleFds.size()) {
+        // 共享时间轮，唤醒任意一个空闲线程
+        tickle();
+        return;
+    }
+    uint64_t one = 1;
+    int rt = write_f(m_tickleFds[wheel], &one, sizeof(one));
+    SYLAR_ASSERT(rt == sizeof(one));
+}
+
+void IOManager::handleEpollEvents(epoll_event* events, int n, int tickle_fd) {
+    for (int i = 0; i < n; ++i) {
+        epoll_event& event = events[i];
+        if (!event.data.ptr) {
+            // 非信号量模式的eventfd一次读完计数
+            uint64_t dummy;
+            while (read_f(tickle_fd, &dummy, sizeof(dummy)) > 0)
+                ;
+            continue;
+        }
+
+        FdContext* fd_ctx = (FdContext*)event.data.ptr;
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        if (event.events & (EPOLLERR | EPOLLHUP)) {
+            event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+        }
+        int real_events = NONE;
+        if (event.events & EPOLLIN) {
+            real_events |= READ;
+        }
+        if (event.events & EPOLLOUT) {
+            real_events |= WRITE;
+        }
+
+        if ((fd_ctx->events & real_events) == NONE) {
+            continue;
+        }
+
+        int left_events = (fd_ctx->events & ~real_events);
+        int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        event.events = EPOLLET | left_events;
+
+        int rt = epoll_ctl(fd_ctx->epfd, op, fd_ctx->fd, &event);
+        if (rt) {
+            SYLAR_LOG_ERROR(g_logger)
+                << "epoll_ctl(" << fd_ctx->epfd << ", " << op << ", "
+                << fd_ctx->fd << ", " << (EPOLL_EVENTS)event.events
+                << "):" << rt << " (" << errno << ") (" << strerror(errno)
+                << ")";
+            continue;
+        }
+        if (!left_events) {
+            fd_ctx->epfd = -1;
+        }
+
+        if (real_events & READ) {
+            fd_ctx->triggerEvent(READ);
+            --m_pendingEventCount;
+        }
+        if (real_events & WRITE) {
+            fd_ctx->triggerEvent(WRITE);
+            --m_pendingEventCount;
+        }
+    }
+}
+
+void IOManager::scheduleExpiredTimers() {
+    std::vector<std::function<void()> > cbs;
+    listExpiredCb(cbs);
+    for (auto& cb : cbs) {
+        // 工作窃取模式下放到本线程的队列
+        schedule(&cb);
+    }
+}
+
+void IOManager::idle() {
+    SYLAR_LOG_DEBUG(g_logger) << "idle";
+    int idx = getWorkerIndex();
+    SYLAR_ASSERT(idx >= 0);
+    if (m_backend == IO_URING) {
+        idleUring(idx);
+    } else {
+        idleEpoll(idx);
+    }
+}
+
+// tickle是精确唤醒，超时只是兜底
+static const int MAX_TIMEOUT = 3000;
+static const int MAX_EVENTS = 256;
+
+void IOManager::idleEpoll(int idx) {
+    int epfd = m_epfds[idx];
+    int tickle_fd = m_tickleFds[idx];
+    std::unique_ptr<epoll_event[]> events(new epoll_event[MAX_EVENTS]);
+
+    while (true) {
+        uint64_t next_timeout = 0;
+        if (stopping(next_timeout)) {
+            SYLAR_LOG_INFO(g_logger)
+                << "name=" << getName() << " idle stopping exit";
+            break;
+        }
+
+        int rt = 0;
+        do {
+            int timeout = (int)std::min(next_timeout, (uint64_t)MAX_TIMEOUT);
+            rt = epoll_wait(epfd, events.get(), MAX_EVENTS, timeout);
+        } while (rt < 0 && errno == EINTR);
+
+        scheduleExpiredTimers();
+        handleEpollEvents(events.get(), rt, tickle_fd);
+
+        Fiber::ptr cur = Fiber::GetThis();
+        auto raw_ptr = cur.get();
+        cur.reset();
+
+        raw_ptr->swapOut();
+    }
+}
+
+/**
+ * @brief: 提交一个一次性的poll请求，触发后需要重新提交
+ */
+static bool ArmPoll(IOUring* ring, int fd, uint64_t tag) {
+    io_uring_sqe* sqe = ring->getSqe();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = tag;
+    return true;
+}
+
+void IOManager::reapUring(int idx) {
+    IOUring* ring = m_rings[idx];
+    UringPolls& polls = m_uringPolls[idx];
+    int epfd = m_epfds[idx];
+    int tickle_fd = m_tickleFds[idx];
+    // 可能在任务协程的栈上执行，缓冲区不能太大
+    static const unsigned BATCH = 16;
+    io_uring_cqe* cqes[BATCH];
+    epoll_event events[BATCH];
+
+    unsigned n = 0;
+    while ((n = ring->peekCqes(cqes, BATCH)) > 0) {
+        for (unsigned i = 0; i < n; ++i) {
+            io_uring_cqe* cqe = cqes[i];
+            if (cqe->user_data == TICKLE_TAG) {
+                uint64_t dummy;
+                while (read_f(tickle_fd, &dummy, sizeof(dummy)) > 0)
+                    ;
+                polls.tickle = false;
+            } else if (cqe->user_data == LINK_TIMEOUT_TAG) {
+                // 结果体现在被链接的IO请求上
+            } else if (cqe->user_data == EPOLL_TAG) {
+                int rt = 0;
+                do {
+                    rt = epoll_wait(epfd, events, BATCH, 0);
+                    handleEpollEvents(events, rt, tickle_fd);
+                } while (rt == (int)BATCH);
+                polls.epoll = false;
+            } else {
+                UringOp* op = (UringOp*)cqe->user_data;
+                op->res = cqe->res;
+                Fiber::ptr fiber;
+                fiber.swap(op->fiber);
+                // 协程只会在本线程恢复；在flushPending中可能还没有切换出去，
+                // 调度器会等它切换出来再执行
+                schedule(&fiber, op->thread);
+                --m_pendingEventCount;
+            }
+        }
+        ring->advance(n);
+    }
+}
+
+void IOManager::idleUring(int idx) {
+    IOUring* ring = m_rings[idx];
+    UringPolls& polls = m_uringPolls[idx];
+
+    while (true) {
+        uint64_t next_timeout = 0;
+        if (stopping(next_timeout)) {
+            SYLAR_LOG_INFO(g_logger)
+                << "name=" << getName() << " idle stopping exit";
+            break;
+        }
+
+        if (!polls.tickle) {
+            polls.tickle = ArmPoll(ring, m_tickleFds[idx], TICKLE_TAG);
+        }
+        if (!polls.epoll) {
+            polls.epoll = ArmPoll(ring, m_epfds[idx], EPOLL_TAG);
+        }
+        // 协程提交的请求在这里和poll请求一起批量提交
+        int rt = ring->submitAndWait(
+            1, std::min(next_timeout, (uint64_t)MAX_TIMEOUT));
+        if (rt < 0 && errno != ETIME && errno != EINTR) {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring_enter errno=" << errno
+                                      << " errstr=" << strerror(errno);
+        }
+
+        scheduleExpiredTimers();
+        reapUring(idx);
+
+        Fiber::ptr cur = Fiber::GetThis();
+        auto raw_ptr = cur.get();
+        cur.reset();
+
+        raw_ptr->swapOut();
+    }
+}
+
+void IOManager::flushPending() {
+    if (m_backend != IO_URING) {
+        return;
+    }
+    int idx = getWorkerIndex();
+    if (idx < 0) {
+        return;
+    }
+    // 任务协程提交的请求不等到idle，数据已经就绪的读写在提交时就完成了，
+    // 顺便恢复已经完成的协程，忙的时候不用等到run queue清空
+    IOUring* ring = m_rings[idx];
+    if (ring->getPending() && ring->submit() < 0) {
+        SYLAR_LOG_ERROR(g_logger) << "io_uring_enter errno=" << errno
+                                  << " errstr=" << strerror(errno);
+    }
+    reapUring(idx);
+}
+
+IOUring* IOManager::getRing() {
+    if (m_backend != IO_URING) {
+        return nullptr;
+    }
+    int idx = getWorkerIndex();
+    if (idx < 0) {
+        return nullptr;
+    }
+    // 共享栈协程挂起后栈内容会被换出，内核不能往栈上的缓冲区写数据
+    if (Fiber::GetThis()->isSharedStack()) {
+        return nullptr;
+    }
+    return m_rings[idx];
+}
+
+io_uring_sqe* IOManager::getSqe(uint64_t timeout_ms) {
+    IOUring* ring = getRing();
+    if (!ring) {
+        return nullptr;
+    }
+    unsigned count = timeout_ms == ~0ull ? 1 : 2;
+    if (ring->getFree() < count) {
+        // SQ满了，先提交一批
+        ring->submit();
+        if (ring->getFree() < count) {
+            return nullptr;
+        }
+    }
+    return ring->getSqe();
+}
+
+int IOManager::uringWait(io_uring_sqe* sqe, uint64_t timeout_ms) {
+    UringOp op;
+    op.fiber = Fiber::GetThis();
+    op.thread = GetThreadId();
+    sqe->user_data = (uint64_t)&op;
+
+    // 提交前timespec一直在协程栈上
+    __kernel_timespec ts;
+    if (timeout_ms != ~0ull) {
+        sqe->flags |= IOSQE_IO_LINK;
+        // getSqe已经预留了位置
+        io_uring_sqe* tsqe = getRing()->getSqe();
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        PrepRw(tsqe, IORING_OP_LINK_TIMEOUT, -1, &ts, 1, 0);
+        tsqe->user_data = LINK_TIMEOUT_TAG;
+    }
+
+    ++m_pendingEventCount;
+    Fiber::YieldToHold();
+    if (op.res == -ECANCELED && timeout_ms != ~0ull) {
+        return -ETIMEDOUT;
+    }
+    return op.res;
+}
+
+int IOManager::waitEvent(int fd, Event event, uint64_t timeout_ms) {
+    Timer::ptr timer;
+    // 超时回调设置的错误码，协程返回后即释放，回调通过weak_ptr判断
+    std::shared_ptr<int> timed_out(new int(0));
+    if (timeout_ms != ~0ull) {
+        std::weak_ptr<int> winfo(timed_out);
+        timer = addConditionTimer(
+            timeout_ms,
+            [winfo, fd, event, this]() {
+                auto t = winfo.lock();
+                if (!t || *t) {
+                    return;
+                }
+                *t = ETIMEDOUT;
+                cancelEvent(fd, event);
+            },
+            winfo);
+    }
+    if (addEvent(fd, event)) {
+        if (timer) {
+            timer->cancel();
+        }
+        return -1;
+    }
+    Fiber::YieldToHold();
+    if (timer) {
+        timer->cancel();
+    }
+    if (*timed_out) {
+        errno = *timed_out;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t IOManager::read(int fd, void* buf, size_t count, uint64_t timeout_ms) {
+    io_uring_sqe* sqe = getSqe(timeout_ms);
+    if (sqe) {
+        PrepRw(sqe, IORING_OP_READ, fd, buf, count, (uint64_t)-1);
+        int res = uringWait(sqe, timeout_ms);
+        if (res != -EAGAIN) {
+            return UringResult(res);
+        }
+    }
+    while (true) {
+        ssize_t n = read_f(fd, buf, count);
+        if (n >= 0 || errno != EAGAIN) {
+            return n;
+        }
+        if (waitEvent(fd, READ, timeout_ms)) {
+            return -1;
+        }
+    }
+}
+
+ssize_t IOManager::write(int fd, const void* buf, size_t count,
+                         uint64_t timeout_ms) {
+    io_uring_sqe* sqe = getSqe(timeout_ms);
+    if (sqe) {
+        PrepRw(sqe, IORING_OP_WRITE, fd, buf, count, (uint64_t)-1);
+        int res = uringWait(sqe, timeout_ms);
+        if (res != -EAGAIN) {
+            return UringResult(res);
+        }
+    }
+    while (true) {
+        ssize_t n = write_f(fd, buf, count);
+        if (n >= 0 || errno != EAGAIN) {
+            return n;
+        }
+        if (waitEvent(fd, WRITE, timeout_ms)) {
+            return -1;
+        }
+    }
+}
+
+int IOManager::accept(int fd, sockaddr* addr, socklen_t* addrlen, int flags,
+                      uint64_t timeout_ms) {
+    io_uring_sqe* sqe = getSqe(timeout_ms);
+    if (sqe) {
+        PrepRw(sqe, IORING_OP_ACCEPT, fd, addr, 0, (uint64_t)addrlen);
+        sqe->accept_flags = flags;
+        int res = uringWait(sqe, timeout_ms);
+        if (res != -EAGAIN) {
+            return UringResult(res);
+        }
+    }
+    while (true) {
+        int rt = ::accept4(fd, addr, addrlen, flags);
+        if (rt >= 0 || errno != EAGAIN) {
+            return rt;
+        }
+        if (waitEvent(fd, READ, timeout_ms)) {
+            return -1;
+        }
+    }
+}
+
+int IOManager::sleepFor(uint64_t ms) {
+    io_uring_sqe* sqe = getSqe(~0ull);
+    if (sqe) {
+        __kernel_timespec ts;
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000;
+        PrepRw(sqe, IORING_OP_TIMEOUT, -1, &ts, 1, 0);
+        int res = uringWait(sqe, ~0ull);
+        return res == -ETIME ? 0 : UringResult(res);
+    }
+
+    Fiber::ptr fiber = Fiber::GetThis();
+    int thread = getWorkerIndex() >= 0 ? GetThreadId() : -1;
+    // 定时器在本线程的时间轮上，只会在本线程挂起之后触发
+    addTimer(ms, [this, fiber, thread]() { schedule(fiber, thread); });
+    Fiber::YieldToHold();
+    return 0;
+}
+
+}  // namespace sylar
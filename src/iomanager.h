@@ -0,0 +1,304 @@
+/*
+ * @Author: lvxr
+ * @brief 基于epoll的IO协程调度器
+ */
+
+#ifndef __SYLAR_IOMANAGER_H__
+#define __SYLAR_IOMANAGER_H__
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mutex.h"
+#include "scheduler.h"
+#include "timer.h"
+
+struct io_uring_sqe;
+struct epoll_event;
+
+namespace sylar {
+
+class IOUring;
+
+/**
+ * @brief: IO协程调度器
+ * @details: 协程在fd上注册读写事件后YieldToHold让出，事件就绪时重新调度。
+ *           每个工作线程有自己的epoll实例和eventfd：
+ *           fd第一次注册事件时加入注册线程的epoll，事件只会在该线程的epoll_wait里返回；
+ *           等待事件的协程绑定到注册事件的线程上恢复执行。
+ *           tickle写目标空闲线程的eventfd，可以精确唤醒指定线程。
+ *           fd上下文保存在以fd为下标的数组里，epoll事件的data.ptr直接指向fd上下文。
+ *           read/write/accept/sleepFor在io_uring后端下直接把操作提交到当前线程的io_uring，
+ *           协程挂起，完成事件到达后恢复；工作线程每次取下一个任务之前提交
+ *           积攒的请求并处理已经完成的事件，不等到run queue清空；
+ *           epoll后端下退化为非阻塞调用+addEvent等待就绪。
+ *           后端由配置iomanager.backend选择，io_uring不可用时回退到epoll。
+ *           每个工作线程有自己的时间轮，epoll_wait/io_uring_enter的超时取自最近的定时器
+ */
+class IOManager : public Scheduler, public TimerManager {
+public:
+    typedef std::shared_ptr<IOManager> ptr;
+    typedef RWMutex RWMutexType;
+
+    /**
+     * @brief: IO事件，与EPOLLIN/EPOLLOUT取值相同
+     */
+    enum Event {
+        // 无事件
+        NONE = 0x0,
+        // 读事件
+        READ = 0x1,
+        // 写事件
+        WRITE = 0x4,
+    };
+
+    /**
+     * @brief: IO后端
+     */
+    enum Backend {
+        // epoll就绪通知
+        EPOLL = 0,
+        // io_uring异步提交
+        IO_URING = 1,
+    };
+
+private:
+    /**
+     * @brief: fd上下文
+     */
+    struct FdContext {
+        typedef Mutex MutexType;
+
+        /**
+         * @brief: 事件上下文
+         */
+        struct EventContext {
+            // 执行事件的调度器
+            Scheduler* scheduler = nullptr;
+            // 事件协程
+            Fiber::ptr fiber;
+            // 事件回调函数
+            std::function<void()> cb;
+            // 注册事件的线程，协程在这个线程上恢复
+            int thread = -1;
+        };
+
+        /**
+         * @brief: 返回事件对应的上下文
+         */
+        EventContext& getContext(Event event);
+
+        /**
+         * @brief: 重置事件上下文
+         */
+        void resetContext(EventContext& ctx);
+
+        /**
+         * @brief: 触发事件并从已注册事件中删除
+         */
+        void triggerEvent(Event event);
+
+        // 读事件上下文
+        EventContext read;
+        // 写事件上下文
+        EventContext write;
+        // 事件关联的fd
+        int fd = 0;
+        // 所在的epoll实例，没有注册事件时为-1
+        int epfd = -1;
+        // 已经注册的事件
+        Event events = NONE;
+        MutexType mutex;
+    };
+
+public:
+    /**
+     * @brief: 构造函数
+     * @param[in] {size_t} threads 线程数量
+     * @param[in] {bool} use_caller 是否把调用线程纳入调度
+     * @param[in] {string&} name 调度器名称
+     */
+    IOManager(size_t threads = 1, bool use_caller = true,
+              const std::string& name = "");
+
+    /**
+     * @brief: 析构函数
+     */
+    ~IOManager();
+
+    /**
+     * @brief: 添加事件
+     * @param[in] {int} fd 文件描述符
+     * @param[in] {Event} event 事件类型
+     * @param[in] cb 事件回调函数，为空时以当前协程作为事件回调
+     * @return: 成功返回0，失败返回-1
+     */
+    int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+
+    /**
+     * @brief: 删除事件，不触发
+     */
+    bool delEvent(int fd, Event event);
+
+    /**
+     * @brief: 取消事件，如果事件已注册则触发一次
+     */
+    bool cancelEvent(int fd, Event event);
+
+    /**
+     * @brief: 取消fd上的所有事件
+     */
+    bool cancelAll(int fd);
+
+    /**
+     * @brief: 在协程中读fd，数据未就绪时挂起当前协程
+     * @details: epoll后端要求fd是非阻塞的
+     * @param[in] {uint64_t} timeout_ms 超时时间(毫秒)，超时返回-1，errno为ETIMEDOUT
+     * @return: 与read(2)相同
+     */
+    ssize_t read(int fd, void* buf, size_t count, uint64_t timeout_ms = ~0ull);
+
+    /**
+     * @brief: 在协程中写fd，不可写时挂起当前协程
+     * @return: 与write(2)相同
+     */
+    ssize_t write(int fd, const void* buf, size_t count,
+                  uint64_t timeout_ms = ~0ull);
+
+    /**
+     * @brief: 在协程中accept，没有新连接时挂起当前协程
+     * @param[in] {int} flags 与accept4(2)相同，如SOCK_NONBLOCK
+     * @return: 与accept4(2)相同
+     */
+    int accept(int fd, sockaddr* addr, socklen_t* addrlen, int flags = 0,
+               uint64_t timeout_ms = ~0ull);
+
+    /**
+     * @brief: 挂起当前协程ms毫秒
+     * @return: 成功返回0，失败返回-1
+     */
+    int sleepFor(uint64_t ms);
+
+    /**
+     * @brief: 返回实际使用的后端
+     */
+    Backend getBackend() const { return m_backend; }
+
+    /**
+     * @brief: 等待fd上的事件就绪
+     * @details: 只能在协程中调用，hook住的socket函数用它挂起当前协程
+     * @return: 成功返回0，超时或者失败返回-1并设置errno
+     */
+    int waitEvent(int fd, Event event, uint64_t timeout_ms);
+
+    /**
+     * @brief: 返回当前的IOManager
+     */
+    static IOManager* GetThis();
+
+protected:
+    void tickle(int thread = -1) override;
+    bool stopping() override;
+    void idle() override;
+    void flushPending() override;
+    void onTimerInsertedAtFront(int wheel) override;
+    int getTimerWheel() override { return getWorkerIndex(); }
+
+    /**
+     * @brief: 是否可以停止，同时返回最近的定时器还有多久到期
+     */
+    bool stopping(uint64_t& timeout);
+
+    /**
+     * @brief: 扩容fd上下文数组
+     * @attention: 需要持有m_mutex写锁
+     */
+    void contextResize(size_t size);
+
+    /**
+     * @brief: 返回fd上下文，不存在时按需扩容
+     */
+    FdContext* getFdContext(int fd, bool auto_create);
+
+    /**
+     * @brief: 选择新注册fd所在的epoll实例
+     */
+    int selectEpoll();
+
+    /**
+     * @brief: 处理epoll_wait返回的事件
+     */
+    void handleEpollEvents(epoll_event* events, int n, int tickle_fd);
+
+    /**
+     * @brief: 调度到期定时器的回调
+     */
+    void scheduleExpiredTimers();
+
+    /**
+     * @brief: epoll后端的idle
+     */
+    void idleEpoll(int idx);
+
+    /**
+     * @brief: io_uring后端的idle，同时用poll监听eventfd和本线程的epoll实例
+     */
+    void idleUring(int idx);
+
+    /**
+     * @brief: 处理本线程io_uring中已经完成的事件，恢复等待的协程
+     */
+    void reapUring(int idx);
+
+    /**
+     * @brief: 返回当前协程可以使用的io_uring
+     * @return: 不是io_uring后端、不在工作线程或者当前协程使用共享栈时返回nullptr
+     */
+    IOUring* getRing();
+
+    /**
+     * @brief: 从当前协程可以使用的io_uring中取一个SQE，SQ满时先提交
+     * @param[in] {uint64_t} timeout_ms 需要超时时额外预留一个SQE
+     * @return: 不能使用io_uring时返回nullptr
+     */
+    io_uring_sqe* getSqe(uint64_t timeout_ms);
+
+    /**
+     * @brief: 挂起当前协程直到sqe完成
+     * @return: 完成事件的res，失败时为负的errno，超时为-ETIMEDOUT
+     */
+    int uringWait(io_uring_sqe* sqe, uint64_t timeout_ms);
+
+private:
+    // 每个工作线程的epoll实例
+    std::vector<int> m_epfds;
+    // 每个工作线程的eventfd，用于tickle
+    std::vector<int> m_tickleFds;
+    // 每个工作线程的io_uring，epoll后端时为空
+    std::vector<IOUring*> m_rings;
+    // 每个工作线程的io_uring里是否已经有eventfd和epoll实例的poll请求
+    struct UringPolls {
+        bool tickle = false;
+        bool epoll = false;
+    };
+    std::vector<UringPolls> m_uringPolls;
+    // 实际使用的后端
+    Backend m_backend = EPOLL;
+    // 当前等待执行的事件数量
+    std::atomic<size_t> m_pendingEventCount{0};
+    // 非工作线程注册fd时轮流选择epoll实例
+    std::atomic<size_t> m_nextEpoll{0};
+    RWMutexType m_mutex;
+    // fd上下文，下标为fd
+    std::vector<FdContext*> m_fdContexts;
+};
+
+}  // namespace sylar
+
+#endif
@@ -14,6 +14,7 @@
 
 #include "config.h"
 #include "env.h"
+#include "fiber.h"
 
 namespace sylar {
 
@@ -61,6 +62,8 @@ LogEventWrap::LogEventWrap(LogEvent::ptr e) : m_event(e) {}
 
 LogEventWrap::~LogEventWrap() {
     m_event->getLogger()->log(m_event->getLevel(), m_event);
+    // 日志输出是长时间计算的任务里最常见的调用，作为抢占检查点
+    Fiber::CheckPreempt();
 }
 
 void LogEvent::format(const char* fmt, ...) {
@@ -8,7 +8,14 @@
 
 #include "mutex.h"
 
+#include <errno.h>
+#include <time.h>
+
+#include <stdexcept>
+
 namespace sylar {
+thread_local uint32_t ThreadLockCounter::t_count = 0;
+
 Semaphore::Semaphore(uint32_t count) {
     if (sem_init(&m_semaphore, 0, count)) {
         throw std::logic_error("sem_init error");
@@ -23,6 +30,26 @@ void Semaphore::wait() {
     }
 }
 
+bool Semaphore::waitFor(uint64_t timeout_ms) {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000;
+    }
+    while (sem_timedwait(&m_semaphore, &ts)) {
+        if (errno == ETIMEDOUT) {
+            return false;
+        }
+        if (errno != EINTR) {
+            throw std::logic_error("sem_timedwait error");
+        }
+    }
+    return true;
+}
+
 void Semaphore::notify() {
     if (sem_post(&m_semaphore)) {
         throw std::logic_error("sem_post error");
@@ -21,6 +21,22 @@
 
 namespace sylar {
 
+/**
+ * @brief: 当前线程持有的线程锁数量
+ * @details: Mutex/RWMutex/Spinlock加解锁时维护。协程抢占点在持有线程锁时不让出，
+ *           否则同一个线程上的其他协程再加这把锁会死锁
+ */
+class ThreadLockCounter {
+public:
+    static void Inc() { ++t_count; }
+    static void Dec() { --t_count; }
+    static uint32_t Get() { return t_count; }
+
+private:
+    static thread_local uint32_t t_count
+        __attribute__((tls_model("initial-exec")));
+};
+
 /**
  * @brief 信号量
  */
@@ -42,6 +58,12 @@ public:
      */
     void wait();
 
+    /**
+     * @brief 获取信号量，最多等待timeout_ms毫秒
+     * @return 超时返回false
+     */
+    bool waitFor(uint64_t timeout_ms);
+
     /**
      * @brief 释放信号量
      */
@@ -214,12 +236,18 @@ public:
     /**
      * @brief 加锁
      */
-    void lock() { pthread_mutex_lock(&m_mutex); }
+    void lock() {
+        pthread_mutex_lock(&m_mutex);
+        ThreadLockCounter::Inc();
+    }
 
     /**
      * @brief 解锁
      */
-    void unlock() { pthread_mutex_unlock(&m_mutex); }
+    void unlock() {
+        ThreadLockCounter::Dec();
+        pthread_mutex_unlock(&m_mutex);
+    }
 
 private:
     // 互斥锁
@@ -250,17 +278,26 @@ public:
     /**
      * @brief 上读锁
      */
-    void rdlock() { pthread_rwlock_rdlock(&m_lock); }
+    void rdlock() {
+        pthread_rwlock_rdlock(&m_lock);
+        ThreadLockCounter::Inc();
+    }
 
     /**
      * @brief 上写锁
      */
-    void wrlock() { pthread_rwlock_wrlock(&m_lock); }
+    void wrlock() {
+        pthread_rwlock_wrlock(&m_lock);
+        ThreadLockCounter::Inc();
+    }
 
     /**
      * @brief 解锁
      */
-    void unlock() { pthread_rwlock_unlock(&m_lock); }
+    void unlock() {
+        ThreadLockCounter::Dec();
+        pthread_rwlock_unlock(&m_lock);
+    }
 
 private:
     // 读写锁
@@ -288,12 +325,18 @@ public:
     /**
      * @brief 上锁
      */
-    void lock() { pthread_spin_lock(&m_mutex); }
+    void lock() {
+        pthread_spin_lock(&m_mutex);
+        ThreadLockCounter::Inc();
+    }
 
     /**
      * @brief 解锁
      */
-    void unlock() { pthread_spin_unlock(&m_mutex); }
+    void unlock() {
+        ThreadLockCounter::Dec();
+        pthread_spin_unlock(&m_mutex);
+    }
 
 private:
     // 自旋锁
@@ -0,0 +1,259 @@
+/*
+ * @Author: lvxr
+ * @brief 基于协程的结构化并发
+ */
+
+#ifndef __SYLAR_PARALLEL_H__
+#define __SYLAR_PARALLEL_H__
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "fiber_sync.h"
+#include "marco.h"
+#include "scheduler.h"
+
+namespace sylar {
+
+/**
+ * @brief: spawn的任务和JoinHandle共享的状态
+ */
+template <class T>
+struct JoinState {
+    WaitGroup wg;
+    T value;
+    std::exception_ptr exception;
+
+    template <class F>
+    void run(F& f) {
+        value = f();
+    }
+
+    T get() { return std::move(value); }
+};
+
+template <>
+struct JoinState<void> {
+    WaitGroup wg;
+    std::exception_ptr exception;
+
+    template <class F>
+    void run(F& f) {
+        f();
+    }
+
+    void get() {}
+};
+
+/**
+ * @brief: spawn返回的句柄，用来等待任务结束并取得结果
+ */
+template <class T>
+class JoinHandle {
+public:
+    JoinHandle() {}
+
+    explicit JoinHandle(std::shared_ptr<JoinState<T> > state)
+        : m_state(state) {}
+
+    /**
+     * @brief: 等待任务结束并返回结果
+     * @details: 在协程中等待时挂起协程；任务抛出的异常在这里重新抛出。
+     *           结果是移动出来的，只能join一次
+     */
+    T join() {
+        SYLAR_ASSERT(m_state);
+        m_state->wg.wait();
+        if (m_state->exception) {
+            std::rethrow_exception(m_state->exception);
+        }
+        return m_state->get();
+    }
+
+    /**
+     * @brief: 任务是否已经结束
+     */
+    bool isDone() const { return m_state->wg.getCount() == 0; }
+
+    bool valid() const { return (bool)m_state; }
+
+private:
+    std::shared_ptr<JoinState<T> > m_state;
+};
+
+/**
+ * @brief: 在调度器上启动一个任务
+ * @param[in] sc 执行任务的调度器
+ * @param[in] f 任务，返回值通过JoinHandle::join取得
+ */
+template <class F>
+JoinHandle<typename std::result_of<F()>::type> spawn(Scheduler* sc, F f) {
+    typedef typename std::result_of<F()>::type R;
+    std::shared_ptr<JoinState<R> > state = std::make_shared<JoinState<R> >();
+    state->wg.add(1);
+    sc->schedule([state, f]() mutable {
+        try {
+            state->run(f);
+        } catch (...) {
+            state->exception = std::current_exception();
+        }
+        state->wg.done();
+    });
+    return JoinHandle<R>(state);
+}
+
+/**
+ * @brief: 在当前线程的调度器上启动一个任务
+ */
+template <class F>
+JoinHandle<typename std::result_of<F()>::type> spawn(F f) {
+    Scheduler* sc = Scheduler::GetThis();
+    SYLAR_ASSERT2(sc, "spawn without scheduler");
+    return spawn(sc, f);
+}
+
+/**
+ * @brief: parallel_for/parallel_reduce的任务共享的状态
+ * @details: 放在堆上，等待者可能是共享栈协程，挂起时它的栈不能被其他线程访问
+ */
+struct ParallelContext {
+    WaitGroup wg;
+    // 有任务失败后剩下的任务不再执行
+    std::atomic<bool> failed{false};
+    Spinlock mutex;
+    // 第一个异常
+    std::exception_ptr exception;
+
+    void setException(std::exception_ptr e) {
+        Spinlock::Lock lock(mutex);
+        if (!exception) {
+            exception = e;
+        }
+        failed = true;
+    }
+};
+
+/**
+ * @brief: 把[begin, end)切分成每段grain个元素，返回段数
+ * @param[in] {size_t&} grain 为0时按工作线程数量自动选择，每个线程大约4段
+ */
+inline size_t ParallelChunks(Scheduler* sc, size_t begin, size_t end,
+                             size_t& grain) {
+    size_t n = end - begin;
+    if (grain == 0) {
+        size_t chunks = std::max<size_t>(1, sc->getWorkerCount() * 4);
+        grain = std::max<size_t>(1, (n + chunks - 1) / chunks);
+    }
+    return (n + grain - 1) / grain;
+}
+
+/**
+ * @brief: 在调度器的工作线程上并行执行f(i)，i属于[begin, end)
+ * @details: 区间被切分成多个协程任务，全部结束后返回；
+ *           任务抛出异常时剩余没开始的段不再执行，等已经开始的段结束后重新抛出第一个异常。
+ *           可以在同一个调度器的协程中调用，等待时挂起协程而不是阻塞线程
+ * @param[in] sc 执行任务的调度器
+ * @param[in] f 每个元素执行的函数，签名为void(size_t)，会被拷贝到每个任务
+ * @param[in] {size_t} grain 每个任务处理的元素数量，0为自动选择
+ */
+template <class F>
+void parallel_for(Scheduler* sc, size_t begin, size_t end, F f,
+                  size_t grain = 0) {
+    if (begin >= end) {
+        return;
+    }
+    size_t chunks = ParallelChunks(sc, begin, end, grain);
+    std::shared_ptr<ParallelContext> ctx = std::make_shared<ParallelContext>();
+    ctx->wg.add(chunks);
+    for (size_t b = begin; b < end; b += grain) {
+        size_t e = std::min(end, b + grain);
+        sc->schedule([ctx, f, b, e]() mutable {
+            std::atomic<bool>& failed = ctx->failed;
+            try {
+                for (size_t i = b;
+                     i < e && !failed.load(std::memory_order_relaxed); ++i) {
+                    f(i);
+                }
+            } catch (...) {
+                ctx->setException(std::current_exception());
+            }
+            ctx->wg.done();
+        });
+    }
+    ctx->wg.wait();
+    if (ctx->exception) {
+        std::rethrow_exception(ctx->exception);
+    }
+}
+
+/**
+ * @brief: parallel_reduce每段的结果
+ * @details: 包一层保证每段是独立的对象，std::vector<bool>按位存放，
+ *           不同线程写相邻的段会互相覆盖
+ */
+template <class T>
+struct ParallelSlot {
+    T value;
+
+    ParallelSlot(const T& v) : value(v) {}
+};
+
+/**
+ * @brief: 并行归约，返回reduce(...reduce(reduce(identity, map(begin)), map(begin + 1))...)
+ * @details: 每段从identity开始按顺序归约，最后按段的顺序合并，
+ *           reduce只需要满足结合律，结果是确定的。异常处理同parallel_for
+ * @param[in] identity reduce的单位元
+ * @param[in] map 签名为T(size_t)
+ * @param[in] reduce 签名为T(T, T)
+ */
+template <class T, class Map, class Reduce>
+T parallel_reduce(Scheduler* sc, size_t begin, size_t end, T identity, Map map,
+                  Reduce reduce, size_t grain = 0) {
+    if (begin >= end) {
+        return identity;
+    }
+    size_t chunks = ParallelChunks(sc, begin, end, grain);
+    std::shared_ptr<ParallelContext> ctx = std::make_shared<ParallelContext>();
+    std::shared_ptr<std::vector<ParallelSlot<T> > > results =
+        std::make_shared<std::vector<ParallelSlot<T> > >(
+            chunks, ParallelSlot<T>(identity));
+    ctx->wg.add(chunks);
+    size_t k = 0;
+    for (size_t b = begin; b < end; b += grain, ++k) {
+        size_t e = std::min(end, b + grain);
+        sc->schedule([ctx, results, map, reduce, b, e, k]() mutable {
+            std::atomic<bool>& failed = ctx->failed;
+            try {
+                T acc = (*results)[k].value;
+                for (size_t i = b;
+                     i < e && !failed.load(std::memory_order_relaxed); ++i) {
+                    acc = reduce(std::move(acc), map(i));
+                }
+                (*results)[k].value = std::move(acc);
+            } catch (...) {
+                ctx->setException(std::current_exception());
+            }
+            ctx->wg.done();
+        });
+    }
+    ctx->wg.wait();
+    if (ctx->exception) {
+        std::rethrow_exception(ctx->exception);
+    }
+    T acc = std::move(identity);
+    for (auto& i : *results) {
+        acc = reduce(std::move(acc), std::move(i.value));
+    }
+    return acc;
+}
+
+}  // namespace sylar
+
+#endif
@@ -0,0 +1,695 @@
+/*
+ * @Author: lvxr
+ * @brief 协程调度器
+ */
+
+#include "scheduler.h"
+
+#include <cxxabi.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <exception>
+
+#include "config.h"
+#include "hook.h"
+#include "log.h"
+#include "marco.h"
+#include "work_stealing_queue.h"
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+// 是否开启工作窃取
+static ConfigVar<bool>::ptr g_scheduler_work_stealing = Config::Lookup<bool>(
+    "scheduler.work_stealing", true, "scheduler per-thread work stealing");
+
+// 任务协程让出时是否直接切换到下一个任务
+static ConfigVar<bool>::ptr g_scheduler_direct_switch = Config::Lookup<bool>(
+    "scheduler.direct_switch", true, "scheduler direct fiber to fiber switch");
+
+// 工作线程是否hook系统调用
+static ConfigVar<bool>::ptr g_scheduler_hook_enable = Config::Lookup<bool>(
+    "scheduler.hook_enable", false, "scheduler worker syscall hook");
+
+// 任务协程的时间片，0表示不抢占
+static ConfigVar<uint32_t>::ptr g_scheduler_preempt_slice =
+    Config::Lookup<uint32_t>("scheduler.preempt_slice_ms", 0,
+                             "scheduler fiber time slice, 0 disables preemption");
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// 抢占定时器使用的信号
+#define SYLAR_PREEMPT_SIGNAL SIGRTMIN
+
+// 任务协程因为时间片用完让出的次数
+static std::atomic<uint64_t> s_preempt_count{0};
+// 下面三个变量在信号处理函数中读写，用initial-exec模型避免调用__tls_get_addr，
+// 它不是异步信号安全的
+// 上一次定时器信号时本线程切入协程的次数
+static thread_local uint32_t t_preempt_seen
+    __attribute__((tls_model("initial-exec"))) = 0;
+// 第一次看到当前协程时的线程CPU时间，纳秒
+static thread_local uint64_t t_preempt_start
+    __attribute__((tls_model("initial-exec"))) = 0;
+// 时间片，纳秒
+static thread_local uint64_t t_preempt_slice
+    __attribute__((tls_model("initial-exec"))) = 0;
+
+static uint64_t ThreadCpuNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 当前线程所属的调度器
+static thread_local Scheduler* t_scheduler = nullptr;
+// 当前线程的调度协程
+static thread_local Fiber* t_scheduler_fiber = nullptr;
+
+/**
+ * @brief: 工作线程
+ */
+struct SchedulerWorker {
+    // 在m_workers中的下标
+    int index = 0;
+    // 线程id
+    int thread = -1;
+    // 是否正在执行任务，只由自己修改
+    std::atomic<bool> active{false};
+    // 是否登记为空闲，只由自己修改
+    std::atomic<bool> idle{false};
+    // 登记为空闲前读到的m_parkEpoch
+    int epoch = 0;
+    // 选择窃取对象的随机数状态
+    uint32_t seed = 0;
+    // 自己的任务队列
+    WorkStealingQueue<Scheduler::FiberAndThread*> queue;
+    // 正在执行的任务协程，直接切换时随之更新
+    Fiber::ptr current;
+    // current指定的线程id
+    int currentThread = -1;
+    // current让出时设置的状态，切换出来之前current保持EXEC
+    Fiber::State currentState = Fiber::HOLD;
+    // 直接切换出去、还没有处理的任务协程
+    Fiber::ptr prev;
+    // prev指定的线程id
+    int prevThread = -1;
+    // prev让出时设置的状态
+    Fiber::State prevState = Fiber::HOLD;
+    // 不能直接切换时取到的任务，回到调度协程后先执行
+    Scheduler::FiberAndThread pending;
+    // 抢占定时器
+    timer_t preemptTimer;
+    // 是否创建了抢占定时器
+    bool hasPreemptTimer = false;
+    // 当前任务协程是因为时间片用完让出的
+    bool preempted = false;
+};
+
+// 当前线程的工作线程信息
+static thread_local SchedulerWorker* t_worker = nullptr;
+
+static void FutexWait(std::atomic<int>* addr, int value) {
+    syscall(SYS_futex, (int*)addr, FUTEX_WAIT_PRIVATE, value, nullptr, nullptr,
+            0);
+}
+
+static void FutexWake(std::atomic<int>* addr, int count) {
+    syscall(SYS_futex, (int*)addr, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr,
+            0);
+}
+
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
+    : m_name(name) {
+    SYLAR_ASSERT(threads > 0);
+    m_workStealing = g_scheduler_work_stealing->getValue();
+    m_directSwitch = g_scheduler_direct_switch->getValue();
+    m_preemptSlice = g_scheduler_preempt_slice->getValue();
+
+    if (use_caller) {
+        Fiber::GetThis();
+        --threads;
+
+        SYLAR_ASSERT(GetThis() == nullptr);
+        t_scheduler = this;
+
+        m_rootFiber.reset(new Fiber(std::bind(&Scheduler::run, this), 0, true));
+        Thread::SetName(m_name);
+
+        t_scheduler_fiber = m_rootFiber.get();
+        m_rootThread = GetThreadId();
+        m_threadIds.push_back(m_rootThread);
+    } else {
+        m_rootThread = -1;
+    }
+    m_threadCount = threads;
+
+    m_workers.resize(m_threadCount + (use_caller ? 1 : 0));
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        m_workers[i] = new SchedulerWorker;
+        m_workers[i]->index = i;
+        m_workers[i]->seed = i * 2654435761U + 1;
+    }
+}
+
+Scheduler::~Scheduler() {
+    SYLAR_ASSERT(m_stopping);
+    if (GetThis() == this) {
+        t_scheduler = nullptr;
+        t_scheduler_fiber = nullptr;
+    }
+    for (auto w : m_workers) {
+        FiberAndThread* ft = nullptr;
+        while (w->queue.pop(ft)) {
+            delete ft;
+        }
+        delete w;
+    }
+}
+
+Scheduler* Scheduler::GetThis() { return t_scheduler; }
+
+Fiber* Scheduler::GetMainFiber() { return t_scheduler_fiber; }
+
+bool Scheduler::InTaskFiber() {
+    return t_worker && t_worker->current &&
+           t_worker->current.get() == Fiber::GetCurrent();
+}
+
+uint64_t Scheduler::GetPreemptCount() { return s_preempt_count; }
+
+void Scheduler::setThis() { t_scheduler = this; }
+
+void Scheduler::start() {
+    MutexType::Lock lock(m_mutex);
+    if (!m_stopping) {
+        return;
+    }
+    m_stopping = false;
+    SYLAR_ASSERT(m_threads.empty());
+
+    m_nextWorker = 0;
+    m_threads.resize(m_threadCount);
+    for (size_t i = 0; i < m_threadCount; ++i) {
+        m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this),
+                                      m_name + "_" + std::to_string(i)));
+        m_threadIds.push_back(m_threads[i]->getId());
+    }
+}
+
+void Scheduler::stop() {
+    m_autoStop = true;
+    if (m_rootFiber && m_threadCount == 0 &&
+        (m_rootFiber->getState() == Fiber::TERM ||
+         m_rootFiber->getState() == Fiber::INIT)) {
+        SYLAR_LOG_INFO(g_logger) << this << " stopped";
+        m_stopping = true;
+
+        if (stopping()) {
+            return;
+        }
+    }
+
+    if (m_rootThread != -1) {
+        SYLAR_ASSERT(GetThis() == this);
+    } else {
+        SYLAR_ASSERT(GetThis() != this);
+    }
+
+    m_stopping = true;
+    // 空闲线程逐个退出，退出前再唤醒下一个
+    tickle();
+
+    if (m_rootFiber && !stopping()) {
+        m_rootFiber->call();
+    }
+
+    std::vector<Thread::ptr> thrs;
+    {
+        MutexType::Lock lock(m_mutex);
+        thrs.swap(m_threads);
+    }
+    for (auto& i : thrs) {
+        i->join();
+    }
+}
+
+bool Scheduler::isLocalWorker() const {
+    return t_worker && t_scheduler == this;
+}
+
+int Scheduler::getWorkerIndex() const {
+    return isLocalWorker() ? t_worker->index : -1;
+}
+
+int Scheduler::getIdleWorker(int thread) {
+    size_t n = m_workers.size();
+    size_t start = thread == -1 ? m_nextIdle++ : 0;
+    for (size_t i = 0; i < n; ++i) {
+        SchedulerWorker* w = m_workers[(start + i) % n];
+        if (w->idle && (thread == -1 || w->thread == thread)) {
+            return w->index;
+        }
+    }
+    return -1;
+}
+
+bool Scheduler::scheduleLocal(FiberAndThread* ft) {
+    if (!ft->fiber && !ft->cb) {
+        delete ft;
+        return false;
+    }
+    t_worker->queue.push(ft);
+    return true;
+}
+
+void Scheduler::tickle(int thread) {
+    // 与空闲线程登记后重新检查队列配对，保证两边至少有一方看到对方
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!hasIdleThreads()) {
+        return;
+    }
+    ++m_parkEpoch;
+    // 指定线程的任务不知道目标线程是哪个等待者，全部唤醒
+    FutexWake(&m_parkEpoch, thread == -1 ? 1 : INT_MAX);
+}
+
+bool Scheduler::hasActiveThreads() {
+    for (auto w : m_workers) {
+        if (w->active) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Scheduler::stopping() {
+    if (!m_autoStop || !m_stopping) {
+        return false;
+    }
+    // 先检查队列再检查active，工作线程在取任务之前就设置了active
+    {
+        MutexType::Lock lock(m_mutex);
+        if (!m_fibers.empty()) {
+            return false;
+        }
+    }
+    for (auto w : m_workers) {
+        if (!w->queue.empty()) {
+            return false;
+        }
+    }
+    return !hasActiveThreads();
+}
+
+void Scheduler::idle() {
+    SYLAR_LOG_DEBUG(g_logger) << "idle";
+    while (!stopping()) {
+        FutexWait(&m_parkEpoch, t_worker->epoch);
+        Fiber::YieldToHold();
+    }
+}
+
+bool Scheduler::takeGlobal(FiberAndThread& ft, bool& has_exec, bool& more) {
+    if (m_globalCount == 0) {
+        return false;
+    }
+    MutexType::Lock lock(m_mutex);
+    auto it = m_fibers.begin();
+    while (it != m_fibers.end()) {
+        if (it->thread != -1 && it->thread != GetThreadId()) {
+            // 指定了其他线程，调度时已经唤醒过
+            ++it;
+            continue;
+        }
+
+        SYLAR_ASSERT(it->fiber || it->cb);
+        if (it->fiber && it->fiber->getState() == Fiber::EXEC) {
+            // 还没有切换出来的协程被重新调度了
+            has_exec = true;
+            ++it;
+            continue;
+        }
+
+        ft = *it;
+        m_fibers.erase(it++);
+        --m_globalCount;
+        more = it != m_fibers.end();
+        return true;
+    }
+    return false;
+}
+
+bool Scheduler::nextTask(SchedulerWorker* worker, FiberAndThread& ft,
+                         bool& has_exec) {
+    FiberAndThread* p = nullptr;
+    bool more = false;
+    if (m_workStealing && worker->queue.pop(p)) {
+        more = !worker->queue.empty();
+    } else if (takeGlobal(ft, has_exec, more)) {
+        if (more) {
+            tickle();
+        }
+        return true;
+    } else if (m_workStealing) {
+        // 从随机位置开始依次尝试其他线程
+        size_t n = m_workers.size();
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 17;
+        worker->seed ^= worker->seed << 5;
+        size_t start = worker->seed % n;
+        for (size_t i = 0; i < n && !p; ++i) {
+            SchedulerWorker* victim = m_workers[(start + i) % n];
+            if (victim != worker) {
+                victim->queue.steal(p);
+            }
+        }
+        // 被窃取的线程可能还有任务，继续唤醒其他空闲线程
+        more = p != nullptr;
+    }
+    if (!p) {
+        return false;
+    }
+
+    ft = std::move(*p);
+    delete p;
+    if (ft.fiber && ft.fiber->getState() == Fiber::EXEC) {
+        // 放回全局队列等它切换出来
+        has_exec = true;
+        MutexType::Lock lock(m_mutex);
+        m_fibers.push_back(ft);
+        ++m_globalCount;
+        ft.reset();
+        return false;
+    }
+    if (more) {
+        tickle();
+    }
+    return true;
+}
+
+void Scheduler::finishTask(Fiber::ptr& fiber, int thread,
+                           Fiber::State state) {
+    // 设置成非EXEC之后其他线程就可能开始执行它，不能再读写fiber的状态
+    thread = TaskThread(fiber, thread);
+    if (state == Fiber::READY && t_worker && t_worker->preempted) {
+        // 时间片用完的协程排到全局队列末尾，先执行已经在等待的任务
+        t_worker->preempted = false;
+        fiber->m_state = state;
+        {
+            MutexType::Lock lock(m_mutex);
+            scheduleNoLock(fiber, thread);
+        }
+        tickle(thread);
+    } else if (state == Fiber::READY) {
+        fiber->m_state = state;
+        schedule(fiber, thread);
+    } else if (state != Fiber::TERM && state != Fiber::EXCEPT) {
+        fiber->m_state = Fiber::HOLD;
+    } else {
+        fiber->m_state = state;
+    }
+    fiber.reset();
+}
+
+bool Scheduler::SwitchToNext(Fiber* cur, Fiber::State state) {
+    SchedulerWorker* worker = t_worker;
+    // 只有任务协程才直接切换，idle协程等仍然回到调度协程
+    if (!worker || worker->current.get() != cur) {
+        cur->m_state = state;
+        return false;
+    }
+    // 切换出来之前其他线程可能已经重新调度了cur，保持EXEC让它们跳过，
+    // 切换完成后再设置成让出时的状态
+    worker->currentState = state;
+    if (!t_scheduler->m_directSwitch || worker->pending.fiber ||
+        worker->pending.cb) {
+        return false;
+    }
+    t_scheduler->flushPending();
+    FiberAndThread ft;
+    bool has_exec = false;
+    bool ok = t_scheduler->nextTask(worker, ft, has_exec);
+    if (ok && ft.cb) {
+        ft.fiber = Fiber::Create(ft.cb);
+        ft.cb = nullptr;
+    } else if (ok && (ft.fiber->getState() == Fiber::TERM ||
+                      ft.fiber->getState() == Fiber::EXCEPT)) {
+        ok = false;
+    } else if (ok && !cur->canSwitchTo(*ft.fiber)) {
+        worker->pending = ft;
+        ok = false;
+    }
+    if (!ok) {
+        return false;
+    }
+
+    worker->prev.swap(worker->current);
+    worker->prevThread = worker->currentThread;
+    worker->prevState = worker->currentState;
+    worker->current.swap(ft.fiber);
+    worker->currentThread = ft.thread;
+    // 切换后cur的栈可能不再恢复，不能留下持有引用的局部变量
+    ft.reset();
+    cur->switchTo(*worker->current);
+    FinishSwitch();
+    return true;
+}
+
+void Scheduler::FinishSwitch() {
+    SchedulerWorker* worker = t_worker;
+    if (worker && worker->prev) {
+        t_scheduler->finishTask(worker->prev, worker->prevThread,
+                                worker->prevState);
+    }
+}
+
+bool Scheduler::YieldPreempted() {
+    Fiber::t_preempt = false;
+    if (!InTaskFiber()) {
+        return false;
+    }
+    // 持有线程锁时切换出去，同一线程上的其他协程再加这把锁会死锁；
+    // catch块中切换出去，线程本地的异常状态会被其他协程打乱
+    if (ThreadLockCounter::Get() > 0 || std::uncaught_exception() ||
+        abi::__cxa_current_exception_type()) {
+        Fiber::t_preempt = true;
+        return false;
+    }
+    ++s_preempt_count;
+    t_worker->preempted = true;
+    Fiber::GetCurrent()->swapOut(Fiber::READY);
+    return true;
+}
+
+void Scheduler::OnPreemptTick(int sig) {
+    // CPU时钟定时器按内核时钟节拍检查，间隔不准，用实际的CPU时间判断
+    int saved_errno = errno;
+    uint32_t switches = Fiber::t_switches;
+    uint64_t now = ThreadCpuNS();
+    if (switches != t_preempt_seen) {
+        // 上一次信号之后切换过协程，从这里开始计时
+        t_preempt_seen = switches;
+        t_preempt_start = now;
+    } else if (now - t_preempt_start >= t_preempt_slice) {
+        Fiber::t_preempt = true;
+    }
+    errno = saved_errno;
+}
+
+void Scheduler::startPreemptTimer(SchedulerWorker* worker) {
+    static bool s_installed = []() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &Scheduler::OnPreemptTick;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SYLAR_PREEMPT_SIGNAL, &sa, nullptr)) {
+            SYLAR_LOG_ERROR(g_logger) << "sigaction preempt signal errno="
+                                      << errno << " " << strerror(errno);
+            return false;
+        }
+        return true;
+    }();
+    if (!s_installed) {
+        return;
+    }
+
+    // 每1/4个时间片检查一次，至少1ms
+    t_preempt_slice = m_preemptSlice * 1000000ull;
+    uint64_t interval = std::max<uint64_t>(t_preempt_slice / 4, 1000000);
+    t_preempt_seen = Fiber::t_switches;
+    t_preempt_start = ThreadCpuNS();
+
+    // 线程CPU时钟只在线程运行时计时，阻塞在futex或epoll_wait上时不会触发
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SYLAR_PREEMPT_SIGNAL;
+    sev.sigev_notify_thread_id = GetThreadId();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &worker->preemptTimer)) {
+        SYLAR_LOG_ERROR(g_logger) << "timer_create preempt timer errno="
+                                  << errno << " " << strerror(errno);
+        return;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval / 1000000000;
+    its.it_interval.tv_nsec = interval % 1000000000;
+    its.it_value = its.it_interval;
+    timer_settime(worker->preemptTimer, 0, &its, nullptr);
+    worker->hasPreemptTimer = true;
+}
+
+bool Scheduler::hasTask(SchedulerWorker* worker) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_workStealing) {
+        for (auto w : m_workers) {
+            if (!w->queue.empty()) {
+                return true;
+            }
+        }
+    }
+    if (m_globalCount == 0) {
+        return false;
+    }
+    MutexType::Lock lock(m_mutex);
+    for (auto& i : m_fibers) {
+        if (i.thread == -1 || i.thread == GetThreadId()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::run() {
+    SYLAR_LOG_DEBUG(g_logger) << m_name << " run";
+    setThis();
+    bool hook_enable = is_hook_enable();
+    set_hook_enable(g_scheduler_hook_enable->getValue());
+    SchedulerWorker* worker = nullptr;
+    if (GetThreadId() != m_rootThread) {
+        t_scheduler_fiber = Fiber::GetThis().get();
+        worker = m_workers[m_nextWorker++];
+    } else {
+        worker = m_workers.back();
+    }
+    worker->thread = GetThreadId();
+    t_worker = worker;
+    if (m_preemptSlice > 0) {
+        startPreemptTimer(worker);
+    }
+
+    Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
+    // idle协程只在本线程运行和引用
+    idle_fiber->setLocalRefCount(true);
+    Fiber::ptr cb_fiber;
+
+    FiberAndThread ft;
+    while (true) {
+        ft.reset();
+        bool has_exec = false;
+        flushPending();
+        // 取任务之前标记，stopping()不会看到任务已出队但线程还不活跃的中间状态
+        worker->active = true;
+        if (worker->pending.fiber || worker->pending.cb) {
+            ft = worker->pending;
+            worker->pending.reset();
+        } else {
+            nextTask(worker, ft, has_exec);
+        }
+
+        if (ft.fiber && (ft.fiber->getState() != Fiber::TERM &&
+                         ft.fiber->getState() != Fiber::EXCEPT)) {
+            Fiber* fiber = ft.fiber.get();
+            worker->current.swap(ft.fiber);
+            worker->currentThread = ft.thread;
+            ft.reset();
+            fiber->swapIn();
+            worker->active = false;
+            // 期间可能直接切换过多个协程，处理最后切换回来的那个
+            finishTask(worker->current, worker->currentThread,
+                       worker->currentState);
+        } else if (ft.cb) {
+            if (cb_fiber &&
+                cb_fiber->getStackSize() < Fiber::ChooseStackSize(ft.cb)) {
+                // 按入口选择栈大小时，复用的协程栈可能不够新任务使用
+                cb_fiber.reset();
+            }
+            if (cb_fiber) {
+                cb_fiber->reset(ft.cb);
+            } else {
+                cb_fiber = Fiber::Create(ft.cb);
+            }
+            ft.reset();
+            worker->current = cb_fiber;
+            worker->currentThread = -1;
+            cb_fiber->swapIn();
+            worker->active = false;
+            if (worker->current != cb_fiber) {
+                // cb_fiber在直接切换时已经处理过，不能复用
+                cb_fiber.reset();
+                finishTask(worker->current, worker->currentThread,
+                           worker->currentState);
+                continue;
+            }
+            Fiber::State state = worker->currentState;
+            worker->current.reset();
+            if (state == Fiber::EXCEPT || state == Fiber::TERM) {
+                cb_fiber->m_state = state;
+                cb_fiber->reset(nullptr);
+            } else {
+                // 让出的cb_fiber不再复用
+                finishTask(cb_fiber, -1, state);
+            }
+        } else {
+            worker->active = false;
+            if (has_exec) {
+                // 协程马上就会切换出来，不能睡眠
+                continue;
+            }
+            if (idle_fiber->getState() == Fiber::TERM) {
+                SYLAR_LOG_INFO(g_logger) << "idle fiber term";
+                // 唤醒下一个空闲线程退出
+                tickle();
+                break;
+            }
+
+            // 先读epoch再登记空闲并重新检查队列，
+            // 之后的tickle都会修改epoch，futex等待会立即返回，不会丢失唤醒
+            worker->epoch = m_parkEpoch;
+            worker->idle = true;
+            ++m_idleThreadCount;
+            if (hasTask(worker)) {
+                worker->idle = false;
+                --m_idleThreadCount;
+                continue;
+            }
+            idle_fiber->swapIn();
+            worker->idle = false;
+            --m_idleThreadCount;
+            if (idle_fiber->getState() != Fiber::TERM &&
+                idle_fiber->getState() != Fiber::EXCEPT) {
+                idle_fiber->m_state = Fiber::HOLD;
+            }
+        }
+    }
+    if (worker->hasPreemptTimer) {
+        timer_delete(worker->preemptTimer);
+        worker->hasPreemptTimer = false;
+    }
+    Fiber::t_preempt = false;
+    t_worker = nullptr;
+    set_hook_enable(hook_enable);
+}
+
+}  // namespace sylar
@@ -0,0 +1,400 @@
+/*
+ * @Author: lvxr
+ * @brief 协程调度器
+ */
+
+#ifndef __SYLAR_SCHEDULER_H__
+#define __SYLAR_SCHEDULER_H__
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fiber.h"
+#include "marco.h"
+#include "mutex.h"
+#include "thread.h"
+
+namespace sylar {
+
+struct SchedulerWorker;
+
+/**
+ * @brief: 协程调度器
+ * @details: N个线程运行M个协程(N:M)，协程可以在线程间切换，也可以绑定到指定线程执行；
+ *           调度器内部是一个线程池，工作线程从任务队列里取出协程或回调函数执行，
+ *           没有任务时切换到idle协程，基类的idle协程在futex上睡眠，
+ *           有新任务时由tickle唤醒一个空闲线程。
+ *           开启工作窃取(scheduler.work_stealing)时每个工作线程有自己的
+ *           Chase-Lev队列，工作线程里调度的任务放进自己的队列，后进先出地执行，
+ *           自己的队列为空时随机选择其他线程窃取；
+ *           指定线程的任务和外部线程提交的任务仍然放在加锁的全局队列里。
+ *           开启直接切换(scheduler.direct_switch)时任务协程让出后直接切换到下一个任务，
+ *           只有没有任务时才回到调度协程。
+ *           scheduler.preempt_slice_ms大于0时工作线程用线程CPU时钟定时，
+ *           任务协程连续运行超过时间片后在下一个抢占检查点(Fiber::CheckPreempt)让出，
+ *           排到全局队列末尾，避免长时间计算的任务拖慢后面的短任务。
+ *           use_caller为true时创建调度器的线程也作为工作线程，
+ *           它的调度协程(root fiber)在stop时运行，把剩余任务执行完
+ */
+class Scheduler {
+public:
+    typedef std::shared_ptr<Scheduler> ptr;
+    typedef Mutex MutexType;
+
+    /**
+     * @brief: 构造函数
+     * @param[in] {size_t} threads 线程数量
+     * @param[in] {bool} use_caller 是否把调用构造函数的线程纳入调度
+     * @param[in] {string&} name 调度器名称
+     */
+    Scheduler(size_t threads = 1, bool use_caller = true,
+              const std::string& name = "");
+
+    /**
+     * @brief: 析构函数
+     */
+    virtual ~Scheduler();
+
+    /**
+     * @brief: 返回工作线程数量，use_caller时包含调用线程
+     */
+    size_t getWorkerCount() const { return m_workers.size(); }
+
+    /**
+     * @brief: 返回调度器名称
+     */
+    const std::string& getName() const { return m_name; }
+
+    /**
+     * @brief: 返回当前线程所属的调度器
+     */
+    static Scheduler* GetThis();
+
+    /**
+     * @brief: 返回当前线程的调度协程，任务协程swapOut时回到这里
+     */
+    static Fiber* GetMainFiber();
+
+    /**
+     * @brief: 当前是否运行在调度器的任务协程中
+     * @details: 只有任务协程可以YieldToHold挂起，之后由其他人schedule重新调度；
+     *           调度协程、idle协程和线程的主协程不能这样挂起
+     */
+    static bool InTaskFiber();
+
+    /**
+     * @brief: 返回所有调度器的任务协程因为时间片用完而让出的次数
+     */
+    static uint64_t GetPreemptCount();
+
+    /**
+     * @brief: 启动工作线程
+     */
+    void start();
+
+    /**
+     * @brief: 停止调度器，等待所有任务执行完成后返回
+     */
+    void stop();
+
+    /**
+     * @brief: 调度一个协程或者回调函数
+     * @param[in] fc 协程或者回调函数
+     * @param[in] {int} thread 执行任务的线程id，-1表示任意线程
+     * @attention: 共享栈协程运行过之后只能在分配共享栈的线程上执行，
+     *             调度器自动把它固定到该线程，指定其他线程会断言失败
+     */
+    template <class FiberOrCb>
+    void schedule(FiberOrCb fc, int thread = -1) {
+        bool need_tickle = false;
+        thread = TaskThread(fc, thread);
+        if (thread == -1 && m_workStealing && isLocalWorker()) {
+            need_tickle = scheduleLocal(new FiberAndThread(fc, thread));
+        } else {
+            MutexType::Lock lock(m_mutex);
+            need_tickle = scheduleNoLock(fc, thread);
+        }
+        if (need_tickle) {
+            tickle(thread);
+        }
+    }
+
+    /**
+     * @brief: 批量调度协程或者回调函数
+     * @param[in] begin 任务数组的开始
+     * @param[in] end 任务数组的结束
+     */
+    template <class InputIterator>
+    void schedule(InputIterator begin, InputIterator end) {
+        size_t count = 0;
+        int pinned = -1;
+        {
+            MutexType::Lock lock(m_mutex);
+            while (begin != end) {
+                int thread = TaskThread(&*begin, -1);
+                if (scheduleNoLock(&*begin, thread)) {
+                    ++count;
+                    pinned = thread == -1 ? pinned : thread;
+                }
+                ++begin;
+            }
+        }
+        if (pinned != -1) {
+            // 有指定线程的任务时唤醒所有空闲线程
+            tickle(pinned);
+            return;
+        }
+        // 每次最多唤醒一个空闲线程
+        while (count--) {
+            tickle();
+        }
+    }
+
+protected:
+    /**
+     * @brief: 通知调度器有任务了，唤醒一个空闲线程
+     * @param[in] {int} thread 任务指定的线程id，-1表示任意线程
+     */
+    virtual void tickle(int thread = -1);
+
+    /**
+     * @brief: 调度循环，每个工作线程都运行它
+     */
+    void run();
+
+    /**
+     * @brief: 是否可以停止
+     */
+    virtual bool stopping();
+
+    /**
+     * @brief: 没有任务时执行idle协程
+     */
+    virtual void idle();
+
+    /**
+     * @brief: 工作线程取下一个任务之前调用，包括任务协程之间的直接切换
+     * @details: 子类在这里把本线程积攒的请求交出去，
+     *           不能等到没有任务、进入idle时才处理
+     */
+    virtual void flushPending() {}
+
+    /**
+     * @brief: 设置当前线程的调度器
+     */
+    void setThis();
+
+    /**
+     * @brief: 是否有空闲线程
+     */
+    bool hasIdleThreads() { return m_idleThreadCount > 0; }
+
+    /**
+     * @brief: 是否有线程正在执行任务
+     */
+    bool hasActiveThreads();
+
+    /**
+     * @brief: 是否开启了工作窃取
+     */
+    bool isWorkStealing() const { return m_workStealing; }
+
+    /**
+     * @brief: 返回当前线程的工作线程下标，不是本调度器的工作线程返回-1
+     */
+    int getWorkerIndex() const;
+
+    /**
+     * @brief: 返回一个空闲工作线程的下标
+     * @param[in] {int} thread 指定的线程id，-1表示任意线程
+     * @return: 没有符合条件的空闲线程返回-1
+     */
+    int getIdleWorker(int thread);
+
+private:
+    /**
+     * @brief: 返回任务实际要在哪个线程上执行
+     * @details: 已经分配了共享栈的协程固定在共享栈所属的线程上
+     */
+    template <class FiberOrCb>
+    static int TaskThread(const FiberOrCb&, int thread) {
+        return thread;
+    }
+    static int TaskThread(const Fiber::ptr& fiber, int thread) {
+        if (!fiber || !fiber->isSharedStack() ||
+            fiber->getStackThread() == -1) {
+            return thread;
+        }
+        SYLAR_ASSERT2(thread == -1 || thread == fiber->getStackThread(),
+                      "shared stack fiber scheduled on another thread id="
+                          << fiber->getId());
+        return fiber->getStackThread();
+    }
+    static int TaskThread(Fiber::ptr* fiber, int thread) {
+        return TaskThread(*fiber, thread);
+    }
+
+    /**
+     * @brief: 无锁加入任务
+     * @return: 任务有效返回true
+     */
+    template <class FiberOrCb>
+    bool scheduleNoLock(FiberOrCb fc, int thread) {
+        FiberAndThread ft(fc, thread);
+        if (ft.fiber || ft.cb) {
+            m_fibers.push_back(ft);
+            ++m_globalCount;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    /**
+     * @brief: 任务，协程或回调函数
+     */
+    struct FiberAndThread {
+        Fiber::ptr fiber;
+        std::function<void()> cb;
+        // 线程id
+        int thread;
+
+        FiberAndThread(Fiber::ptr f, int thr) : fiber(f), thread(thr) {}
+
+        FiberAndThread(Fiber::ptr* f, int thr) : thread(thr) { fiber.swap(*f); }
+
+        FiberAndThread(std::function<void()> f, int thr) : cb(f), thread(thr) {}
+
+        FiberAndThread(std::function<void()>* f, int thr) : thread(thr) {
+            cb.swap(*f);
+        }
+
+        FiberAndThread() : thread(-1) {}
+
+        void reset() {
+            fiber = nullptr;
+            cb = nullptr;
+            thread = -1;
+        }
+    };
+
+    friend struct SchedulerWorker;
+    friend class Fiber;
+
+    /**
+     * @brief: 当前任务协程让出时，取下一个任务直接切换过去
+     * @param[in] {Fiber*} cur 正在让出的协程
+     * @param[in] {State} state cur让出后的状态，任务协程切换出来之前保持EXEC
+     * @return: 切换过去并且cur重新被调度回来时返回true，
+     *          没有任务或者不能直接切换时返回false，由调用者切换回调度协程
+     */
+    static bool SwitchToNext(Fiber* cur, Fiber::State state);
+
+    /**
+     * @brief: 协程恢复运行后，处理直接切换出去的上一个任务协程
+     */
+    static void FinishSwitch();
+
+    /**
+     * @brief: 时间片用完的任务协程在抢占检查点让出
+     * @details: 不在任务协程中、持有线程锁或者正在处理异常时不让出，
+     *           持有线程锁时保留标记，到下一个检查点再判断
+     * @return: 让出过返回true
+     */
+    static bool YieldPreempted();
+
+    /**
+     * @brief: 抢占定时器的信号处理函数，当前协程运行满一个时间片时设置抢占标记
+     */
+    static void OnPreemptTick(int sig);
+
+    /**
+     * @brief: 为当前工作线程创建抢占定时器
+     */
+    void startPreemptTimer(SchedulerWorker* worker);
+
+    /**
+     * @brief: 任务协程切换出来以后设置让出时的状态，READY的重新调度，其他的设置为HOLD
+     * @post: fiber被置空
+     */
+    void finishTask(Fiber::ptr& fiber, int thread, Fiber::State state);
+
+    /**
+     * @brief: 当前线程是否是本调度器的工作线程
+     */
+    bool isLocalWorker() const;
+
+    /**
+     * @brief: 把任务放进当前工作线程自己的队列
+     * @return: 任务有效返回true
+     */
+    bool scheduleLocal(FiberAndThread* ft);
+
+    /**
+     * @brief: 依次从自己的队列，全局队列，其他线程的队列取任务
+     * @param[out] ft 取到的任务
+     * @param[out] {bool&} has_exec 是否遇到了还没有切换出来的协程
+     * @return: 取到任务返回true
+     */
+    bool nextTask(SchedulerWorker* worker, FiberAndThread& ft, bool& has_exec);
+
+    /**
+     * @brief: 从全局队列取当前线程可以执行的任务
+     * @param[out] {bool&} more 取完后全局队列是否还有任务
+     */
+    bool takeGlobal(FiberAndThread& ft, bool& has_exec, bool& more);
+
+    /**
+     * @brief: 是否有当前线程可以执行的任务，登记为空闲后调用
+     */
+    bool hasTask(SchedulerWorker* worker);
+
+private:
+    MutexType m_mutex;
+    // 线程池
+    std::vector<Thread::ptr> m_threads;
+    // 全局任务队列
+    std::list<FiberAndThread> m_fibers;
+    // 全局任务队列长度，不加锁判断是否为空
+    std::atomic<size_t> m_globalCount{0};
+    // 工作线程，use_caller时最后一个属于调用线程
+    std::vector<SchedulerWorker*> m_workers;
+    // 下一个启动的工作线程的下标
+    std::atomic<size_t> m_nextWorker{0};
+    // 下一次查找空闲线程的起始下标，分散唤醒
+    std::atomic<size_t> m_nextIdle{0};
+    // 空闲线程在这里futex等待，tickle时加一
+    std::atomic<int> m_parkEpoch{0};
+    // 是否开启工作窃取，构造时读取配置
+    bool m_workStealing;
+    // 是否开启直接切换，构造时读取配置
+    bool m_directSwitch;
+    // 任务协程的时间片，毫秒，0表示不抢占，构造时读取配置
+    uint32_t m_preemptSlice;
+    // use_caller为true时有效，调用线程的调度协程
+    Fiber::ptr m_rootFiber;
+    // 调度器名称
+    std::string m_name;
+
+protected:
+    // 工作线程的线程id
+    std::vector<int> m_threadIds;
+    // 线程数量，不包含use_caller的调用线程
+    size_t m_threadCount = 0;
+    // 空闲线程数量
+    std::atomic<size_t> m_idleThreadCount{0};
+    // 是否正在停止
+    std::atomic<bool> m_stopping{true};
+    // 是否自动停止
+    std::atomic<bool> m_autoStop{false};
+    // use_caller为true时调用线程的id
+    int m_rootThread = 0;
+};
+
+}  // namespace sylar
+
+#endif
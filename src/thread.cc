@@ -33,6 +33,7 @@ Thread::Thread(std::function<void()> cb, const std::string& name)
             << "pthread_create thread fail, rt=" << rt << " name=" << name;
         throw std::logic_error("pthread_create error");
     }
+    m_semaphore.wait();
 }
 
 Thread::~Thread() {
@@ -64,6 +65,8 @@ void* Thread::run(void* arg) {
     // 转换所有权？避免竞态条件
     cb.swap(thread->m_cb);
 
+    thread->m_semaphore.notify();
+
     cb();
     return 0;
 }
@@ -11,6 +11,7 @@
 #include <memory>
 #include <string>
 
+#include "mutex.h"
 #include "noncopyable.h"
 
 namespace sylar {
@@ -82,6 +83,8 @@ private:
     std::function<void()> m_cb;
     // 线程名称
     std::string m_name;
+    // 等待线程启动，构造函数返回时线程id已经可用
+    Semaphore m_semaphore;
 };
 }  // namespace sylar
 #endif
\ No newline at end of file
@@ -0,0 +1,413 @@
+/*
+ * @Author: lvxr
+ * @brief 定时器，分层时间轮实现
+ */
+
+#include "timer.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "marco.h"
+#include "util.h"
+
+namespace sylar {
+
+// 时间轮层数
+static const int WHEEL_LEVELS = 4;
+// 每层槽位数的位数
+static const int WHEEL_BITS = 8;
+static const int WHEEL_SLOTS = 1 << WHEEL_BITS;
+static const uint64_t WHEEL_MASK = WHEEL_SLOTS - 1;
+// 能直接表示的最大间隔(约49天)，更远的定时器先放在最远的槽位，下放时重新计算
+static const uint64_t WHEEL_MAX = (1ull << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+
+/**
+ * @brief: 分层时间轮
+ * @details: 时刻以毫秒为单位(tick)，从TimerManager创建时开始计算。
+ *           第L层的槽位宽度是256^L个tick，定时器按照离current的距离选择层，
+ *           按照到期时刻的对应位选择槽位；current走到第L层槽位的起点时，
+ *           把这个槽位的定时器重新插入到下层
+ */
+struct TimerWheel {
+    typedef Mutex MutexType;
+
+    TimerWheel(int idx, uint64_t e) : index(idx), epoch(e) {
+        memset(slots, 0, sizeof(slots));
+        memset(bitmap, 0, sizeof(bitmap));
+    }
+
+    ~TimerWheel() {
+        for (int l = 0; l < WHEEL_LEVELS; ++l) {
+            for (int s = 0; s < WHEEL_SLOTS; ++s) {
+                Timer* t = slots[l][s];
+                while (t) {
+                    Timer* next = t->m_nextNode;
+                    t->m_level = -1;
+                    t->m_self.reset();
+                    t = next;
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief: 定时器到期的tick
+     */
+    uint64_t tickOf(Timer* t) const {
+        return t->m_next > epoch ? t->m_next - epoch : 0;
+    }
+
+    /**
+     * @brief: 插入定时器
+     * @return: 是否比所属线程正在等待的时刻更早
+     */
+    bool insert(Timer* t) {
+        uint64_t tick = std::max(tickOf(t), current);
+        uint64_t delta = tick - current;
+        if (delta > WHEEL_MAX) {
+            delta = WHEEL_MAX;
+            tick = current + WHEEL_MAX;
+        }
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1 &&
+               delta >= (1ull << ((level + 1) * WHEEL_BITS))) {
+            ++level;
+        }
+        int slot = (tick >> (level * WHEEL_BITS)) & WHEEL_MASK;
+
+        Timer*& head = slots[level][slot];
+        t->m_prevNode = nullptr;
+        t->m_nextNode = head;
+        if (head) {
+            head->m_prevNode = t;
+        }
+        head = t;
+        bitmap[level][slot >> 6] |= 1ull << (slot & 63);
+        t->m_level = level;
+        t->m_slot = slot;
+        ++count;
+
+        if (tick < waitUntil) {
+            waitUntil = tick;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief: 从槽位上摘下定时器，不释放m_self
+     */
+    void remove(Timer* t) {
+        SYLAR_ASSERT(t->m_level >= 0);
+        if (t->m_prevNode) {
+            t->m_prevNode->m_nextNode = t->m_nextNode;
+        } else {
+            Timer*& head = slots[t->m_level][t->m_slot];
+            head = t->m_nextNode;
+            if (!head) {
+                bitmap[t->m_level][t->m_slot >> 6] &=
+                    ~(1ull << (t->m_slot & 63));
+            }
+        }
+        if (t->m_nextNode) {
+            t->m_nextNode->m_prevNode = t->m_prevNode;
+        }
+        t->m_prevNode = t->m_nextNode = nullptr;
+        t->m_level = t->m_slot = -1;
+        --count;
+    }
+
+    /**
+     * @brief: 第level层从from开始第一个非空槽位，没有返回-1
+     */
+    int findSlot(int level, int from) const {
+        for (int w = from >> 6; w < WHEEL_SLOTS / 64; ++w) {
+            uint64_t bits = bitmap[level][w];
+            if (w == from >> 6) {
+                bits &= ~0ull << (from & 63);
+            }
+            if (bits) {
+                return (w << 6) + __builtin_ctzll(bits);
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * @brief: 把第level层slot槽位的定时器重新插入
+     */
+    void cascade(int level, int slot) {
+        Timer* t = slots[level][slot];
+        while (t) {
+            Timer* next = t->m_nextNode;
+            remove(t);
+            insert(t);
+            t = next;
+        }
+    }
+
+    /**
+     * @brief: 推进到now(包括now)，到期的定时器连同m_self放到expired
+     */
+    void advance(uint64_t now, std::vector<Timer::ptr>& expired) {
+        if (!count) {
+            current = std::max(current, now + 1);
+            return;
+        }
+        std::vector<Timer*> later;
+        while (current <= now) {
+            if (!(current & WHEEL_MASK)) {
+                // 从高层往低层下放，下放的定时器都以current为基准重新选择层
+                for (int l = WHEEL_LEVELS - 1; l > 0; --l) {
+                    uint64_t unit_mask = (1ull << (l * WHEEL_BITS)) - 1;
+                    if (!(current & unit_mask)) {
+                        cascade(l, (current >> (l * WHEEL_BITS)) & WHEEL_MASK);
+                    }
+                }
+            }
+
+            int idx = current & WHEEL_MASK;
+            Timer* t = slots[0][idx];
+            while (t) {
+                Timer* next = t->m_nextNode;
+                remove(t);
+                if (tickOf(t) > current) {
+                    // 超过WHEEL_MAX被截断的定时器
+                    later.push_back(t);
+                } else {
+                    expired.push_back(Timer::ptr());
+                    expired.back().swap(t->m_self);
+                }
+                t = next;
+            }
+
+            // 跳过第0层的空槽位，但不能越过下一次下放
+            uint64_t next = current + 1;
+            if (next & WHEEL_MASK) {
+                int s = findSlot(0, next & WHEEL_MASK);
+                next = s < 0 ? (current | WHEEL_MASK) + 1
+                             : (current & ~WHEEL_MASK) + s;
+            }
+            current = std::min(next, now + 1);
+        }
+        for (auto t : later) {
+            insert(t);
+        }
+    }
+
+    /**
+     * @brief: 需要醒来的最早时刻，没有定时器返回~0ull
+     * @details: 第0层是准确的到期时刻，上层取槽位的下放时刻
+     */
+    uint64_t nextTick() const {
+        if (!count) {
+            return ~0ull;
+        }
+        uint64_t best = ~0ull;
+        for (int l = 0; l < WHEEL_LEVELS; ++l) {
+            int shift = l * WHEEL_BITS;
+            // 第一个还没有处理的槽位
+            uint64_t u = (current + (1ull << shift) - 1) >> shift;
+            int from = u & WHEEL_MASK;
+            int s = findSlot(l, from);
+            int dist = 0;
+            if (s >= 0) {
+                dist = s - from;
+            } else {
+                s = findSlot(l, 0);
+                if (s < 0) {
+                    continue;
+                }
+                dist = s + WHEEL_SLOTS - from;
+            }
+            best = std::min(best, (u + dist) << shift);
+        }
+        return best;
+    }
+
+    // 在TimerManager中的下标
+    int index;
+    // 零点(单调时钟毫秒)
+    uint64_t epoch;
+    MutexType mutex;
+    // 下一个还没有处理的tick
+    uint64_t current = 0;
+    // 所属线程正在等待到的tick，比它早的定时器需要唤醒所属线程
+    uint64_t waitUntil = ~0ull;
+    // 定时器数量
+    size_t count = 0;
+    // 槽位链表
+    Timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    // 非空槽位
+    uint64_t bitmap[WHEEL_LEVELS][WHEEL_SLOTS / 64];
+};
+
+Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring,
+             TimerManager* manager)
+    : m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager) {
+    m_next = GetCurrentMS() + m_ms;
+}
+
+bool Timer::cancel() {
+    // 在锁外释放自己
+    Timer::ptr self;
+    TimerWheel::MutexType::Lock lock(m_wheel->mutex);
+    if (m_cb) {
+        m_cb = nullptr;
+        if (m_level >= 0) {
+            m_wheel->remove(this);
+            self.swap(m_self);
+        }
+        return true;
+    }
+    return false;
+}
+
+bool Timer::refresh() {
+    TimerWheel::MutexType::Lock lock(m_wheel->mutex);
+    if (!m_cb || m_level < 0) {
+        return false;
+    }
+    m_wheel->remove(this);
+    m_next = GetCurrentMS() + m_ms;
+    // 只会变晚，不需要通知
+    m_wheel->insert(this);
+    return true;
+}
+
+bool Timer::reset(uint64_t ms, bool from_now) {
+    if (ms == m_ms && !from_now) {
+        return true;
+    }
+    bool at_front = false;
+    {
+        TimerWheel::MutexType::Lock lock(m_wheel->mutex);
+        if (!m_cb || m_level < 0) {
+            return false;
+        }
+        m_wheel->remove(this);
+        uint64_t start = from_now ? GetCurrentMS() : m_next - m_ms;
+        m_ms = ms;
+        m_next = start + m_ms;
+        at_front = m_wheel->insert(this);
+    }
+    if (at_front) {
+        m_manager->onTimerInsertedAtFront(m_wheel->index);
+    }
+    return true;
+}
+
+TimerManager::TimerManager(size_t wheels) {
+    m_epoch = GetCurrentMS();
+    for (size_t i = 0; i <= wheels; ++i) {
+        m_wheels.push_back(new TimerWheel(i, m_epoch));
+    }
+}
+
+TimerManager::~TimerManager() {
+    for (auto w : m_wheels) {
+        delete w;
+    }
+}
+
+TimerWheel* TimerManager::getWheel() {
+    int idx = getTimerWheel();
+    if (idx < 0 || idx >= (int)m_wheels.size() - 1) {
+        return m_wheels.back();
+    }
+    return m_wheels[idx];
+}
+
+Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb,
+                                  bool recurring) {
+    Timer::ptr timer(new Timer(ms, cb, recurring, this));
+    addTimer(timer);
+    return timer;
+}
+
+void TimerManager::addTimer(Timer::ptr val) {
+    TimerWheel* wheel = getWheel();
+    val->m_wheel = wheel;
+    bool at_front = false;
+    {
+        TimerWheel::MutexType::Lock lock(wheel->mutex);
+        val->m_self = val;
+        at_front = wheel->insert(val.get());
+    }
+    if (at_front) {
+        onTimerInsertedAtFront(wheel->index);
+    }
+}
+
+static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
+    std::shared_ptr<void> tmp = weak_cond.lock();
+    if (tmp) {
+        cb();
+    }
+}
+
+Timer::ptr TimerManager::addConditionTimer(uint64_t ms,
+                                           std::function<void()> cb,
+                                           std::weak_ptr<void> weak_cond,
+                                           bool recurring) {
+    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+}
+
+uint64_t TimerManager::getNextTimer() {
+    uint64_t now = GetCurrentMS() - m_epoch;
+    uint64_t next = ~0ull;
+    TimerWheel* own = getWheel();
+    for (TimerWheel* wheel : {own, m_wheels.back()}) {
+        TimerWheel::MutexType::Lock lock(wheel->mutex);
+        // 记录等待到的时刻，更早的定时器插入时才需要唤醒
+        wheel->waitUntil = wheel->nextTick();
+        next = std::min(next, wheel->waitUntil);
+        if (wheel == m_wheels.back()) {
+            break;
+        }
+    }
+    if (next == ~0ull) {
+        return ~0ull;
+    }
+    return next > now ? next - now : 0;
+}
+
+void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
+    uint64_t now_ms = GetCurrentMS();
+    uint64_t now = now_ms - m_epoch;
+    TimerWheel* own = getWheel();
+    for (TimerWheel* wheel : {own, m_wheels.back()}) {
+        // 非循环定时器在锁外释放
+        std::vector<Timer::ptr> expired;
+        TimerWheel::MutexType::Lock lock(wheel->mutex);
+        wheel->advance(now, expired);
+        for (auto& timer : expired) {
+            if (timer->m_recurring) {
+                cbs.push_back(timer->m_cb);
+                timer->m_next = now_ms + timer->m_ms;
+                timer->m_self = timer;
+                wheel->insert(timer.get());
+            } else {
+                cbs.push_back(nullptr);
+                cbs.back().swap(timer->m_cb);
+            }
+        }
+        if (wheel == m_wheels.back()) {
+            break;
+        }
+    }
+}
+
+bool TimerManager::hasTimer() {
+    for (auto wheel : m_wheels) {
+        TimerWheel::MutexType::Lock lock(wheel->mutex);
+        if (wheel->count) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace sylar
@@ -0,0 +1,173 @@
+/*
+ * @Author: lvxr
+ * @brief 定时器，分层时间轮实现
+ */
+
+#ifndef __SYLAR_TIMER_H__
+#define __SYLAR_TIMER_H__
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "mutex.h"
+
+namespace sylar {
+
+class TimerManager;
+struct TimerWheel;
+
+/**
+ * @brief: 定时器
+ */
+class Timer : public std::enable_shared_from_this<Timer> {
+    friend class TimerManager;
+    friend struct TimerWheel;
+
+public:
+    typedef std::shared_ptr<Timer> ptr;
+
+    /**
+     * @brief: 取消定时器
+     * @return: 定时器已经触发(非循环)或者已经取消时返回false
+     */
+    bool cancel();
+
+    /**
+     * @brief: 以当前时间为起点重新计时
+     */
+    bool refresh();
+
+    /**
+     * @brief: 重新设置定时器的时间
+     * @param[in] {uint64_t} ms 新的间隔(毫秒)
+     * @param[in] {bool} from_now 是否从当前时间开始计算
+     */
+    bool reset(uint64_t ms, bool from_now);
+
+private:
+    /**
+     * @brief: 构造函数
+     * @param[in] {uint64_t} ms 间隔(毫秒)
+     * @param[in] cb 回调函数
+     * @param[in] {bool} recurring 是否循环
+     * @param[in] manager 所属的定时器管理器
+     */
+    Timer(uint64_t ms, std::function<void()> cb, bool recurring,
+          TimerManager* manager);
+
+private:
+    // 是否循环
+    bool m_recurring = false;
+    // 间隔(毫秒)
+    uint64_t m_ms = 0;
+    // 到期时间(单调时钟毫秒)
+    uint64_t m_next = 0;
+    // 回调函数，为空表示已经取消或者已经触发
+    std::function<void()> m_cb;
+    TimerManager* m_manager = nullptr;
+
+    // 所在的时间轮，创建后不变
+    TimerWheel* m_wheel = nullptr;
+    // 时间轮槽位链表
+    Timer* m_prevNode = nullptr;
+    Timer* m_nextNode = nullptr;
+    // 所在的层和槽位，不在时间轮上时为-1
+    int m_level = -1;
+    int m_slot = -1;
+    // 在时间轮上时持有自己，保证回调触发前不被释放
+    Timer::ptr m_self;
+};
+
+/**
+ * @brief: 定时器管理器
+ * @details: 每个时间轮分4层，每层256个槽位，第0层精度1毫秒，
+ *           上层槽位到期时把定时器下放到下层(cascade)，添加和取消都是O(1)；
+ *           每层用位图记录非空槽位，getNextTimer不需要遍历定时器。
+ *           可以有多个时间轮：子类通过getTimerWheel把定时器放到当前工作线程自己的时间轮上，
+ *           只有本线程在空闲时推进自己的时间轮，避免线程之间竞争同一把锁；
+ *           不属于任何工作线程的定时器放在共享的时间轮上，所有线程都会推进
+ */
+class TimerManager {
+    friend class Timer;
+
+public:
+    /**
+     * @brief: 构造函数
+     * @param[in] {size_t} wheels 私有时间轮的数量(一般是工作线程数)，另外总有一个共享时间轮
+     */
+    explicit TimerManager(size_t wheels = 0);
+
+    /**
+     * @brief: 析构函数
+     */
+    virtual ~TimerManager();
+
+    /**
+     * @brief: 添加定时器
+     * @param[in] {uint64_t} ms 间隔(毫秒)
+     * @param[in] cb 回调函数
+     * @param[in] {bool} recurring 是否循环
+     */
+    Timer::ptr addTimer(uint64_t ms, std::function<void()> cb,
+                        bool recurring = false);
+
+    /**
+     * @brief: 添加条件定时器，触发时weak_cond指向的对象已经释放则不执行回调
+     */
+    Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb,
+                                 std::weak_ptr<void> weak_cond,
+                                 bool recurring = false);
+
+    /**
+     * @brief: 当前线程的时间轮和共享时间轮上最近一个定时器还有多久到期
+     * @return: 毫秒数，没有定时器时返回~0ull
+     * @details: 上层槽位的定时器以下放时间作为到期时间，返回值不会晚于真正的到期时间
+     */
+    uint64_t getNextTimer();
+
+    /**
+     * @brief: 推进当前线程的时间轮和共享时间轮，取出到期的回调
+     */
+    void listExpiredCb(std::vector<std::function<void()> >& cbs);
+
+    /**
+     * @brief: 是否还有定时器
+     */
+    bool hasTimer();
+
+protected:
+    /**
+     * @brief: 添加的定时器比时间轮所属线程正在等待的时间更早
+     * @param[in] {int} wheel 时间轮下标，等于私有时间轮数量时是共享时间轮
+     */
+    virtual void onTimerInsertedAtFront(int wheel) = 0;
+
+    /**
+     * @brief: 当前线程使用的时间轮下标，-1表示共享时间轮
+     */
+    virtual int getTimerWheel() { return -1; }
+
+private:
+    /**
+     * @brief: 把定时器放到当前线程使用的时间轮上，比所属线程的等待时间早时通知它
+     */
+    void addTimer(Timer::ptr val);
+
+    /**
+     * @brief: 返回当前线程使用的时间轮
+     */
+    TimerWheel* getWheel();
+
+private:
+    // 私有时间轮，最后一个是共享时间轮
+    std::vector<TimerWheel*> m_wheels;
+    // 时间轮的零点(单调时钟毫秒)
+    uint64_t m_epoch = 0;
+};
+
+}  // namespace sylar
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * @Author: lvxr
+ * @brief io_uring封装
+ */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "log.h"
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+IOUring::~IOUring() {
+    if (m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if (m_cqRing && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if (m_sqRing) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool IOUring::init(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    m_fd = syscall(SYS_io_uring_setup, entries, &p);
+    if (m_fd < 0) {
+        SYLAR_LOG_WARN(g_logger) << "io_uring_setup(" << entries
+                                 << ") errno=" << errno << " errstr="
+                                 << strerror(errno);
+        return false;
+    }
+    // 等待完成事件时需要超时参数(5.11)
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        SYLAR_LOG_WARN(g_logger) << "io_uring without IORING_FEAT_EXT_ARG";
+        return false;
+    }
+
+    m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) {
+        m_sqRing = nullptr;
+        SYLAR_LOG_WARN(g_logger) << "io_uring mmap sq ring errno=" << errno;
+        return false;
+    }
+    if (single_mmap) {
+        m_cqRing = m_sqRing;
+    } else {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) {
+            m_cqRing = nullptr;
+            SYLAR_LOG_WARN(g_logger) << "io_uring mmap cq ring errno=" << errno;
+            return false;
+        }
+    }
+    m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        SYLAR_LOG_WARN(g_logger) << "io_uring mmap sqes errno=" << errno;
+        return false;
+    }
+    m_sqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)m_sqRing;
+    m_sqHead = (unsigned*)(sq + p.sq_off.head);
+    m_sqTail = (unsigned*)(sq + p.sq_off.tail);
+    m_sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    m_sqEntries = *(unsigned*)(sq + p.sq_off.ring_entries);
+    m_sqArray = (unsigned*)(sq + p.sq_off.array);
+    m_sqeTail = *m_sqTail;
+    // SQE数组和SQ环一一对应
+    for (unsigned i = 0; i < m_sqEntries; ++i) {
+        m_sqArray[i] = i;
+    }
+
+    char* cq = (char*)m_cqRing;
+    m_cqHead = (unsigned*)(cq + p.cq_off.head);
+    m_cqTail = (unsigned*)(cq + p.cq_off.tail);
+    m_cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    return true;
+}
+
+io_uring_sqe* IOUring::getSqe() {
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (m_sqeTail - head >= m_sqEntries) {
+        return nullptr;
+    }
+    io_uring_sqe* sqe = &m_sqes[m_sqeTail & m_sqMask];
+    ++m_sqeTail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void IOUring::flush() {
+    __atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+}
+
+unsigned IOUring::getPending() const {
+    return m_sqeTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+}
+
+int IOUring::enter(unsigned to_submit, unsigned wait_nr, unsigned flags,
+                   void* arg, size_t argsz) {
+    return syscall(SYS_io_uring_enter, m_fd, to_submit, wait_nr, flags, arg,
+                   argsz);
+}
+
+int IOUring::submit() {
+    flush();
+    unsigned to_submit = getPending();
+    if (!to_submit) {
+        return 0;
+    }
+    return enter(to_submit, 0, 0, nullptr, 0);
+}
+
+int IOUring::submitAndWait(unsigned wait_nr, uint64_t timeout_ms) {
+    flush();
+    __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)&ts;
+    return enter(getPending(), wait_nr,
+                 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                 sizeof(arg));
+}
+
+unsigned IOUring::peekCqes(io_uring_cqe** cqes, unsigned count) {
+    // head只有自己修改
+    unsigned head = *m_cqHead;
+    unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    unsigned n = std::min(tail - head, count);
+    for (unsigned i = 0; i < n; ++i) {
+        cqes[i] = &m_cqes[(head + i) & m_cqMask];
+    }
+    return n;
+}
+
+void IOUring::advance(unsigned count) {
+    __atomic_store_n(m_cqHead, *m_cqHead + count, __ATOMIC_RELEASE);
+}
+
+}  // namespace sylar
@@ -0,0 +1,128 @@
+/*
+ * @Author: lvxr
+ * @brief io_uring封装
+ */
+
+#ifndef __SYLAR_URING_H__
+#define __SYLAR_URING_H__
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief: io_uring实例
+ * @details: 直接使用io_uring_setup/io_uring_enter系统调用和mmap出来的SQ/CQ环，不依赖liburing。
+ *           不是线程安全的，只能由一个线程使用；
+ *           getSqe拿到的请求在submit或submitAndWait时才批量提交给内核
+ */
+class IOUring : Noncopyable {
+public:
+    /**
+     * @brief: 构造函数，需要再调用init
+     */
+    IOUring() {}
+
+    /**
+     * @brief: 析构函数，关闭io_uring，未完成的请求由内核取消
+     */
+    ~IOUring();
+
+    /**
+     * @brief: 创建io_uring
+     * @param[in] {unsigned} entries SQ大小
+     * @return: 内核不支持或者被禁用时返回false
+     */
+    bool init(unsigned entries);
+
+    /**
+     * @brief: 返回一个空闲的SQE
+     * @return: SQ已满时返回nullptr
+     */
+    io_uring_sqe* getSqe();
+
+    /**
+     * @brief: 提交所有待提交的SQE，不等待完成
+     * @return: 提交的数量，失败返回-1并设置errno
+     */
+    int submit();
+
+    /**
+     * @brief: 提交所有待提交的SQE，并等待完成事件
+     * @param[in] {unsigned} wait_nr 至少等待的完成事件数量
+     * @param[in] {uint64_t} timeout_ms 超时时间(毫秒)
+     * @return: 提交的数量，失败返回-1并设置errno，超时errno为ETIME
+     */
+    int submitAndWait(unsigned wait_nr, uint64_t timeout_ms);
+
+    /**
+     * @brief: 取出已完成的CQE，处理完需要调用advance
+     * @param[out] cqes 存放CQE指针
+     * @param[in] {unsigned} count cqes的大小
+     * @return: 取到的数量
+     */
+    unsigned peekCqes(io_uring_cqe** cqes, unsigned count);
+
+    /**
+     * @brief: 标记count个CQE已处理
+     */
+    void advance(unsigned count);
+
+    /**
+     * @brief: 返回还没有提交给内核的SQE数量
+     */
+    unsigned getPending() const;
+
+    /**
+     * @brief: 返回SQ中空闲的位置数量
+     */
+    unsigned getFree() const { return m_sqEntries - getPending(); }
+
+    int getFd() const { return m_fd; }
+
+private:
+    /**
+     * @brief: 把本地的SQ尾指针发布给内核
+     */
+    void flush();
+
+    /**
+     * @brief: io_uring_enter系统调用
+     */
+    int enter(unsigned to_submit, unsigned wait_nr, unsigned flags, void* arg,
+              size_t argsz);
+
+private:
+    int m_fd = -1;
+
+    // SQ环
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    // 本地尾指针，包括还没有发布给内核的SQE
+    unsigned m_sqeTail = 0;
+    io_uring_sqe* m_sqes = nullptr;
+
+    // CQ环
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+
+    // mmap的区域
+    void* m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    void* m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    size_t m_sqesSize = 0;
+};
+
+}  // namespace sylar
+
+#endif
@@ -5,6 +5,10 @@
  */
 #include "util.h"
 
+#include <dirent.h>
+#include <string.h>
+#include <time.h>
+
 namespace sylar {
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
@@ -13,6 +17,18 @@ pid_t GetThreadId() { return syscall(SYS_gettid); }
 
 uint32_t GetFiberId() { return 0; }
 
+uint64_t GetCurrentMS() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
+uint64_t GetCurrentUS() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+}
+
 void Backtrace(std::vector<std::string>& bt, int size, int skip) {
     void** array = (void**)malloc((sizeof(void*) * size));
 
@@ -47,4 +63,38 @@ std::string BacktraceToString(int size, int skip, const std::string& prefix) {
     return ss.str();
 }
 
+void FSUtil::ListAllFile(std::vector<std::string>& files,
+                         const std::string& path, const std::string& subfix) {
+    if (access(path.c_str(), 0) != 0) {
+        return;
+    }
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+    struct dirent* dp = nullptr;
+    while ((dp = readdir(dir)) != nullptr) {
+        if (dp->d_type == DT_DIR) {
+            if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) {
+                continue;
+            }
+            ListAllFile(files, path + "/" + dp->d_name, subfix);
+        } else if (dp->d_type == DT_REG) {
+            std::string filename(dp->d_name);
+            if (subfix.empty()) {
+                files.push_back(path + "/" + filename);
+            } else {
+                if (filename.size() < subfix.size()) {
+                    continue;
+                }
+                if (filename.substr(filename.length() - subfix.size()) ==
+                    subfix) {
+                    files.push_back(path + "/" + filename);
+                }
+            }
+        }
+    }
+    closedir(dir);
+}
+
 }  // namespace sylar
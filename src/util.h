@@ -33,6 +33,16 @@ pid_t GetThreadId();
  */
 uint32_t GetFiberId();
 
+/**
+ * @brief: 返回单调时钟的毫秒数
+ */
+uint64_t GetCurrentMS();
+
+/**
+ * @brief: 返回单调时钟的微秒数
+ */
+uint64_t GetCurrentUS();
+
 /**
  * @brief 获取当前的调用栈
  * @param[out] bt 保存调用栈
@@ -65,5 +75,21 @@ const char* TypeToName() {
     return s_name;
 }
 
+/**
+ * @brief 文件系统工具类
+ */
+class FSUtil {
+public:
+    /**
+     * @brief 递归列出目录下所有指定后缀的文件
+     * @param[out] files 文件路径
+     * @param[in] path 目录
+     * @param[in] subfix 文件后缀,为空时列出所有文件
+     */
+    static void ListAllFile(std::vector<std::string>& files,
+                            const std::string& path,
+                            const std::string& subfix);
+};
+
 }  // namespace sylar
 #endif
\ No newline at end of file
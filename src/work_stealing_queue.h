@@ -0,0 +1,179 @@
+/*
+ * @Author: lvxr
+ * @brief Chase-Lev无锁工作窃取队列
+ */
+
+#ifndef __SYLAR_WORK_STEALING_QUEUE_H__
+#define __SYLAR_WORK_STEALING_QUEUE_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief: Chase-Lev工作窃取双端队列
+ * @details: 只有所属线程调用push和pop，在bottom端后进先出，刚加入的任务数据还在缓存里；
+ *           其他线程调用steal从top端先进先出地窃取。
+ *           内存序参照Lê等人的《Correct and Efficient Work-Stealing for Weak
+ *           Memory Models》；扩容后旧数组可能还在被窃取线程读取，析构时才释放
+ * @tparam T 元素类型，需要是可以原子读写的平凡类型(一般是指针)
+ */
+template <class T>
+class WorkStealingQueue : Noncopyable {
+private:
+    /**
+     * @brief: 环形数组
+     */
+    struct Array {
+        explicit Array(int64_t c)
+            : capacity(c), mask(c - 1), data(new std::atomic<T>[c]) {}
+
+        ~Array() { delete[] data; }
+
+        T get(int64_t i) const {
+            return data[i & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, T x) {
+            data[i & mask].store(x, std::memory_order_relaxed);
+        }
+
+        // 容量，2的幂
+        int64_t capacity;
+        int64_t mask;
+        std::atomic<T>* data;
+    };
+
+public:
+    /**
+     * @brief: 构造函数
+     * @param[in] {int64_t} capacity 初始容量，必须是2的幂
+     */
+    explicit WorkStealingQueue(int64_t capacity = 256)
+        : m_array(new Array(capacity)) {}
+
+    /**
+     * @brief: 析构函数
+     */
+    ~WorkStealingQueue() {
+        for (auto a : m_garbage) {
+            delete a;
+        }
+        delete m_array.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief: 在bottom端加入元素，只能由所属线程调用
+     */
+    void push(T x) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array* a = m_array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            a = resize(a, b, t);
+        }
+        a->put(b, x);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief: 从bottom端取出元素，只能由所属线程调用
+     * @return: 队列为空或者最后一个元素被窃取时返回false，此时不修改x
+     */
+    bool pop(T& x) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        if (t > b) {
+            // 队列为空
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        T v = a->get(b);
+        if (t == b) {
+            // 最后一个元素，和窃取线程竞争
+            bool ok = m_top.compare_exchange_strong(
+                t, t + 1, std::memory_order_seq_cst,
+                std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            if (!ok) {
+                return false;
+            }
+        }
+        x = v;
+        return true;
+    }
+
+    /**
+     * @brief: 从top端窃取元素，任意线程都可以调用
+     * @return: 队列为空或者竞争失败返回false，此时不修改x
+     */
+    bool steal(T& x) {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+        Array* a = m_array.load(std::memory_order_acquire);
+        T v = a->get(t);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                           std::memory_order_relaxed)) {
+            return false;
+        }
+        x = v;
+        return true;
+    }
+
+    /**
+     * @brief: 返回元素数量的近似值
+     */
+    size_t size() const {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+    /**
+     * @brief: 是否为空(近似值)
+     */
+    bool empty() const { return size() == 0; }
+
+private:
+    /**
+     * @brief: 容量翻倍，只有所属线程在push时调用
+     */
+    Array* resize(Array* a, int64_t b, int64_t t) {
+        Array* na = new Array(a->capacity * 2);
+        for (int64_t i = t; i != b; ++i) {
+            na->put(i, a->get(i));
+        }
+        m_garbage.push_back(a);
+        m_array.store(na, std::memory_order_release);
+        return na;
+    }
+
+private:
+    // 窃取端
+    std::atomic<int64_t> m_top{0};
+    // top和bottom分别被窃取线程和所属线程频繁修改，放在不同的缓存行
+    char m_pad[64 - sizeof(std::atomic<int64_t>)];
+    // 所属线程端
+    std::atomic<int64_t> m_bottom{0};
+    // 当前数组
+    std::atomic<Array*> m_array;
+    // 扩容前的旧数组
+    std::vector<Array*> m_garbage;
+};
+
+}  // namespace sylar
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ * @Author: lvxr
+ * @brief 通道测试
+ */
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "src/channel.h"
+#include "src/iomanager.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/scheduler.h"
+#include "src/thread.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+// 无缓冲通道在单线程里来回传递
+void test_unbuffered() {
+    SYLAR_LOG_INFO(g_logger) << "test_unbuffered begin";
+    static const int N = 10000;
+    sylar::Channel<int> ping;
+    sylar::Channel<int> pong;
+    int last = 0;
+    {
+        sylar::Scheduler sc(1, false, "unbuffered");
+        sc.start();
+        sc.schedule([&]() {
+            int v = 0;
+            while (ping.recv(v)) {
+                SYLAR_ASSERT(pong.send(v + 1));
+            }
+            pong.close();
+        });
+        sc.schedule([&]() {
+            int v = 0;
+            for (int i = 0; i < N; ++i) {
+                SYLAR_ASSERT(ping.send(std::move(v)));
+                SYLAR_ASSERT(pong.recv(v));
+            }
+            last = v;
+            ping.close();
+            SYLAR_ASSERT(!pong.recv(v));
+        });
+        sc.stop();
+    }
+    SYLAR_ASSERT(last == N);
+    SYLAR_LOG_INFO(g_logger) << "test_unbuffered end";
+}
+
+// 多个生产者多个消费者，最后一个生产者关闭通道
+void test_buffered(size_t capacity) {
+    SYLAR_LOG_INFO(g_logger) << "test_buffered begin capacity=" << capacity;
+    static const int PRODUCERS = 4;
+    static const int CONSUMERS = 4;
+    static const int N = 20000;
+    sylar::Channel<int> ch(capacity);
+    std::atomic<int> producers{PRODUCERS};
+    std::atomic<long> sum{0};
+    std::atomic<int> count{0};
+    {
+        sylar::Scheduler sc(4, false, "buffered");
+        sc.start();
+        for (int i = 0; i < CONSUMERS; ++i) {
+            sc.schedule([&]() {
+                int v = 0;
+                while (ch.recv(v)) {
+                    sum += v;
+                    ++count;
+                }
+            });
+        }
+        for (int i = 0; i < PRODUCERS; ++i) {
+            sc.schedule([&]() {
+                for (int j = 1; j <= N; ++j) {
+                    SYLAR_ASSERT(ch.send(j));
+                }
+                if (--producers == 0) {
+                    ch.close();
+                }
+            });
+        }
+        sc.stop();
+    }
+    SYLAR_ASSERT(count == PRODUCERS * N);
+    SYLAR_ASSERT(sum == (long)PRODUCERS * N * (N + 1) / 2);
+    SYLAR_LOG_INFO(g_logger) << "test_buffered end sum=" << sum;
+}
+
+// 单生产者单消费者，顺序不变
+void test_spsc() {
+    SYLAR_LOG_INFO(g_logger) << "test_spsc begin";
+    static const int N = 200000;
+    sylar::Channel<int> ch(64, true);
+    SYLAR_ASSERT(ch.isSpsc());
+    int received = 0;
+    {
+        sylar::Scheduler sc(2, false, "spsc");
+        sc.start();
+        sc.schedule([&]() {
+            int v = 0;
+            int expect = 0;
+            while (ch.recv(v)) {
+                SYLAR_ASSERT(v == expect++);
+            }
+            received = expect;
+        });
+        sc.schedule([&]() {
+            for (int i = 0; i < N; ++i) {
+                SYLAR_ASSERT(ch.send(i));
+            }
+            ch.close();
+        });
+        sc.stop();
+    }
+    SYLAR_ASSERT(received == N);
+    SYLAR_LOG_INFO(g_logger) << "test_spsc end";
+}
+
+// spsc通道由第三方close时，send返回true的值都能被接收到
+void test_spsc_close() {
+    SYLAR_LOG_INFO(g_logger) << "test_spsc_close begin";
+    static const int rounds = 200;
+    for (int i = 0; i < rounds; ++i) {
+        sylar::Channel<int> ch(4, true);
+        std::atomic<int> sent{0};
+        int received = 0;
+        sylar::Thread sender(
+            [&]() {
+                for (int v = 0; ch.send(v); ++v) {
+                    ++sent;
+                }
+            },
+            "sender");
+        sylar::Thread receiver(
+            [&]() {
+                int v = 0;
+                while (ch.recv(v)) {
+                    SYLAR_ASSERT(v == received++);
+                }
+            },
+            "receiver");
+        sylar::Thread closer([&]() { ch.close(); }, "closer");
+        closer.join();
+        sender.join();
+        receiver.join();
+        SYLAR_ASSERT(received == sent);
+    }
+    SYLAR_LOG_INFO(g_logger) << "test_spsc_close end";
+}
+
+void test_close() {
+    SYLAR_LOG_INFO(g_logger) << "test_close begin";
+    sylar::Channel<int> ch(4);
+    SYLAR_ASSERT(ch.send(1));
+    SYLAR_ASSERT(ch.send(2));
+    ch.close();
+    SYLAR_ASSERT(ch.isClosed());
+    SYLAR_ASSERT(!ch.send(3));
+    int v = 0;
+    SYLAR_ASSERT(ch.recv(v) && v == 1);
+    SYLAR_ASSERT(ch.recv(v) && v == 2);
+    SYLAR_ASSERT(!ch.recv(v));
+    SYLAR_ASSERT(!ch.tryRecv(v));
+
+    sylar::Channel<int> full(1);
+    SYLAR_ASSERT(full.trySend(1));
+    SYLAR_ASSERT(!full.trySend(2));
+    SYLAR_ASSERT(full.size() == 1);
+    SYLAR_LOG_INFO(g_logger) << "test_close end";
+}
+
+// 值只移动不拷贝
+void test_move_only() {
+    SYLAR_LOG_INFO(g_logger) << "test_move_only begin";
+    sylar::Channel<std::unique_ptr<int> > ch(2);
+    SYLAR_ASSERT(ch.send(std::unique_ptr<int>(new int(42))));
+    std::unique_ptr<int> p;
+    SYLAR_ASSERT(ch.recv(p) && *p == 42);
+
+    sylar::Channel<std::unique_ptr<int> > unbuffered;
+    sylar::Scheduler sc(2, false, "move");
+    sc.start();
+    sc.schedule([&]() {
+        for (int i = 0; i < 100; ++i) {
+            SYLAR_ASSERT(unbuffered.send(std::unique_ptr<int>(new int(i))));
+        }
+        unbuffered.close();
+    });
+    int expect = 0;
+    // 不在协程里时阻塞线程
+    while (unbuffered.recv(p)) {
+        SYLAR_ASSERT(*p == expect++);
+    }
+    sc.stop();
+    SYLAR_ASSERT(expect == 100);
+    SYLAR_LOG_INFO(g_logger) << "test_move_only end";
+}
+
+void test_select() {
+    SYLAR_LOG_INFO(g_logger) << "test_select begin";
+    static const int N = 1000;
+    sylar::Channel<int> ints;
+    sylar::Channel<std::string> strs(8);
+    sylar::Channel<int> done;
+    int int_count = 0;
+    int str_count = 0;
+    {
+        sylar::IOManager iom(2, false, "select");
+        iom.schedule([&]() {
+            for (int i = 0; i < N; ++i) {
+                SYLAR_ASSERT(ints.send(i));
+            }
+        });
+        iom.schedule([&]() {
+            for (int i = 0; i < N; ++i) {
+                SYLAR_ASSERT(strs.send(std::to_string(i)));
+            }
+        });
+        iom.schedule([&]() {
+            int i = 0;
+            std::string s;
+            int d = 0;
+            std::vector<sylar::SelectCase::ptr> cases = {
+                ints.recvCase(i), strs.recvCase(s), done.recvCase(d)};
+            while (int_count < N || str_count < N) {
+                int idx = sylar::Select(cases);
+                if (idx == 0) {
+                    SYLAR_ASSERT(i == int_count++);
+                } else if (idx == 1) {
+                    SYLAR_ASSERT(s == std::to_string(str_count++));
+                } else {
+                    SYLAR_ASSERT(false);
+                }
+            }
+
+            // 没有就绪的分支，超时返回-1
+            uint64_t start = sylar::GetCurrentMS();
+            SYLAR_ASSERT(sylar::Select(cases, 50) == -1);
+            uint64_t used = sylar::GetCurrentMS() - start;
+            SYLAR_ASSERT(used >= 50 && used < 500);
+            SYLAR_ASSERT(sylar::Select(cases, 0) == -1);
+
+            // 发送分支
+            sylar::IOManager::GetThis()->schedule([&]() {
+                int v = 0;
+                SYLAR_ASSERT(ints.recv(v) && v == 7);
+            });
+            std::vector<sylar::SelectCase::ptr> send_cases = {
+                ints.sendCase(7), done.recvCase(d)};
+            SYLAR_ASSERT(sylar::Select(send_cases, 1000) == 0);
+            SYLAR_ASSERT(send_cases[0]->ok());
+
+            // 关闭的通道让接收分支立即完成
+            done.close();
+            SYLAR_ASSERT(sylar::Select(cases) == 2);
+            SYLAR_ASSERT(!cases[2]->ok());
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "test_select end";
+}
+
+// 发送者数量:接收者数量
+void bench(int senders, int receivers, size_t capacity, bool spsc) {
+    static const int N = 200000;
+    sylar::Channel<int> ch(capacity, spsc);
+    std::atomic<int> remain{senders};
+    std::atomic<int> count{0};
+    uint64_t start = sylar::GetCurrentUS();
+    {
+        sylar::Scheduler sc(4, false, "bench");
+        sc.start();
+        for (int i = 0; i < receivers; ++i) {
+            sc.schedule([&]() {
+                int v = 0;
+                int n = 0;
+                while (ch.recv(v)) {
+                    ++n;
+                }
+                count += n;
+            });
+        }
+        for (int i = 0; i < senders; ++i) {
+            sc.schedule([&]() {
+                for (int j = 0; j < N / senders; ++j) {
+                    ch.send(j);
+                }
+                if (--remain == 0) {
+                    ch.close();
+                }
+            });
+        }
+        sc.stop();
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    SYLAR_ASSERT(count == N / senders * senders);
+    SYLAR_LOG_INFO(g_logger) << senders << ":" << receivers
+                             << " capacity=" << capacity << " spsc=" << spsc
+                             << " " << (uint64_t)(count * 1000000.0 / used)
+                             << " msg/s";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    test_unbuffered();
+    test_buffered(0);
+    test_buffered(16);
+    test_spsc();
+    test_spsc_close();
+    test_close();
+    test_move_only();
+    test_select();
+    bench(1, 1, 0, false);
+    bench(1, 1, 1024, false);
+    bench(1, 1, 1024, true);
+    bench(4, 1, 1024, false);
+    bench(1, 4, 1024, false);
+    return 0;
+}
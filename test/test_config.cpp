@@ -2,12 +2,20 @@
  * @Author: lvxr
  * @LastEditTime: 2024-05-11 19:35:27
  */
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include <yaml-cpp/yaml.h>
 
+#include <algorithm>
+#include <fstream>
 #include <vector>
 
 #include "../src/config.h"
+#include "../src/config_snapshot.h"
+#include "../src/env.h"
 #include "../src/log.h"
+#include "../src/marco.h"
 #include "../src/thread.h"
 
 sylar::ConfigVar<int>::ptr int_value =
@@ -230,6 +238,186 @@ void test_listener() {
     sylar::Config::LoadFromYaml(root);
 }
 
+void test_async_listener() {
+    sylar::ConfigVar<int>::ptr var =
+        sylar::Config::Lookup("test.async", (int)0, "async listener");
+    std::vector<std::pair<int, int>> changes;
+    var->addAsyncListener([&changes, var](const int& old_value,
+                                          const int& new_value) {
+        // 在分发线程中读取同一配置项不会死锁
+        var->getValue();
+        changes.push_back(std::make_pair(old_value, new_value));
+    });
+    for (int i = 1; i <= 100; ++i) {
+        var->setValue(i);
+    }
+    sylar::ConfigDispatcherMgr::GetInstance()->flush();
+    SYLAR_ASSERT(changes.size() == 100);
+    for (size_t i = 0; i < changes.size(); ++i) {
+        SYLAR_ASSERT(changes[i].first == (int)i);
+        SYLAR_ASSERT(changes[i].second == (int)i + 1);
+    }
+    SYLAR_LOG_INFO(SYLAR_LOG_ROOT())
+        << "async listener changes=" << changes.size();
+}
+
+void test_index() {
+    std::vector<sylar::ConfigVarBase::ptr> vars;
+    for (int i = 0; i < 1000; ++i) {
+        vars.push_back(sylar::Config::Lookup(
+            "test.index.key_" + std::to_string(i), i, "index"));
+    }
+    sylar::Config::RebuildIndex();
+    for (auto& v : vars) {
+        SYLAR_ASSERT(sylar::Config::LookupBase(v->getName()) == v);
+        SYLAR_ASSERT(sylar::Config::LookupById(v->getId()) == v);
+        // 已存在的配置项返回同一个对象
+        SYLAR_ASSERT(sylar::Config::Lookup(v->getName(), 0) == v);
+    }
+    SYLAR_ASSERT(!sylar::Config::LookupBase("test.index.not_exist"));
+    // 重建后新注册的配置项也可以查到
+    auto late = sylar::Config::Lookup("test.index.late", 1, "late");
+    SYLAR_ASSERT(sylar::Config::LookupBase("test.index.late") == late);
+    SYLAR_LOG_INFO(SYLAR_LOG_ROOT()) << "index lookup ok size=" << vars.size();
+}
+
+void test_snapshot() {
+    auto port = sylar::Config::Lookup("test.snapshot.port", 0, "port");
+    auto hosts = sylar::Config::Lookup("test.snapshot.hosts",
+                                       std::vector<std::string>(), "hosts");
+    std::string dir = "/tmp/sylar_test_snapshot";
+    system(("rm -rf " + dir + " && mkdir -p " + dir).c_str());
+    {
+        std::ofstream ofs(dir + "/server.yaml");
+        ofs << "test:\n  snapshot:\n    port: 8080\n    hosts: [a, b]\n";
+    }
+
+    std::vector<std::string> files;
+    sylar::FSUtil::ListAllFile(files, dir, ".yaml");
+    sylar::ConfigTree tree;
+    sylar::Config::Flatten(YAML::LoadFile(files[0]), tree, files[0]);
+    SYLAR_ASSERT(sylar::ConfigSnapshot::Write(
+        dir + "/" + sylar::ConfigSnapshot::FileName(), tree, files));
+
+    sylar::ConfigSnapshot snapshot;
+    SYLAR_ASSERT(snapshot.open(dir + "/" + sylar::ConfigSnapshot::FileName()));
+    SYLAR_ASSERT(snapshot.isFresh(files));
+    std::string value;
+    SYLAR_ASSERT(snapshot.find("test.snapshot.port", value) && value == "8080");
+    SYLAR_ASSERT(!snapshot.find("test.snapshot.none", value));
+
+    sylar::Config::LoadFromConfDir(dir);
+    SYLAR_ASSERT(port->getValue() == 8080);
+    SYLAR_ASSERT(hosts->getValue().size() == 2);
+
+    // 修改配置文件后快照过期，回退到解析YAML
+    sleep(1);
+    {
+        std::ofstream ofs(dir + "/server.yaml");
+        ofs << "test:\n  snapshot:\n    port: 9090\n";
+    }
+    SYLAR_ASSERT(!snapshot.isFresh(files));
+    sylar::Config::LoadFromConfDir(dir);
+    SYLAR_ASSERT(port->getValue() == 9090);
+
+    // 恢复出修改时间更旧的文件(cp -p, tar x)也视为过期
+    std::string snapshot_path = dir + "/" + sylar::ConfigSnapshot::FileName();
+    SYLAR_ASSERT(sylar::ConfigSnapshot::Write(snapshot_path, tree, files));
+    SYLAR_ASSERT(snapshot.open(snapshot_path) && snapshot.isFresh(files));
+    struct stat st;
+    SYLAR_ASSERT(stat(files[0].c_str(), &st) == 0);
+    {
+        std::ofstream ofs(dir + "/server.yaml");
+        ofs << "test:\n  snapshot:\n    port: 7070\n";
+    }
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    times[1].tv_sec -= 3600;
+    SYLAR_ASSERT(utimensat(AT_FDCWD, files[0].c_str(), times, 0) == 0);
+    SYLAR_ASSERT(!snapshot.isFresh(files));
+    sylar::Config::LoadFromConfDir(dir);
+    SYLAR_ASSERT(port->getValue() == 7070);
+
+    // 重命名改变合并顺序，修改时间不变，也视为过期
+    SYLAR_ASSERT(sylar::ConfigSnapshot::Write(snapshot_path, tree, files));
+    SYLAR_ASSERT(snapshot.open(snapshot_path) && snapshot.isFresh(files));
+    SYLAR_ASSERT(
+        rename(files[0].c_str(), (dir + "/zserver.yaml").c_str()) == 0);
+    files.clear();
+    sylar::FSUtil::ListAllFile(files, dir, ".yaml");
+    SYLAR_ASSERT(!snapshot.isFresh(files));
+    SYLAR_LOG_INFO(SYLAR_LOG_ROOT()) << "snapshot ok";
+}
+
+void test_conf_dir() {
+    auto a = sylar::Config::Lookup("test.dir.a", 0, "a");
+    auto b = sylar::Config::Lookup("test.dir.b", 0, "b");
+    std::string dir = "/tmp/sylar_test_conf_dir";
+    system(("rm -rf " + dir + " && mkdir -p " + dir + "/sub").c_str());
+    for (int i = 0; i < 32; ++i) {
+        std::ofstream ofs(dir + "/sub/file_" + std::to_string(100 + i) +
+                          ".yaml");
+        ofs << "test:\n  dir:\n    a: " << i << "\n";
+    }
+    {
+        std::ofstream ofs(dir + "/base.yaml");
+        ofs << "test:\n  dir:\n    a: -1\n    b: 7\n";
+    }
+
+    std::vector<std::string> files;
+    sylar::FSUtil::ListAllFile(files, dir, ".yaml");
+    std::sort(files.begin(), files.end());
+    std::vector<sylar::ConfigConflict> conflicts;
+    sylar::Config::LoadFromYamlFiles(files, &conflicts);
+    // 按路径字典序合并，最后一个文件生效
+    SYLAR_ASSERT(a->getValue() == 31);
+    SYLAR_ASSERT(b->getValue() == 7);
+    SYLAR_ASSERT(conflicts.size() == 32);
+    SYLAR_ASSERT(conflicts.back().key == "test.dir.a");
+    SYLAR_ASSERT(conflicts.back().override_origin ==
+                 dir + "/sub/file_131.yaml");
+    SYLAR_LOG_INFO(SYLAR_LOG_ROOT()) << "conf dir ok";
+}
+
+void test_overrides() {
+    auto a = sylar::Config::Lookup("test.layer.a", 0, "a");
+    auto b = sylar::Config::Lookup("test.layer.b", 0, "b");
+    auto c = sylar::Config::Lookup("test.layer.c", 0, "c");
+    std::string dir = "/tmp/sylar_test_layer";
+    system(("rm -rf " + dir + " && mkdir -p " + dir).c_str());
+    {
+        std::ofstream ofs(dir + "/layer.yaml");
+        ofs << "test:\n  layer:\n    a: 1\n    b: 2\n    c: 3\n";
+    }
+
+    // 命令行优先于环境变量，环境变量优先于配置文件
+    setenv("SYLAR_TEST_LAYER_A", "5", 1);
+    setenv("SYLAR_TEST_LAYER_B", "5", 1);
+    const char* argv[] = {"test_config", "-set", "test.layer.b=6"};
+    SYLAR_ASSERT(sylar::EnvMgr::GetInstance()->init(3, (char**)argv));
+    sylar::Config::LoadFromConfDir(dir);
+    SYLAR_ASSERT(a->getValue() == 5);
+    SYLAR_ASSERT(b->getValue() == 6);
+    SYLAR_ASSERT(c->getValue() == 3);
+
+    // 使用快照时同样生效
+    a->setValue(0);
+    b->setValue(0);
+    c->setValue(0);
+    std::vector<std::string> files;
+    sylar::FSUtil::ListAllFile(files, dir, ".yaml");
+    sylar::ConfigTree tree;
+    sylar::Config::ParseYamlFiles(files, tree);
+    sylar::ConfigSnapshot::Write(dir + "/" + sylar::ConfigSnapshot::FileName(),
+                                 tree, files);
+    sylar::Config::LoadFromConfDir(dir);
+    SYLAR_ASSERT(a->getValue() == 5);
+    SYLAR_ASSERT(b->getValue() == 6);
+    SYLAR_ASSERT(c->getValue() == 3);
+    unsetenv("SYLAR_TEST_LAYER_A");
+    unsetenv("SYLAR_TEST_LAYER_B");
+    SYLAR_LOG_INFO(SYLAR_LOG_ROOT()) << "overrides ok";
+}
+
 void test_log() {
     sylar::Logger::ptr system_log = SYLAR_LOG_NAME("system");
     SYLAR_LOG_INFO(system_log) << "hello system" << std::endl;
@@ -252,6 +440,11 @@ int main() {
     // test_config();
     // test_class();
     // test_listener();
+    test_async_listener();
+    test_index();
+    test_snapshot();
+    test_conf_dir();
+    test_overrides();
     test_log();
     return 0;
 }
\ No newline at end of file
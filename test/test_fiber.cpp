@@ -2,10 +2,18 @@
  * @Author: lvxr
  * @LastEditTime: 2024-05-30 22:09:03
  */
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <string>
 #include <vector>
 
 #include "src/fiber.h"
+#include "src/fiber_local.h"
 #include "src/log.h"
+#include "src/marco.h"
 #include "src/thread.h"
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
@@ -32,4 +40,254 @@ void test_fiber() {
     SYLAR_LOG_INFO(g_logger) << "main after end2";
 }
 
-int main() { test_fiber(); }
\ No newline at end of file
+// 侵入式引用计数：从裸指针重新构造的智能指针共享同一个计数
+void test_ref() {
+    sylar::Fiber::GetThis();
+    SYLAR_ASSERT(sylar::Fiber::GetThis()->isLocalRefCount());
+    sylar::Fiber* raw = nullptr;
+    sylar::Fiber::ptr fiber(new sylar::Fiber([&raw]() {
+        sylar::Fiber::ptr self = sylar::Fiber::GetThis();
+        SYLAR_ASSERT(self.get() == raw);
+        sylar::Fiber::YieldToHold();
+    }));
+    raw = fiber.get();
+    fiber->swapIn();
+    sylar::Fiber::ptr copy(raw);
+    SYLAR_ASSERT(copy == fiber);
+    fiber.reset();
+    // copy仍然持有协程
+    copy->swapIn();
+    SYLAR_ASSERT(copy->getState() == sylar::Fiber::TERM);
+    SYLAR_LOG_INFO(g_logger) << "test_ref ok";
+}
+
+struct LocalValue {
+    static int s_destroyed;
+    int value = -1;
+    ~LocalValue() { ++s_destroyed; }
+};
+int LocalValue::s_destroyed = 0;
+
+static sylar::FiberLocal<LocalValue> s_local;
+static sylar::FiberLocal<int> s_local_int;
+
+// 同一个线程里交替执行的协程各自有自己的值，协程结束时析构
+void test_fiber_local() {
+    sylar::Fiber::GetThis();
+    s_local->value = 100;
+    std::vector<sylar::Fiber::ptr> fibers;
+    for (int i = 0; i < 10; ++i) {
+        fibers.push_back(sylar::Fiber::ptr(new sylar::Fiber([i]() {
+            SYLAR_ASSERT(!s_local.has());
+            SYLAR_ASSERT(s_local->value == -1);
+            s_local->value = i;
+            s_local_int.set(i * 10);
+            sylar::Fiber::YieldToHold();
+            SYLAR_ASSERT(s_local->value == i);
+            SYLAR_ASSERT(*s_local_int == i * 10);
+        })));
+        fibers.back()->swapIn();
+    }
+    SYLAR_ASSERT(LocalValue::s_destroyed == 0);
+    for (auto& f : fibers) {
+        f->swapIn();
+    }
+    SYLAR_ASSERT(LocalValue::s_destroyed == 10);
+    // 线程主协程的值不受影响
+    SYLAR_ASSERT(s_local->value == 100);
+
+    static const int n = 10000000;
+    auto start = std::chrono::steady_clock::now();
+    // 编译屏障让每次循环都重新读取，与thread_local的读取方式一致
+    for (int i = 0; i < n; ++i) {
+        ++*s_local_int;
+        asm volatile("" ::: "memory");
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    static thread_local int t_value = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        ++t_value;
+        asm volatile("" ::: "memory");
+    }
+    auto tls_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    SYLAR_ASSERT(*s_local_int == n && t_value == n);
+    SYLAR_LOG_INFO(g_logger) << "fiber local " << (double)ns / n
+                             << " ns/access, thread_local "
+                             << (double)tls_ns / n << " ns/access";
+}
+
+void test_switch_cost() {
+    static const int n = 1000000;
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(new sylar::Fiber([]() {
+        for (int i = 0; i < n; ++i) {
+            sylar::Fiber::YieldToHold();
+        }
+    }));
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        fiber->swapIn();
+    }
+    fiber->swapIn();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    // 每次swapIn和YieldToHold各切换一次
+    SYLAR_LOG_INFO(g_logger)
+        << "switch cost " << ns / (2.0 * n) << " ns/switch sizeof(Fiber)="
+        << sizeof(sylar::Fiber);
+}
+
+static long rss_kb() {
+    long pages = 0, resident = 0;
+    std::ifstream ifs("/proc/self/statm");
+    ifs >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+void test_stack_churn() {
+    sylar::Fiber::GetThis();
+    const int rounds = 5;
+    const int n = 10000;
+    for (int r = 0; r < rounds; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<sylar::Fiber::ptr> fibers;
+        for (int i = 0; i < n; ++i) {
+            fibers.push_back(sylar::Fiber::ptr(new sylar::Fiber([]() {
+                // 使用一部分栈空间
+                char buf[16 * 1024];
+                memset(buf, 0, sizeof(buf));
+                sylar::Fiber::YieldToHold();
+            })));
+            fibers.back()->swapIn();
+        }
+        long peak = rss_kb();
+        for (auto& f : fibers) {
+            f->swapIn();
+        }
+        fibers.clear();
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+        SYLAR_LOG_INFO(g_logger)
+            << "stack churn round=" << r << " fibers/s=" << n * 1000000L / us
+            << " peak_rss_kb=" << peak << " rss_kb=" << rss_kb();
+    }
+}
+
+// 短任务从协程池复用已经结束的协程
+void test_pool() {
+    sylar::Fiber::GetThis();
+    static const int n = 100000;
+    for (int pooled = 0; pooled < 2; ++pooled) {
+        uint64_t hits = sylar::Fiber::GetPoolHits();
+        int count = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; ++i) {
+            auto cb = [&count]() { ++count; };
+            sylar::Fiber::ptr fiber =
+                pooled ? sylar::Fiber::Create(cb)
+                       : sylar::Fiber::ptr(new sylar::Fiber(cb));
+            fiber->swapIn();
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+        SYLAR_ASSERT(count == n);
+        if (pooled) {
+            // 除了第一次，之后都复用同一个协程
+            SYLAR_ASSERT(sylar::Fiber::GetPoolHits() - hits >= (uint64_t)n - 1);
+        }
+        SYLAR_LOG_INFO(g_logger)
+            << (pooled ? "Fiber::Create " : "new Fiber ") << ns / n
+            << " ns/fiber hits=" << sylar::Fiber::GetPoolHits()
+            << " misses=" << sylar::Fiber::GetPoolMisses();
+    }
+}
+
+void test_shared_stack() {
+    sylar::Fiber::GetThis();
+    const int n = 10000;
+    for (int shared = 0; shared < 2; ++shared) {
+        long before = rss_kb();
+        std::vector<sylar::Fiber::ptr> fibers;
+        int ok = 0;
+        for (int i = 0; i < n; ++i) {
+            fibers.push_back(sylar::Fiber::ptr(new sylar::Fiber(
+                [i, &ok]() {
+                    // 栈上的数据在被换出再换入后保持不变
+                    char buf[512];
+                    memset(buf, i & 0xff, sizeof(buf));
+                    sylar::Fiber::YieldToHold();
+                    if (buf[0] == (char)(i & 0xff) &&
+                        buf[sizeof(buf) - 1] == (char)(i & 0xff)) {
+                        ++ok;
+                    }
+                },
+                0, false, shared)));
+            fibers.back()->swapIn();
+        }
+        long idle = rss_kb() - before;
+        size_t saved = 0;
+        for (auto& f : fibers) {
+            saved += f->getSavedStackSize();
+            f->swapIn();
+        }
+        SYLAR_LOG_INFO(g_logger)
+            << "idle fibers=" << n << " shared_stack=" << shared
+            << " rss_growth_kb=" << idle << " saved_stack_kb=" << saved / 1024
+            << " ok=" << ok;
+        SYLAR_ASSERT(ok == n);
+    }
+}
+
+static size_t count_maps() {
+    std::ifstream ifs("/proc/self/maps");
+    std::string line;
+    size_t n = 0;
+    while (std::getline(ifs, line)) {
+        ++n;
+    }
+    return n;
+}
+
+// 线程退出时共享栈归还给空闲栈缓存，映射不会泄漏
+void test_shared_stack_thread_exit() {
+    const int n = 50;
+    size_t before = count_maps();
+    for (int i = 0; i < n; ++i) {
+        sylar::Thread::ptr thr(new sylar::Thread(
+            []() {
+                sylar::Fiber::GetThis();
+                sylar::Fiber::ptr fiber(new sylar::Fiber(
+                    []() { sylar::Fiber::YieldToHold(); }, 0, false, true));
+                fiber->swapIn();
+                fiber->swapIn();
+            },
+            "shared_" + std::to_string(i)));
+        thr->join();
+    }
+    size_t after = count_maps();
+    SYLAR_LOG_INFO(g_logger) << "shared stack threads=" << n
+                             << " maps before=" << before
+                             << " after=" << after;
+    SYLAR_ASSERT(after < before + 16);
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::INFO);
+    test_fiber();
+    test_ref();
+    test_fiber_local();
+    test_switch_cost();
+    test_stack_churn();
+    test_shared_stack();
+    test_shared_stack_thread_exit();
+    test_pool();
+}
\ No newline at end of file
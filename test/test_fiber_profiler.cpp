@@ -0,0 +1,151 @@
+/*
+ * @Author: lvxr
+ * @brief 协程运行时间统计和看门狗测试
+ */
+#include <unistd.h>
+
+#include <sstream>
+#include <string>
+
+#include "src/config.h"
+#include "src/fiber.h"
+#include "src/fiber_profiler.h"
+#include "src/iomanager.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/scheduler.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static sylar::ConfigVar<bool>::ptr g_cpu =
+    sylar::Config::Lookup<bool>("fiber.profile.cpu");
+static sylar::ConfigVar<uint32_t>::ptr g_threshold =
+    sylar::Config::Lookup<uint32_t>("fiber.profile.hog_threshold_ms");
+
+// 占用CPU ms毫秒
+static void Busy(uint64_t ms) {
+    uint64_t end = sylar::GetCurrentUS() + ms * 1000;
+    while (sylar::GetCurrentUS() < end) {
+    }
+}
+
+// 入口名称通过动态符号表解析，不能是static函数
+void busy_task() {
+    Busy(20);
+    sylar::Fiber::YieldToHold();
+    Busy(10);
+}
+
+void short_task() { Busy(1); }
+
+void test_disabled() {
+    SYLAR_LOG_INFO(g_logger) << "test_disabled begin";
+    SYLAR_ASSERT(!sylar::FiberProfiler::IsCpuEnabled());
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(new sylar::Fiber(busy_task));
+    fiber->swapIn();
+    fiber->swapIn();
+    SYLAR_ASSERT(fiber->getState() == sylar::Fiber::TERM);
+    SYLAR_ASSERT(fiber->getCpuTime() == 0);
+    SYLAR_ASSERT(fiber->getEntry().empty());
+    SYLAR_LOG_INFO(g_logger) << "test_disabled end";
+}
+
+// 只累计切入到切出之间的时间
+void test_cpu_time() {
+    SYLAR_LOG_INFO(g_logger) << "test_cpu_time begin";
+    g_cpu->setValue(true);
+    SYLAR_ASSERT(sylar::FiberProfiler::IsCpuEnabled());
+    sylar::Fiber::ptr fiber(new sylar::Fiber(busy_task));
+    fiber->swapIn();
+    usleep(50 * 1000);
+    fiber->swapIn();
+    SYLAR_ASSERT(fiber->getState() == sylar::Fiber::TERM);
+    uint64_t used = fiber->getCpuTime() / 1000000;
+    SYLAR_LOG_INFO(g_logger) << "cpu_time=" << used << "ms entry="
+                             << fiber->getEntry().getName();
+    SYLAR_ASSERT(used >= 30 && used < 80);
+    SYLAR_ASSERT(fiber->getEntry().getName() == "busy_task()");
+
+    fiber->reset(short_task);
+    SYLAR_ASSERT(fiber->getCpuTime() == 0);
+    SYLAR_ASSERT(fiber->getEntry().empty());
+    SYLAR_LOG_INFO(g_logger) << "test_cpu_time end";
+}
+
+// 按入口汇总，退出的线程的数据也保留
+void test_stats() {
+    SYLAR_LOG_INFO(g_logger) << "test_stats begin";
+    static const int N = 50;
+    sylar::FiberProfiler::ResetCpuStats();
+    {
+        sylar::Scheduler sc(2, false, "stats");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sc.schedule(&short_task);
+            sc.schedule([]() {
+                sylar::Fiber::YieldToReady();
+                Busy(2);
+            });
+        }
+        sc.stop();
+    }
+    std::map<std::string, sylar::FiberProfiler::Histogram> stats =
+        sylar::FiberProfiler::GetCpuStats();
+    SYLAR_ASSERT(stats["short_task()"].count == N);
+    SYLAR_ASSERT(stats["short_task()"].total >= N * 1000000ull);
+    bool found = false;
+    for (auto& i : stats) {
+        if (i.first.find("test_stats()::{lambda()") != std::string::npos) {
+            found = true;
+            SYLAR_ASSERT(i.second.count == N);
+            SYLAR_ASSERT(i.second.percentile(0.5) >= 2000000);
+            SYLAR_ASSERT(i.second.max >= 2000000);
+        }
+    }
+    SYLAR_ASSERT(found);
+    std::stringstream ss;
+    sylar::FiberProfiler::DumpCpuStats(ss);
+    SYLAR_LOG_INFO(g_logger) << "cpu stats\n" << ss.str();
+
+    sylar::FiberProfiler::ResetCpuStats();
+    SYLAR_ASSERT(sylar::FiberProfiler::GetCpuStats().empty());
+    g_cpu->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << "test_stats end";
+}
+
+// 只报告一次运行超过阈值的任务协程，阻塞的idle协程和经常让出的协程不报告
+void test_watchdog() {
+    SYLAR_LOG_INFO(g_logger) << "test_watchdog begin";
+    g_threshold->setValue(50);
+    SYLAR_ASSERT(sylar::FiberProfiler::IsCpuEnabled());
+    uint64_t hogs = sylar::FiberProfiler::GetHogCount();
+    {
+        sylar::IOManager iom(1, false, "watchdog");
+        iom.schedule([]() {
+            for (int i = 0; i < 20; ++i) {
+                Busy(10);
+                sylar::Fiber::YieldToReady();
+            }
+        });
+        // idle协程阻塞在epoll_wait
+        usleep(300 * 1000);
+        SYLAR_ASSERT(sylar::FiberProfiler::GetHogCount() == hogs);
+        iom.schedule([]() { Busy(300); });
+    }
+    SYLAR_ASSERT(sylar::FiberProfiler::GetHogCount() == hogs + 1);
+    g_threshold->setValue(0);
+    SYLAR_ASSERT(!sylar::FiberProfiler::IsCpuEnabled());
+    SYLAR_LOG_INFO(g_logger) << "test_watchdog end";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    test_disabled();
+    test_cpu_time();
+    test_stats();
+    test_watchdog();
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * @Author: lvxr
+ * @brief 协程栈深度统计和自动选择栈大小测试
+ */
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "src/config.h"
+#include "src/fiber.h"
+#include "src/fiber_profiler.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/scheduler.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static sylar::ConfigVar<bool>::ptr g_stack =
+    sylar::Config::Lookup<bool>("fiber.profile.stack");
+static sylar::ConfigVar<bool>::ptr g_auto =
+    sylar::Config::Lookup<bool>("fiber.stack_auto_size");
+
+// 每层占用1KB以上的栈
+static int Recurse(int depth) {
+    volatile char buf[1024];
+    buf[0] = depth;
+    if (depth == 0) {
+        return buf[0];
+    }
+    return Recurse(depth - 1) + buf[0];
+}
+
+// 入口名称通过动态符号表解析，不能是static函数
+void shallow_task() { Recurse(1); }
+
+void deep_task() { Recurse(40); }
+
+void test_disabled() {
+    SYLAR_LOG_INFO(g_logger) << "test_disabled begin";
+    SYLAR_ASSERT(!sylar::FiberProfiler::IsStackEnabled());
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(new sylar::Fiber(deep_task));
+    fiber->swapIn();
+    fiber->reset(deep_task);
+    fiber->swapIn();
+    fiber = nullptr;
+    SYLAR_ASSERT(sylar::FiberProfiler::GetStackStats().empty());
+    SYLAR_LOG_INFO(g_logger) << "test_disabled end";
+}
+
+// 协程复用或者回收时记录，同一次运行只记录一次
+void test_measure() {
+    SYLAR_LOG_INFO(g_logger) << "test_measure begin";
+    g_stack->setValue(true);
+    SYLAR_ASSERT(sylar::FiberProfiler::IsStackEnabled());
+    sylar::Fiber::ptr fiber(new sylar::Fiber(deep_task));
+    fiber->swapIn();
+    fiber->reset(shallow_task);
+    fiber->swapIn();
+    fiber->reset(deep_task);
+    fiber->swapIn();
+    fiber = nullptr;
+    // 从协程池取出已经记录过的协程
+    sylar::Fiber::Create(shallow_task)->swapIn();
+
+    auto stats = sylar::FiberProfiler::GetStackStats();
+    SYLAR_ASSERT(stats.size() == 2);
+    sylar::FiberProfiler::Histogram deep = stats["deep_task()"];
+    sylar::FiberProfiler::Histogram shallow = stats["shallow_task()"];
+    SYLAR_LOG_INFO(g_logger) << "deep max=" << deep.max
+                             << " shallow max=" << shallow.max;
+    SYLAR_ASSERT(deep.count == 2);
+    SYLAR_ASSERT(shallow.count == 2);
+    SYLAR_ASSERT(deep.max >= 40 * 1024 && deep.max < 128 * 1024);
+    SYLAR_ASSERT(shallow.max > 0 && shallow.max < 8 * 1024);
+    // 复用时只重新填充被改写的部分，深度不受上一次运行影响
+    SYLAR_ASSERT(shallow.percentile(0.99) < 8 * 1024);
+    sylar::FiberProfiler::ResetStackStats();
+    SYLAR_LOG_INFO(g_logger) << "test_measure end";
+}
+
+// 记录足够多次后按入口推荐栈大小
+void test_auto_size() {
+    SYLAR_LOG_INFO(g_logger) << "test_auto_size begin";
+    static const int N = 100;
+    {
+        sylar::Scheduler sc(2, false, "stack");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sc.schedule(&shallow_task);
+            sc.schedule(&deep_task);
+        }
+        sc.stop();
+    }
+    sylar::FiberEntry shallow =
+        sylar::FiberEntry::FromCallback(std::function<void()>(shallow_task));
+    sylar::FiberEntry deep =
+        sylar::FiberEntry::FromCallback(std::function<void()>(deep_task));
+    SYLAR_ASSERT(sylar::FiberProfiler::GetStackSize(shallow) == 16 * 1024);
+    SYLAR_ASSERT(sylar::FiberProfiler::GetStackSize(deep) == 128 * 1024);
+    std::stringstream ss;
+    sylar::FiberProfiler::DumpStackStats(ss);
+    SYLAR_LOG_INFO(g_logger) << "stack stats\n" << ss.str();
+
+    // 关闭时使用fiber.stack_size
+    SYLAR_ASSERT(sylar::Fiber::ChooseStackSize(shallow_task) == 128 * 1024);
+    g_auto->setValue(true);
+    SYLAR_ASSERT(sylar::Fiber::ChooseStackSize(shallow_task) == 16 * 1024);
+    SYLAR_ASSERT(sylar::Fiber::ChooseStackSize(deep_task) == 128 * 1024);
+    SYLAR_ASSERT(sylar::Fiber::ChooseStackSize([]() {}) == 128 * 1024);
+    sylar::Fiber::ptr fiber(new sylar::Fiber(shallow_task));
+    SYLAR_ASSERT(fiber->getStackSize() == 16 * 1024);
+    SYLAR_ASSERT(sylar::Fiber::Create(shallow_task)->getStackSize() ==
+                 16 * 1024);
+    fiber.reset(new sylar::Fiber(shallow_task, 64 * 1024));
+    SYLAR_ASSERT(fiber->getStackSize() == 64 * 1024);
+    fiber = nullptr;
+
+    // 两种任务交替执行，复用的回调协程栈不够时重新创建
+    std::vector<sylar::Fiber::ptr> fibers;
+    size_t reserved = 0;
+    {
+        sylar::Scheduler sc(1, false, "auto");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sc.schedule(&deep_task);
+            sc.schedule(&shallow_task);
+            fibers.push_back(sylar::Fiber::Create(shallow_task));
+            reserved += fibers.back()->getStackSize();
+            sc.schedule(fibers.back());
+        }
+        sc.stop();
+    }
+    g_auto->setValue(false);
+    g_stack->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << N << " shallow fibers reserve "
+                             << reserved / 1024 << "KB stack, default "
+                             << N * 128 << "KB";
+    SYLAR_ASSERT(reserved * 8 == N * 128 * 1024);
+    fibers.clear();
+    SYLAR_ASSERT(sylar::FiberProfiler::GetStackStats()["shallow_task()"].max <
+                 8 * 1024);
+    sylar::FiberProfiler::ResetStackStats();
+    SYLAR_ASSERT(sylar::FiberProfiler::GetStackSize(shallow) == 0);
+    SYLAR_LOG_INFO(g_logger) << "test_auto_size end";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    test_disabled();
+    test_measure();
+    test_auto_size();
+    return 0;
+}
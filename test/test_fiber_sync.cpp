@@ -0,0 +1,297 @@
+/*
+ * @Author: lvxr
+ * @brief 协程同步原语测试
+ */
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "src/fiber_sync.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/scheduler.h"
+#include "src/thread.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+// 临界区里让出协程，线程锁在单线程调度器里会死锁
+void test_mutex(size_t threads) {
+    SYLAR_LOG_INFO(g_logger) << "test_mutex begin threads=" << threads;
+    static const int N = 20;
+    static const int M = 200;
+    sylar::FiberMutex mutex;
+    int count = 0;
+    {
+        sylar::Scheduler sc(threads, false, "mutex");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sc.schedule([&mutex, &count]() {
+                for (int j = 0; j < M; ++j) {
+                    sylar::FiberMutex::Lock lock(mutex);
+                    int v = count;
+                    sylar::Fiber::YieldToReady();
+                    count = v + 1;
+                }
+            });
+        }
+        sc.stop();
+    }
+    SYLAR_ASSERT(count == N * M);
+    SYLAR_LOG_INFO(g_logger) << "test_mutex end count=" << count;
+}
+
+// 按排队的顺序拿到锁
+void test_fifo() {
+    SYLAR_LOG_INFO(g_logger) << "test_fifo begin";
+    static const int N = 10;
+    sylar::FiberMutex mutex;
+    std::vector<int> arrive;
+    std::vector<int> acquire;
+    sylar::Scheduler sc(1, false, "fifo");
+    sc.start();
+    sc.schedule([&]() {
+        mutex.lock();
+        for (int i = 0; i < N; ++i) {
+            sylar::Scheduler::GetThis()->schedule([&, i]() {
+                arrive.push_back(i);
+                sylar::FiberMutex::Lock lock(mutex);
+                acquire.push_back(i);
+            });
+        }
+        while ((int)arrive.size() < N) {
+            sylar::Fiber::YieldToReady();
+        }
+        mutex.unlock();
+    });
+    sc.stop();
+    SYLAR_ASSERT(acquire.size() == (size_t)N);
+    SYLAR_ASSERT(acquire == arrive);
+    SYLAR_LOG_INFO(g_logger) << "test_fifo end";
+}
+
+void test_rwmutex() {
+    SYLAR_LOG_INFO(g_logger) << "test_rwmutex begin";
+    static const int N = 40;
+    static const int M = 100;
+    sylar::FiberRWMutex mutex;
+    std::atomic<int> readers{0};
+    std::atomic<int> max_readers{0};
+    std::atomic<bool> writing{false};
+    int writes = 0;
+    {
+        sylar::Scheduler sc(4, false, "rwmutex");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sc.schedule([&, i]() {
+                for (int j = 0; j < M; ++j) {
+                    if ((i + j) % 8 == 0) {
+                        sylar::FiberRWMutex::WriteLock lock(mutex);
+                        SYLAR_ASSERT(!writing && readers == 0);
+                        writing = true;
+                        sylar::Fiber::YieldToReady();
+                        ++writes;
+                        writing = false;
+                    } else {
+                        sylar::FiberRWMutex::ReadLock lock(mutex);
+                        SYLAR_ASSERT(!writing);
+                        int r = ++readers;
+                        int m = max_readers;
+                        while (r > m && !max_readers.compare_exchange_weak(m, r)) {
+                        }
+                        sylar::Fiber::YieldToReady();
+                        --readers;
+                    }
+                }
+            });
+        }
+        sc.stop();
+    }
+    SYLAR_ASSERT(writes == N * M / 8);
+    SYLAR_LOG_INFO(g_logger) << "test_rwmutex end writes=" << writes
+                             << " max_readers=" << max_readers;
+}
+
+void test_semaphore() {
+    SYLAR_LOG_INFO(g_logger) << "test_semaphore begin";
+    static const int N = 50;
+    sylar::FiberSemaphore sem(3);
+    std::atomic<int> inside{0};
+    std::atomic<int> done{0};
+    {
+        sylar::Scheduler sc(2, false, "semaphore");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sc.schedule([&]() {
+                sem.wait();
+                SYLAR_ASSERT(++inside <= 3);
+                sylar::Fiber::YieldToReady();
+                --inside;
+                ++done;
+                sem.notify();
+            });
+        }
+        sc.stop();
+    }
+    SYLAR_ASSERT(done == N);
+    SYLAR_ASSERT(sem.getCount() == 3);
+    SYLAR_LOG_INFO(g_logger) << "test_semaphore end";
+}
+
+// 生产者消费者
+void test_condition() {
+    SYLAR_LOG_INFO(g_logger) << "test_condition begin";
+    static const int PRODUCERS = 4;
+    static const int CONSUMERS = 8;
+    static const int N = 2000;
+    sylar::FiberMutex mutex;
+    sylar::FiberConditionVariable cond;
+    std::deque<int> queue;
+    int producers = PRODUCERS;
+    std::atomic<long> sum{0};
+    {
+        sylar::Scheduler sc(4, false, "condition");
+        sc.start();
+        for (int i = 0; i < CONSUMERS; ++i) {
+            sc.schedule([&]() {
+                while (true) {
+                    sylar::FiberMutex::Lock lock(mutex);
+                    cond.wait(lock, [&]() { return !queue.empty() || !producers; });
+                    if (queue.empty()) {
+                        break;
+                    }
+                    sum += queue.front();
+                    queue.pop_front();
+                }
+            });
+        }
+        for (int i = 0; i < PRODUCERS; ++i) {
+            sc.schedule([&]() {
+                for (int j = 1; j <= N; ++j) {
+                    {
+                        sylar::FiberMutex::Lock lock(mutex);
+                        queue.push_back(j);
+                    }
+                    cond.notifyOne();
+                    if (j % 64 == 0) {
+                        sylar::Fiber::YieldToReady();
+                    }
+                }
+                sylar::FiberMutex::Lock lock(mutex);
+                if (--producers == 0) {
+                    cond.notifyAll();
+                }
+            });
+        }
+        sc.stop();
+    }
+    SYLAR_ASSERT(sum == (long)PRODUCERS * N * (N + 1) / 2);
+    SYLAR_LOG_INFO(g_logger) << "test_condition end sum=" << sum;
+}
+
+// 不在协程里时阻塞线程，可以和协程混用
+void test_thread_fallback() {
+    SYLAR_LOG_INFO(g_logger) << "test_thread_fallback begin";
+    static const int M = 10000;
+    sylar::FiberMutex mutex;
+    sylar::FiberSemaphore sem;
+    int count = 0;
+    {
+        sylar::Scheduler sc(2, false, "fallback");
+        sc.start();
+        std::vector<sylar::Thread::ptr> thrs;
+        for (int i = 0; i < 2; ++i) {
+            thrs.push_back(std::make_shared<sylar::Thread>(
+                [&]() {
+                    for (int j = 0; j < M; ++j) {
+                        sylar::FiberMutex::Lock lock(mutex);
+                        ++count;
+                    }
+                },
+                "fallback_" + std::to_string(i)));
+        }
+        for (int i = 0; i < 4; ++i) {
+            sc.schedule([&]() {
+                for (int j = 0; j < M; ++j) {
+                    sylar::FiberMutex::Lock lock(mutex);
+                    ++count;
+                    if (j % 100 == 0) {
+                        sylar::Fiber::YieldToReady();
+                    }
+                }
+                sem.notify();
+            });
+        }
+        for (auto& i : thrs) {
+            i->join();
+        }
+        for (int i = 0; i < 4; ++i) {
+            sem.wait();
+        }
+        sc.stop();
+    }
+    SYLAR_ASSERT(count == 6 * M);
+    SYLAR_LOG_INFO(g_logger) << "test_thread_fallback end count=" << count;
+}
+
+// 多个协程争抢一把锁，临界区里有让出
+template <class MutexType>
+uint64_t bench_contended(MutexType& mutex) {
+    static const int N = 64;
+    static const int M = 2000;
+    int count = 0;
+    uint64_t start = sylar::GetCurrentUS();
+    {
+        sylar::Scheduler sc(4, false, "bench");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sc.schedule([&mutex, &count]() {
+                for (int j = 0; j < M; ++j) {
+                    typename MutexType::Lock lock(mutex);
+                    ++count;
+                }
+            });
+        }
+        sc.stop();
+    }
+    SYLAR_ASSERT(count == N * M);
+    return sylar::GetCurrentUS() - start;
+}
+
+void bench() {
+    static const int M = 1000000;
+    sylar::FiberMutex fmutex;
+    sylar::Mutex mutex;
+    uint64_t start = sylar::GetCurrentUS();
+    for (int i = 0; i < M; ++i) {
+        sylar::FiberMutex::Lock lock(fmutex);
+    }
+    uint64_t fiber_used = sylar::GetCurrentUS() - start;
+    start = sylar::GetCurrentUS();
+    for (int i = 0; i < M; ++i) {
+        sylar::Mutex::Lock lock(mutex);
+    }
+    uint64_t mutex_used = sylar::GetCurrentUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "uncontended lock/unlock FiberMutex="
+                             << fiber_used * 1000.0 / M
+                             << "ns Mutex=" << mutex_used * 1000.0 / M << "ns";
+
+    fiber_used = bench_contended(fmutex);
+    mutex_used = bench_contended(mutex);
+    SYLAR_LOG_INFO(g_logger) << "contended FiberMutex=" << fiber_used
+                             << "us Mutex=" << mutex_used << "us";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    test_mutex(1);
+    test_mutex(4);
+    test_fifo();
+    test_rwmutex();
+    test_semaphore();
+    test_condition();
+    test_thread_fallback();
+    bench();
+    return 0;
+}
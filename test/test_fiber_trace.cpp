@@ -0,0 +1,189 @@
+/*
+ * @Author: lvxr
+ * @brief 协程切换跟踪测试
+ */
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+
+#include "src/config.h"
+#include "src/fiber.h"
+#include "src/fiber_trace.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/scheduler.h"
+#include "src/thread.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static size_t Count(const std::string& str, const std::string& sub) {
+    size_t n = 0;
+    for (size_t pos = str.find(sub); pos != std::string::npos;
+         pos = str.find(sub, pos + sub.size())) {
+        ++n;
+    }
+    return n;
+}
+
+static void YieldTwice() {
+    sylar::Fiber::YieldToHold();
+    sylar::Fiber::YieldToHold();
+}
+
+// 关闭时不记录
+void test_disabled() {
+    SYLAR_LOG_INFO(g_logger) << "test_disabled begin";
+    SYLAR_ASSERT(!sylar::FiberTrace::IsEnabled());
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(new sylar::Fiber(YieldTwice));
+    for (int i = 0; i < 3; ++i) {
+        fiber->swapIn();
+    }
+    SYLAR_ASSERT(sylar::FiberTrace::GetEventCount() == 0);
+    SYLAR_LOG_INFO(g_logger) << "test_disabled end";
+}
+
+void test_fiber() {
+    SYLAR_LOG_INFO(g_logger) << "test_fiber begin";
+    sylar::FiberTrace::SetEnabled(true);
+    sylar::Fiber::ptr fiber(new sylar::Fiber(YieldTwice));
+    for (int i = 0; i < 3; ++i) {
+        fiber->swapIn();
+    }
+    sylar::FiberTrace::SetEnabled(false);
+    // 创建、3次切入、3次切出、结束
+    SYLAR_ASSERT(sylar::FiberTrace::GetEventCount() == 8);
+
+    std::string json = sylar::FiberTrace::Dump();
+    std::string name = "\"name\":\"fiber " + std::to_string(fiber->getId());
+    SYLAR_ASSERT(Count(json, name) == 3);
+    SYLAR_ASSERT(Count(json, "\"ph\":\"B\"") == 3);
+    SYLAR_ASSERT(Count(json, "\"ph\":\"E\"") == 3);
+    SYLAR_ASSERT(Count(json, "\"from\":\"INIT\"") == 1);
+    SYLAR_ASSERT(Count(json, "\"from\":\"HOLD\"") == 2);
+    SYLAR_ASSERT(Count(json, "\"to\":\"HOLD\",\"out\":\"hold\"") == 2);
+    SYLAR_ASSERT(Count(json, "\"to\":\"TERM\",\"out\":\"finish\"") == 1);
+    SYLAR_ASSERT(Count(json, "\"name\":\"create\"") == 1);
+    SYLAR_ASSERT(Count(json, "\"name\":\"term\"") == 1);
+    SYLAR_ASSERT(Count(json, "\"name\":\"thread_name\"") == 1);
+
+    sylar::FiberTrace::Clear();
+    SYLAR_ASSERT(sylar::FiberTrace::GetEventCount() == 0);
+    SYLAR_LOG_INFO(g_logger) << "test_fiber end";
+}
+
+// 通过配置打开，多个线程的事件分别输出
+void test_scheduler() {
+    SYLAR_LOG_INFO(g_logger) << "test_scheduler begin";
+    auto enable = sylar::Config::Lookup<bool>("fiber.trace.enable");
+    SYLAR_ASSERT(enable);
+    enable->setValue(true);
+    SYLAR_ASSERT(sylar::FiberTrace::IsEnabled());
+
+    static const int N = 100;
+    std::atomic<int> count{0};
+    {
+        sylar::Scheduler sc(3, false, "trace");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sc.schedule([&count]() {
+                sylar::Fiber::YieldToReady();
+                ++count;
+            });
+        }
+        sc.stop();
+    }
+    enable->setValue(false);
+    SYLAR_ASSERT(!sylar::FiberTrace::IsEnabled());
+    SYLAR_ASSERT(count == N);
+
+    std::string path = "/tmp/test_fiber_trace_" + std::to_string(getpid()) +
+                       ".json";
+    SYLAR_ASSERT(sylar::FiberTrace::DumpToFile(path));
+    std::string json = sylar::FiberTrace::Dump();
+    unlink(path.c_str());
+    SYLAR_ASSERT(Count(json, "\"name\":\"thread_name\"") == 3);
+    SYLAR_ASSERT(Count(json, "trace_0") == 1);
+    // 每个任务至少切入两次，让出一次
+    SYLAR_ASSERT(Count(json, "\"out\":\"yield\"") >= N);
+    SYLAR_ASSERT(Count(json, "\"name\":\"term\"") >= N);
+    SYLAR_ASSERT(Count(json, "\"ph\":\"B\"") >= 2 * N);
+    SYLAR_ASSERT(Count(json, "\"ph\":\"B\"") == Count(json, "\"ph\":\"E\""));
+    sylar::FiberTrace::Clear();
+    SYLAR_LOG_INFO(g_logger) << "test_scheduler end";
+}
+
+// 缓冲区满了覆盖最旧的事件，Clear释放已经退出的线程的缓冲区
+void test_overwrite() {
+    SYLAR_LOG_INFO(g_logger) << "test_overwrite begin";
+    auto size = sylar::Config::Lookup<uint32_t>("fiber.trace.buffer_size");
+    uint32_t old_size = size->getValue();
+    size->setValue(16);
+    sylar::FiberTrace::SetEnabled(true);
+    sylar::Thread::ptr thr(new sylar::Thread(
+        []() {
+            sylar::Fiber::GetThis();
+            sylar::Fiber::ptr fiber(new sylar::Fiber([]() {
+                for (int i = 0; i < 100; ++i) {
+                    sylar::Fiber::YieldToHold();
+                }
+            }));
+            while (fiber->getState() != sylar::Fiber::TERM) {
+                fiber->swapIn();
+            }
+        },
+        "overwrite"));
+    thr->join();
+    sylar::FiberTrace::SetEnabled(false);
+    size->setValue(old_size);
+
+    SYLAR_ASSERT(sylar::FiberTrace::GetEventCount() == 16);
+    std::string json = sylar::FiberTrace::Dump();
+    // 最后一个事件是切出，结束事件也在里面
+    SYLAR_ASSERT(Count(json, "\"to\":\"TERM\"") == 1);
+    SYLAR_ASSERT(Count(json, "\"name\":\"term\"") == 1);
+    SYLAR_ASSERT(Count(json, "\"ph\":\"B\"") == Count(json, "\"ph\":\"E\""));
+    sylar::FiberTrace::Clear();
+    SYLAR_ASSERT(sylar::FiberTrace::GetEventCount() == 0);
+    SYLAR_ASSERT(Count(sylar::FiberTrace::Dump(), "overwrite") == 0);
+    SYLAR_LOG_INFO(g_logger) << "test_overwrite end";
+}
+
+// 切换一次的耗时
+static uint64_t SwitchCost(int n) {
+    sylar::Fiber::ptr fiber(new sylar::Fiber([n]() {
+        for (int i = 0; i < n; ++i) {
+            sylar::Fiber::YieldToHold();
+        }
+    }));
+    uint64_t start = sylar::GetCurrentUS();
+    for (int i = 0; i <= n; ++i) {
+        fiber->swapIn();
+    }
+    return (sylar::GetCurrentUS() - start) * 1000 / n;
+}
+
+void bench() {
+    static const int N = 1000000;
+    SwitchCost(N / 10);
+    uint64_t disabled = SwitchCost(N);
+    sylar::FiberTrace::SetEnabled(true);
+    uint64_t enabled = SwitchCost(N);
+    sylar::FiberTrace::SetEnabled(false);
+    sylar::FiberTrace::Clear();
+    SYLAR_LOG_INFO(g_logger) << "swapIn+yield round trip disabled=" << disabled
+                             << "ns enabled=" << enabled << "ns";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    test_disabled();
+    test_fiber();
+    test_scheduler();
+    test_overwrite();
+    bench();
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * @Author: lvxr
+ * @brief hook测试
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "src/config.h"
+#include "src/hook.h"
+#include "src/iomanager.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static std::atomic<int> s_count{0};
+
+// 单线程里的多个sleep并发执行，总耗时接近最长的那个
+void test_sleep() {
+    SYLAR_LOG_INFO(g_logger) << "test_sleep begin";
+    s_count = 0;
+    uint64_t start = sylar::GetCurrentMS();
+    {
+        sylar::IOManager iom(1, false, "sleep");
+        iom.schedule([]() {
+            SYLAR_ASSERT(sylar::is_hook_enable());
+            sleep(1);
+            ++s_count;
+        });
+        for (int i = 0; i < 10; ++i) {
+            iom.schedule([]() {
+                usleep(200 * 1000);
+                ++s_count;
+            });
+        }
+        iom.schedule([]() {
+            struct timespec ts = {0, 300 * 1000 * 1000};
+            nanosleep(&ts, nullptr);
+            ++s_count;
+        });
+    }
+    uint64_t used = sylar::GetCurrentMS() - start;
+    SYLAR_ASSERT(s_count == 12);
+    SYLAR_ASSERT(used >= 1000 && used < 1500);
+    SYLAR_ASSERT(!sylar::is_hook_enable());
+    SYLAR_LOG_INFO(g_logger) << "test_sleep end used=" << used << "ms";
+}
+
+static int listen_loopback(sockaddr_in& addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    SYLAR_ASSERT(!bind(fd, (sockaddr*)&addr, sizeof(addr)));
+    SYLAR_ASSERT(!listen(fd, 16));
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr*)&addr, &len);
+    return fd;
+}
+
+// 单线程里阻塞式的echo服务端和客户端，不hook的话会互相等待
+void test_socket() {
+    SYLAR_LOG_INFO(g_logger) << "test_socket begin";
+    static const int N = 100;
+    s_count = 0;
+    sylar::IOManager iom(1, false, "socket");
+    iom.schedule([]() {
+        sockaddr_in addr;
+        int listen_fd = listen_loopback(addr);
+        // 用户看到的仍然是阻塞的socket
+        SYLAR_ASSERT(!(fcntl(listen_fd, F_GETFL) & O_NONBLOCK));
+
+        sylar::IOManager::GetThis()->schedule([addr]() {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            SYLAR_ASSERT(!connect(fd, (const sockaddr*)&addr, sizeof(addr)));
+            char buf[64];
+            for (int i = 0; i < N; ++i) {
+                SYLAR_ASSERT(send(fd, "hello", 5, 0) == 5);
+                SYLAR_ASSERT(recv(fd, buf, sizeof(buf), 0) == 5);
+                SYLAR_ASSERT(!memcmp(buf, "hello", 5));
+                ++s_count;
+            }
+            close(fd);
+        });
+
+        int fd = accept(listen_fd, nullptr, nullptr);
+        SYLAR_ASSERT(fd >= 0);
+        char buf[64];
+        ssize_t n = 0;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            SYLAR_ASSERT(write(fd, buf, n) == n);
+        }
+        SYLAR_ASSERT(n == 0);
+        close(fd);
+        close(listen_fd);
+    });
+    iom.stop();
+    SYLAR_ASSERT(s_count == N);
+    SYLAR_LOG_INFO(g_logger) << "test_socket end count=" << s_count;
+}
+
+// SO_RCVTIMEO设置的超时生效，超时期间线程还能执行其他协程
+void test_recv_timeout() {
+    SYLAR_LOG_INFO(g_logger) << "test_recv_timeout begin";
+    s_count = 0;
+    sylar::IOManager iom(1, false, "timeout");
+    iom.schedule([]() {
+        sockaddr_in addr;
+        int listen_fd = listen_loopback(addr);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        SYLAR_ASSERT(!connect(fd, (const sockaddr*)&addr, sizeof(addr)));
+        timeval tv = {0, 100 * 1000};
+        SYLAR_ASSERT(!setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)));
+
+        sylar::IOManager::GetThis()->schedule([]() { ++s_count; });
+        uint64_t start = sylar::GetCurrentMS();
+        char buf[16];
+        SYLAR_ASSERT(recv(fd, buf, sizeof(buf), 0) == -1);
+        SYLAR_ASSERT(errno == ETIMEDOUT);
+        uint64_t used = sylar::GetCurrentMS() - start;
+        SYLAR_ASSERT(used >= 100 && used < 500);
+        SYLAR_ASSERT(s_count == 1);
+        close(fd);
+        close(listen_fd);
+        s_count += 10;
+    });
+    iom.stop();
+    SYLAR_ASSERT(s_count == 11);
+    SYLAR_LOG_INFO(g_logger) << "test_recv_timeout end";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    sylar::Config::Lookup<bool>("scheduler.hook_enable", false)->setValue(true);
+    test_sleep();
+    test_socket();
+    test_recv_timeout();
+    return 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * @Author: lvxr
+ * @brief IO协程调度器测试
+ */
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+
+#include "src/config.h"
+#include "src/iomanager.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static std::atomic<int> s_count{0};
+
+static void set_nonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// 协程等待读事件，恢复后仍在注册事件的线程上
+void test_socketpair() {
+    SYLAR_LOG_INFO(g_logger) << "test_socketpair begin";
+    s_count = 0;
+    int fds[2];
+    SYLAR_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    set_nonblock(fds[0]);
+    set_nonblock(fds[1]);
+    {
+        sylar::IOManager iom(3, false, "iom");
+        for (int i = 0; i < 100; ++i) {
+            iom.schedule([fds]() {
+                int tid = sylar::GetThreadId();
+                char buf[1];
+                while (read(fds[0], buf, 1) != 1) {
+                    sylar::IOManager::GetThis()->addEvent(
+                        fds[0], sylar::IOManager::READ);
+                    sylar::Fiber::YieldToHold();
+                    SYLAR_ASSERT(tid == sylar::GetThreadId());
+                }
+                ++s_count;
+            });
+            iom.schedule([fds]() {
+                usleep(100);
+                SYLAR_ASSERT(write(fds[1], "x", 1) == 1);
+            });
+            // 同一个fd同一时间只能有一个读等待者
+            while (s_count <= i) {
+                usleep(100);
+            }
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+    SYLAR_ASSERT(s_count == 100);
+    SYLAR_LOG_INFO(g_logger) << "test_socketpair end count=" << s_count;
+}
+
+// 非阻塞connect，等待写事件
+void test_connect() {
+    SYLAR_LOG_INFO(g_logger) << "test_connect begin";
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    SYLAR_ASSERT(!bind(listen_fd, (sockaddr*)&addr, sizeof(addr)));
+    SYLAR_ASSERT(!listen(listen_fd, 16));
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd, (sockaddr*)&addr, &len);
+    set_nonblock(listen_fd);
+
+    sylar::IOManager iom(2, true, "connect");
+    iom.schedule([listen_fd]() {
+        int fd = -1;
+        while ((fd = accept(listen_fd, nullptr, nullptr)) < 0) {
+            sylar::IOManager::GetThis()->addEvent(listen_fd,
+                                                  sylar::IOManager::READ);
+            sylar::Fiber::YieldToHold();
+        }
+        SYLAR_LOG_INFO(g_logger) << "accepted fd=" << fd;
+        close(fd);
+    });
+    iom.schedule([addr]() {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        set_nonblock(fd);
+        int rt = connect(fd, (const sockaddr*)&addr, sizeof(addr));
+        if (rt && errno == EINPROGRESS) {
+            sylar::IOManager::GetThis()->addEvent(fd, sylar::IOManager::WRITE);
+            sylar::Fiber::YieldToHold();
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        SYLAR_ASSERT(err == 0);
+        SYLAR_LOG_INFO(g_logger) << "connected fd=" << fd;
+        close(fd);
+    });
+    iom.stop();
+    close(listen_fd);
+    SYLAR_LOG_INFO(g_logger) << "test_connect end";
+}
+
+// 取消事件会立即唤醒等待的协程
+void test_cancel() {
+    SYLAR_LOG_INFO(g_logger) << "test_cancel begin";
+    int fds[2];
+    SYLAR_ASSERT(!pipe(fds));
+    set_nonblock(fds[0]);
+    std::atomic<bool> resumed{false};
+    {
+        sylar::IOManager iom(2, false, "cancel");
+        iom.schedule([fds, &resumed]() {
+            sylar::IOManager::GetThis()->addEvent(fds[0],
+                                                  sylar::IOManager::READ);
+            sylar::Fiber::YieldToHold();
+            resumed = true;
+        });
+        while (!iom.cancelEvent(fds[0], sylar::IOManager::READ)) {
+            usleep(1000);
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+    SYLAR_ASSERT(resumed);
+    SYLAR_LOG_INFO(g_logger) << "test_cancel end";
+}
+
+// 协程IO接口，两种后端下行为相同
+void test_fiber_io() {
+    SYLAR_LOG_INFO(g_logger) << "test_fiber_io begin";
+    int fds[2];
+    SYLAR_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    set_nonblock(fds[0]);
+    set_nonblock(fds[1]);
+    {
+        sylar::IOManager iom(2, false, "fiber_io");
+        iom.schedule([fds]() {
+            auto iom = sylar::IOManager::GetThis();
+            char buf[16];
+            SYLAR_ASSERT(iom->read(fds[0], buf, sizeof(buf)) == 5);
+            SYLAR_ASSERT(!memcmp(buf, "hello", 5));
+            SYLAR_ASSERT(iom->write(fds[0], "world", 5) == 5);
+        });
+        iom.schedule([fds]() {
+            auto iom = sylar::IOManager::GetThis();
+            auto start = std::chrono::steady_clock::now();
+            SYLAR_ASSERT(!iom->sleepFor(50));
+            SYLAR_ASSERT(std::chrono::steady_clock::now() - start >=
+                         std::chrono::milliseconds(50));
+            SYLAR_ASSERT(iom->write(fds[1], "hello", 5) == 5);
+            char buf[16];
+            SYLAR_ASSERT(iom->read(fds[1], buf, sizeof(buf)) == 5);
+            SYLAR_ASSERT(!memcmp(buf, "world", 5));
+        });
+    }
+    close(fds[0]);
+    close(fds[1]);
+    SYLAR_LOG_INFO(g_logger) << "test_fiber_io end";
+}
+
+// 读超时
+void test_timeout() {
+    SYLAR_LOG_INFO(g_logger) << "test_timeout begin";
+    int fds[2];
+    SYLAR_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    set_nonblock(fds[0]);
+    {
+        sylar::IOManager iom(2, false, "timeout");
+        iom.schedule([fds]() {
+            auto start = std::chrono::steady_clock::now();
+            char buf[16];
+            ssize_t n = sylar::IOManager::GetThis()->read(fds[0], buf,
+                                                          sizeof(buf), 50);
+            SYLAR_ASSERT(n == -1 && errno == ETIMEDOUT);
+            SYLAR_ASSERT(std::chrono::steady_clock::now() - start >=
+                         std::chrono::milliseconds(50));
+            // 超时后fd仍然可以正常使用
+            SYLAR_ASSERT(write(fds[1], "x", 1) == 1);
+            n = sylar::IOManager::GetThis()->read(fds[0], buf, sizeof(buf),
+                                                  1000);
+            SYLAR_ASSERT(n == 1);
+        });
+    }
+    close(fds[0]);
+    close(fds[1]);
+    SYLAR_LOG_INFO(g_logger) << "test_timeout end";
+}
+
+static const int s_conns = 32;
+static const int s_rounds = 1000;
+static const int s_msg_size = 64;
+
+// 回环echo服务器吞吐
+void bench_echo() {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    SYLAR_ASSERT(!bind(listen_fd, (sockaddr*)&addr, sizeof(addr)));
+    SYLAR_ASSERT(!listen(listen_fd, 128));
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd, (sockaddr*)&addr, &len);
+    set_nonblock(listen_fd);
+
+    s_count = 0;
+    sylar::IOManager::Backend backend;
+    auto start = std::chrono::steady_clock::now();
+    {
+        sylar::IOManager iom(2, false, "echo");
+        backend = iom.getBackend();
+        iom.schedule([listen_fd]() {
+            auto iom = sylar::IOManager::GetThis();
+            for (int i = 0; i < s_conns; ++i) {
+                int fd = iom->accept(listen_fd, nullptr, nullptr,
+                                     SOCK_NONBLOCK);
+                SYLAR_ASSERT(fd >= 0);
+                iom->schedule([fd]() {
+                    auto iom = sylar::IOManager::GetThis();
+                    char buf[s_msg_size];
+                    ssize_t n = 0;
+                    while ((n = iom->read(fd, buf, sizeof(buf))) > 0) {
+                        SYLAR_ASSERT(iom->write(fd, buf, n) == n);
+                    }
+                    close(fd);
+                });
+            }
+        });
+        for (int i = 0; i < s_conns; ++i) {
+            iom.schedule([addr]() {
+                auto iom = sylar::IOManager::GetThis();
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                // 回环地址上连接会立即完成
+                SYLAR_ASSERT(!connect(fd, (const sockaddr*)&addr,
+                                      sizeof(addr)));
+                set_nonblock(fd);
+                char buf[s_msg_size];
+                memset(buf, 'x', sizeof(buf));
+                for (int r = 0; r < s_rounds; ++r) {
+                    SYLAR_ASSERT(iom->write(fd, buf, sizeof(buf)) ==
+                                 sizeof(buf));
+                    size_t got = 0;
+                    while (got < sizeof(buf)) {
+                        ssize_t n = iom->read(fd, buf + got, sizeof(buf) - got);
+                        SYLAR_ASSERT(n > 0);
+                        got += n;
+                    }
+                    ++s_count;
+                }
+                close(fd);
+            });
+        }
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    close(listen_fd);
+    SYLAR_ASSERT(s_count == s_conns * s_rounds);
+    SYLAR_LOG_INFO(g_logger)
+        << "echo " << (backend == sylar::IOManager::IO_URING ? "io_uring" : "epoll")
+        << " " << s_count << " round trips in " << ms << " ms, "
+        << (ms ? s_count * 1000 / ms : 0) << " rt/s";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    for (auto backend : {"epoll", "io_uring"}) {
+        sylar::Config::Lookup<std::string>("iomanager.backend")
+            ->setValue(backend);
+        SYLAR_LOG_INFO(g_logger) << "backend=" << backend;
+        test_socketpair();
+        test_connect();
+        test_cancel();
+        test_fiber_io();
+        test_timeout();
+    }
+    for (auto backend : {"epoll", "io_uring"}) {
+        sylar::Config::Lookup<std::string>("iomanager.backend")
+            ->setValue(backend);
+        bench_echo();
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * @Author: lvxr
+ * @brief 结构化并发测试
+ */
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "src/fiber_sync.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/parallel.h"
+#include "src/scheduler.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+void test_wait_group() {
+    SYLAR_LOG_INFO(g_logger) << "test_wait_group begin";
+    static const int N = 100;
+    std::atomic<int> count{0};
+    sylar::Scheduler sc(4, false, "wg");
+    sc.start();
+    // 不在协程中时阻塞线程等待
+    sylar::WaitGroup wg;
+    wg.add(N);
+    for (int i = 0; i < N; ++i) {
+        sc.schedule([&]() {
+            sylar::Fiber::YieldToReady();
+            ++count;
+            wg.done();
+        });
+    }
+    wg.wait();
+    SYLAR_ASSERT(count == N);
+    SYLAR_ASSERT(wg.getCount() == 0);
+    // 计数为0时直接返回
+    wg.wait();
+
+    // 在协程中等待时挂起协程
+    sylar::WaitGroup outer;
+    outer.add(1);
+    sc.schedule([&]() {
+        sylar::WaitGroup inner;
+        inner.add(N);
+        for (int i = 0; i < N; ++i) {
+            sylar::Scheduler::GetThis()->schedule([&]() {
+                ++count;
+                inner.done();
+            });
+        }
+        inner.wait();
+        SYLAR_ASSERT(count == 2 * N);
+        outer.done();
+    });
+    outer.wait();
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "test_wait_group end";
+}
+
+void test_spawn() {
+    SYLAR_LOG_INFO(g_logger) << "test_spawn begin";
+    sylar::Scheduler sc(2, false, "spawn");
+    sc.start();
+    sylar::JoinHandle<int> h = sylar::spawn(&sc, []() { return 42; });
+    SYLAR_ASSERT(h.join() == 42);
+    SYLAR_ASSERT(h.isDone());
+
+    std::atomic<int> count{0};
+    sylar::JoinHandle<void> v = sylar::spawn(&sc, [&count]() { ++count; });
+    v.join();
+    SYLAR_ASSERT(count == 1);
+
+    // 异常传递给join的一方
+    sylar::JoinHandle<std::string> e = sylar::spawn(&sc, []() -> std::string {
+        throw std::runtime_error("spawn error");
+    });
+    bool caught = false;
+    try {
+        e.join();
+    } catch (std::runtime_error& ex) {
+        caught = std::string(ex.what()) == "spawn error";
+    }
+    SYLAR_ASSERT(caught);
+
+    // 协程里spawn和join，单线程也不会死锁
+    sylar::Scheduler single(1, false, "spawn_single");
+    single.start();
+    sylar::JoinHandle<long> sum = sylar::spawn(&single, []() {
+        std::vector<sylar::JoinHandle<long> > handles;
+        for (long i = 1; i <= 100; ++i) {
+            handles.push_back(sylar::spawn([i]() { return i; }));
+        }
+        long s = 0;
+        for (auto& h : handles) {
+            s += h.join();
+        }
+        return s;
+    });
+    SYLAR_ASSERT(sum.join() == 5050);
+    single.stop();
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "test_spawn end";
+}
+
+// 协程入口抛出的异常保存在协程里
+void test_fiber_exception() {
+    SYLAR_LOG_INFO(g_logger) << "test_fiber_exception begin";
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(
+        new sylar::Fiber([]() { throw std::logic_error("fiber error"); }));
+    fiber->swapIn();
+    SYLAR_ASSERT(fiber->getState() == sylar::Fiber::EXCEPT);
+    SYLAR_ASSERT(fiber->getException());
+    bool caught = false;
+    try {
+        std::rethrow_exception(fiber->getException());
+    } catch (std::logic_error& e) {
+        caught = true;
+    }
+    SYLAR_ASSERT(caught);
+    fiber->reset([]() {});
+    SYLAR_ASSERT(!fiber->getException());
+    SYLAR_LOG_INFO(g_logger) << "test_fiber_exception end";
+}
+
+void test_parallel_for() {
+    SYLAR_LOG_INFO(g_logger) << "test_parallel_for begin";
+    static const size_t N = 100000;
+    sylar::Scheduler sc(4, false, "parallel");
+    sc.start();
+    std::vector<uint64_t> v(N);
+    sylar::parallel_for(&sc, 0, N, [&v](size_t i) { v[i] = i * i; });
+    for (size_t i = 0; i < N; ++i) {
+        SYLAR_ASSERT(v[i] == i * i);
+    }
+
+    // 空区间和指定粒度
+    sylar::parallel_for(&sc, 10, 10, [](size_t) { SYLAR_ASSERT(false); });
+    std::atomic<size_t> count{0};
+    sylar::parallel_for(&sc, 5, 1005, [&count](size_t) { ++count; }, 7);
+    SYLAR_ASSERT(count == 1000);
+
+    bool caught = false;
+    try {
+        sylar::parallel_for(&sc, 0, N, [](size_t i) {
+            if (i == N / 2) {
+                throw std::out_of_range("parallel_for error");
+            }
+        });
+    } catch (std::out_of_range& e) {
+        caught = true;
+    }
+    SYLAR_ASSERT(caught);
+
+    // 在协程里嵌套使用
+    sylar::JoinHandle<uint64_t> h = sylar::spawn(&sc, [&v]() {
+        return sylar::parallel_reduce(
+            sylar::Scheduler::GetThis(), 0, v.size(), (uint64_t)0,
+            [&v](size_t i) { return v[i]; },
+            [](uint64_t a, uint64_t b) { return a + b; });
+    });
+    uint64_t expect = 0;
+    for (size_t i = 0; i < N; ++i) {
+        expect += i * i;
+    }
+    SYLAR_ASSERT(h.join() == expect);
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "test_parallel_for end";
+}
+
+void test_parallel_reduce() {
+    SYLAR_LOG_INFO(g_logger) << "test_parallel_reduce begin";
+    sylar::Scheduler sc(4, false, "reduce");
+    sc.start();
+    static const size_t N = 1000000;
+    uint64_t sum = sylar::parallel_reduce(
+        &sc, 1, N + 1, (uint64_t)0, [](size_t i) { return (uint64_t)i; },
+        [](uint64_t a, uint64_t b) { return a + b; });
+    SYLAR_ASSERT(sum == (uint64_t)N * (N + 1) / 2);
+
+    // 只满足结合律的归约，结果按区间顺序
+    std::string s = sylar::parallel_reduce(
+        &sc, 0, 100, std::string(),
+        [](size_t i) { return std::string(1, 'a' + i % 26); },
+        [](std::string a, std::string b) { return a + b; }, 3);
+    std::string expect;
+    for (size_t i = 0; i < 100; ++i) {
+        expect += 'a' + i % 26;
+    }
+    SYLAR_ASSERT(s == expect);
+
+    // bool的每段结果写在相邻的位置，不能互相覆盖
+    for (int round = 0; round < 100; ++round) {
+        bool all = sylar::parallel_reduce(
+            &sc, 0, 256, true, [](size_t i) { return i < 256; },
+            [](bool a, bool b) { return a && b; }, 1);
+        SYLAR_ASSERT(all);
+        bool any = sylar::parallel_reduce(
+            &sc, 0, 256, false,
+            [round](size_t i) { return i == (size_t)round; },
+            [](bool a, bool b) { return a || b; }, 1);
+        SYLAR_ASSERT(any);
+    }
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "test_parallel_reduce end";
+}
+
+void bench() {
+    static const size_t N = 1 << 22;
+    std::vector<double> v(N);
+    for (size_t i = 0; i < N; ++i) {
+        v[i] = i * 0.5;
+    }
+    auto map = [&v](size_t i) { return v[i] * v[i]; };
+    auto reduce = [](double a, double b) { return a + b; };
+    // 串行版本使用同样的函数，只比较并行带来的差别
+    uint64_t start = sylar::GetCurrentUS();
+    double serial = 0;
+    for (size_t i = 0; i < N; ++i) {
+        serial = reduce(serial, map(i));
+    }
+    uint64_t serial_used = sylar::GetCurrentUS() - start;
+
+    sylar::Scheduler sc(4, false, "bench");
+    sc.start();
+    start = sylar::GetCurrentUS();
+    double parallel = sylar::parallel_reduce(&sc, 0, N, 0.0, map, reduce);
+    uint64_t parallel_used = sylar::GetCurrentUS() - start;
+    sc.stop();
+    SYLAR_ASSERT(parallel > serial * 0.999999 && parallel < serial * 1.000001);
+    SYLAR_LOG_INFO(g_logger) << "sum of squares n=" << N
+                             << " serial=" << serial_used
+                             << "us parallel_reduce(4 threads)=" << parallel_used
+                             << "us";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    test_wait_group();
+    test_spawn();
+    test_fiber_exception();
+    test_parallel_for();
+    test_parallel_reduce();
+    bench();
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * @Author: lvxr
+ * @brief 协程抢占测试
+ */
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "src/config.h"
+#include "src/fiber.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/mutex.h"
+#include "src/scheduler.h"
+#include "src/thread.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static sylar::ConfigVar<uint32_t>::ptr g_slice =
+    sylar::Config::Lookup<uint32_t>("scheduler.preempt_slice_ms");
+
+// 占用CPU us微秒
+static void Busy(uint64_t us) {
+    uint64_t end = sylar::GetCurrentUS() + us;
+    while (sylar::GetCurrentUS() < end) {
+    }
+}
+
+// 线程锁的加解锁维护持有数量
+void test_lock_counter() {
+    SYLAR_LOG_INFO(g_logger) << "test_lock_counter begin";
+    SYLAR_ASSERT(sylar::ThreadLockCounter::Get() == 0);
+    sylar::Mutex mutex;
+    sylar::RWMutex rwmutex;
+    sylar::Spinlock spin;
+    {
+        sylar::Mutex::Lock l1(mutex);
+        sylar::RWMutex::ReadLock l2(rwmutex);
+        sylar::Spinlock::Lock l3(spin);
+        SYLAR_ASSERT(sylar::ThreadLockCounter::Get() == 3);
+        l3.unlock();
+        SYLAR_ASSERT(sylar::ThreadLockCounter::Get() == 2);
+    }
+    SYLAR_ASSERT(sylar::ThreadLockCounter::Get() == 0);
+    SYLAR_LOG_INFO(g_logger) << "test_lock_counter end";
+}
+
+// 持有线程锁时不让出，解锁后的检查点让出
+void test_lock_held() {
+    SYLAR_LOG_INFO(g_logger) << "test_lock_held begin";
+    g_slice->setValue(2);
+    std::atomic<int> yield_in_lock{0};
+    std::atomic<bool> yielded{false};
+    {
+        sylar::Scheduler sc(1, false, "held");
+        sc.start();
+        sc.schedule([&yield_in_lock, &yielded]() {
+            sylar::Mutex mutex;
+            sylar::Fiber* cur = sylar::Fiber::GetCurrent();
+            uint64_t count = sylar::Scheduler::GetPreemptCount();
+            {
+                sylar::Mutex::Lock lock(mutex);
+                Busy(20 * 1000);
+                sylar::Fiber::CheckPreempt();
+                yield_in_lock = sylar::Scheduler::GetPreemptCount() - count;
+            }
+            for (int i = 0; i < 100 && !yielded; ++i) {
+                sylar::Fiber::CheckPreempt();
+                yielded = sylar::Scheduler::GetPreemptCount() > count;
+                Busy(1000);
+            }
+            SYLAR_ASSERT(sylar::Fiber::GetCurrent() == cur);
+        });
+        sc.stop();
+    }
+    g_slice->setValue(0);
+    SYLAR_ASSERT(yield_in_lock == 0);
+    SYLAR_ASSERT(yielded);
+    SYLAR_LOG_INFO(g_logger) << "test_lock_held end";
+}
+
+// 经常让出的协程不会被抢占
+void test_cooperative() {
+    SYLAR_LOG_INFO(g_logger) << "test_cooperative begin";
+    g_slice->setValue(4);
+    uint64_t count = sylar::Scheduler::GetPreemptCount();
+    {
+        sylar::Scheduler sc(1, false, "coop");
+        sc.start();
+        sc.schedule([]() {
+            for (int i = 0; i < 100; ++i) {
+                Busy(500);
+                sylar::Fiber::YieldToReady();
+            }
+        });
+        sc.stop();
+    }
+    g_slice->setValue(0);
+    SYLAR_ASSERT(sylar::Scheduler::GetPreemptCount() == count);
+    SYLAR_LOG_INFO(g_logger) << "test_cooperative end";
+}
+
+// 被抢占的共享栈协程重新排队时仍然固定在原来的线程上
+void test_shared_stack() {
+    SYLAR_LOG_INFO(g_logger) << "test_shared_stack begin";
+    static const int N = 16;
+    g_slice->setValue(1);
+    uint64_t count = sylar::Scheduler::GetPreemptCount();
+    std::atomic<int> done{0};
+    {
+        sylar::Scheduler sc(4, false, "shared");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sylar::Fiber::ptr fiber(new sylar::Fiber(
+                [&done]() {
+                    int thread = sylar::GetThreadId();
+                    for (int j = 0; j < 20; ++j) {
+                        Busy(500);
+                        sylar::Fiber::CheckPreempt();
+                        SYLAR_ASSERT(sylar::GetThreadId() == thread);
+                    }
+                    ++done;
+                },
+                0, false, true));
+            sc.schedule(fiber);
+        }
+        sc.stop();
+    }
+    g_slice->setValue(0);
+    SYLAR_ASSERT(done == N);
+    SYLAR_ASSERT(sylar::Scheduler::GetPreemptCount() > count);
+    SYLAR_LOG_INFO(g_logger) << "test_shared_stack end";
+}
+
+/**
+ * @brief: 单线程调度器上跑长时间计算的任务，另一个线程定时提交短任务，
+ *         统计短任务从提交到开始执行的延迟，微秒
+ */
+static std::vector<uint64_t> MeasureLatency(uint32_t slice_ms) {
+    static const int HEAVY = 4;
+    static const int LOOPS = 1000;
+    static const int SHORT = 50;
+    g_slice->setValue(slice_ms);
+    std::vector<uint64_t> latency(SHORT);
+    {
+        sylar::Scheduler sc(1, false, "latency");
+        sc.start();
+        for (int i = 0; i < HEAVY; ++i) {
+            sc.schedule([]() {
+                for (int j = 0; j < LOOPS; ++j) {
+                    Busy(100);
+                    sylar::Fiber::CheckPreempt();
+                }
+            });
+        }
+        for (int i = 0; i < SHORT; ++i) {
+            usleep(5 * 1000);
+            uint64_t submit = sylar::GetCurrentUS();
+            sc.schedule([&latency, i, submit]() {
+                latency[i] = sylar::GetCurrentUS() - submit;
+            });
+        }
+        sc.stop();
+    }
+    g_slice->setValue(0);
+    std::sort(latency.begin(), latency.end());
+    return latency;
+}
+
+static void LogLatency(const char* name, const std::vector<uint64_t>& v) {
+    SYLAR_LOG_INFO(g_logger)
+        << name << " short task latency p50=" << v[v.size() / 2]
+        << "us p99=" << v[v.size() * 99 / 100] << "us max=" << v.back()
+        << "us";
+}
+
+void bench_latency() {
+    SYLAR_LOG_INFO(g_logger) << "bench_latency begin";
+    std::vector<uint64_t> off = MeasureLatency(0);
+    uint64_t count = sylar::Scheduler::GetPreemptCount();
+    std::vector<uint64_t> on = MeasureLatency(5);
+    count = sylar::Scheduler::GetPreemptCount() - count;
+    LogLatency("preempt off", off);
+    LogLatency("preempt 5ms", on);
+    SYLAR_LOG_INFO(g_logger) << "preempt count=" << count;
+    SYLAR_ASSERT(count > 0);
+    SYLAR_ASSERT(on.back() < off.back());
+    SYLAR_LOG_INFO(g_logger) << "bench_latency end";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    test_lock_counter();
+    test_lock_held();
+    test_cooperative();
+    test_shared_stack();
+    bench_latency();
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * @Author: lvxr
+ * @brief 协程调度器测试
+ */
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "src/config.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/scheduler.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static std::atomic<int> s_count{0};
+
+void test_fiber() {
+    static int s_depth = 5;
+    SYLAR_LOG_INFO(g_logger) << "test in fiber s_depth=" << s_depth;
+    usleep(100 * 1000);
+    if (--s_depth >= 0) {
+        // 绑定到当前线程继续调度
+        sylar::Scheduler::GetThis()->schedule(&test_fiber,
+                                              sylar::GetThreadId());
+    }
+}
+
+void test_basic() {
+    SYLAR_LOG_INFO(g_logger) << "test_basic begin";
+    sylar::Scheduler sc(3, false, "test");
+    sc.start();
+    sc.schedule(&test_fiber);
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "test_basic end";
+}
+
+void test_use_caller() {
+    SYLAR_LOG_INFO(g_logger) << "test_use_caller begin";
+    s_count = 0;
+    {
+        sylar::Scheduler sc(2, true, "caller");
+        sc.start();
+        for (int i = 0; i < 100; ++i) {
+            sc.schedule([]() {
+                ++s_count;
+                // 让出后由调度器重新执行
+                sylar::Fiber::YieldToReady();
+                ++s_count;
+            });
+        }
+        sc.stop();
+    }
+    SYLAR_ASSERT(s_count == 200);
+    SYLAR_LOG_INFO(g_logger) << "test_use_caller end count=" << s_count;
+}
+
+void test_pinned() {
+    SYLAR_LOG_INFO(g_logger) << "test_pinned begin";
+    s_count = 0;
+    sylar::Scheduler sc(4, false, "pinned");
+    sc.start();
+    // 取得一个工作线程的id
+    std::atomic<int> target{0};
+    sc.schedule([&target]() { target = sylar::GetThreadId(); });
+    while (target == 0) {
+        usleep(1000);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        sc.schedule(
+            [&target]() {
+                SYLAR_ASSERT(sylar::GetThreadId() == target);
+                ++s_count;
+            },
+            target);
+    }
+    sc.stop();
+    SYLAR_ASSERT(s_count == 1000);
+    SYLAR_LOG_INFO(g_logger) << "test_pinned end count=" << s_count;
+}
+
+// 共享栈协程在主线程创建，第一次运行后固定在分配共享栈的工作线程上
+void test_shared_stack(bool stealing) {
+    SYLAR_LOG_INFO(g_logger) << "test_shared_stack begin stealing="
+                             << stealing;
+    static const int N = 64;
+    static const int loops = 200;
+    sylar::Config::Lookup<bool>("scheduler.work_stealing")->setValue(stealing);
+    s_count = 0;
+    std::vector<sylar::Fiber::ptr> fibers;
+    {
+        sylar::Scheduler sc(4, false, "shared");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            fibers.emplace_back(new sylar::Fiber(
+                []() {
+                    int thread = sylar::GetThreadId();
+                    for (int j = 0; j < loops; ++j) {
+                        // 阻塞当前工作线程，让其他线程有机会取到让出的协程
+                        usleep(10);
+                        sylar::Fiber::YieldToReady();
+                        SYLAR_ASSERT(sylar::GetThreadId() == thread);
+                    }
+                    ++s_count;
+                },
+                0, false, true));
+            sc.schedule(fibers.back());
+        }
+        sc.stop();
+    }
+    sylar::Config::Lookup<bool>("scheduler.work_stealing")->setValue(true);
+    for (auto& f : fibers) {
+        SYLAR_ASSERT(f->getState() == sylar::Fiber::TERM);
+    }
+    SYLAR_ASSERT(s_count == N);
+    SYLAR_LOG_INFO(g_logger) << "test_shared_stack end count=" << s_count;
+}
+
+// 协程环：每个协程唤醒下一个后挂起，只有一个协程在运行
+void test_direct_switch() {
+    SYLAR_LOG_INFO(g_logger) << "test_direct_switch begin";
+    static const int N = 16;
+    static const int passes = 100000;
+    s_count = 0;
+    std::vector<sylar::Fiber::ptr> ring(N);
+    sylar::Scheduler sc(4, false, "ring");
+    for (int i = 0; i < N; ++i) {
+        ring[i].reset(new sylar::Fiber([&ring, i]() {
+            sylar::Fiber::ptr next = ring[(i + 1) % N];
+            while (s_count < passes) {
+                ++s_count;
+                sylar::Scheduler::GetThis()->schedule(next);
+                sylar::Fiber::YieldToHold();
+            }
+            // 唤醒下一个让它也退出
+            sylar::Scheduler::GetThis()->schedule(next);
+        }));
+    }
+    sc.start();
+    sc.schedule(ring[0]);
+    sc.stop();
+    for (auto& f : ring) {
+        SYLAR_ASSERT(f->getState() == sylar::Fiber::TERM);
+    }
+    SYLAR_ASSERT(s_count == passes);
+    SYLAR_LOG_INFO(g_logger) << "test_direct_switch end count=" << s_count;
+}
+
+// 扇出/扇入：每轮派生s_fanout个子任务，最后完成的子任务开始下一轮
+static const int s_fanout = 1000;
+static const int s_rounds = 100;
+static std::atomic<int> s_pending{0};
+static std::atomic<int> s_round{0};
+
+static void work(int n) {
+    volatile int x = 0;
+    for (int i = 0; i < n; ++i) {
+        x = x + i;
+    }
+}
+
+void fan_round();
+
+void fan_child() {
+    work(200);
+    ++s_count;
+    if (--s_pending == 0) {
+        fan_round();
+    }
+}
+
+void fan_round() {
+    if (++s_round > s_rounds) {
+        return;
+    }
+    s_pending = s_fanout;
+    for (int i = 0; i < s_fanout; ++i) {
+        sylar::Scheduler::GetThis()->schedule(&fan_child);
+    }
+}
+
+// 不平衡的任务图：斐波那契递归树，左右子树大小不同
+void fib_task(int n) {
+    if (n < 2) {
+        work(200);
+        ++s_count;
+        return;
+    }
+    sylar::Scheduler::GetThis()->schedule(std::bind(&fib_task, n - 1));
+    sylar::Scheduler::GetThis()->schedule(std::bind(&fib_task, n - 2));
+}
+
+void bench(const std::string& name, bool stealing, std::function<void()> cb,
+           int expect) {
+    sylar::Config::Lookup<bool>("scheduler.work_stealing")->setValue(stealing);
+    s_count = 0;
+    s_round = 0;
+    sylar::Scheduler sc(4, false, "bench");
+    sc.start();
+    auto start = std::chrono::steady_clock::now();
+    sc.schedule(cb);
+    sc.stop();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    SYLAR_ASSERT(s_count == expect);
+    SYLAR_LOG_INFO(g_logger) << name << (stealing ? " work-stealing " : " global-queue ")
+                             << s_count << " tasks in " << ms << " ms";
+}
+
+// 两个协程互相让出，比较直接切换和经过调度协程的开销
+void bench_switch(bool direct) {
+    static const int N = 200000;
+    sylar::Config::Lookup<bool>("scheduler.direct_switch")->setValue(direct);
+    s_count = 0;
+    sylar::Scheduler sc(1, false, "switch");
+    sc.start();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 2; ++i) {
+        sc.schedule([]() {
+            for (int j = 0; j < N; ++j) {
+                ++s_count;
+                sylar::Fiber::YieldToReady();
+            }
+        });
+    }
+    sc.stop();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    SYLAR_ASSERT(s_count == 2 * N);
+    SYLAR_LOG_INFO(g_logger) << (direct ? "direct switch " : "via scheduler ")
+                             << ns / s_count << " ns/yield";
+    sylar::Config::Lookup<bool>("scheduler.direct_switch")->setValue(true);
+}
+
+void test_throughput() {
+    // fib(22)的叶子数
+    static const int fib_leaves = 28657;
+    for (bool stealing : {false, true}) {
+        bench("fan-out/fan-in", stealing, &fan_round, s_fanout * s_rounds);
+        bench("unbalanced", stealing, std::bind(&fib_task, 22), fib_leaves);
+    }
+    bench_switch(false);
+    bench_switch(true);
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::INFO);
+    test_basic();
+    test_use_caller();
+    test_pinned();
+    test_shared_stack(true);
+    test_shared_stack(false);
+    test_direct_switch();
+    test_throughput();
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * @Author: lvxr
+ * @brief 定时器测试
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+#include "src/iomanager.h"
+#include "src/log.h"
+#include "src/marco.h"
+#include "src/timer.h"
+#include "src/util.h"
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+/**
+ * @brief: 手动推进的定时器管理器
+ */
+class TestTimerManager : public sylar::TimerManager {
+public:
+    int front = 0;
+
+protected:
+    void onTimerInsertedAtFront(int wheel) override { ++front; }
+};
+
+// 到期时间随机的定时器，每个都不能早于到期时间触发
+void test_wheel() {
+    SYLAR_LOG_INFO(g_logger) << "test_wheel begin";
+    TestTimerManager mgr;
+    static const int N = 2000;
+    std::vector<uint64_t> deadline(N);
+    std::vector<uint64_t> fired(N, 0);
+    uint64_t start = sylar::GetCurrentMS();
+    for (int i = 0; i < N; ++i) {
+        uint64_t ms = rand() % 1000;
+        deadline[i] = start + ms;
+        mgr.addTimer(ms, [i, &fired]() { fired[i] = sylar::GetCurrentMS(); });
+    }
+    SYLAR_ASSERT(mgr.front > 0);
+
+    int count = 0;
+    while (count < N) {
+        uint64_t next = mgr.getNextTimer();
+        SYLAR_ASSERT(next != ~0ull);
+        usleep(std::min(next, (uint64_t)10) * 1000);
+        std::vector<std::function<void()> > cbs;
+        mgr.listExpiredCb(cbs);
+        for (auto& cb : cbs) {
+            cb();
+        }
+        count += cbs.size();
+    }
+    SYLAR_ASSERT(!mgr.hasTimer());
+    SYLAR_ASSERT(mgr.getNextTimer() == ~0ull);
+    uint64_t max_late = 0;
+    for (int i = 0; i < N; ++i) {
+        SYLAR_ASSERT(fired[i] >= deadline[i]);
+        max_late = std::max(max_late, fired[i] - deadline[i]);
+    }
+    SYLAR_LOG_INFO(g_logger) << "test_wheel end max_late=" << max_late << "ms";
+}
+
+void test_cancel_reset() {
+    SYLAR_LOG_INFO(g_logger) << "test_cancel_reset begin";
+    TestTimerManager mgr;
+    int count = 0;
+    auto t1 = mgr.addTimer(10, [&count]() { ++count; });
+    auto t2 = mgr.addTimer(10, [&count]() { count += 10; });
+    auto t3 = mgr.addTimer(500, [&count]() { count += 100; });
+    auto t4 = mgr.addTimer(5, [&count]() { count += 1000; }, true);
+    SYLAR_ASSERT(t2->cancel());
+    SYLAR_ASSERT(!t2->cancel());
+    // 从第1层移回第0层
+    SYLAR_ASSERT(t3->reset(20, true));
+
+    uint64_t start = sylar::GetCurrentMS();
+    while (sylar::GetCurrentMS() - start < 60) {
+        usleep(1000);
+        std::vector<std::function<void()> > cbs;
+        mgr.listExpiredCb(cbs);
+        for (auto& cb : cbs) {
+            cb();
+        }
+    }
+    SYLAR_ASSERT(!t1->cancel());
+    SYLAR_ASSERT(!t3->refresh());
+    SYLAR_ASSERT(t4->cancel());
+    SYLAR_ASSERT(count % 1000 == 101);
+    SYLAR_ASSERT(count / 1000 >= 5);
+    SYLAR_LOG_INFO(g_logger) << "test_cancel_reset end count=" << count;
+}
+
+void test_condition() {
+    SYLAR_LOG_INFO(g_logger) << "test_condition begin";
+    TestTimerManager mgr;
+    int count = 0;
+    std::shared_ptr<int> alive(new int(0));
+    std::shared_ptr<int> dead(new int(0));
+    mgr.addConditionTimer(1, [&count]() { ++count; }, alive);
+    mgr.addConditionTimer(1, [&count]() { count += 10; }, dead);
+    dead.reset();
+    usleep(5000);
+    std::vector<std::function<void()> > cbs;
+    mgr.listExpiredCb(cbs);
+    for (auto& cb : cbs) {
+        cb();
+    }
+    SYLAR_ASSERT(count == 1);
+    SYLAR_LOG_INFO(g_logger) << "test_condition end";
+}
+
+// IOManager的超时由最近的定时器决定，而不是固定的epoll_wait超时
+void test_iomanager_timer() {
+    SYLAR_LOG_INFO(g_logger) << "test_iomanager_timer begin";
+    std::atomic<int> count{0};
+    std::atomic<int> ticks{0};
+    {
+        sylar::IOManager iom(2, false, "timer");
+        sylar::Timer::ptr timer;
+        uint64_t start = sylar::GetCurrentMS();
+        timer = iom.addTimer(
+            20,
+            [&ticks, &timer]() {
+                if (++ticks == 5) {
+                    timer->cancel();
+                }
+            },
+            true);
+        for (int i = 0; i < 10; ++i) {
+            iom.schedule([&count]() {
+                uint64_t s = sylar::GetCurrentMS();
+                sylar::IOManager::GetThis()->sleepFor(50);
+                SYLAR_ASSERT(sylar::GetCurrentMS() - s >= 50);
+                count += 100;
+            });
+        }
+        while (count < 1000 || ticks < 5) {
+            usleep(1000);
+        }
+        SYLAR_ASSERT(sylar::GetCurrentMS() - start < 1000);
+    }
+    SYLAR_ASSERT(count == 1000 && ticks == 5);
+    SYLAR_LOG_INFO(g_logger) << "test_iomanager_timer end";
+}
+
+// 大量定时器的添加和取消
+void bench_timer() {
+    TestTimerManager mgr;
+    static const int N = 200000;
+    std::vector<sylar::Timer::ptr> timers;
+    timers.reserve(N);
+    uint64_t start = sylar::GetCurrentUS();
+    for (int i = 0; i < N; ++i) {
+        timers.push_back(mgr.addTimer(1000 + i % 60000, []() {}));
+    }
+    uint64_t added = sylar::GetCurrentUS();
+    for (auto& t : timers) {
+        t->cancel();
+    }
+    uint64_t cancelled = sylar::GetCurrentUS();
+    SYLAR_ASSERT(!mgr.hasTimer());
+    SYLAR_LOG_INFO(g_logger)
+        << N << " timers add " << (added - start) * 1000 / N << " ns/op, cancel "
+        << (cancelled - added) * 1000 / N << " ns/op";
+}
+
+int main() {
+    g_logger->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    test_wheel();
+    test_cancel_reset();
+    test_condition();
+    test_iomanager_timer();
+    bench_timer();
+    return 0;
+}
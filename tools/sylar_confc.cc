@@ -0,0 +1,52 @@
+/*
+ * @Author: lvxr
+ * @brief 配置快照编译工具
+ * @details 将配置目录下所有*.yaml拍平后编译成二进制快照,
+ *          程序启动时Config::LoadFromConfDir优先加载未过期的快照
+ *          用法: sylar_confc -c conf_dir [-o output]
+ */
+#include <algorithm>
+#include <iostream>
+
+#include "src/config.h"
+#include "src/config_snapshot.h"
+#include "src/env.h"
+#include "src/util.h"
+
+int main(int argc, char** argv) {
+    sylar::EnvMgr::GetInstance()->addHelp("c", "config directory");
+    sylar::EnvMgr::GetInstance()->addHelp(
+        "o", "output snapshot, default is conf_dir/config.snapshot");
+    sylar::EnvMgr::GetInstance()->addHelp("h", "print help");
+    if (!sylar::EnvMgr::GetInstance()->init(argc, argv) ||
+        sylar::EnvMgr::GetInstance()->has("h")) {
+        sylar::EnvMgr::GetInstance()->printHelp();
+        return 1;
+    }
+
+    std::string conf_dir = sylar::EnvMgr::GetInstance()->getConfigPath();
+    std::string output = sylar::EnvMgr::GetInstance()->get(
+        "o", conf_dir + "/" + sylar::ConfigSnapshot::FileName());
+
+    std::vector<std::string> files;
+    sylar::FSUtil::ListAllFile(files, conf_dir, ".yaml");
+    std::sort(files.begin(), files.end());
+    if (files.empty()) {
+        std::cerr << "no yaml file in " << conf_dir << std::endl;
+        return 1;
+    }
+
+    sylar::ConfigTree tree;
+    if (!sylar::Config::ParseYamlFiles(files, tree)) {
+        std::cerr << "parse " << conf_dir << " failed" << std::endl;
+        return 1;
+    }
+
+    if (!sylar::ConfigSnapshot::Write(output, tree, files)) {
+        std::cerr << "write " << output << " failed" << std::endl;
+        return 1;
+    }
+    std::cout << "compiled " << files.size() << " files, " << tree.size()
+              << " entries into " << output << std::endl;
+    return 0;
+}